@@ -228,10 +228,12 @@ struct thread;
 #define NM_ATOMIC_READ(p)               atomic_read(p)
 
 
+struct sk_buff *nm_os_host_skb_alloc(struct net_device *, unsigned int);
+
 // XXX maybe implement it as a proper function somewhere
 // it is important to set s->len before the copy.
 #define	m_devget(_buf, _len, _ofs, _dev, _fn)	( {		\
-	struct sk_buff *s = netdev_alloc_skb(_dev, _len);	\
+	struct sk_buff *s = nm_os_host_skb_alloc(_dev, _len);	\
 	if (s) {						\
 		skb_put(s, _len);					\
 		skb_copy_to_linear_data_offset(s, _ofs, _buf, _len);	\
@@ -396,6 +398,11 @@ static inline void mtx_unlock(safe_spinlock_t *m)
 #define BDG_RLOCK(b)		down_read(&(b)->bdg_lock)
 #define BDG_RUNLOCK(b)		up_read(&(b)->bdg_lock)
 #define BDG_RTRYLOCK(b)		down_read_trylock(&(b)->bdg_lock)
+/* read side of the bridge datapath, see netmap_bdg.h */
+#define BDG_EPOCH_T		int
+#define BDG_EPOCH_ENTER(et)	do { (void)&(et); rcu_read_lock(); } while (0)
+#define BDG_EPOCH_EXIT(et)	rcu_read_unlock()
+#define BDG_EPOCH_WAIT()	synchronize_rcu()
 #define BDG_SET_VAR(lval, p)	((lval) = (p))
 #define BDG_GET_VAR(lval)	(lval)
 
@@ -422,6 +429,17 @@ static inline int ilog2(uint64_t n)
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
 
+/* same, on the given node (DOMAINSET_PREF is just the node number) */
+#define DOMAINSET_PREF(n)	(n)
+#define contigmalloc_domainset(sz, ty, ds, flags, a, b, pgsz, c) ({	\
+	unsigned int order_ =					\
+		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
+	struct page *p_ = alloc_pages_node(ds,			\
+		GFP_ATOMIC | __GFP_ZERO, order_);		\
+	if (p_ != NULL) 					\
+		split_page(p_, order_);				\
+	(p_ != NULL ? (char*)page_address(p_) : NULL); })
+
 #define contigfree(va, sz, ty)					\
 	do {							\
 		unsigned int npages_ =				\
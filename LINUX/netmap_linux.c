@@ -83,6 +83,44 @@ nm_os_vfree(void *addr){
 	vfree(addr);
 }
 
+#if defined(CONFIG_TRANSPARENT_HUGEPAGE) && \
+	(defined(NETMAP_LINUX_HAVE_HUGE_FAULT_ORDER) || \
+	 defined(NETMAP_LINUX_HAVE_HUGE_FAULT_PE_SIZE)) && \
+	(defined(NETMAP_LINUX_HAVE_VMF_INSERT_PFN_PMD) || \
+	 defined(NETMAP_LINUX_HAVE_VMF_INSERT_PFN_PMD_ULONG)) && \
+	defined(NETMAP_LINUX_HAVE_VM_FLAGS_SET)
+#define NM_LINUX_HUGEMAP	/* we can map PMD pages to userspace */
+#include <linux/huge_mm.h>
+#ifndef NETMAP_LINUX_HAVE_VMF_INSERT_PFN_PMD_ULONG
+#include <linux/pfn_t.h>
+#endif
+#endif
+
+u_int
+nm_os_hugepage_shift(void)
+{
+#ifdef NM_LINUX_HUGEMAP
+	return PMD_SHIFT;
+#else
+	return 0;
+#endif
+}
+
+void *
+nm_os_hugepage_alloc(size_t size, int node)
+{
+	struct page *page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO |
+			__GFP_COMP | __GFP_NOWARN, get_order(size));
+
+	return page ? page_address(page) : NULL;
+}
+
+void
+nm_os_hugepage_free(void *addr, size_t size)
+{
+	__free_pages(virt_to_page(addr), get_order(size));
+}
+
 void
 nm_os_selinfo_init(NM_SELINFO_T *si)
 {
@@ -176,6 +214,22 @@ nm_os_ifnet_mtu(struct ifnet *ifp)
 	return ifp->mtu;
 }
 
+int
+nm_os_numa_node(struct netmap_adapter *na)
+{
+	struct device *dev = na->pdev;
+
+	if (dev == NULL && na->ifp != NULL)
+		dev = na->ifp->dev.parent;
+	return dev ? dev_to_node(dev) : NUMA_NO_NODE;
+}
+
+int
+nm_os_numa_node_valid(int node)
+{
+	return node >= 0 && node < MAX_NUMNODES && node_online(node);
+}
+
 #ifdef WITH_EXTMEM
 struct nm_os_extmem {
 	struct page **pages;
@@ -397,14 +451,81 @@ nm_os_csum_fold(rawsum_t cur_sum)
 	return csum_fold(cur_sum);
 }
 
-/* on linux we send up one packet at a time */
+/*
+ * Used by the NAPI skb cache allocator. napi_alloc_skb() only takes
+ * the device from it, and eth_type_trans() sets skb->dev anyway.
+ */
+static struct napi_struct nm_host_napi;
+
+/*
+ * skbs for the host stack. Between nm_os_send_up_begin() and
+ * nm_os_send_up_end() bottom halves are disabled, so we can take
+ * skb heads from the per-cpu cache used by NAPI drivers, which is
+ * refilled in bulk and also collects the skbs consumed by the stack
+ * in softirq context, and data from the NAPI page fragment cache.
+ */
+struct sk_buff *
+nm_os_host_skb_alloc(struct net_device *dev, unsigned int len)
+{
+#ifdef NETMAP_LINUX_HAVE_NAPI_ALLOC_SKB
+	if (softirq_count() && !hardirq_count() && !in_nmi())
+		return napi_alloc_skb(&nm_host_napi, len);
+#endif /* NETMAP_LINUX_HAVE_NAPI_ALLOC_SKB */
+	return netdev_alloc_skb(dev, len);
+}
+
+void
+nm_os_send_up_begin(void)
+{
+	local_bh_disable();
+}
+
+void
+nm_os_send_up_end(void)
+{
+	local_bh_enable();
+}
+
+/*
+ * On linux packets are linked through skb->next, and the chain is
+ * passed to the stack on the final call, as a list if the kernel
+ * supports it. Either way the packets are processed in our context
+ * instead of going through the backlog queue as with netif_rx().
+ */
 void *
 nm_os_send_up(struct ifnet *ifp, struct mbuf *m, struct mbuf *prev)
 {
 	(void)ifp;
-	(void)prev;
-	m->priority = NM_MAGIC_PRIORITY_RX; /* do not reinject to netmap */
-	netif_rx(m);
+	if (m != NULL) {
+		m->priority = NM_MAGIC_PRIORITY_RX; /* do not reinject to netmap */
+		m->next = NULL;
+		if (prev != NULL)
+			prev->next = m;
+		return m;
+	}
+
+	/* prev is the head of the chain */
+	local_bh_disable();
+#ifdef NETMAP_LINUX_HAVE_NETIF_RECEIVE_SKB_LIST
+	{
+		LIST_HEAD(list);
+
+		/* next and list share storage in the skb */
+		for (m = prev; m != NULL; m = prev) {
+			prev = m->next;
+			m->next = NULL;
+			list_add_tail(&m->list, &list);
+		}
+		netif_receive_skb_list(&list);
+	}
+#else  /* !NETMAP_LINUX_HAVE_NETIF_RECEIVE_SKB_LIST */
+	for (m = prev; m != NULL; m = prev) {
+		prev = m->next;
+		m->next = NULL;
+		netif_receive_skb(m);
+	}
+#endif /* !NETMAP_LINUX_HAVE_NETIF_RECEIVE_SKB_LIST */
+	local_bh_enable();
 	return NULL;
 }
 
@@ -420,6 +541,19 @@ nm_os_mbuf_has_seg_offld(struct mbuf *m)
 	return skb_is_gso(m);
 }
 
+/* the skb is consumed by netmap, so its tstamp can be reused */
+void
+nm_os_mbuf_set_rx_ts(struct mbuf *m, uint64_t ns)
+{
+	m->tstamp = ns_to_ktime(ns);
+}
+
+uint64_t
+nm_os_mbuf_rx_ts(struct mbuf *m)
+{
+	return ktime_to_ns(m->tstamp);
+}
+
 #ifdef WITH_GENERIC
 /* ####################### MITIGATION SUPPORT ###################### */
 
@@ -1244,6 +1378,146 @@ static struct vm_operations_struct linux_netmap_mmap_ops = {
 	.fault = linux_netmap_fault,
 };
 
+#ifdef NM_LINUX_HUGEMAP
+/*
+ * Memory with huge page pools is mapped by pfn, so that the clusters
+ * of those pools can be inserted as a whole in the PMD entries.
+ * The other pools are mapped one page at a time.
+ */
+static vm_fault_t
+linux_netmap_pfn_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	unsigned long off = (vma->vm_pgoff + vmf->pgoff) << PAGE_SHIFT;
+	unsigned long pa;
+
+	pa = netmap_mem_ofstophys(priv->np_na->nm_mem, off);
+	if (pa == 0)
+		return VM_FAULT_SIGBUS;
+	return vmf_insert_pfn(vma, vmf->address, pa >> PAGE_SHIFT);
+}
+
+static vm_fault_t
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT_ORDER
+linux_netmap_huge_fault(struct vm_fault *vmf, unsigned int order)
+{
+#else
+linux_netmap_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	unsigned int order = pe_size == PE_SIZE_PMD ?
+		PMD_SHIFT - PAGE_SHIFT : 0;
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT_ORDER */
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_mem_d *nmd =
+		((struct netmap_priv_d *)vma->vm_private_data)->np_na->nm_mem;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long off, pa;
+
+	if (order != PMD_SHIFT - PAGE_SHIFT)
+		return VM_FAULT_FALLBACK;
+	if (addr < vma->vm_start || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	off = (vma->vm_pgoff << PAGE_SHIFT) + (addr - vma->vm_start);
+	if ((off & ~PMD_MASK) ||
+	    netmap_mem_ofs_pageshift(nmd, off) != PMD_SHIFT)
+		return VM_FAULT_FALLBACK;
+	pa = netmap_mem_ofstophys(nmd, off);
+	if (pa == 0 || (pa & ~PMD_MASK))
+		return VM_FAULT_FALLBACK;
+#ifdef NETMAP_LINUX_HAVE_VMF_INSERT_PFN_PMD_ULONG
+	return vmf_insert_pfn_pmd(vmf, pa >> PAGE_SHIFT,
+			vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, phys_to_pfn_t(pa, PFN_DEV),
+			vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+
+static struct vm_operations_struct linux_netmap_huge_mmap_ops = {
+	.fault = linux_netmap_pfn_fault,
+	.huge_fault = linux_netmap_huge_fault,
+};
+#endif /* NM_LINUX_HUGEMAP */
+
+/*
+ * Insert the len bytes of physically contiguous memory at pa in
+ * the page tables of vma, at addr.
+ */
+static int
+linux_netmap_insert_pages(struct vm_area_struct *vma, unsigned long addr,
+		unsigned long pa, size_t len)
+{
+#ifdef NETMAP_LINUX_HAVE_VM_INSERT_PAGES
+	struct page *pages[64];
+	unsigned long i, n, left;
+	int error;
+
+	while (len > 0) {
+		n = min_t(unsigned long, len >> PAGE_SHIFT, ARRAY_SIZE(pages));
+		for (i = 0; i < n; i++)
+			pages[i] = pfn_to_page((pa >> PAGE_SHIFT) + i);
+		left = n;
+		error = vm_insert_pages(vma, addr, pages, &left);
+		if (error)
+			return error;
+		addr += n << PAGE_SHIFT;
+		pa += n << PAGE_SHIFT;
+		len -= n << PAGE_SHIFT;
+	}
+#else
+	int error;
+
+	for (; len > 0; addr += PAGE_SIZE, pa += PAGE_SIZE, len -= PAGE_SIZE) {
+		error = vm_insert_page(vma, addr, pfn_to_page(pa >> PAGE_SHIFT));
+		if (error)
+			return error;
+	}
+#endif /* NETMAP_LINUX_HAVE_VM_INSERT_PAGES */
+	return 0;
+}
+
+/*
+ * Map the whole vma at mmap() time (NR_PREFAULT), one cluster at a
+ * time, so that the application takes no page faults on it.
+ * In pfn mappings (huge page pools) the huge page clusters are left
+ * to linux_netmap_huge_fault(), which maps each of them with a single
+ * fault. The room to grow of the pools is not backed yet, and stays
+ * unmapped.
+ */
+static int
+linux_netmap_prefault(struct vm_area_struct *vma, struct netmap_mem_d *nmd,
+		int pfnmap)
+{
+	unsigned long addr = vma->vm_start;
+	vm_ooffset_t off = vma->vm_pgoff << PAGE_SHIFT;
+	int error = 0;
+
+	while (addr < vma->vm_end && !error) {
+		size_t len;
+		unsigned long pa = netmap_mem_ofs_cluster(nmd, off, &len);
+
+		if (len == 0)
+			break;
+		if (len > vma->vm_end - addr)
+			len = vma->vm_end - addr;
+		if (pa == 0 || !pfn_valid(pa >> PAGE_SHIFT)) {
+			/* not backed, leave it */
+		} else if (!pfnmap) {
+			error = linux_netmap_insert_pages(vma, addr, pa, len);
+		} else if (netmap_mem_ofs_pageshift(nmd, off) == PAGE_SHIFT) {
+			error = remap_pfn_range(vma, addr, pa >> PAGE_SHIFT,
+					len, vma->vm_page_prot);
+		}
+		addr += len;
+		off += len;
+	}
+	if (error)
+		nm_prerr("prefault failed at offset %llx: %d",
+			(unsigned long long)off, error);
+	return error;
+}
+
 static int
 linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 {
@@ -1287,14 +1561,29 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 				pa >> PAGE_SHIFT,
 				vma->vm_end - vma->vm_start,
 				vma->vm_page_prot);
+#ifdef NM_LINUX_HUGEMAP
+	} else if (memflags & NETMAP_MEM_HUGEPAGE) {
+		/* vmf_insert_pfn*() refuse (BUG_ON) COW mappings */
+		if (!(vma->vm_flags & VM_SHARED))
+			return -EINVAL;
+		vm_flags_set(vma, VM_PFNMAP | VM_HUGEPAGE | VM_DONTEXPAND |
+				VM_DONTDUMP);
+		vma->vm_private_data = priv;
+		vma->vm_ops = &linux_netmap_huge_mmap_ops;
+		if (priv->np_flags & NR_PREFAULT)
+			error = linux_netmap_prefault(vma, na->nm_mem, 1);
+#endif /* NM_LINUX_HUGEMAP */
 	} else {
 		/* non contiguous memory, we serve
-		 * page faults as they come
+		 * page faults as they come, unless asked
+		 * to map everything now
 		 */
 		vma->vm_private_data = priv;
 		vma->vm_ops = &linux_netmap_mmap_ops;
+		if (priv->np_flags & NR_PREFAULT)
+			error = linux_netmap_prefault(vma, na->nm_mem, 0);
 	}
-	return 0;
+	return error;
 }
 
 
@@ -1379,6 +1668,7 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 		struct nm_ifreq ifr;
 		struct nmreq nmr;
 		struct nmreq_header hdr;
+		struct nmsyncv syncv;
 	} arg;
 	size_t argsize = 0;
 
@@ -1386,6 +1676,9 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	case NIOCTXSYNC:
 	case NIOCRXSYNC:
 		break;
+	case NIOCSYNCV:
+		argsize = sizeof(arg.syncv);
+		break;
 	case NIOCCONFIG:
 		argsize = sizeof(arg.ifr);
 		break;
@@ -1459,6 +1752,10 @@ static struct file_operations netmap_fops = {
 	.owner = THIS_MODULE,
 	.open = linux_netmap_open,
 	.mmap = linux_netmap_mmap,
+#ifdef NM_LINUX_HUGEMAP
+	/* align the mappings to the huge pages */
+	.get_unmapped_area = thp_get_unmapped_area,
+#endif /* NM_LINUX_HUGEMAP */
 	LIN_IOCTL_NAME = linux_netmap_ioctl,
 #ifdef CONFIG_COMPAT
 	.compat_ioctl = linux_netmap_compat_ioctl,
@@ -1467,6 +1764,30 @@ static struct file_operations netmap_fops = {
 	.release = linux_netmap_release,
 };
 
+/* NIOCSYNCV support: get the priv of another /dev/netmap descriptor. */
+int
+nm_os_priv_fget(struct thread *td, int fd, struct netmap_priv_d **ppriv,
+		void **cookie)
+{
+	struct file *filp = fget(fd);
+
+	if (filp == NULL)
+		return EBADF;
+	if (filp->f_op != &netmap_fops || filp->private_data == NULL) {
+		fput(filp);
+		return EINVAL;
+	}
+	*ppriv = filp->private_data;
+	*cookie = filp;
+	return 0;
+}
+
+void
+nm_os_priv_fput(struct thread *td, void *cookie)
+{
+	fput((struct file *)cookie);
+}
+
 
 #ifdef CONFIG_NET_NS
 #include <net/netns/generic.h>
@@ -1619,6 +1940,25 @@ nm_os_ncpus(void)
 	return nr_cpu_ids;
 }
 
+/* may be stale when preemption is enabled, the callers do not care */
+u_int
+nm_os_curcpu(void)
+{
+	return raw_smp_processor_id();
+}
+
+uint64_t
+nm_os_get_ns(void)
+{
+	return ktime_get_ns();
+}
+
+uint64_t
+nm_os_realtime_ns(void)
+{
+	return ktime_get_real_ns();
+}
+
 struct nm_kctx {
 	struct mm_struct *mm;       /* to access guest memory */
 	struct task_struct *worker; /* the kernel thread */
@@ -291,6 +291,37 @@ nm_os_realloc(void *src, size_t size, size_t oldSize)
     return newBuff;
 }
 
+/* huge pages are not supported */
+u_int
+nm_os_hugepage_shift(void)
+{
+    return 0;
+}
+
+void *
+nm_os_hugepage_alloc(size_t size, int node)
+{
+    return NULL;
+}
+
+void
+nm_os_hugepage_free(void *addr, size_t size)
+{
+}
+
+/* allocations are not bound to NUMA nodes */
+int
+nm_os_numa_node(struct netmap_adapter *na)
+{
+    return -1;
+}
+
+int
+nm_os_numa_node_valid(int node)
+{
+    return node == 0;
+}
+
 int
 nm_os_catch_rx(struct netmap_generic_adapter *gna, int intercept)
 {
@@ -345,6 +376,16 @@ nm_os_send_up(struct ifnet *ifp, struct mbuf *m, struct mbuf *prev)
 	return head;
 }
 
+void
+nm_os_send_up_begin(void)
+{
+}
+
+void
+nm_os_send_up_end(void)
+{
+}
+
 int
 MBUF_TRANSMIT(struct netmap_adapter *na, struct ifnet *ifp, struct mbuf *m)
 {
@@ -1010,10 +1051,49 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit)
 	//hrtimer_cancel(&mit->mit_timer);
 }
 
+/*
+ * Processor numbers are relative to a processor group, like the count
+ * returned here; the callers of nm_os_curcpu() reduce it modulo
+ * nm_os_ncpus() anyway.
+ */
 u_int
 nm_os_ncpus(void)
 {
-	return 1;  // TODO
+	return KeQueryActiveProcessorCount(NULL);
+}
+
+u_int
+nm_os_curcpu(void)
+{
+	return KeGetCurrentProcessorNumber();
+}
+
+uint64_t
+nm_os_get_ns(void)
+{
+	return KeQueryInterruptTime() * 100; /* 100ns units */
+}
+
+uint64_t
+nm_os_realtime_ns(void)
+{
+	LARGE_INTEGER t;
+
+	KeQuerySystemTime(&t); /* 100ns units since 1601 */
+	return (t.QuadPart - 116444736000000000LL) * 100;
+}
+
+/* NIOCSYNCV entries can only refer to the calling descriptor. */
+int
+nm_os_priv_fget(struct thread *td, int fd, struct netmap_priv_d **ppriv,
+		void **cookie)
+{
+	return EOPNOTSUPP;
+}
+
+void
+nm_os_priv_fput(struct thread *td, void *cookie)
+{
 }
 
 int
@@ -1028,6 +1108,18 @@ nm_os_mbuf_has_seg_offld(struct mbuf *m)
 	return 0;  // TODO
 }
 
+/* no room for a timestamp here, the slots are stamped by rxsync */
+void
+nm_os_mbuf_set_rx_ts(struct mbuf *m, uint64_t ns)
+{
+}
+
+uint64_t
+nm_os_mbuf_rx_ts(struct mbuf *m)
+{
+	return 0;
+}
+
 void
 nm_os_get_module(void)
 {
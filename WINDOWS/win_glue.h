@@ -406,6 +406,9 @@ win_contigmalloc(int sz, int page_size)
  */
 #define contigmalloc(sz, ty, flags, a, b, pgsz, c)	\
 					win_contigmalloc(sz, M_NETMAP)
+#define contigmalloc_domainset(sz, ty, ds, flags, a, b, pgsz, c)	\
+					win_contigmalloc(sz, M_NETMAP)
+#define DOMAINSET_PREF(n)		(n)
 #define contigfree(va, sz, ty)		ExFreePoolWithTag(va, M_NETMAP)
 
 #define vtophys				MmGetPhysicalAddress
@@ -196,6 +196,295 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config, int nr_arg2)
 	return error;
 }
 
+/* Show (and optionally change) the learning table of a bridge.
+ * conf is "[size][,age]" or "flush".
+ */
+static int
+bdg_fdb(const char *name, const char *conf)
+{
+	struct nmreq_header hdr;
+	struct nmreq_vale_fdb req;
+	int error, fd;
+
+	if (name == NULL) {
+		D("missing bridge name");
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&req, 0, sizeof(req));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_VALE_FDB;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	if (conf != NULL && !strcmp(conf, "flush")) {
+		req.nr_flags = NR_FDB_FLUSH;
+	} else if (conf != NULL && *conf) {
+		const char *age = strchr(conf, ',');
+
+		if (conf[0] != ',') {
+			req.nr_flags |= NR_FDB_SET_SIZE;
+			req.nr_size = atoi(conf);
+		}
+		if (age != NULL && age[1]) {
+			req.nr_flags |= NR_FDB_SET_AGE;
+			req.nr_max_age = atoi(age + 1);
+		}
+	}
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error) {
+		perror(name);
+	} else {
+		printf("%s: %u entries (%u buckets x %u ways), max age %us\n",
+			name, req.nr_size, req.nr_buckets, req.nr_ways,
+			req.nr_max_age);
+		printf("  used %u expired %u full buckets %u\n",
+			req.nr_used, req.nr_expired, req.nr_full_buckets);
+		printf("  learned %" PRIu64 " moved %" PRIu64
+			" collisions %" PRIu64 "\n",
+			req.nr_learned, req.nr_moved, req.nr_collisions);
+	}
+	close(fd);
+	return error;
+}
+
+/* Show (and optionally set) the rx ring dispatch mode of a port.
+ * conf is "ring" or "hash".
+ */
+static int
+bdg_dispatch(const char *name, const char *conf)
+{
+	struct nmreq_header hdr;
+	struct nmreq_vale_dispatch req;
+	int error, fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memset(&req, 0, sizeof(req));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DISPATCH;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	if (conf != NULL) {
+		req.nr_flags = NR_DISPATCH_SET;
+		if (!strcmp(conf, "hash")) {
+			req.nr_mode = NR_DISPATCH_RXHASH;
+		} else if (!strcmp(conf, "ring")) {
+			req.nr_mode = NR_DISPATCH_SRC_RING;
+		} else {
+			D("unknown dispatch mode %s", conf);
+			return -1;
+		}
+	}
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error)
+		perror(name);
+	else
+		D("%s: rx dispatch by %s", name,
+			req.nr_mode == NR_DISPATCH_RXHASH ? "hash" : "ring");
+	close(fd);
+	return error;
+}
+
+/* Show the flow table of a bridge. conf is "enable,size",
+ * "disable" or "flush".
+ */
+static int
+bdg_flow(const char *name, const char *conf)
+{
+	struct nm_ifreq ifr;
+	struct nm_vale_flow_cfg *cfg = (struct nm_vale_flow_cfg *)ifr.data;
+	int error, fd;
+
+	if (name == NULL) {
+		D("missing bridge name");
+		return -1;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.nifr_name, name, sizeof(ifr.nifr_name) - 1);
+	cfg->nfc_cmd = NM_VALE_FLOW_INFO;
+	if (conf != NULL && !strncmp(conf, "enable,", 7)) {
+		cfg->nfc_cmd = NM_VALE_FLOW_ENABLE;
+		cfg->nfc_size = atoi(conf + 7);
+	} else if (conf != NULL && !strcmp(conf, "disable")) {
+		cfg->nfc_cmd = NM_VALE_FLOW_DISABLE;
+	} else if (conf != NULL && !strcmp(conf, "flush")) {
+		cfg->nfc_cmd = NM_VALE_FLOW_FLUSH;
+	} else if (conf != NULL) {
+		D("unknown flow table command %s", conf);
+		return -1;
+	}
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	error = ioctl(fd, NIOCCONFIG, &ifr);
+	if (error) {
+		perror(name);
+	} else if (!cfg->nfc_enabled) {
+		printf("%s: learning bridge, no flow table\n", name);
+	} else {
+		printf("%s: %u flows out of %u\n", name, cfg->nfc_used,
+			cfg->nfc_size);
+		printf("  hits %" PRIu64 " misses %" PRIu64 "\n",
+			cfg->nfc_hits, cfg->nfc_misses);
+	}
+	close(fd);
+	return error;
+}
+
+static void
+bdg_stats_print(const char *what, const struct nmreq_vale_stats *req)
+{
+	int k;
+
+	printf("%s: fwd %" PRIu64 " pkts %" PRIu64 " bytes, brd copies %"
+		PRIu64 " (%" PRIu64 " saved by snooping)\n", what,
+		req->nr_fwd_pkts, req->nr_fwd_bytes, req->nr_brd_copies,
+		req->nr_mcast_saved);
+	printf("  drop nospace %" PRIu64 " lookup %" PRIu64 " hdr %" PRIu64
+		"\n", req->nr_drop_nospace, req->nr_drop_lookup,
+		req->nr_drop_hdr);
+	printf("  batches");
+	for (k = 0; k < NR_VALE_BATCH_BUCKETS; k++)
+		printf(" %s%d:%" PRIu64, k == NR_VALE_BATCH_BUCKETS - 1 ?
+			">=" : "", 1 << k, req->nr_batch[k]);
+	printf("\n");
+}
+
+/* Show the datapath counters of a port, for each tx ring and in total.
+ * conf "reset" clears them after reading.
+ */
+static int
+bdg_stats(const char *name, const char *conf)
+{
+	struct nmreq_header hdr;
+	struct nmreq_vale_stats req;
+	int error, fd, i, nrings;
+	char what[32];
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_VALE_STATS_GET;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	if (conf != NULL && strcmp(conf, "reset")) {
+		D("unknown stats option %s", conf);
+		return -1;
+	}
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	/* the first request tells us the number of rings */
+	memset(&req, 0, sizeof(req));
+	req.nr_ring_id = NR_VALE_STATS_ALLRINGS;
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	nrings = req.nr_tx_rings;
+	for (i = 0; !error && i < nrings; i++) {
+		memset(&req, 0, sizeof(req));
+		req.nr_ring_id = i;
+		error = ioctl(fd, NIOCCTRL, &hdr);
+		if (!error) {
+			snprintf(what, sizeof(what), "ring %d", i);
+			bdg_stats_print(what, &req);
+		}
+	}
+	if (!error) {
+		memset(&req, 0, sizeof(req));
+		req.nr_ring_id = NR_VALE_STATS_ALLRINGS;
+		if (conf != NULL)
+			req.nr_flags = NR_VALE_STATS_RESET;
+		error = ioctl(fd, NIOCCTRL, &hdr);
+		if (!error)
+			bdg_stats_print(name, &req);
+	}
+	if (error)
+		perror(name);
+	close(fd);
+	return error;
+}
+
+/* Show the occupancy of the pools of the allocator of a port (or of
+ * memid, if not zero). conf "reset" clears the high-water marks, the
+ * leak counters and the latency histogram after reading.
+ */
+static int
+mem_stats(const char *name, const char *conf, int memid)
+{
+	static const char *pools[NR_POOLS_NUM] = { "if", "ring", "buf", "lbuf" };
+	struct nmreq_header hdr;
+	struct nmreq_pools_stats req;
+	int error, fd, i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.nr_version = NETMAP_API;
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_STATS_GET;
+	strncpy(hdr.nr_name, name, sizeof(hdr.nr_name) - 1);
+	hdr.nr_body = (uintptr_t)&req;
+
+	if (conf != NULL && strcmp(conf, "reset")) {
+		D("unknown stats option %s", conf);
+		return -1;
+	}
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	memset(&req, 0, sizeof(req));
+	req.nr_info.nr_mem_id = memid;
+	if (conf != NULL)
+		req.nr_flags = NR_POOLS_STATS_RESET;
+	error = ioctl(fd, NIOCCTRL, &hdr);
+	if (error) {
+		perror(name);
+		close(fd);
+		return error;
+	}
+	printf("%s: memid %u, %" PRIu64 " bytes, ring bufs %u, extra bufs %u\n",
+		name, req.nr_info.nr_mem_id, req.nr_info.nr_memsize,
+		req.nr_port_ring_bufs, req.nr_port_extra_bufs);
+	for (i = 0; i < NR_POOLS_NUM; i++) {
+		const struct nmreq_pool_stats *s = &req.nr_pool[i];
+
+		if (s->nr_objtotal == 0)
+			continue;
+		printf("  %-4s total %u inuse %u (cached %u) hiwat %u leaked %"
+			PRIu64 " free runs %u largest %u\n", pools[i],
+			s->nr_objtotal, s->nr_inuse, s->nr_cached, s->nr_hiwat,
+			s->nr_leaked, s->nr_free_runs, s->nr_largest_run);
+	}
+	printf("  alloc ns");
+	for (i = 0; i < NR_POOLS_LAT_BUCKETS; i++) {
+		if (req.nr_alloc_lat[i] == 0)
+			continue;
+		printf(" %s%u:%" PRIu64, i == NR_POOLS_LAT_BUCKETS - 1 ?
+			">=" : "", 1U << i, req.nr_alloc_lat[i]);
+	}
+	printf("\n");
+	close(fd);
+	return 0;
+}
+
 static void
 usage(int errcode)
 {
@@ -215,7 +504,18 @@ usage(int errcode)
 	    "\t\t y: CPU core id for ALL_NIC and core/ring for ONE_NIC\n"
 	    "\t\t z: (ONE_NIC only) num of total cores/rings\n"
 	    "\t-P interface stop polling\n"
-	    "\t-m memid to use when creating a new interface\n");
+	    "\t-m memid to use when creating a new interface\n"
+	    "\t-F bridge show the learning table. Additional -C configures\n"
+	    "\t\t size,age: number of entries and max age in seconds\n"
+	    "\t\t (either can be omitted), or flush\n"
+	    "\t-D interface show the rx ring dispatch mode. Additional -C\n"
+	    "\t\t hash or ring sets it\n"
+	    "\t-S interface show the datapath counters. Additional -C\n"
+	    "\t\t reset clears them\n"
+	    "\t-M interface show the memory pools counters (of the -m memid\n"
+	    "\t\t if given). Additional -C reset clears them\n"
+	    "\t-T bridge show the flow table. Additional -C configures\n"
+	    "\t\t enable,size: use a table of size flows, or disable, flush\n");
 	exit(errcode);
 }
 
@@ -224,9 +524,9 @@ main(int argc, char *argv[])
 {
 	int ch, nr_cmd = 0, nr_arg = 0;
 	char *name = NULL, *nmr_config = NULL;
-	int nr_arg2 = 0;
+	int nr_arg2 = 0, fdb = 0, dispatch = 0, stats = 0, flow = 0, mem = 0;
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:m:F:D:S:T:M:")) != -1) {
 		if (ch != 'C' && ch != 'm')
 			name = optarg; /* default */
 		switch (ch) {
@@ -268,6 +568,21 @@ main(int argc, char *argv[])
 		case 'm':
 			nr_arg2 = atoi(optarg);
 			break;
+		case 'F':
+			fdb = 1;
+			break;
+		case 'D':
+			dispatch = 1;
+			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'T':
+			flow = 1;
+			break;
+		case 'M':
+			mem = 1;
+			break;
 		}
 	}
 	if (optind != argc) {
@@ -278,5 +593,15 @@ main(int argc, char *argv[])
 		nr_cmd = NETMAP_BDG_LIST;
 		name = NULL;
 	}
+	if (fdb)
+		return bdg_fdb(name, nmr_config) ? 1 : 0;
+	if (dispatch)
+		return bdg_dispatch(name, nmr_config) ? 1 : 0;
+	if (stats)
+		return bdg_stats(name, nmr_config) ? 1 : 0;
+	if (flow)
+		return bdg_flow(name, nmr_config) ? 1 : 0;
+	if (mem)
+		return mem_stats(name, nmr_config, nr_arg2) ? 1 : 0;
 	return bdg_ctl(name, nr_cmd, nr_arg, nmr_config, nr_arg2) ? 1 : 0;
 }
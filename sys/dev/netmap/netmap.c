@@ -489,6 +489,8 @@ static int netmap_no_timestamp; /* don't timestamp on rxsync */
 int netmap_no_pendintr = 1;
 int netmap_txsync_retry = 2;
 static int netmap_fwd = 0;	/* force transparent forwarding */
+static int netmap_host_batch = 64; /* packets per delivery to the host stack */
+static int netmap_ring_latency = 0; /* time the syncs, see nm_sync_finalize() */
 
 /*
  * netmap_admode selects the netmap mode to use.
@@ -554,6 +556,10 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, txsync_retry, CTLFLAG_RW,
 
 SYSCTL_INT(_dev_netmap, OID_AUTO, fwd, CTLFLAG_RW, &netmap_fwd, 0,
 		"Force NR_FORWARD mode");
+SYSCTL_INT(_dev_netmap, OID_AUTO, host_batch, CTLFLAG_RW, &netmap_host_batch, 0,
+		"Max packets passed to the host stack in one go");
+SYSCTL_INT(_dev_netmap, OID_AUTO, ring_latency, CTLFLAG_RW,
+		&netmap_ring_latency, 0, "Histogram of the sync times of each ring");
 SYSCTL_INT(_dev_netmap, OID_AUTO, admode, CTLFLAG_RW, &netmap_admode, 0,
 		"Adapter mode. 0 selects the best option available,"
 		"1 forces native adapter, 2 forces emulated adapter");
@@ -1130,15 +1136,22 @@ netmap_send_up(struct ifnet *dst, struct mbq *q)
 {
 	struct mbuf *m;
 	struct mbuf *head = NULL, *prev = NULL;
+	int n = 0, batch = netmap_host_batch;
 
-	/* Send packets up, outside the lock; head/prev machinery
-	 * is only useful for Windows. */
+	/* Send packets up, outside the lock. The OS links them
+	 * through prev and delivers each chain as a batch when
+	 * it is closed by a call with m == NULL. */
 	while ((m = mbq_dequeue(q)) != NULL) {
 		if (netmap_debug & NM_DEBUG_HOST)
 			nm_prinf("sending up pkt %p size %d", m, MBUF_LEN(m));
 		prev = nm_os_send_up(dst, m, prev);
 		if (head == NULL)
 			head = prev;
+		if (head != NULL && ++n >= batch) {
+			nm_os_send_up(dst, NULL, head);
+			head = prev = NULL;
+			n = 0;
+		}
 	}
 	if (head)
 		nm_os_send_up(dst, NULL, head);
@@ -1160,24 +1173,29 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 	u_int n;
 	struct netmap_adapter *na = kring->na;
 
+	nm_os_send_up_begin();
 	for (n = kring->nr_hwcur; n != head; n = nm_next(n, lim)) {
 		struct mbuf *m;
 		struct netmap_slot *slot = &kring->ring->slot[n];
 
 		if ((slot->flags & NS_FORWARD) == 0 && !force)
 			continue;
-		if (slot->len < 14 || slot->len > NETMAP_BUF_SIZE(na)) {
+		if (slot->len < 14 || slot->len > NMB_SIZE(na, slot)) {
 			RD(5, "bad pkt at %d len %d", n, slot->len);
+			kring->nkr_stats.host_drops++;
 			continue;
 		}
 		slot->flags &= ~NS_FORWARD; // XXX needed ?
 		/* XXX TODO: adapt to the case of a multisegment packet */
 		m = m_devget(NMB(na, slot), slot->len, 0, na->ifp, NULL);
 
-		if (m == NULL)
+		if (m == NULL) {
+			kring->nkr_stats.host_drops++;
 			break;
+		}
 		mbq_enqueue(q, m);
 	}
+	nm_os_send_up_end();
 }
 
 static inline int
@@ -1214,9 +1232,17 @@ nm_may_forward_down(struct netmap_kring *kring, int sync_flags)
  * we are in poll/ioctl system call context, and the application
  * is not supposed to touch the ring (using a different thread)
  * during the execution of the system call.
+ *
+ * Packets are moved by exchanging the buffers of the sw rx slots
+ * with those of the NIC tx slots. A packet made of several slots
+ * (NS_MOREFRAG) goes to a single tx ring, which must have room
+ * for all of it. Packets that do not fit anywhere, and the ones
+ * after them, are left in the sw rx ring for the next call.
+ * Returns the number of packets sent and sets *cur to the first
+ * slot that has not been consumed.
  */
 static u_int
-netmap_sw_to_nic(struct netmap_adapter *na)
+netmap_sw_to_nic(struct netmap_adapter *na, u_int *cur)
 {
 	struct netmap_kring *kring = na->rx_rings[na->num_rx_rings];
 	struct netmap_slot *rxslot = kring->ring->slot;
@@ -1226,38 +1252,68 @@ netmap_sw_to_nic(struct netmap_adapter *na)
 	u_int sent = 0;
 
 	/* scan rings to find space, then fill as much as possible */
-	for (i = 0; i < na->num_tx_rings; i++) {
+	for (i = 0; i < na->num_tx_rings && rxcur != head; i++) {
 		struct netmap_kring *kdst = na->tx_rings[i];
 		struct netmap_ring *rdst = kdst->ring;
 		u_int const dst_lim = kdst->nkr_num_slots - 1;
 
 		/* XXX do we trust ring or kring->rcur,rtail ? */
-		for (; rxcur != head && !nm_ring_empty(rdst);
-		     rxcur = nm_next(rxcur, src_lim) ) {
+		while (rxcur != head) {
 			struct netmap_slot *src, *dst, tmp;
 			u_int dst_head = rdst->head;
-
+			u_int nfrags = 1, j = rxcur;
+			int space;
+
+			/* find the end of the packet */
+			while (rxslot[j].flags & NS_MOREFRAG) {
+				j = nm_next(j, src_lim);
+				if (j == head)
+					goto out; /* not released yet */
+				nfrags++;
+			}
 			src = &rxslot[rxcur];
-			if ((src->flags & NS_FORWARD) == 0 && !netmap_fwd)
+			if (((src->flags & NS_FORWARD) == 0 && !netmap_fwd) ||
+			    (nfrags > 1 && !(na->na_flags & NAF_MOREFRAG)) ||
+			    nfrags > dst_lim) {
+				if (src->flags & NS_FORWARD || netmap_fwd) {
+					RD(5, "%s: drop %u slots packet",
+						na->name, nfrags);
+					kring->nkr_stats.host_drops++;
+				}
+				rxcur = nm_next(j, src_lim);
 				continue;
+			}
 
-			sent++;
+			space = rdst->tail - dst_head;
+			if (space < 0)
+				space += kdst->nkr_num_slots;
+			if ((u_int)space < nfrags)
+				break;	/* try the next ring */
 
-			dst = &rdst->slot[dst_head];
+			for (; nfrags > 0; nfrags--) {
+				src = &rxslot[rxcur];
+				dst = &rdst->slot[dst_head];
 
-			tmp = *src;
+				tmp = *src;
 
-			src->buf_idx = dst->buf_idx;
-			src->flags = NS_BUF_CHANGED;
+				src->buf_idx = dst->buf_idx;
+				src->flags = NS_BUF_CHANGED;
 
-			dst->buf_idx = tmp.buf_idx;
-			dst->len = tmp.len;
-			dst->flags = NS_BUF_CHANGED;
+				dst->buf_idx = tmp.buf_idx;
+				dst->len = tmp.len;
+				dst->flags = NS_BUF_CHANGED |
+					(tmp.flags & NS_MOREFRAG);
 
-			rdst->head = rdst->cur = nm_next(dst_head, dst_lim);
+				dst_head = nm_next(dst_head, dst_lim);
+				rxcur = nm_next(rxcur, src_lim);
+			}
+			rdst->head = rdst->cur = dst_head;
+			sent++;
 		}
 		/* if (sent) XXX txsync ? it would be just an optimization */
 	}
+out:
+	*cur = rxcur;
 	return sent;
 }
 
@@ -1316,26 +1372,66 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 
 	mbq_lock(q);
 
-	/* First part: import newly received packets */
+	/* First part: import newly received packets.
+	 * If the ring has NR_MOREFRAG, packets longer than a buffer
+	 * take several slots, linked with NS_MOREFRAG.
+	 */
 	n = mbq_len(q);
 	if (n) { /* grab packets from the queue */
 		struct mbuf *m;
 		uint32_t stop_i;
+		int space, frags = ring->flags & NR_MOREFRAG;
+		int slot_ts = nm_slot_ts_enabled(kring);
 
 		nm_i = kring->nr_hwtail;
 		stop_i = nm_prev(kring->nr_hwcur, lim);
-		while ( nm_i != stop_i && (m = mbq_dequeue(q)) != NULL ) {
-			int len = MBUF_LEN(m);
+		space = stop_i - nm_i;
+		if (space < 0)
+			space += kring->nkr_num_slots;
+		while ( space > 0 && (m = mbq_peek(q)) != NULL ) {
+			int len = MBUF_LEN(m), ofs = 0;
 			struct netmap_slot *slot = &ring->slot[nm_i];
 
-			m_copydata(m, 0, len, NMB(na, slot));
-			ND("nm %d len %d", nm_i, len);
-			if (netmap_debug & NM_DEBUG_HOST)
-				nm_prinf("%s", nm_dump_buf(NMB(na, slot),len, 128, NULL));
+			if (len > NMB_SIZE(na, slot)) {
+				u_int j = nm_i;
+				int room = 0, need = 0;
 
-			slot->len = len;
-			slot->flags = 0;
-			nm_i = nm_next(nm_i, lim);
+				/* the user may have put buffers of
+				 * any class in the slots */
+				while (frags && room < len && need < space) {
+					room += NMB_SIZE(na, &ring->slot[j]);
+					j = nm_next(j, lim);
+					need++;
+				}
+				if (room < len && frags && space < (int)lim)
+					break; /* may not fit, wait for more room */
+				if (room < len) {
+					RD(5, "%s drop packet size %d", kring->name,
+						len);
+					kring->nkr_stats.host_drops++;
+					mbq_enqueue(&fq, mbq_dequeue(q));
+					continue;
+				}
+			}
+			m = mbq_dequeue(q);
+			ND("nm %d len %d", nm_i, len);
+			do {
+				int frag = len - ofs;
+
+				slot = &ring->slot[nm_i];
+				if (frag > NMB_SIZE(na, slot))
+					frag = NMB_SIZE(na, slot);
+				m_copydata(m, ofs, frag, NMB(na, slot));
+				if (netmap_debug & NM_DEBUG_HOST)
+					nm_prinf("%s", nm_dump_buf(NMB(na, slot), frag, 128, NULL));
+				ofs += frag;
+				slot->len = frag;
+				slot->flags = (ofs < len) ? NS_MOREFRAG : 0;
+				if (slot_ts)
+					slot->ptr = nm_os_mbuf_rx_ts(m);
+				nm_i = nm_next(nm_i, lim);
+				space--;
+			} while (ofs < len);
 			mbq_enqueue(&fq, m);
 		}
 		kring->nr_hwtail = nm_i;
@@ -1343,17 +1439,21 @@ netmap_rxsync_from_host(struct netmap_kring *kring, int flags)
 
 	/*
 	 * Second part: skip past packets that userspace has released.
+	 * Packets to be forwarded that find no room in the NIC rings
+	 * are kept until the next call.
 	 */
 	nm_i = kring->nr_hwcur;
 	if (nm_i != head) { /* something was released */
 		if (nm_may_forward_down(kring, flags)) {
-			ret = netmap_sw_to_nic(na);
+			ret = netmap_sw_to_nic(na, &nm_i);
 			if (ret > 0) {
 				kring->nr_kflags |= NR_FORWARD;
 				ret = 0;
 			}
+		} else {
+			nm_i = head;
 		}
-		kring->nr_hwcur = head;
+		kring->nr_hwcur = nm_i;
 	}
 
 	mbq_unlock(q);
@@ -1606,6 +1706,18 @@ netmap_unget_na(struct netmap_adapter *na, struct ifnet *ifp)
 	}								\
 } while (0)
 
+/* start accounting a *sync() on the kring, see nm_sync_finalize().
+ * Reading the clock twice per sync is not free, so the sync times
+ * are only taken when asked for.
+ */
+static inline void
+nm_kr_stats_begin(struct netmap_kring *kring)
+{
+	kring->nkr_stats.syncs++;
+	kring->nkr_stats.hwcur0 = kring->nr_hwcur;
+	kring->nkr_stats.t0 = netmap_ring_latency ? nm_os_get_ns() : 0;
+}
+
 /*
  * validate parameters on entry for *_txsync()
  * Returns ring->cur if ok, or something >= kring->nkr_num_slots
@@ -1626,6 +1738,8 @@ nm_txsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 	u_int cur = ring->cur; /* read only once */
 	u_int n = kring->nkr_num_slots;
 
+	nm_kr_stats_begin(kring);
+
 	ND(5, "%s kcur %d ktail %d head %d cur %d tail %d",
 		kring->name,
 		kring->nr_hwcur, kring->nr_hwtail,
@@ -1689,6 +1803,7 @@ nm_rxsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 	uint32_t const n = kring->nkr_num_slots;
 	uint32_t head, cur;
 
+	nm_kr_stats_begin(kring);
 	ND(5,"%s kc %d kt %d h %d c %d t %d",
 		kring->name,
 		kring->nr_hwcur, kring->nr_hwtail,
@@ -1729,6 +1844,10 @@ nm_rxsync_prologue(struct netmap_kring *kring, struct netmap_ring *ring)
 			ring->tail, kring->rtail);
 		ring->tail = kring->rtail;
 	}
+	if (nm_slot_ts_enabled(kring)) {
+		/* clear the timestamps of the slots being released */
+		nm_slot_ts_fill(kring, kring->nr_hwcur, head, 0);
+	}
 	return head;
 }
 
@@ -1754,6 +1873,7 @@ netmap_ring_reinit(struct netmap_kring *kring)
 
 	// XXX KASSERT nm_kr_tryget
 	RD(10, "called for %s", kring->name);
+	kring->nkr_stats.reinit++;
 	// XXX probably wrong to trust userspace
 	kring->rhead = ring->head;
 	kring->rcur  = ring->cur;
@@ -1768,11 +1888,11 @@ netmap_ring_reinit(struct netmap_kring *kring)
 	for (i = 0; i <= lim; i++) {
 		u_int idx = ring->slot[i].buf_idx;
 		u_int len = ring->slot[i].len;
-		if (idx < 2 || idx >= kring->na->na_lut.objtotal) {
+		if (idx < 2 || !NMB_VALID(kring->na, idx)) {
 			RD(5, "bad index at slot %d idx %d len %d ", i, idx, len);
 			ring->slot[i].buf_idx = 0;
 			ring->slot[i].len = 0;
-		} else if (len > NETMAP_BUF_SIZE(kring->na)) {
+		} else if (len > NMB_SIZE(kring->na, &ring->slot[i])) {
 			ring->slot[i].len = 0;
 			RD(5, "bad len at slot %d idx %d len %d", i, idx, len);
 		}
@@ -1925,6 +2045,7 @@ netmap_unset_ringid(struct netmap_priv_d *priv)
 /* Set the nr_pending_mode for the requested rings.
  * If requested, also try to get exclusive access to the rings, provided
  * the rings we want to bind are not exclusively owned by a previous bind.
+ * The rings that do not exist yet get large buffers if requested.
  */
 static int
 netmap_krings_get(struct netmap_priv_d *priv)
@@ -1933,8 +2054,24 @@ netmap_krings_get(struct netmap_priv_d *priv)
 	u_int i;
 	struct netmap_kring *kring;
 	int excl = (priv->np_flags & NR_EXCLUSIVE);
+	int large = (priv->np_flags & NR_LARGE_BUFS);
 	enum txrx t;
 
+	/* devices are programmed with NETMAP_BUF_SIZE() */
+	if (large && (na->na_lut.lobjsize == 0 || na->pdev != NULL ||
+			(na->na_flags & NAF_NATIVE))) {
+		nm_prerr("%s: large buffers not available", na->name);
+		return EINVAL;
+	}
+#ifdef WITH_PIPES
+	/* the ends of a pipe exchange whole slots, and the rings of
+	 * one end may be created by the registration of the other */
+	if (large && NMR(na, NR_TX)[0]->pipe != NULL) {
+		nm_prerr("%s: large buffers not available on pipes", na->name);
+		return EINVAL;
+	}
+#endif /* WITH_PIPES */
+
 	if (netmap_debug & NM_DEBUG_ON)
 		nm_prinf("%s: grabbing tx [%d, %d) rx [%d, %d)",
 			na->name,
@@ -1965,6 +2102,12 @@ netmap_krings_get(struct netmap_priv_d *priv)
 	for_rx_tx(t) {
 		for (i = priv->np_qfirst[t]; i < priv->np_qlast[t]; i++) {
 			kring = NMR(na, t)[i];
+			if (kring->ring == NULL) {
+				if (large)
+					kring->nr_kflags |= NKR_LARGEBUF;
+				else
+					kring->nr_kflags &= ~NKR_LARGEBUF;
+			}
 			kring->users++;
 			if (excl)
 				kring->nr_kflags |= NKR_EXCLUSIVE;
@@ -2284,9 +2427,13 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 				goto err_drop_mem;
 			}
 
-			error = netmap_buf_size_validate(na, mtu);
-			if (error)
-				goto err_drop_mem;
+			/* large buffers hold a whole frame */
+			if (!(nr_flags & NR_LARGE_BUFS) ||
+					mtu > na->na_lut.lobjsize) {
+				error = netmap_buf_size_validate(na, mtu);
+				if (error)
+					goto err_drop_mem;
+			}
 		}
 
 		/*
@@ -2359,12 +2506,60 @@ err:
 }
 
 
+/*
+ * Stamp the rx slots from rtail to hwtail that have not been
+ * stamped when they were filled (NR_SLOT_TS).
+ */
+static void
+netmap_slot_ts_finalize(struct netmap_kring *kring)
+{
+	struct netmap_slot *slot = kring->ring->slot;
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int i = kring->rtail;
+	uint64_t now = 0;
+
+	for (; i != kring->nr_hwtail; i = nm_next(i, lim)) {
+		if (slot[i].ptr != 0)
+			continue;
+		if (now == 0)
+			now = nm_os_realtime_ns();
+		slot[i].ptr = now;
+	}
+}
+
+void
+nm_kr_stats_end(struct netmap_kring *kring)
+{
+	struct nm_kring_stats *st = &kring->nkr_stats;
+	int n;
+
+	/* slots sent (tx) or received (rx) by this sync */
+	n = (kring->tx == NR_TX) ? kring->nr_hwcur - st->hwcur0 :
+		kring->nr_hwtail - kring->rtail;
+	if (n < 0)
+		n += kring->nkr_num_slots;
+	st->slots += n;
+	if (st->t0) {
+		uint64_t dt = nm_os_get_ns() - st->t0;
+		u_int b = 0;
+
+		while (dt > 1 && b < NR_RING_LAT_BUCKETS - 1) {
+			dt >>= 1;
+			b++;
+		}
+		st->lat[b]++;
+	}
+}
+
 /*
  * update kring and ring at the end of rxsync/txsync.
  */
 static inline void
 nm_sync_finalize(struct netmap_kring *kring)
 {
+	nm_kr_stats_end(kring);
+	if (nm_slot_ts_enabled(kring) && kring->rtail != kring->nr_hwtail)
+		netmap_slot_ts_finalize(kring);
 	/*
 	 * Update ring tail to what the kernel knows
 	 * After txsync: head/rhead/hwcur might be behind cur/rcur
@@ -2390,6 +2585,175 @@ static int nmreq_copyin(struct nmreq_header *, int);
 static int nmreq_copyout(struct nmreq_header *, int);
 static int nmreq_checkoptions(struct nmreq_header *);
 
+/*
+ * Sync a single kring on behalf of NIOCTXSYNC, NIOCRXSYNC and NIOCSYNCV.
+ * The caller has checked that priv is bound and that the kring belongs
+ * to it. Packets to be forwarded to the host stack are appended to q.
+ * Returns EIO if the kring has been stopped.
+ */
+static int
+netmap_ioctl_sync_kring(struct netmap_priv_d *priv,
+		struct netmap_kring *kring, enum txrx t, struct mbq *q)
+{
+	struct netmap_ring *ring = kring->ring;
+	int sync_flags = priv->np_sync_flags;
+	int error = 0;
+
+	if (unlikely(nm_kr_tryget(kring, 1, &error))) {
+		return (error ? EIO : 0);
+	}
+
+	if (t == NR_TX) {
+		if (netmap_debug & NM_DEBUG_TXSYNC)
+			nm_prinf("pre txsync ring %d cur %d hwcur %d",
+			    kring->ring_id, ring->cur,
+			    kring->nr_hwcur);
+		if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
+			nm_sync_finalize(kring);
+		}
+		if (netmap_debug & NM_DEBUG_TXSYNC)
+			nm_prinf("post txsync ring %d cur %d hwcur %d",
+			    kring->ring_id, ring->cur,
+			    kring->nr_hwcur);
+	} else {
+		if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
+			netmap_ring_reinit(kring);
+		}
+		if (nm_may_forward_up(kring)) {
+			/* transparent forwarding, see netmap_poll() */
+			netmap_grab_packets(kring, q, netmap_fwd);
+		}
+		if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
+			nm_sync_finalize(kring);
+		}
+		ring_timestamp_set(ring);
+	}
+	nm_kr_put(kring);
+
+	return 0;
+}
+
+/* Process NETMAP_REQ_RING_STATS_GET. */
+static int
+netmap_ring_stats_get(struct nmreq_header *hdr)
+{
+	struct nmreq_ring_stats *req =
+		(struct nmreq_ring_stats *)(uintptr_t)hdr->nr_body;
+	struct netmap_adapter *na = NULL;
+	struct ifnet *ifp = NULL;
+	struct nmreq_register regreq;
+	struct nm_kring_stats *st;
+	enum txrx t;
+	int error;
+
+	if (req->nr_dir != NR_SYNC_TX && req->nr_dir != NR_SYNC_RX)
+		return EINVAL;
+	t = (req->nr_dir == NR_SYNC_TX ? NR_TX : NR_RX);
+
+	bzero(&regreq, sizeof(regreq));
+	regreq.nr_mode = NR_REG_ALL_NIC;
+	NMG_LOCK();
+	hdr->nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr->nr_body = (uintptr_t)&regreq;
+	error = netmap_get_na(hdr, &na, &ifp, NULL, 0 /* don't create */);
+	hdr->nr_reqtype = NETMAP_REQ_RING_STATS_GET;
+	hdr->nr_body = (uintptr_t)req;
+	if (error) {
+		NMG_UNLOCK();
+		return error;
+	}
+
+	req->nr_tx_rings = netmap_real_rings(na, NR_TX);
+	req->nr_rx_rings = netmap_real_rings(na, NR_RX);
+	if (req->nr_ring_id >= netmap_real_rings(na, t)) {
+		error = EINVAL;
+		goto out;
+	}
+	req->nr_syncs = req->nr_slots = req->nr_busy = 0;
+	req->nr_reinit = req->nr_host_drops = 0;
+	bzero(req->nr_sync_lat, sizeof(req->nr_sync_lat));
+	/* the krings only exist while the port is in use,
+	 * and NMG_LOCK keeps them around */
+	if (NMR(na, t) == NULL)
+		goto out;
+	st = &NMR(na, t)[req->nr_ring_id]->nkr_stats;
+	req->nr_syncs = st->syncs;
+	req->nr_slots = st->slots;
+	req->nr_busy = st->busy;
+	req->nr_reinit = st->reinit;
+	req->nr_host_drops = st->host_drops;
+	memcpy(req->nr_sync_lat, st->lat, sizeof(req->nr_sync_lat));
+	if (req->nr_flags & NR_RING_STATS_RESET) {
+		st->syncs = st->slots = st->busy = 0;
+		st->reinit = st->host_drops = 0;
+		bzero(st->lat, sizeof(st->lat));
+	}
+out:
+	netmap_unget_na(na, ifp);
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Entries of a NIOCSYNCV request copied on the stack at a time. */
+#define NM_SYNCV_BATCH	16
+
+/*
+ * Process one NIOCSYNCV entry. Entries naming another file descriptor
+ * are resolved through the OS, which also keeps the descriptor (and
+ * hence its binding) alive while the ring is synced. Host-bound
+ * packets are sent up right away, as entries may refer to different
+ * adapters.
+ */
+static int
+netmap_syncv_entry(struct netmap_priv_d *priv, struct nmsync_entry *e,
+		struct thread *td)
+{
+	struct netmap_adapter *na;
+	struct mbq q;
+	void *cookie = NULL;
+	enum txrx t;
+	int error;
+
+	if (e->ns_dir != NR_SYNC_TX && e->ns_dir != NR_SYNC_RX) {
+		return EINVAL;
+	}
+	t = (e->ns_dir == NR_SYNC_TX ? NR_TX : NR_RX);
+
+	if (e->ns_fd != -1) {
+		error = nm_os_priv_fget(td, e->ns_fd, &priv, &cookie);
+		if (error)
+			return error;
+	}
+
+	if (unlikely(priv->np_nifp == NULL)) {
+		error = ENXIO;
+		goto out;
+	}
+	mb(); /* make sure following reads are not from cache */
+
+	if (unlikely(priv->np_csb_atok_base)) {
+		error = EBUSY;
+		goto out;
+	}
+	if (e->ns_ring < priv->np_qfirst[t] || e->ns_ring >= priv->np_qlast[t]) {
+		error = EINVAL;
+		goto out;
+	}
+
+	na = priv->np_na;
+	mbq_init(&q);
+	error = netmap_ioctl_sync_kring(priv, NMR(na, t)[e->ns_ring], t, &q);
+	if (mbq_peek(&q)) {
+		netmap_send_up(na->ifp, &q);
+	}
+out:
+	if (cookie != NULL)
+		nm_os_priv_fput(td, cookie);
+	return error;
+}
+
 /*
  * ioctl(2) support for the "netmap" device.
  *
@@ -2397,6 +2761,7 @@ static int nmreq_checkoptions(struct nmreq_header *);
  * - NIOCCTRL		device control API
  * - NIOCTXSYNC		sync TX rings
  * - NIOCRXSYNC		sync RX rings
+ * - NIOCSYNCV		sync a list of rings, possibly of other fds
  * - SIOCGIFADDR	just for convenience
  * - NIOCGINFO		deprecated (legacy API)
  * - NIOCREGIF		deprecated (legacy API)
@@ -2414,7 +2779,6 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 	int error = 0;
 	u_int i, qfirst, qlast;
 	struct netmap_kring **krings;
-	int sync_flags;
 	enum txrx t;
 
 	switch (cmd) {
@@ -2453,6 +2817,9 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			do {
 				struct nmreq_option *opt;
 				u_int memflags;
+#ifdef WITH_EXTMEM
+				int extmem = 0;
+#endif /* WITH_EXTMEM */
 
 				if (priv->np_nifp != NULL) {	/* thread already registered */
 					error = EBUSY;
@@ -2476,9 +2843,32 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 					opt->nro_status = error;
 					if (nmd == NULL)
 						break;
+					extmem = 1;
+				} else if (req->nr_flags & NR_EXTMEM_PERSIST) {
+					error = EINVAL;
+					break;
 				}
 #endif /* WITH_EXTMEM */
 
+				opt = nmreq_findoption((struct nmreq_option *)(uintptr_t)hdr->nr_options,
+						NETMAP_REQ_OPT_MEM_NODE);
+				if (opt != NULL) {
+					struct nmreq_opt_mem_node *n =
+						(struct nmreq_opt_mem_node *)opt;
+
+					error = nmreq_checkduplicate(opt);
+					if (!error && (nmd != NULL || req->nr_mem_id))
+						error = EINVAL; /* conflicting requests */
+					if (error) {
+						opt->nro_status = error;
+						break;
+					}
+					nmd = netmap_mem_node_get(n->nro_node, &error);
+					opt->nro_status = error;
+					if (nmd == NULL)
+						break;
+				}
+
 				if (nmd == NULL && req->nr_mem_id) {
 					/* find the allocator and get a reference */
 					nmd = netmap_mem_find(req->nr_mem_id);
@@ -2571,6 +2961,13 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 
 				/* store ifp reference so that priv destructor may release it */
 				priv->np_ifp = ifp;
+#ifdef WITH_EXTMEM
+				/* only now, a failed registration must not
+				 * change the region */
+				if (extmem)
+					netmap_mem_ext_persist(nmd,
+						req->nr_flags & NR_EXTMEM_PERSIST);
+#endif /* WITH_EXTMEM */
 			} while (0);
 			if (error) {
 				netmap_unget_na(na, ifp);
@@ -2743,12 +3140,36 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			error = nm_bdg_polling(hdr);
 			break;
 		}
+
+		case NETMAP_REQ_VALE_FDB: {
+			error = netmap_vale_fdb(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_DISPATCH: {
+			error = netmap_vale_dispatch(hdr);
+			break;
+		}
+
+		case NETMAP_REQ_VALE_STATS_GET: {
+			error = netmap_vale_stats_get(hdr);
+			break;
+		}
 #endif  /* WITH_VALE */
-		case NETMAP_REQ_POOLS_INFO_GET: {
+		case NETMAP_REQ_POOLS_INFO_GET:
+		case NETMAP_REQ_POOLS_STATS_GET: {
 			/* Get information from the memory allocator used for
-			 * hdr->nr_name. */
+			 * hdr->nr_name, and optionally its statistics. */
+			uint16_t reqtype = hdr->nr_reqtype;
+			uint64_t body = hdr->nr_body;
+			struct nmreq_pools_stats *st = NULL;
 			struct nmreq_pools_info *req =
-				(struct nmreq_pools_info *)(uintptr_t)hdr->nr_body;
+				(struct nmreq_pools_info *)(uintptr_t)body;
+
+			if (reqtype == NETMAP_REQ_POOLS_STATS_GET) {
+				st = (struct nmreq_pools_stats *)(uintptr_t)body;
+				req = &st->nr_info;
+			}
 			NMG_LOCK();
 			do {
 				/* Build a nmreq_register out of the nmreq_pools_info,
@@ -2761,8 +3182,8 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 				hdr->nr_reqtype = NETMAP_REQ_REGISTER;
 				hdr->nr_body = (uintptr_t)&regreq;
 				error = netmap_get_na(hdr, &na, &ifp, NULL, 1 /* create */);
-				hdr->nr_reqtype = NETMAP_REQ_POOLS_INFO_GET; /* reset type */
-				hdr->nr_body = (uintptr_t)req; /* reset nr_body */
+				hdr->nr_reqtype = reqtype; /* reset type */
+				hdr->nr_body = body; /* reset nr_body */
 				if (error) {
 					na = NULL;
 					ifp = NULL;
@@ -2781,6 +3202,8 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 					break;
 				}
 				error = netmap_mem_pools_info_get(req, nmd);
+				if (!error && st != NULL)
+					error = netmap_mem_pools_stats_get(st, na);
 				netmap_mem_drop(na);
 			} while (0);
 			netmap_unget_na(na, ifp);
@@ -2788,6 +3211,11 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			break;
 		}
 
+		case NETMAP_REQ_RING_STATS_GET: {
+			error = netmap_ring_stats_get(hdr);
+			break;
+		}
+
 		case NETMAP_REQ_CSB_ENABLE: {
 			struct nmreq_option *opt;
 
@@ -2851,45 +3279,12 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 		krings = NMR(na, t);
 		qfirst = priv->np_qfirst[t];
 		qlast = priv->np_qlast[t];
-		sync_flags = priv->np_sync_flags;
 
 		for (i = qfirst; i < qlast; i++) {
-			struct netmap_kring *kring = krings[i];
-			struct netmap_ring *ring = kring->ring;
-
-			if (unlikely(nm_kr_tryget(kring, 1, &error))) {
-				error = (error ? EIO : 0);
-				continue;
-			}
+			int err = netmap_ioctl_sync_kring(priv, krings[i], t, &q);
 
-			if (cmd == NIOCTXSYNC) {
-				if (netmap_debug & NM_DEBUG_TXSYNC)
-					nm_prinf("pre txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-				if (nm_txsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				} else if (kring->nm_sync(kring, sync_flags | NAF_FORCE_RECLAIM) == 0) {
-					nm_sync_finalize(kring);
-				}
-				if (netmap_debug & NM_DEBUG_TXSYNC)
-					nm_prinf("post txsync ring %d cur %d hwcur %d",
-					    i, ring->cur,
-					    kring->nr_hwcur);
-			} else {
-				if (nm_rxsync_prologue(kring, ring) >= kring->nkr_num_slots) {
-					netmap_ring_reinit(kring);
-				}
-				if (nm_may_forward_up(kring)) {
-					/* transparent forwarding, see netmap_poll() */
-					netmap_grab_packets(kring, &q, netmap_fwd);
-				}
-				if (kring->nm_sync(kring, sync_flags | NAF_FORCE_READ) == 0) {
-					nm_sync_finalize(kring);
-				}
-				ring_timestamp_set(ring);
-			}
-			nm_kr_put(kring);
+			if (err)
+				error = err;
 		}
 
 		if (mbq_peek(&q)) {
@@ -2899,6 +3294,48 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 		break;
 	}
 
+	case NIOCSYNCV: {
+		struct nmsyncv *sv = (struct nmsyncv *)data;
+		struct nmsync_entry *uent =
+			(struct nmsync_entry *)(uintptr_t)sv->nsv_entries;
+		struct nmsync_entry ent[NM_SYNCV_BATCH];
+		u_int n, j;
+
+		sv->nsv_errors = 0;
+		if (sv->nsv_count > NM_SYNCV_MAX) {
+			error = EINVAL;
+			break;
+		}
+		/* Entries are copied in and out in small batches,
+		 * to keep them on the stack. */
+		for (i = 0; i < sv->nsv_count; i += n) {
+			n = sv->nsv_count - i;
+			if (n > NM_SYNCV_BATCH)
+				n = NM_SYNCV_BATCH;
+			if (nr_body_is_user) {
+				error = copyin(uent + i, ent, n * sizeof(ent[0]));
+				if (error)
+					break;
+			} else {
+				memcpy(ent, uent + i, n * sizeof(ent[0]));
+			}
+			for (j = 0; j < n; j++) {
+				ent[j].ns_error = netmap_syncv_entry(priv,
+						&ent[j], td);
+				if (ent[j].ns_error)
+					sv->nsv_errors++;
+			}
+			if (nr_body_is_user) {
+				error = copyout(ent, uent + i, n * sizeof(ent[0]));
+				if (error)
+					break;
+			} else {
+				memcpy(uent + i, ent, n * sizeof(ent[0]));
+			}
+		}
+		break;
+	}
+
 	default: {
 		return netmap_ioctl_legacy(priv, cmd, data, td);
 		break;
@@ -2938,6 +3375,16 @@ nmreq_size_by_type(uint16_t nr_reqtype)
 		return sizeof(struct nmreq_pools_info);
 	case NETMAP_REQ_SYNC_KLOOP_START:
 		return sizeof(struct nmreq_sync_kloop_start);
+	case NETMAP_REQ_VALE_FDB:
+		return sizeof(struct nmreq_vale_fdb);
+	case NETMAP_REQ_VALE_DISPATCH:
+		return sizeof(struct nmreq_vale_dispatch);
+	case NETMAP_REQ_VALE_STATS_GET:
+		return sizeof(struct nmreq_vale_stats);
+	case NETMAP_REQ_POOLS_STATS_GET:
+		return sizeof(struct nmreq_pools_stats);
+	case NETMAP_REQ_RING_STATS_GET:
+		return sizeof(struct nmreq_ring_stats);
 	}
 	return 0;
 }
@@ -2963,6 +3410,9 @@ nmreq_opt_size_by_type(uint32_t nro_reqtype, uint64_t nro_size)
 	case NETMAP_REQ_OPT_CSB:
 		rv = sizeof(struct nmreq_opt_csb);
 		break;
+	case NETMAP_REQ_OPT_MEM_NODE:
+		rv = sizeof(struct nmreq_opt_mem_node);
+		break;
 	}
 	/* subtract the common header */
 	return rv - sizeof(struct nmreq_option);
@@ -3832,7 +4282,7 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	unsigned int txr;
 	struct mbq *q;
 	int busy;
-	u_int i;
+	u_int i, maxfrags;
 
 	i = MBUF_TXQ(m);
 	if (i >= na->num_host_rx_rings) {
@@ -3862,10 +4312,18 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 
 	q = &kring->rx_queue;
 
-	// XXX reconsider long packets if we handle fragments
-	if (len > NETMAP_BUF_SIZE(na)) { /* too long for us */
+	/* if the user asked for it with NR_MOREFRAG, long packets are
+	 * split over several slots, up to NETMAP_MAX_FRAGS and half of
+	 * the ring */
+	maxfrags = 1;
+	if (kring->ring != NULL && (kring->ring->flags & NR_MOREFRAG)) {
+		maxfrags = kring->nkr_num_slots / 2;
+		if (maxfrags > NETMAP_MAX_FRAGS)
+			maxfrags = NETMAP_MAX_FRAGS;
+	}
+	if (len > NETMAP_KRING_BUF_SIZE(kring) * maxfrags) { /* too long for us */
 		nm_prerr("%s from_host, drop packet size %d > %d", na->name,
-			len, NETMAP_BUF_SIZE(na));
+			len, NETMAP_KRING_BUF_SIZE(kring) * maxfrags);
 		goto done;
 	}
 
@@ -3900,6 +4358,8 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 		RD(2, "%s full hwcur %d hwtail %d qlen %d", na->name,
 			kring->nr_hwcur, kring->nr_hwtail, mbq_len(q));
 	} else {
+		if (nm_slot_ts_enabled(kring))
+			nm_os_mbuf_set_rx_ts(m, nm_os_realtime_ns());
 		mbq_enqueue(q, m);
 		ND(2, "%s %d bufs in queue", na->name, mbq_len(q));
 		/* notify outside the lock */
@@ -3909,8 +4369,10 @@ netmap_transmit(struct ifnet *ifp, struct mbuf *m)
 	mbq_unlock(q);
 
 done:
-	if (m)
+	if (m) {
+		kring->nkr_stats.host_drops++;
 		m_freem(m);
+	}
 	/* unconditionally wake up listeners */
 	kring->nm_notify(kring, 0);
 	/* this is normally netmap_notify(), but for nics
@@ -36,10 +36,15 @@ A switch cannot be deleted until all ports are gone.
 For each switch, an SX lock (RWlock on linux) protects
 deletion of ports. When configuring or deleting a new port, the
 lock is acquired in exclusive mode (after holding NMG_LOCK).
-When forwarding, the lock is acquired in shared mode (without NMG_LOCK).
+When forwarding from a VALE port, the lock is acquired in shared
+mode (without NMG_LOCK).
 The lock is held throughout the entire forwarding cycle,
 during which the thread may incur in a page fault.
 Hence it is important that sleepable shared locks are used.
+NICs and host stack ports cannot sleep, and forward within an
+epoch section instead, so they never have to wait for the lock:
+writers wait for a grace period before freeing or reusing
+anything they changed (see netmap_bdg.h).
 
 On the rx ring, the per-port lock is grabbed initially to reserve
 a number of slot in the ring, then the lock is released,
@@ -168,6 +173,257 @@ nm_bdg_name_validate(const char *name, size_t prefixlen)
 	return colon_pos;
 }
 
+/*
+ * Allocate the per-port arrays of a bridge. They are sized for
+ * NM_BDG_MAXPORTS ports, so we only pay for them on bridges
+ * that are actually in use.
+ */
+static void nm_bdg_ports_free(struct nm_bridge *b);
+
+static int
+nm_bdg_ports_alloc(struct nm_bridge *b)
+{
+	size_t idxsz = sizeof(uint32_t) * NM_BDG_MAXPORTS;
+
+	b->bdg_port_index = nm_os_malloc(idxsz);
+	b->tmp_bdg_port_index = nm_os_malloc(idxsz);
+	b->bdg_ports = nm_os_malloc(sizeof(b->bdg_ports[0]) * NM_BDG_MAXPORTS);
+	if (b->bdg_port_index == NULL || b->tmp_bdg_port_index == NULL ||
+			b->bdg_ports == NULL) {
+		nm_bdg_ports_free(b);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static void
+nm_bdg_ports_free(struct nm_bridge *b)
+{
+	if (b->bdg_port_index) {
+		nm_os_free(b->bdg_port_index);
+		b->bdg_port_index = NULL;
+	}
+	if (b->tmp_bdg_port_index) {
+		nm_os_free(b->tmp_bdg_port_index);
+		b->tmp_bdg_port_index = NULL;
+	}
+	if (b->bdg_ports) {
+		nm_os_free(b->bdg_ports);
+		b->bdg_ports = NULL;
+	}
+}
+
+/*
+ * Make the current lookup functions and private_data visible to the
+ * datapath, using the copy that readers do not see. The caller must
+ * BDG_EPOCH_WAIT() before the next update, and before freeing
+ * anything the old copy refers to.
+ */
+void
+nm_bdg_publish_lookup(struct nm_bridge *b)
+{
+	struct nm_bdg_lookup *l = &b->bdg_lookup_cp[0];
+
+	if (b->bdg_lookup == l)
+		l++;
+	l->lookup = b->bdg_ops.lookup;
+	l->lookup_batch = b->bdg_ops.lookup_batch;
+	l->private_data = b->private_data;
+	nm_stst_barrier();
+	b->bdg_lookup = l;
+}
+
+/*
+ * Default size and aging of the learning table of new bridges.
+ * The table of an existing bridge can be changed with
+ * NETMAP_REQ_VALE_FDB.
+ */
+static int bridge_hash_size = NM_BDG_HASH;
+static int bridge_hash_age = NM_BDG_HASH_AGE;
+SYSBEGIN(vars_bdg);
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_hash_size, CTLFLAG_RW,
+		&bridge_hash_size, 0, "Learning table entries of new bridges");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_hash_age, CTLFLAG_RW,
+		&bridge_hash_age, 0, "Max age (s) of learning table entries");
+SYSEND;
+
+/* number of buckets (a power of 2) needed to hold 'entries' addresses */
+static u_int
+nm_bdg_ht_nbuckets(u_int entries)
+{
+	u_int nb = 1;
+
+	if (entries > NM_BDG_HASH_MAX)
+		entries = NM_BDG_HASH_MAX;
+	while (nb * NM_BDG_HASH_WAYS < entries)
+		nb <<= 1;
+	return nb;
+}
+
+static struct nm_hash_ent *
+nm_bdg_ht_buckets_alloc(u_int nb)
+{
+	struct nm_hash_ent *buckets;
+	u_int i, j;
+
+	buckets = nm_os_vmalloc(sizeof(*buckets) * nb);
+	if (buckets == NULL)
+		return NULL;
+	for (i = 0; i < nb; i++) {
+		for (j = 0; j < NM_BDG_HASH_WAYS; j++) {
+			buckets[i].mac[j] = NM_BDG_HT_ENT(0, NM_BDG_NOPORT);
+			buckets[i].epoch[j] = 0;
+		}
+		buckets[i].pad = 0;
+	}
+	return buckets;
+}
+
+struct nm_hash_tbl *
+nm_bdg_ht_alloc(u_int entries, u_int max_age)
+{
+	struct nm_hash_tbl *ht;
+	u_int nb = nm_bdg_ht_nbuckets(entries);
+
+	ht = nm_os_malloc(sizeof(*ht));
+	if (ht == NULL)
+		return NULL;
+	ht->buckets = nm_bdg_ht_buckets_alloc(nb);
+	if (ht->buckets == NULL) {
+		nm_os_free(ht);
+		return NULL;
+	}
+	ht->mcast = nm_os_vmalloc(sizeof(*ht->mcast));
+	if (ht->mcast == NULL) {
+		nm_os_vfree(ht->buckets);
+		nm_os_free(ht);
+		return NULL;
+	}
+	memset(ht->mcast, 0, sizeof(*ht->mcast));
+	mtx_init(&ht->mcast->lock, "nm_mcast_lock", NULL, MTX_DEF);
+	ht->mask = nb - 1;
+	ht->max_age = max_age > 0xffff ? 0xffff : max_age;
+	return ht;
+}
+
+void
+nm_bdg_ht_free(struct nm_hash_tbl *ht)
+{
+	if (ht == NULL)
+		return;
+	mtx_destroy(&ht->mcast->lock);
+	nm_os_vfree(ht->mcast);
+	nm_os_vfree(ht->buckets);
+	nm_os_free(ht);
+}
+
+/* forget all the learned addresses. Called with BDG_WLOCK() */
+void
+nm_bdg_ht_flush(struct nm_hash_tbl *ht)
+{
+	u_int i, j;
+
+	for (i = 0; i <= ht->mask; i++) {
+		for (j = 0; j < NM_BDG_HASH_WAYS; j++)
+			ht->buckets[i].mac[j] = NM_BDG_HT_ENT(0, NM_BDG_NOPORT);
+	}
+	ht->learned = ht->moved = ht->collisions = 0;
+}
+
+static void
+nm_bdg_mcast_clear(struct nm_bdg_mcast_ports *p, u_int port)
+{
+	p->cur[port / 32] &= ~(1U << (port % 32));
+	p->prev[port / 32] &= ~(1U << (port % 32));
+}
+
+/* forget the addresses and the multicast groups learned on a port
+ * that is going away, so that a new port with the same index does
+ * not inherit them
+ */
+void
+nm_bdg_ht_purge_port(struct nm_hash_tbl *ht, u_int port)
+{
+	struct nm_bdg_mcast *mc = ht->mcast;
+	u_int i, j;
+
+	for (i = 0; i <= ht->mask; i++) {
+		for (j = 0; j < NM_BDG_HASH_WAYS; j++) {
+			if (NM_BDG_HT_PORT(ht->buckets[i].mac[j]) == port)
+				ht->buckets[i].mac[j] =
+					NM_BDG_HT_ENT(0, NM_BDG_NOPORT);
+		}
+	}
+	mtx_lock(&mc->lock);
+	nm_bdg_mcast_clear(&mc->routers, port);
+	for (i = 0; i < NM_BDG_MCAST_GROUPS; i++)
+		nm_bdg_mcast_clear(&mc->grp[i], port);
+	mtx_unlock(&mc->lock);
+}
+
+/*
+ * Change the number of buckets of the learning table of 'b',
+ * moving the live entries to the new buckets. Entries that
+ * do not fit (on shrink) are dropped and will be learned again.
+ * Called with NMG_LOCK().
+ */
+int
+nm_bdg_ht_resize(struct nm_bridge *b, u_int entries)
+{
+	struct nm_hash_tbl *ht = b->ht;
+	struct nm_hash_ent *nbk, *obk;
+	u_int nb = nm_bdg_ht_nbuckets(entries), i, j, k;
+
+	NMG_LOCK_ASSERT();
+
+	if (nb == ht->mask + 1)
+		return 0;
+	nbk = nm_bdg_ht_buckets_alloc(nb);
+	if (nbk == NULL)
+		return ENOMEM;
+
+	/* the datapath keeps learning in the old buckets while
+	 * we rehash, we may lose a few updates */
+	for (i = 0; i <= ht->mask; i++) {
+		struct nm_hash_ent *o = &ht->buckets[i];
+
+		for (j = 0; j < NM_BDG_HASH_WAYS; j++) {
+			struct nm_hash_ent *n;
+
+			if (NM_BDG_HT_PORT(o->mac[j]) == NM_BDG_NOPORT)
+				continue;
+			n = &nbk[nm_bdg_rthash(o->mac[j] & NM_BDG_HASH_MACMASK) &
+				(nb - 1)];
+			for (k = 0; k < NM_BDG_HASH_WAYS; k++) {
+				if (NM_BDG_HT_PORT(n->mac[k]) == NM_BDG_NOPORT) {
+					n->mac[k] = o->mac[j];
+					n->epoch[k] = o->epoch[j];
+					break;
+				}
+			}
+		}
+	}
+	/* readers may combine the old mask with the new buckets or
+	 * vice versa, so the smaller mask must be in place first */
+	obk = ht->buckets;
+	BDG_WLOCK(b);
+	if (nb > ht->mask + 1)
+		ht->buckets = nbk;
+	else
+		ht->mask = nb - 1;
+	BDG_WUNLOCK(b);
+	BDG_EPOCH_WAIT();
+	BDG_WLOCK(b);
+	ht->buckets = nbk;
+	ht->mask = nb - 1;
+	BDG_WUNLOCK(b);
+	BDG_EPOCH_WAIT();
+
+	nm_os_vfree(obk);
+	return 0;
+}
+
 /*
  * locate a bridge among the existing ones.
  * MUST BE CALLED WITH NMG_LOCK()
@@ -212,11 +468,17 @@ nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops)
 		/* initialize the bridge */
 		ND("create new bridge %s with ports %d", b->bdg_basename,
 			b->bdg_active_ports);
-		b->ht = nm_os_malloc(sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		b->ht = nm_bdg_ht_alloc(bridge_hash_size, bridge_hash_age);
 		if (b->ht == NULL) {
 			nm_prerr("failed to allocate hash table");
 			return NULL;
 		}
+		if (nm_bdg_ports_alloc(b)) {
+			nm_prerr("failed to allocate port arrays");
+			nm_bdg_ht_free(b->ht);
+			b->ht = NULL;
+			return NULL;
+		}
 		strncpy(b->bdg_basename, name, namelen);
 		b->bdg_namelen = namelen;
 		b->bdg_active_ports = 0;
@@ -225,6 +487,8 @@ nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops)
 		/* set the default function */
 		b->bdg_ops = b->bdg_saved_ops = *ops;
 		b->private_data = b->ht;
+		b->bdg_lookup = NULL;
+		nm_bdg_publish_lookup(b);
 		b->bdg_flags = 0;
 		NM_BNS_GET(b);
 	}
@@ -240,9 +504,15 @@ netmap_bdg_free(struct nm_bridge *b)
 	}
 
 	ND("marking bridge %s as free", b->bdg_basename);
-	nm_os_free(b->ht);
+	nm_bdg_ht_free(b->ht);
+	b->ht = NULL;
+	if (b->flowtab != NULL)
+		b->bdg_saved_ops.flowtab_free(b->flowtab);
+	b->flowtab = NULL;
+	nm_bdg_ports_free(b);
 	memset(&b->bdg_ops, 0, sizeof(b->bdg_ops));
 	memset(&b->bdg_saved_ops, 0, sizeof(b->bdg_saved_ops));
+	b->bdg_lookup = NULL;
 	b->bdg_flags = 0;
 	NM_BNS_PUT(b);
 	return 0;
@@ -272,10 +542,18 @@ netmap_bdg_update_private_data(const char *name, bdg_update_private_data_fn_t ca
 		error = EACCES;
 		goto unlock_update_priv;
 	}
+	/* the callback may free the old data, so stop the datapath
+	 * from using it (senders will retry later) */
+	BDG_WLOCK(b);
+	b->bdg_lookup = NULL;
+	BDG_WUNLOCK(b);
+	BDG_EPOCH_WAIT();
 	BDG_WLOCK(b);
 	private_data = callback(b->private_data, callback_data, &error);
 	b->private_data = private_data;
+	nm_bdg_publish_lookup(b);
 	BDG_WUNLOCK(b);
+	BDG_EPOCH_WAIT();
 
 unlock_update_priv:
 	NMG_UNLOCK();
@@ -293,6 +571,7 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	int s_hw = hw, s_sw = sw;
 	int i, lim =b->bdg_active_ports;
 	uint32_t *tmp = b->tmp_bdg_port_index;
+	struct netmap_vp_adapter *hw_vpna;
 
 	/*
 	New algorithm:
@@ -300,16 +579,19 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	lookup NA(ifp)->bdg_port and SWNA(ifp)->bdg_port
 	in the array of bdg_port_index, replacing them with
 	entries from the bottom of the array;
+	publish the copy, wait for a grace period and then
 	decrement bdg_active_ports;
-	acquire BDG_WLOCK() and copy back the array.
+	wait again before the ports can go away.
 	 */
 
 	if (netmap_debug & NM_DEBUG_BDG)
 		nm_prinf("detach %d and %d (lim %d)", hw, sw, lim);
-	/* make a copy of the list of active ports, update it,
-	 * and then copy back within BDG_WLOCK().
+	/* make a copy of the list of active ports and update it.
+	 * The first bdg_active_ports entries of the copy are still
+	 * the same set of ports, so readers may use either array.
 	 */
-	memcpy(b->tmp_bdg_port_index, b->bdg_port_index, sizeof(b->tmp_bdg_port_index));
+	memcpy(b->tmp_bdg_port_index, b->bdg_port_index,
+		sizeof(uint32_t) * NM_BDG_MAXPORTS);
 	for (i = 0; (hw >= 0 || sw >= 0) && i < lim; ) {
 		if (hw >= 0 && tmp[i] == hw) {
 			ND("detach hw %d at %d", hw, i);
@@ -332,15 +614,30 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	}
 
 	BDG_WLOCK(b);
-	if (b->bdg_ops.dtor)
-		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
+	b->tmp_bdg_port_index = b->bdg_port_index;
+	nm_stst_barrier();
+	b->bdg_port_index = tmp;
+	BDG_WUNLOCK(b);
+	BDG_EPOCH_WAIT();
+
+	BDG_WLOCK(b);
+	hw_vpna = b->bdg_ports[s_hw];
 	b->bdg_ports[s_hw] = NULL;
 	if (s_sw >= 0) {
 		b->bdg_ports[s_sw] = NULL;
 	}
-	memcpy(b->bdg_port_index, b->tmp_bdg_port_index, sizeof(b->tmp_bdg_port_index));
 	b->bdg_active_ports = lim;
 	BDG_WUNLOCK(b);
+	BDG_EPOCH_WAIT();
+
+	/* nobody can reach the ports from the datapath anymore */
+	if (b->bdg_ops.dtor)
+		b->bdg_ops.dtor(hw_vpna);
+
+	/* stale entries would point to whatever port reuses these slots */
+	nm_bdg_ht_purge_port(b->ht, s_hw);
+	if (s_sw >= 0)
+		nm_bdg_ht_purge_port(b->ht, s_sw);
 
 	ND("now %d active ports", lim);
 	netmap_bdg_free(b);
@@ -516,18 +813,22 @@ netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	BDG_WLOCK(b);
 	vpna->bdg_port = cand;
 	ND("NIC  %p to bridge port %d", vpna, cand);
-	/* bind the port to the bridge (virtual ports are not active) */
+	/* bind the port to the bridge (virtual ports are not active).
+	 * cand and cand2 are already in bdg_port_index, right after
+	 * the active ports, so readers only need to see the ports
+	 * before the new bdg_active_ports.
+	 */
 	b->bdg_ports[cand] = vpna;
 	vpna->na_bdg = b;
-	b->bdg_active_ports++;
 	if (hostna != NULL) {
 		/* also bind the host stack to the bridge */
 		b->bdg_ports[cand2] = hostna;
 		hostna->bdg_port = cand2;
 		hostna->na_bdg = b;
-		b->bdg_active_ports++;
 		ND("host %p to bridge port %d", hostna, cand2);
 	}
+	nm_stst_barrier();
+	b->bdg_active_ports += (hostna != NULL) ? 2 : 1;
 	ND("if %s refs %d", ifname, vpna->up.na_refcount);
 	BDG_WUNLOCK(b);
 	*na = &vpna->up;
@@ -853,6 +1154,7 @@ int
 netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *private_data, void *auth_token)
 {
 	struct nm_bridge *b;
+	void *fl;
 	int error = 0;
 
 	NMG_LOCK();
@@ -867,16 +1169,29 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 	}
 
 	BDG_WLOCK(b);
+	/* the built-in flow table, if any, gives way to the module */
+	fl = b->flowtab;
+	if (fl != NULL) {
+		b->flowtab = NULL;
+		b->bdg_ops.lookup = b->bdg_saved_ops.lookup;
+		b->bdg_ops.lookup_batch = b->bdg_saved_ops.lookup_batch;
+		b->private_data = b->ht;
+	}
 	if (!bdg_ops) {
 		/* resetting the bridge */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		nm_bdg_ht_flush(b->ht);
 		b->bdg_ops = b->bdg_saved_ops;
 		b->private_data = b->ht;
 	} else {
 		/* modifying the bridge */
 		b->private_data = private_data;
+		/* a new per-packet lookup without a batched version
+		 * must not be bypassed by the one we have */
+		if (bdg_ops->lookup && !bdg_ops->lookup_batch)
+			b->bdg_ops.lookup_batch = NULL;
 #define nm_bdg_override(m) if (bdg_ops->m) b->bdg_ops.m = bdg_ops->m
 		nm_bdg_override(lookup);
+		nm_bdg_override(lookup_batch);
 		nm_bdg_override(config);
 		nm_bdg_override(dtor);
 		nm_bdg_override(vp_create);
@@ -884,7 +1199,12 @@ netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *privat
 #undef nm_bdg_override
 
 	}
+	nm_bdg_publish_lookup(b);
 	BDG_WUNLOCK(b);
+	/* the caller may free the data of the old lookup function */
+	BDG_EPOCH_WAIT();
+	if (fl != NULL)
+		b->bdg_saved_ops.flowtab_free(fl);
 
 unlock_regops:
 	NMG_UNLOCK();
@@ -954,8 +1274,12 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 			}
 		}
 	}
-	if (vpna->na_bdg)
+	if (vpna->na_bdg) {
 		BDG_WUNLOCK(vpna->na_bdg);
+		/* senders that saw the rings on may still be using them */
+		if (!onoff)
+			BDG_EPOCH_WAIT();
+	}
 	return 0;
 }
 
@@ -1428,7 +1752,7 @@ netmap_bwrap_notify(struct netmap_kring *kring, int flags)
 	netmap_vp_rxsync(kring, flags);
 	ND("%s[%d] PRE rx(c%3d t%3d l%3d) ring(h%3d c%3d t%3d) tx(c%3d ht%3d t%3d)",
 		na->name, ring_n,
-		kring->nr_hwcur, kring->nr_hwtail, kring->nkr_hwlease,
+		kring->nr_hwcur, kring->nr_hwtail, NM_LEASE_HW(kring->nkr_lease_state),
 		kring->rhead, kring->rcur, kring->rtail,
 		hw_kring->nr_hwcur, hw_kring->nr_hwtail, hw_kring->rtail);
 	/* second step: the new packets are sent on the tx ring
@@ -1447,7 +1771,7 @@ netmap_bwrap_notify(struct netmap_kring *kring, int flags)
 	netmap_vp_rxsync(kring, flags);
 	ND("%s[%d] PST rx(c%3d t%3d l%3d) ring(h%3d c%3d t%3d) tx(c%3d ht%3d t%3d)",
 		na->name, ring_n,
-		kring->nr_hwcur, kring->nr_hwtail, kring->nkr_hwlease,
+		kring->nr_hwcur, kring->nr_hwtail, NM_LEASE_HW(kring->nkr_lease_state),
 		kring->rhead, kring->rcur, kring->rtail,
 		hw_kring->nr_hwcur, hw_kring->nr_hwtail, hw_kring->rtail);
 put_out:
@@ -42,8 +42,30 @@
 #define BDG_RUNLOCK(b)		rw_runlock(&(b)->bdg_lock)
 #define BDG_RWDESTROY(b)	rw_destroy(&(b)->bdg_lock)
 
+#if __FreeBSD_version >= 1300000
+#include <sys/epoch.h>
+#define BDG_EPOCH_T		struct epoch_tracker
+#define BDG_EPOCH_ENTER(et)	NET_EPOCH_ENTER(et)
+#define BDG_EPOCH_EXIT(et)	NET_EPOCH_EXIT(et)
+#define BDG_EPOCH_WAIT()	NET_EPOCH_WAIT()
+#endif /* __FreeBSD_version >= 1300000 */
+
 #endif /* __FreeBSD__ */
 
+/*
+ * Sources that cannot sleep (NICs, host stack) read the port table,
+ * the lookup functions and the learning table inside an epoch (RCU)
+ * section, without locks. Sources that may sleep still take
+ * BDG_RLOCK(). Writers make each change under BDG_WLOCK(), in steps
+ * that are all consistent for readers, and call BDG_EPOCH_WAIT()
+ * before reusing or freeing what readers may still see. Without
+ * epoch support, the other sources fall back to BDG_RTRYLOCK().
+ */
+#ifndef BDG_EPOCH_T
+#define NM_BDG_NOEPOCH
+#define BDG_EPOCH_WAIT()
+#endif /* !BDG_EPOCH_T */
+
 /*
  * The following bridge-related functions are used by other
  * kernel modules.
@@ -52,9 +74,32 @@
  * function can return 0 .. NM_BDG_MAXPORTS-1 for regular ports,
  * NM_BDG_MAXPORTS for broadcast, NM_BDG_MAXPORTS+1 to indicate
  * drop.
+ * Modules must use NM_BDG_BROADCAST and NM_BDG_NOPORT: before
+ * NM_BDG_MAXPORTS was raised to 4096 they were 254 and 255,
+ * which are now regular ports.
  */
 typedef uint32_t (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
 		struct netmap_vp_adapter *, void *private_data);
+/*
+ * Optional batched lookup. ft[0..n-1] point to the first fragment of
+ * each packet, as passed to lookup(); the function must fill in
+ * dst_port[i] and may change dst_ring[i] (initialized to the source
+ * ring). When not set, lookup() is called for each packet.
+ */
+typedef void (*bdg_lookup_batch_fn_t)(struct nm_bdg_fwd **ft, u_int n,
+		uint32_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *, void *private_data);
+/*
+ * What the datapath needs from bdg_ops and private_data. There are
+ * two copies in the bridge, and writers publish the updated one by
+ * pointer, so that readers always see a function together with the
+ * data it expects.
+ */
+struct nm_bdg_lookup {
+	bdg_lookup_fn_t		lookup;
+	bdg_lookup_batch_fn_t	lookup_batch;
+	void			*private_data;
+};
 typedef int (*bdg_config_fn_t)(struct nm_ifreq *);
 typedef void (*bdg_dtor_fn_t)(const struct netmap_vp_adapter *);
 typedef void *(*bdg_update_private_data_fn_t)(void *private_data, void *callback_data, int *error);
@@ -62,31 +107,170 @@ typedef int (*bdg_vp_create_fn_t)(struct nmreq_header *hdr,
 		struct ifnet *ifp, struct netmap_mem_d *nmd,
 		struct netmap_vp_adapter **ret);
 typedef int (*bdg_bwrap_attach_fn_t)(const char *nr_name, struct netmap_adapter *hwna);
+typedef void (*bdg_flowtab_free_fn_t)(void *flowtab);
 struct netmap_bdg_ops {
 	bdg_lookup_fn_t lookup;
+	bdg_lookup_batch_fn_t lookup_batch;
 	bdg_config_fn_t config;
 	bdg_dtor_fn_t	dtor;
 	bdg_vp_create_fn_t	vp_create;
 	bdg_bwrap_attach_fn_t	bwrap_attach;
+	/* frees the built-in flow table of the bridge type, if any */
+	bdg_flowtab_free_fn_t	flowtab_free;
 	char name[IFNAMSIZ];
 };
 int netmap_bwrap_attach(const char *name, struct netmap_adapter *, struct netmap_bdg_ops *);
 int netmap_bdg_regops(const char *name, struct netmap_bdg_ops *bdg_ops, void *private_data, void *auth_token);
 
 #define	NM_BRIDGES		8	/* number of bridges */
-#define	NM_BDG_MAXPORTS		254	/* up to 254 */
+#define	NM_BDG_MAXPORTS		4096	/* up to 65533 */
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
 #define	NM_BDG_NOPORT		(NM_BDG_MAXPORTS+1)
 
-/* XXX Should go away after fixing find_bridge() - Michio */
-#define NM_BDG_HASH		1024	/* forwarding table entries */
+/*
+ * Learning table (forwarding database) of a bridge.
+ * The table is an array of buckets, each one holding NM_BDG_HASH_WAYS
+ * entries in a single cache line, so a lookup costs one cache miss
+ * and colliding addresses can coexist in the same bucket.
+ * The low 48 bits of mac[] contain the address and the top 16 bits
+ * the port, so that readers see both in a single load. epoch[] is
+ * the time_second of the last time the address was seen as a source,
+ * in 32 bits so that entries idle for a long time do not look fresh
+ * again when it wraps. Entries older than max_age are treated as free.
+ * An unused entry has port NM_BDG_NOPORT.
+ *
+ * The bucket array can be resized with NETMAP_REQ_VALE_FDB; the
+ * nm_hash_tbl itself never moves, since its address is also used
+ * as the authentication token of the bridge.
+ */
+#define NM_BDG_HASH		1024	/* default forwarding table entries */
+#define NM_BDG_HASH_MAX		(1 << 20)
+#define NM_BDG_HASH_WAYS	5	/* entries per bucket */
+#define NM_BDG_HASH_AGE		300	/* default max age, in seconds */
+#define NM_BDG_HASH_MACMASK	0xffffffffffffULL
 
-/* XXX revise this */
 struct nm_hash_ent {
-	uint64_t	mac;	/* the top 2 bytes are the epoch */
-	uint64_t	ports;
+	uint64_t	mac[NM_BDG_HASH_WAYS];	/* the top 2 bytes are the port */
+	uint32_t	epoch[NM_BDG_HASH_WAYS];
+	uint32_t	pad;
+};
+
+struct nm_hash_tbl {
+	struct nm_hash_ent *buckets;
+	uint32_t	mask;		/* number of buckets - 1 */
+	uint32_t	max_age;	/* seconds, 0 means never expire */
+	/* Counters are updated by concurrent senders without
+	 * atomic operations, so they are only approximate.
+	 */
+	uint64_t	learned;	/* new addresses inserted */
+	uint64_t	moved;		/* addresses that changed port */
+	uint64_t	collisions;	/* live entries evicted on insertion */
+	struct nm_bdg_mcast *mcast;	/* snooped multicast groups */
+};
+
+/* ----- FreeBSD if_bridge hash function ------- */
+
+/*
+ * The following hash function is adapted from "Hash Functions" by Bob Jenkins
+ * ("Algorithm Alley", Dr. Dobbs Journal, September 1997).
+ *
+ * http://www.burtleburtle.net/bob/hash/spooky.html
+ */
+#define nm_bdg_mix(a, b, c)                                             \
+do {                                                                    \
+	a -= b; a -= c; a ^= (c >> 13);                                 \
+	b -= c; b -= a; b ^= (a << 8);                                  \
+	c -= a; c -= b; c ^= (b >> 13);                                 \
+	a -= b; a -= c; a ^= (c >> 12);                                 \
+	b -= c; b -= a; b ^= (a << 16);                                 \
+	c -= a; c -= b; c ^= (b >> 5);                                  \
+	a -= b; a -= c; a ^= (c >> 3);                                  \
+	b -= c; b -= a; b ^= (a << 10);                                 \
+	c -= a; c -= b; c ^= (b >> 15);                                 \
+} while (/*CONSTCOND*/0)
+
+/* Hash of a MAC address, as loaded with le64toh() from the frame
+ * (byte 0 of the address in the least significant byte).
+ * The caller masks the result with the size of its table.
+ */
+static __inline uint32_t
+nm_bdg_rthash(uint64_t mac)
+{
+	uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0; // hask key
+
+	b += (uint32_t)(mac >> 32) & 0xffff;
+	a += (uint32_t)mac;
+
+	nm_bdg_mix(a, b, c);
+	return c;
+}
+
+#undef nm_bdg_mix
+
+/* port of a learning table entry, and entry for mac on port */
+#define NM_BDG_HT_PORT(m)	((u_int)((m) >> 48))
+#define NM_BDG_HT_ENT(mac, port) ((mac) | ((uint64_t)(port) << 48))
+
+static __inline int
+nm_bdg_ht_expired(const struct nm_hash_tbl *ht, const struct nm_hash_ent *e,
+		u_int i, uint32_t now)
+{
+	return ht->max_age && now - e->epoch[i] > ht->max_age;
+}
+
+struct nm_hash_tbl *nm_bdg_ht_alloc(u_int entries, u_int max_age);
+void nm_bdg_ht_free(struct nm_hash_tbl *ht);
+void nm_bdg_ht_flush(struct nm_hash_tbl *ht);
+int nm_bdg_ht_resize(struct nm_bridge *b, u_int entries);
+void nm_bdg_ht_purge_port(struct nm_hash_tbl *ht, u_int port);
+
+/*
+ * Multicast groups learned by IGMP/MLD snooping on the ports of a
+ * learning bridge (see nm_vale_mcast_dst()). For frames to a known
+ * group g the lookup sets ft_mgrp = g in the frame and returns
+ * NM_BDG_BROADCAST, and the flush only copies them to the members
+ * of g and to the ports where multicast routers (queriers) have
+ * been seen.
+ * Memberships are kept in two generations of NM_BDG_MCAST_PERIOD
+ * seconds, which rotate when a report arrives after the end of the
+ * current one, so a port that stops reporting is dropped after one
+ * or two periods. Groups are never removed, a group with no members
+ * left for two periods is reused for a new address.
+ * Updates come from the datapath and are serialized by the lock,
+ * readers take no lock and may see a slightly stale membership.
+ */
+#define NM_BDG_MCAST_GROUPS	64	/* groups per bridge */
+#define NM_BDG_MCAST_PERIOD	130	/* seconds, > the IGMP query interval */
+
+struct nm_bdg_mcast_ports {
+	uint32_t	epoch;	/* start of the current generation */
+	uint32_t	cur[NM_BDG_MAXPORTS / 32];
+	uint32_t	prev[NM_BDG_MAXPORTS / 32];
+};
+
+struct nm_bdg_mcast {
+	NM_LOCK_T	lock;
+	uint64_t	mac[NM_BDG_MCAST_GROUPS];	/* 0 if never used */
+	struct nm_bdg_mcast_ports routers;
+	struct nm_bdg_mcast_ports grp[NM_BDG_MCAST_GROUPS];
 };
 
+/* whether 'port' is in the set p, at time 'now' */
+static __inline int
+nm_bdg_mcast_member(const struct nm_bdg_mcast_ports *p, u_int port,
+		uint32_t now)
+{
+	uint32_t age = now - NM_ACCESS_ONCE(p->epoch);
+	uint32_t bits;
+
+	if (age >= 2 * NM_BDG_MCAST_PERIOD)
+		return 0;
+	bits = p->cur[port / 32];
+	if (age < NM_BDG_MCAST_PERIOD)
+		bits |= p->prev[port / 32];
+	return (bits >> (port % 32)) & 1;
+}
+
 /* Default size for the Maximum Frame Size. */
 #define NM_BDG_MFS_DEFAULT	1514
 
@@ -96,12 +280,19 @@ struct nm_hash_ent {
  * The array has fixed size, an empty entry does not terminate
  * the search, but lookups only occur on attach/detach so we
  * don't mind if they are slow.
+ * The port arrays have NM_BDG_MAXPORTS entries and are only
+ * allocated when the bridge is created (see nm_find_bridge()),
+ * so that unused bridge slots do not waste memory.
  *
  * The bridge is non blocking on the transmit ports: excess
  * packets are dropped if there is no room on the output port.
  *
- * bdg_lock protects accesses to the bdg_ports array.
- * This is a rw lock (or equivalent).
+ * bdg_lock serializes the updates of the bdg_ports array.
+ * This is a rw lock (or equivalent). Epoch readers do not take it:
+ * the datapath reads bdg_port_index before
+ * bdg_active_ports, and netmap_bdg_detach_common() publishes a new
+ * index array and waits for a grace period before shrinking
+ * bdg_active_ports, so that every active port is seen exactly once.
  */
 #define NM_BDG_IFNAMSIZ IFNAMSIZ
 struct nm_bridge {
@@ -114,11 +305,11 @@ struct nm_bridge {
 	/* Indexes of active ports (up to active_ports)
 	 * and all other remaining ports.
 	 */
-	uint32_t	bdg_port_index[NM_BDG_MAXPORTS];
+	uint32_t	*bdg_port_index;
 	/* used by netmap_bdg_detach_common() */
-	uint32_t	tmp_bdg_port_index[NM_BDG_MAXPORTS];
+	uint32_t	*tmp_bdg_port_index;
 
-	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
+	struct netmap_vp_adapter **bdg_ports;
 
 	/*
 	 * Programmable lookup functions to figure out the destination port.
@@ -138,7 +329,20 @@ struct nm_bridge {
 	 * otherwise will point to the data structure received by netmap_bdg_regops().
 	 */
 	void *private_data;
-	struct nm_hash_ent *ht;
+	struct nm_hash_tbl *ht;
+
+	/* datapath view of the lookup functions and private_data,
+	 * points to one of bdg_lookup_cp[] (see nm_bdg_publish_lookup()).
+	 * NULL while a module replaces its private data.
+	 */
+	struct nm_bdg_lookup *bdg_lookup;
+	struct nm_bdg_lookup bdg_lookup_cp[2];
+
+	/* built-in flow table, when it replaces the learning bridge
+	 * (see netmap_vale_config()). It is also private_data, and
+	 * it is freed with bdg_saved_ops.flowtab_free().
+	 */
+	void *flowtab;
 
 	/* Currently used to specify if the bridge is still in use while empty and
 	 * if it has been put in exclusive mode by an external module, see netmap_bdg_regops()
@@ -174,6 +378,7 @@ int netmap_get_bdg_na(struct nmreq_header *hdr, struct netmap_adapter **na,
 	struct netmap_mem_d *nmd, int create, struct netmap_bdg_ops *ops);
 
 struct nm_bridge *nm_find_bridge(const char *name, int create, struct netmap_bdg_ops *ops);
+void nm_bdg_publish_lookup(struct nm_bridge *b);
 int netmap_bdg_free(struct nm_bridge *b);
 void netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw);
 int netmap_vp_bdg_ctl(struct nmreq_header *hdr, struct netmap_adapter *na);
@@ -38,6 +38,9 @@
 #include <sys/conf.h>	/* DEV_MODULE_ORDERED */
 #include <sys/endian.h>
 #include <sys/syscallsubr.h> /* kern_ioctl() */
+#include <sys/capsicum.h> /* cap_ioctl_rights */
+#include <sys/file.h> /* fget() */
+#include <sys/vnode.h>
 
 #include <sys/rwlock.h>
 
@@ -47,6 +50,7 @@
 #include <vm/vm_object.h>
 #include <vm/vm_page.h>
 #include <vm/vm_pager.h>
+#include <vm/vm_phys.h> /* vm_ndomains */
 #include <vm/uma.h>
 
 
@@ -109,6 +113,52 @@ nm_os_free(void *addr)
 	free(addr, M_DEVBUF);
 }
 
+void *
+nm_os_vmalloc(size_t size)
+{
+	return malloc(size, M_DEVBUF, M_NOWAIT | M_ZERO);
+}
+
+void
+nm_os_vfree(void *addr)
+{
+	free(addr, M_DEVBUF);
+}
+
+/* the pager does not map superpages for us, so we do not use them */
+u_int
+nm_os_hugepage_shift(void)
+{
+	return 0;
+}
+
+void *
+nm_os_hugepage_alloc(size_t size, int node)
+{
+	return NULL;
+}
+
+void
+nm_os_hugepage_free(void *addr, size_t size)
+{
+}
+
+int
+nm_os_numa_node(struct netmap_adapter *na)
+{
+#ifdef IF_NODOM
+	if (na->ifp != NULL && na->ifp->if_numa_domain != IF_NODOM)
+		return na->ifp->if_numa_domain;
+#endif /* IF_NODOM */
+	return -1;
+}
+
+int
+nm_os_numa_node_valid(int node)
+{
+	return node >= 0 && node < vm_ndomains;
+}
+
 void
 nm_os_ifnet_lock(void)
 {
@@ -261,14 +311,35 @@ nm_os_csum_tcpudp_ipv6(struct nm_ipv6hdr *ip6h, void *data,
 #endif
 }
 
-/* on FreeBSD we send up one packet at a time */
+/*
+ * On FreeBSD packets are linked through m_nextpkt and the chain
+ * is passed to if_input() on the final call: ether_input()
+ * processes chains of packets.
+ */
 void *
 nm_os_send_up(struct ifnet *ifp, struct mbuf *m, struct mbuf *prev)
 {
-	NA(ifp)->if_input(ifp, m);
+	if (m != NULL) {
+		m->m_nextpkt = NULL;
+		if (prev != NULL)
+			prev->m_nextpkt = m;
+		return m;
+	}
+	NA(ifp)->if_input(ifp, prev);
 	return NULL;
 }
 
+/* mbufs already come from the per-cpu UMA caches */
+void
+nm_os_send_up_begin(void)
+{
+}
+
+void
+nm_os_send_up_end(void)
+{
+}
+
 int
 nm_os_mbuf_has_csum_offld(struct mbuf *m)
 {
@@ -283,6 +354,25 @@ nm_os_mbuf_has_seg_offld(struct mbuf *m)
 	return m->m_pkthdr.csum_flags & CSUM_TSO;
 }
 
+void
+nm_os_mbuf_set_rx_ts(struct mbuf *m, uint64_t ns)
+{
+#ifdef M_TSTMP
+	m->m_pkthdr.rcv_tstmp = ns;
+	m->m_flags |= M_TSTMP;
+#endif /* M_TSTMP */
+}
+
+uint64_t
+nm_os_mbuf_rx_ts(struct mbuf *m)
+{
+#ifdef M_TSTMP
+	if (m->m_flags & M_TSTMP)
+		return m->m_pkthdr.rcv_tstmp;
+#endif /* M_TSTMP */
+	return 0;
+}
+
 static void
 freebsd_generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 {
@@ -1144,6 +1234,27 @@ nm_os_ncpus(void)
 	return mp_maxid + 1;
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return curcpu;
+}
+
+uint64_t
+nm_os_get_ns(void)
+{
+	return sbttons(sbinuptime());
+}
+
+uint64_t
+nm_os_realtime_ns(void)
+{
+	struct timespec ts;
+
+	nanotime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 struct nm_kctx_ctx {
 	/* Userspace thread (kthread creator). */
 	struct thread *user_td;
@@ -1519,6 +1630,47 @@ struct cdevsw netmap_cdevsw = {
 };
 /*--- end of kqueue support ----*/
 
+/*
+ * NIOCSYNCV support: get the priv of another /dev/netmap descriptor.
+ * devfs_get_cdevpriv() looks at the file being operated on by the
+ * thread, so we point it to the one we looked up for the duration
+ * of the call.
+ */
+int
+nm_os_priv_fget(struct thread *td, int fd, struct netmap_priv_d **ppriv,
+		void **cookie)
+{
+	struct file *fp, *fpop;
+	struct vnode *vp;
+	int error;
+
+	error = fget(td, fd, &cap_ioctl_rights, &fp);
+	if (error)
+		return error;
+	vp = fp->f_vnode;
+	if (fp->f_type != DTYPE_VNODE || vp == NULL || vp->v_type != VCHR ||
+	    vp->v_rdev == NULL || vp->v_rdev->si_devsw != &netmap_cdevsw) {
+		fdrop(fp, td);
+		return EINVAL;
+	}
+	fpop = td->td_fpop;
+	td->td_fpop = fp;
+	error = devfs_get_cdevpriv((void **)ppriv);
+	td->td_fpop = fpop;
+	if (error) {
+		fdrop(fp, td);
+		return ENXIO;
+	}
+	*cookie = fp;
+	return 0;
+}
+
+void
+nm_os_priv_fput(struct thread *td, void *cookie)
+{
+	fdrop((struct file *)cookie, td);
+}
+
 /*
  * Kernel entry point.
  *
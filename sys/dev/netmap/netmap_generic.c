@@ -722,7 +722,8 @@ generic_netmap_txsync(struct netmap_kring *kring, int flags)
 			m = kring->tx_pool[nm_i];
 			if (unlikely(m == NULL)) {
 				kring->tx_pool[nm_i] = m =
-					nm_os_get_mbuf(ifp, NETMAP_BUF_SIZE(na));
+					nm_os_get_mbuf(ifp,
+						NETMAP_KRING_BUF_SIZE(kring));
 				if (m == NULL) {
 					nm_prlim(2, "Failed to replenish mbuf");
 					/* Here we could schedule a timer which
@@ -849,7 +850,7 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 	}
 
 	/* limit the size of the queue */
-	if (unlikely(!gna->rxsg && MBUF_LEN(m) > NETMAP_BUF_SIZE(na))) {
+	if (unlikely(!gna->rxsg && MBUF_LEN(m) > NETMAP_KRING_BUF_SIZE(kring))) {
 		/* This may happen when GRO/LRO features are enabled for
 		 * the NIC driver when the generic adapter does not
 		 * support RX scatter-gather. */
@@ -859,6 +860,8 @@ generic_rx_handler(struct ifnet *ifp, struct mbuf *m)
 	} else if (unlikely(mbq_len(&kring->rx_queue) > 1024)) {
 		m_freem(m);
 	} else {
+		if (nm_slot_ts_enabled(kring))
+			nm_os_mbuf_set_rx_ts(m, nm_os_realtime_ns());
 		mbq_safe_enqueue(&kring->rx_queue, m);
 	}
 
@@ -900,12 +903,14 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 	int force_update = (flags & NAF_FORCE_READ) || kring->nr_kflags & NKR_PENDINTR;
 
 	/* Adapter-specific variables. */
-	u_int nm_buf_len = NETMAP_BUF_SIZE(na);
+	u_int nm_buf_len = NETMAP_KRING_BUF_SIZE(kring);
 	struct mbq tmpq;
 	struct mbuf *m;
 	int avail; /* in bytes */
 	int mlen;
 	int copy;
+	int slot_ts = nm_slot_ts_enabled(kring);
+	uint64_t ts = 0;
 
 	if (head > lim)
 		return netmap_ring_reinit(kring);
@@ -968,6 +973,8 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 		}
 
 		mbq_dequeue(&kring->rx_queue);
+		if (slot_ts)
+			ts = nm_os_mbuf_rx_ts(m);
 
 		while (mlen) {
 			copy = nm_buf_len;
@@ -979,6 +986,8 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 
 			ring->slot[nm_i].len = copy;
 			ring->slot[nm_i].flags = (mlen ? NS_MOREFRAG : 0);
+			if (slot_ts)
+				ring->slot[nm_i].ptr = ts;
 			nm_i = nm_next(nm_i, lim);
 		}
 
@@ -1011,6 +1020,12 @@ generic_netmap_rxsync(struct netmap_kring *kring, int flags)
 			}
 
 			copy = ring->slot[nm_i].len;
+			if (unlikely(copy > NMB_SIZE(na, &ring->slot[nm_i]))) {
+				/* userspace put a small buffer in a ring
+				 * of large buffers, truncate */
+				copy = ring->slot[nm_i].len =
+					NMB_SIZE(na, &ring->slot[nm_i]);
+			}
 			m_copydata(m, ofs, copy, nmaddr);
 			ofs += copy;
 			morefrag = ring->slot[nm_i].flags & NS_MOREFRAG;
@@ -110,6 +110,11 @@
 #include <machine/atomic.h>
 #define NM_ATOMIC_TEST_AND_SET(p)       (!atomic_cmpset_acq_int((p), 0, 1))
 #define NM_ATOMIC_CLEAR(p)              atomic_store_rel_int((p), 0)
+#define NM_ATOMIC_CMPSET32(p, o, n)	atomic_cmpset_32((p), (o), (n))
+#define nm_full_barrier()		atomic_thread_fence_seq_cst()
+/* bit scan (x must not be 0) and population count on 32-bit words */
+#define NM_CTZ32(x)			(ffs(x) - 1)
+#define NM_POPCOUNT32(x)		bitcount32(x)
 
 #if __FreeBSD_version >= 1100030
 #define	WNA(_ifp)	(_ifp)->if_netmap
@@ -161,6 +166,11 @@ struct hrtimer {
 #define	GEN_TX_MBUF_IFP(m)	((struct ifnet *)skb_shinfo(m)->destructor_arg)
 
 #define NM_ATOMIC_T	volatile long unsigned int
+#define NM_ATOMIC_CMPSET32(p, o, n)	(cmpxchg((p), (o), (n)) == (o))
+#define nm_full_barrier()		smp_mb()
+/* bit scan (x must not be 0) and population count on 32-bit words */
+#define NM_CTZ32(x)			__ffs(x)
+#define NM_POPCOUNT32(x)		hweight32(x)
 
 #define NM_MTX_T	struct mutex	/* OS-specific sleepable lock */
 #define NM_MTX_INIT(m)	mutex_init(&(m))
@@ -181,6 +191,10 @@ struct hrtimer {
 #define	NM_LOCK_T	IOLock *
 #define	NM_SELINFO_T	struct selinfo
 #define	MBUF_LEN(m)	((m)->m_pkthdr.len)
+#define NM_ATOMIC_CMPSET32(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define nm_full_barrier()		__sync_synchronize()
+#define NM_CTZ32(x)			__builtin_ctz(x)
+#define NM_POPCOUNT32(x)		__builtin_popcount(x)
 
 #elif defined (_WIN32)
 #include "../../../WINDOWS/win_glue.h"
@@ -195,6 +209,9 @@ struct hrtimer {
 #define NM_MTX_LOCK(m)		KeAcquireGuardedMutex(&(m))
 #define NM_MTX_UNLOCK(m)	KeReleaseGuardedMutex(&(m))
 #define NM_MTX_ASSERT(m)	assert(&m.Count>0)
+#define NM_ATOMIC_CMPSET32(p, o, n)	\
+	(InterlockedCompareExchange((volatile LONG *)(p), (n), (o)) == (LONG)(o))
+#define nm_full_barrier()	MemoryBarrier()
 
 //These linknames are for the NDIS driver
 #define NETMAP_NDIS_LINKNAME_STRING             L"\\DosDevices\\NMAPNDIS"
@@ -219,6 +236,23 @@ typedef struct hrtimer{
 #define unlikely(x)	__builtin_expect((long)!!(x), 0L)
 #endif //_MSC_VER
 
+/* bit scan (x must not be 0) and population count on 32-bit words */
+#ifdef _MSC_VER
+static inline u_int
+nm_win_ctz32(uint32_t x)
+{
+	unsigned long i;
+
+	_BitScanForward(&i, x);
+	return i;
+}
+#define NM_CTZ32(x)		nm_win_ctz32(x)
+#define NM_POPCOUNT32(x)	__popcnt(x)
+#else
+#define NM_CTZ32(x)		__builtin_ctz(x)
+#define NM_POPCOUNT32(x)	__builtin_popcount(x)
+#endif //_MSC_VER
+
 #else
 
 #error unsupported platform
@@ -323,6 +357,17 @@ void *nm_os_realloc(void *, size_t new_size, size_t old_size);
 void nm_os_free(void *);
 void nm_os_vfree(void *);
 
+/* huge pages for the memory pools, nm_os_hugepage_shift() returns 0
+ * if they cannot be mapped to userspace */
+u_int nm_os_hugepage_shift(void);
+void *nm_os_hugepage_alloc(size_t, int node);
+void nm_os_hugepage_free(void *, size_t);
+
+/* NUMA node of the device of an adapter (-1 if unknown), and
+ * whether a node can be used for allocations */
+int nm_os_numa_node(struct netmap_adapter *);
+int nm_os_numa_node_valid(int node);
+
 /* os specific attach/detach enter/exit-netmap-mode routines */
 void nm_os_onattach(struct ifnet *);
 void nm_os_ondetach(struct ifnet *);
@@ -336,9 +381,16 @@ void nm_os_onexit(struct ifnet *);
  * the entire chain to the host stack.
  */
 void *nm_os_send_up(struct ifnet *, struct mbuf *m, struct mbuf *prev);
+/* bracket the allocation of a batch of mbufs for the host stack */
+void nm_os_send_up_begin(void);
+void nm_os_send_up_end(void);
 
 int nm_os_mbuf_has_seg_offld(struct mbuf *m);
 int nm_os_mbuf_has_csum_offld(struct mbuf *m);
+/* arrival time of an mbuf queued to a ring with NR_SLOT_TS, in the
+ * units of nm_os_realtime_ns(); 0 if the OS cannot record it */
+void nm_os_mbuf_set_rx_ts(struct mbuf *m, uint64_t ns);
+uint64_t nm_os_mbuf_rx_ts(struct mbuf *m);
 
 #include "netmap_mbq.h"
 
@@ -367,6 +419,22 @@ struct netmap_zmon_list {
 };
 #endif /* WITH_MONITOR */
 
+/*
+ * Datapath counters of a kring (NETMAP_REQ_RING_STATS_GET). They are
+ * updated without locks by the thread that owns the ring (busy
+ * failures by the contenders), so they are approximate.
+ */
+struct nm_kring_stats {
+	uint64_t	syncs;
+	uint64_t	slots;
+	uint64_t	busy;
+	uint64_t	reinit;
+	uint64_t	host_drops;
+	uint64_t	t0;	/* start of the current sync */
+	uint64_t	lat[NR_RING_LAT_BUCKETS];
+	uint32_t	hwcur0;	/* nr_hwcur at the start of the current sync */
+};
+
 /*
  * private, kernel view of a ring. Keeps track of the status of
  * a ring across system calls.
@@ -394,18 +462,23 @@ struct netmap_zmon_list {
  *
  * The following fields are used to implement lock-free copy of packets
  * from input to output ports in VALE switch:
- *	nkr_hwlease	buffer after the last one being copied.
+ *	nkr_lease_state	packs two 16-bit fields, updated together
+ *			with a single compare-and-set so that writers
+ *			do not need the q_lock to make a reservation:
+ *	  hwlease	(low half) buffer after the last one being copied.
  *			A writer in nm_bdg_flush reserves N buffers
- *			from nr_hwlease, advances it, then does the
- *			copy outside the lock.
+ *			from hwlease, advances it, then does the copy.
  *			In RX rings (used for VALE ports),
- *			nkr_hwtail <= nkr_hwlease < nkr_hwcur+N-1
+ *			nkr_hwtail <= hwlease < nkr_hwcur+N-1
  *			In TX rings (used for NIC or host stack ports)
- *			nkr_hwcur <= nkr_hwlease < nkr_hwtail
+ *			nkr_hwcur <= hwlease < nkr_hwtail
+ *	  lease_idx	(high half) index of next free slot in nkr_leases,
+ *			to be assigned
  *	nkr_leases	array of nkr_num_slots where writers can report
  *			completion of their block. NR_NOSLOT (~0) indicates
  *			that the writer has not finished yet
- *	nkr_lease_idx	index of next free slot in nr_leases, to be assigned
+ *	nkr_lease_head	first lease not yet merged into hwtail.
+ *			Protected by the q_lock.
  *
  * The kring is manipulated by txsync/rxsync and generic netmap function.
  *
@@ -447,6 +520,7 @@ struct netmap_kring {
 					 */
 #define NKR_NOINTR      0x10            /* don't use interrupts on this ring */
 #define NKR_FAKERING	0x20		/* don't allocate/free buffers */
+#define NKR_LARGEBUF	0x40		/* the ring has large buffers */
 
 	uint32_t	nr_mode;
 	uint32_t	nr_pending_mode;
@@ -486,8 +560,12 @@ struct netmap_kring {
 	struct nm_bdg_fwd *nkr_ft;
 	uint32_t	*nkr_leases;
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
-	uint32_t	nkr_hwlease;
-	uint32_t	nkr_lease_idx;
+	volatile uint32_t nkr_lease_state;
+#define NM_LEASE_HW(s)		((s) & 0xffff)
+#define NM_LEASE_IDX(s)		((s) >> 16)
+#define NM_LEASE_MK(idx, hw)	(((uint32_t)(idx) << 16) | (hw))
+#define NM_LEASE_MAXSLOTS	65536	/* both halves must fit 16 bits */
+	uint32_t	nkr_lease_head;
 
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
@@ -510,6 +588,8 @@ struct netmap_kring {
 
 	uint32_t	users;		/* existing bindings for this ring */
 
+	struct nm_kring_stats nkr_stats;
+
 	uint32_t	ring_id;	/* kring identifier */
 	enum txrx	tx;		/* kind of ring (tx or rx) */
 	char name[64];			/* diagnostic */
@@ -640,9 +720,10 @@ tail->|                 |<-hwtail    |                 |<-hwlease
  *
  * nm_kr_space() returns the maximum number of slots that
  * can be assigned.
- * nm_kr_lease() reserves the required number of buffers,
- *    advances nkr_hwlease and also returns an entry in
- *    a circular array where completions should be reported.
+ * nm_kr_lease() reserves up to the required number of buffers,
+ *    advancing hwlease and lease_idx with a compare-and-set,
+ *    and also returns an entry in a circular array where
+ *    completions should be reported.
  */
 
 struct lut_entry;
@@ -655,6 +736,11 @@ struct netmap_lut {
 	struct plut_entry *plut;
 	uint32_t objtotal;	/* max buffer index */
 	uint32_t objsize;	/* buffer size */
+	uint32_t lobjfirst;	/* first large buffer, objtotal if none */
+	uint32_t lobjsize;	/* large buffer size */
+	/* buffers below lobjfirst that exist, the others only reserve
+	 * the index space to grow (see NMB_VALID()). NULL if all exist */
+	const u_int *objbacked;
 };
 
 struct netmap_vp_adapter; // forward
@@ -855,6 +941,10 @@ struct netmap_adapter {
  	struct netmap_mem_d *nm_mem;
 	struct netmap_mem_d *nm_mem_prev;
 	struct netmap_lut na_lut;
+	/* next adapter with a physical lut on nm_mem, see netmap_mem_map() */
+	struct netmap_adapter *na_mapped_next;
+	/* extra buffers given to the netmap_if's of this adapter */
+	u_int na_extra_bufs;
 
 	/* additional information attached to this adapter
 	 * by other netmap subsystems. Currently used by
@@ -967,6 +1057,10 @@ struct netmap_vp_adapter {	/* VALE software port */
 	u_int mfs;
 	/* Last source MAC on this port */
 	uint64_t last_smac;
+	uint32_t last_smac_epoch;	/* time_second of the last refresh */
+	/* how packets for this port are spread on its rx rings,
+	 * one of NR_DISPATCH_* */
+	uint32_t rx_dispatch;
 };
 
 
@@ -1103,6 +1197,9 @@ int nm_bdg_polling(struct nmreq_header *hdr);
 int netmap_vale_attach(struct nmreq_header *hdr, void *auth_token);
 int netmap_vale_detach(struct nmreq_header *hdr, void *auth_token);
 int netmap_vale_list(struct nmreq_header *hdr);
+int netmap_vale_fdb(struct nmreq_header *hdr);
+int netmap_vale_dispatch(struct nmreq_header *hdr);
+int netmap_vale_stats_get(struct nmreq_header *hdr);
 int netmap_vi_create(struct nmreq_header *hdr, int);
 int nm_vi_create(struct nmreq_header *);
 int nm_vi_destroy(const char *name);
@@ -1155,6 +1252,36 @@ nm_kr_rxspace(struct netmap_kring *k)
 #define nm_kr_txspace(_k) nm_kr_rxspace(_k)
 
 
+/*
+ * Per-slot rx timestamps (NR_SLOT_TS), kept in slot->ptr. Adapters
+ * that fill rx slots outside of rxsync stamp them with
+ * nm_slot_ts_fill() as they go. The emulated adapter and the host
+ * rings record the time in the mbuf when they queue it
+ * (nm_os_mbuf_set_rx_ts()) and copy it into the slots. Native drivers
+ * may store hardware timestamps in the slots from their rxsync.
+ * nm_rxsync_prologue() clears the slots released by the user, and
+ * nm_sync_finalize() stamps those that are still clear when they are
+ * exposed, with one timestamp for the whole sync.
+ */
+static inline int
+nm_slot_ts_enabled(struct netmap_kring *kring)
+{
+	return kring->tx == NR_RX && kring->ring != NULL &&
+		(kring->ring->flags & NR_SLOT_TS);
+}
+
+/* set the timestamp of slots first..end-1 */
+static inline void
+nm_slot_ts_fill(struct netmap_kring *kring, u_int first, u_int end,
+		uint64_t ns)
+{
+	struct netmap_slot *slot = kring->ring->slot;
+	u_int lim = kring->nkr_num_slots - 1;
+
+	for (; first != end; first = nm_next(first, lim))
+		slot[first].ptr = ns;
+}
+
 /* True if no space in the tx ring, only valid after txsync_prologue */
 static inline int
 nm_kr_txempty(struct netmap_kring *kring)
@@ -1226,9 +1353,14 @@ retry:
 		goto stop;
 	}
 
-	return unlikely(busy) ? NM_KR_BUSY : 0;
+	if (unlikely(busy)) {
+		kr->nkr_stats.busy++;
+		return NM_KR_BUSY;
+	}
+	return 0;
 
 stop:
+	kr->nkr_stats.busy++;
 	if (!busy)
 		nm_kr_put(kr);
 	if (stopped == NM_KR_STOPPED) {
@@ -1385,20 +1517,30 @@ uint32_t nm_txsync_prologue(struct netmap_kring *, struct netmap_ring *);
  */
 uint32_t nm_rxsync_prologue(struct netmap_kring *, struct netmap_ring *);
 
+/*
+ * accounts the slots and the time of the sync started by the prologue
+ * in kring->nkr_stats. Called by nm_sync_finalize(), and by the callers
+ * of the prologues that finalize the sync by themselves (sync kloop),
+ * before they update kring->rtail.
+ */
+void nm_kr_stats_end(struct netmap_kring *);
 
-/* check/fix address and len in tx rings */
+
+/* check/fix address and len in tx rings (see NMB_TX_SIZE()) */
 #if 1 /* debug version */
 #define	NM_CHECK_ADDR_LEN(_na, _a, _l)	do {				\
-	if (_a == NETMAP_BUF_BASE(_na) || _l > NETMAP_BUF_SIZE(_na)) {	\
+	u_int _lim = NMB_TX_SIZE(kring, slot);				\
+	if (_a == NETMAP_BUF_BASE(_na) || _l > _lim) {			\
 		RD(5, "bad addr/len ring %d slot %d idx %d len %d",	\
 			kring->ring_id, nm_i, slot->buf_idx, len);	\
-		if (_l > NETMAP_BUF_SIZE(_na))				\
-			_l = NETMAP_BUF_SIZE(_na);			\
+		if (_l > _lim)						\
+			_l = _lim;					\
 	} } while (0)
 #else /* no debug version */
 #define	NM_CHECK_ADDR_LEN(_na, _a, _l)	do {				\
-		if (_l > NETMAP_BUF_SIZE(_na))				\
-			_l = NETMAP_BUF_SIZE(_na);			\
+		u_int _lim = NMB_TX_SIZE(kring, slot);			\
+		if (_l > _lim)						\
+			_l = _lim;					\
 	} while (0)
 #endif
 
@@ -1469,6 +1611,15 @@ int netmap_get_hw_na(struct ifnet *ifp,
 #ifdef WITH_VALE
 uint32_t netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		struct netmap_vp_adapter *, void *private_data);
+void netmap_vale_learning_batch(struct nm_bdg_fwd **ft, u_int n,
+		uint32_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *, void *private_data);
+uint32_t netmap_vale_flow_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *, void *private_data);
+void netmap_vale_flow_lookup_batch(struct nm_bdg_fwd **ft, u_int n,
+		uint32_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *, void *private_data);
+int netmap_vale_config(struct nm_ifreq *nr);
 
 /* these are redefined in case of no VALE support */
 int netmap_get_vale_na(struct nmreq_header *hdr, struct netmap_adapter **na,
@@ -1538,6 +1689,11 @@ int netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 int netmap_ioctl_legacy(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 			struct thread *td);
 size_t nmreq_size_by_type(uint16_t nr_reqtype);
+/* Resolve a netmap file descriptor of the calling process to its
+ * priv (NIOCSYNCV). The cookie keeps the file alive until released. */
+int nm_os_priv_fget(struct thread *td, int fd,
+		struct netmap_priv_d **ppriv, void **cookie);
+void nm_os_priv_fput(struct thread *td, void *cookie);
 
 /* netmap_adapter creation/destruction */
 
@@ -1579,6 +1735,10 @@ int netmap_adapter_put(struct netmap_adapter *na);
  */
 #define NETMAP_BUF_BASE(_na)	((_na)->na_lut.lut[0].vaddr)
 #define NETMAP_BUF_SIZE(_na)	((_na)->na_lut.objsize)
+/* size of the buffers the ring of a kring was created with */
+#define NETMAP_KRING_BUF_SIZE(_kr)					\
+	(((_kr)->nr_kflags & NKR_LARGEBUF) ?				\
+	 (_kr)->na->na_lut.lobjsize : NETMAP_BUF_SIZE((_kr)->na))
 extern int netmap_no_pendintr;
 extern int netmap_mitigate;
 extern int netmap_verbose;
@@ -1893,6 +2053,49 @@ PNMB(struct netmap_adapter *na, struct netmap_slot *slot, uint64_t *pp)
 	return ret;
 }
 
+/*
+ * is i the index of an existing buffer? Between the buffers and the
+ * large buffers of a region that can grow there are indexes with no
+ * buffer yet, which NMB() maps to buffer 0. The number of buffers
+ * only grows while the region is in use, so no lock is needed.
+ */
+static inline int
+NMB_VALID(struct netmap_adapter *na, uint32_t i)
+{
+	struct netmap_lut *lut = &na->na_lut;
+
+	return i < lut->objtotal && (i >= lut->lobjfirst ||
+		lut->objbacked == NULL || i < NM_ACCESS_ONCE(*lut->objbacked));
+}
+
+/*
+ * size of the buffer returned by NMB, which may not be of the
+ * class of the ring if userspace moved buffers around
+ */
+static inline u_int
+NMB_SIZE(struct netmap_adapter *na, struct netmap_slot *slot)
+{
+	uint32_t i = slot->buf_idx;
+
+	return (i >= na->na_lut.lobjfirst && i < na->na_lut.objtotal) ?
+		na->na_lut.lobjsize : na->na_lut.objsize;
+}
+
+/*
+ * how much of the buffer of a tx slot can be sent: the buffer may
+ * be smaller than the ones of the ring, and the ring may be smaller
+ * than the buffer (the device, or the mbufs of the generic adapter,
+ * are set up for the buffers of the ring)
+ */
+static inline u_int
+NMB_TX_SIZE(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	u_int size = NMB_SIZE(kring->na, slot);
+
+	return size < NETMAP_KRING_BUF_SIZE(kring) ?
+		size : NETMAP_KRING_BUF_SIZE(kring);
+}
+
 
 /*
  * Structure associated to each netmap file descriptor.
@@ -2075,15 +2278,20 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
  * Each transmit queue accumulates a batch of packets into
  * a structure before forwarding. Packets to the same
  * destination are put in a list using ft_next as a link field.
- * ft_frags and ft_next are valid only on the first fragment.
+ * ft_frags, ft_mgrp and ft_next are valid only on the first fragment.
+ * Lookup functions may set ft_mgrp in the frame they are passed,
+ * which is reset before the lookup.
  */
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
+	uint8_t ft_mgrp;	/* multicast group, 0 for all ports */
 	uint16_t ft_offset;	/* dst port (unused) */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
+	uint16_t ft_slot;	/* source slot, for zero-copy */
+	uint32_t ft_hash;	/* flow hash, for rx ring dispatch */
 };
 
 /* struct 'virtio_net_hdr' from linux. */
@@ -2197,6 +2405,11 @@ void nm_os_kctx_worker_stop(struct nm_kctx *);
 void nm_os_kctx_destroy(struct nm_kctx *);
 void nm_os_kctx_worker_setaff(struct nm_kctx *, int);
 u_int nm_os_ncpus(void);
+u_int nm_os_curcpu(void);
+/* monotonic time in nanoseconds, for statistics */
+uint64_t nm_os_get_ns(void);
+/* wall clock time in nanoseconds since the Epoch (NR_SLOT_TS) */
+uint64_t nm_os_realtime_ns(void);
 
 int netmap_sync_kloop(struct netmap_priv_d *priv,
 		      struct nmreq_header *hdr);
@@ -209,6 +209,7 @@ netmap_sync_kloop_tx_ring(const struct sync_kloop_ring_args *a)
 		 * Copy kernel hwcur and hwtail into the CSB for the application sync(), and
 		 * do the nm_sync_finalize.
 		 */
+		nm_kr_stats_end(kring);
 		sync_kloop_kernel_write(csb_ktoa, kring->nr_hwcur,
 				kring->nr_hwtail);
 		if (kring->rtail != kring->nr_hwtail) {
@@ -325,6 +326,7 @@ netmap_sync_kloop_rx_ring(const struct sync_kloop_ring_args *a)
 		 * Finalize
 		 * Copy kernel hwcur and hwtail into the CSB for the application sync()
 		 */
+		nm_kr_stats_end(kring);
 		hwtail = NM_ACCESS_ONCE(kring->nr_hwtail);
 		sync_kloop_kernel_write(csb_ktoa, kring->nr_hwcur, hwtail);
 		if (kring->rtail != hwtail) {
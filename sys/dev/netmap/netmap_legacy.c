@@ -383,7 +383,7 @@ netmap_ioctl_legacy(struct netmap_priv_d *priv, u_long cmd, caddr_t data,
 #ifdef WITH_VALE
 	case NIOCCONFIG: {
 		struct nm_ifreq *nr = (struct nm_ifreq *)data;
-		error = netmap_bdg_config(nr);
+		error = netmap_vale_config(nr);
 		break;
 	}
 #endif
@@ -42,6 +42,12 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 241723 2012-10-19 09:41:45Z gle
 
 #include <sys/types.h>
 #include <sys/malloc.h>
+#if __FreeBSD_version >= 1200000
+#include <sys/domainset.h>	/* DOMAINSET_PREF */
+#else
+#define contigmalloc_domainset(sz, ty, ds, flags, a, b, pgsz, c) \
+	contigmalloc(sz, ty, flags, a, b, pgsz, c)
+#endif
 #include <sys/kernel.h>		/* MALLOC_DEFINE */
 #include <sys/proc.h>
 #include <vm/vm.h>	/* vtophys */
@@ -82,6 +88,7 @@ enum {
 	NETMAP_IF_POOL   = 0,
 	NETMAP_RING_POOL,
 	NETMAP_BUF_POOL,
+	NETMAP_LBUF_POOL,	/* large buffers, may be empty */
 	NETMAP_POOLS_NR
 };
 
@@ -89,6 +96,7 @@ enum {
 struct netmap_obj_params {
 	u_int size;
 	u_int num;
+	u_int max;	/* private pools may grow up to this many objects */
 
 	u_int last_size;
 	u_int last_num;
@@ -103,13 +111,25 @@ struct netmap_obj_pool {
 	u_int objtotal;         /* actual total number of objects. */
 	u_int memtotal;		/* actual total memory space */
 	u_int numclusters;	/* actual number of clusters */
+	u_int objcap;		/* entries of lut and bitmap, objtotal plus
+				 * the room to grow (see netmap_mem_grow()) */
 
 	u_int objfree;          /* number of free objects. */
+	u_int hiwat;		/* max objtotal - objfree seen */
+	uint64_t leaked;	/* objects reclaimed at the last user reset */
 
-	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
+	struct lut_entry *lut;  /* virt,phys addresses, objcap entries */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
 	uint32_t *invalid_bitmap;/* one bit per buffer, 1 means invalid */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
+	/* Summary levels on top of the bitmap, in the same allocation:
+	 * bit j of bitmap_lvl[l][i] is set if word 32 * i + j of level
+	 * l - 1 is not zero, and the last level has a single word.
+	 * bitmap_lvl[0] is the bitmap itself.
+	 */
+#define NM_BITMAP_LEVELS	7	/* enough for 2^32 objects */
+	uint32_t *bitmap_lvl[NM_BITMAP_LEVELS];
+	uint32_t bitmap_nlvl;	/* number of levels in use */
 	int	alloc_done;	/* we have allocated the memory */
 	/* ---------------------------------------------------*/
 
@@ -125,10 +145,15 @@ struct netmap_obj_pool {
 	u_int _clustsize;       /* cluster size */
 	u_int _clustentries;    /* objects per cluster */
 	u_int _numclusters;	/* number of clusters */
+	u_int _maxclusters;	/* the pool may grow up to this many
+				 * clusters, at least _numclusters */
+	u_int _hugesize;	/* clusters are huge pages of this size,
+				 * 0 if they are normal pages */
 
 	/* requested values */
 	u_int r_objtotal;
 	u_int r_objsize;
+	u_int r_objmax;
 };
 
 #define NMA_LOCK_T		NM_MTX_T
@@ -164,6 +189,10 @@ struct netmap_mem_d {
 	u_int flags;
 #define NETMAP_MEM_FINALIZED	0x1	/* preallocation done */
 #define NETMAP_MEM_HIDDEN	0x8	/* beeing prepared */
+#define NETMAP_MEM_NODE		0x40	/* nm_node requested by the user */
+#define NETMAP_MEM_PERSIST	0x80	/* survives its users, see
+					 * netmap_mem_ext_persist() */
+	u_int hugeshift;	/* huge page shift of the config, 0 if none */
 	int lasterr;		/* last error for curr config */
 	int active;		/* active users */
 	int refcount;
@@ -172,6 +201,30 @@ struct netmap_mem_d {
 
 	nm_memid_t nm_id;	/* allocator identifier */
 	int nm_grp;	/* iommu groupd id */
+	int nm_node;	/* NUMA node of the pools, -1 for any */
+
+	/* lut of both buffer pools, NULL if there are no large buffers */
+	struct lut_entry *lut_all;
+
+	/* adapters with a physical lut of the buffers, see netmap_mem_map() */
+	struct netmap_adapter *mapped;
+
+	/* extra buffers left by the closed netmap_if's of a persistent
+	 * region, for the next one (see netmap_extra_park()) */
+	uint32_t parked_bufs;
+	u_int parked_num;	/* ... and their number */
+
+	/* latency of the buffer allocation calls, log2 of ns */
+	uint64_t alloc_lat[NR_POOLS_LAT_BUCKETS];
+
+	/* per-CPU caches of free buffers, NULL if not used */
+	struct netmap_mag_cache *mag;
+	struct {
+		u_long alloc_hits;	/* buffers taken from the caches */
+		u_long alloc_misses;	/* ... and from the pool */
+		u_long free_hits;	/* buffers returned to the caches */
+		u_long free_misses;	/* ... and to the pool */
+	} mag_stats;
 
 	/* list of all existing allocators, sorted by nm_id */
 	struct netmap_mem_d *prev, *next;
@@ -228,6 +281,70 @@ netmap_mem_ofstophys(struct netmap_mem_d *nmd, vm_ooffset_t off)
 	return pa;
 }
 
+#ifdef linux
+/*
+ * Shift of the page that contains the given offset: the huge page
+ * shift if the offset falls in the clusters of a huge page pool,
+ * PAGE_SHIFT otherwise.
+ */
+u_int
+netmap_mem_ofs_pageshift(struct netmap_mem_d *nmd, vm_ooffset_t off)
+{
+	u_int i, shift = PAGE_SHIFT;
+
+	NMA_LOCK(nmd);
+	for (i = 0; i < NETMAP_POOLS_NR; off -= nmd->pools[i].memtotal, i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+
+		if (off >= p->memtotal)
+			continue;
+		if (p->_hugesize && off < p->numclusters * p->_clustsize)
+			shift = nmd->hugeshift;
+		break;
+	}
+	NMA_UNLOCK(nmd);
+
+	return shift;
+}
+
+/*
+ * Physical address of the given offset, and in *len the number of
+ * bytes from there to the end of its (physically contiguous) cluster.
+ * Offsets that are not backed, i.e. the room to grow or the padding
+ * of a pool, return 0 and the bytes to the end of the pool.
+ * *len is 0 beyond the end of the region.
+ */
+vm_paddr_t
+netmap_mem_ofs_cluster(struct netmap_mem_d *nmd, vm_ooffset_t off,
+		size_t *len)
+{
+	vm_paddr_t pa = 0;
+	u_int i;
+
+	*len = 0;
+	NMA_LOCK(nmd);
+	for (i = 0; i < NETMAP_POOLS_NR; off -= nmd->pools[i].memtotal, i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+		u_int c;
+
+		if (off >= p->memtotal)
+			continue;
+		c = off / p->_clustsize;
+		if (c >= p->numclusters) {
+			*len = p->memtotal - off;
+			break;
+		}
+		pa = vtophys(p->lut[c * p->_clustentries].vaddr) +
+			off % p->_clustsize;
+		*len = p->_clustsize - off % p->_clustsize;
+		break;
+	}
+	NMA_UNLOCK(nmd);
+
+	return pa;
+}
+#endif /* linux */
+
 static int
 netmap_mem_config(struct netmap_mem_d *nmd)
 {
@@ -364,12 +481,17 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 	if (netmap_mem_config(nmd))
 		goto out;
 
+	/* unless asked otherwise, allocate on the node of the device */
+	if (nmd->ops == &netmap_mem_global_ops &&
+	    !(nmd->flags & (NETMAP_MEM_FINALIZED | NETMAP_MEM_NODE)))
+		nmd->nm_node = nm_os_numa_node(na);
+
 	nmd->active++;
 
 	nmd->lasterr = nmd->ops->nmd_finalize(nmd);
 
 	if (!nmd->lasterr && na->pdev) {
-		nmd->lasterr = netmap_mem_map(&nmd->pools[NETMAP_BUF_POOL], na);
+		nmd->lasterr = netmap_mem_map(nmd, na);
 	}
 
 out:
@@ -389,21 +511,91 @@ nm_isset(uint32_t *bitmap, u_int i)
 }
 
 
+/* number of words of the summary level above one with n words */
+#define NM_BITMAP_UP(n)	(((n) + 31) / 32)
+
+/* recompute the summary levels from the bitmap */
+static void
+netmap_obj_bitmap_summarize(struct netmap_obj_pool *p)
+{
+	u_int l, i, n = p->bitmap_slots;
+
+	for (l = 1; l < p->bitmap_nlvl; l++) {
+		uint32_t *lo = p->bitmap_lvl[l - 1], *hi = p->bitmap_lvl[l];
+
+		memset(hi, 0, NM_BITMAP_UP(n) * sizeof(*hi));
+		for (i = 0; i < n; i++) {
+			if (lo[i])
+				hi[i / 32] |= 1U << (i % 32);
+		}
+		n = NM_BITMAP_UP(n);
+	}
+}
+
+/* clear 'mask' in word i of the bitmap (objects in use), and
+ * propagate to the summary levels if the word becomes empty
+ */
+static __inline void
+netmap_obj_bitmap_take(struct netmap_obj_pool *p, uint32_t i, uint32_t mask)
+{
+	u_int l;
+
+	for (l = 0; l < p->bitmap_nlvl; l++) {
+		uint32_t *w = &p->bitmap_lvl[l][i];
+
+		*w &= ~mask;
+		if (*w != 0)
+			break;
+		mask = 1U << (i % 32);
+		i /= 32;
+	}
+}
+
+/* set 'mask' in word i of the bitmap (objects freed), and propagate
+ * to the summary levels if the word was empty
+ */
+static __inline void
+netmap_obj_bitmap_give(struct netmap_obj_pool *p, uint32_t i, uint32_t mask)
+{
+	u_int l;
+
+	for (l = 0; l < p->bitmap_nlvl; l++) {
+		uint32_t *w = &p->bitmap_lvl[l][i], old = *w;
+
+		*w = old | mask;
+		if (old != 0)
+			break;
+		mask = 1U << (i % 32);
+		i /= 32;
+	}
+}
+
 static int
 netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
 {
-	u_int n, j;
+	u_int n, j, l, tot;
 
 	if (p->bitmap == NULL) {
-		/* Allocate the bitmap */
-		n = (p->objtotal + 31) / 32;
-		p->bitmap = nm_os_malloc(sizeof(p->bitmap[0]) * n);
+		/* Allocate the bitmap and its summary levels */
+		n = (p->objcap + 31) / 32;
+		tot = n;
+		for (l = 1, j = n; j > 1; l++) {
+			j = NM_BITMAP_UP(j);
+			tot += j;
+		}
+		p->bitmap = nm_os_malloc(sizeof(p->bitmap[0]) * tot);
 		if (p->bitmap == NULL) {
-			nm_prerr("Unable to create bitmap (%d entries) for allocator '%s'", (int)n,
+			nm_prerr("Unable to create bitmap (%d entries) for allocator '%s'", (int)tot,
 			    p->name);
 			return ENOMEM;
 		}
 		p->bitmap_slots = n;
+		p->bitmap_nlvl = l;
+		p->bitmap_lvl[0] = p->bitmap;
+		for (l = 1, j = n; l < p->bitmap_nlvl; l++) {
+			p->bitmap_lvl[l] = p->bitmap_lvl[l - 1] + j;
+			j = NM_BITMAP_UP(j);
+		}
 	} else {
 		memset(p->bitmap, 0, p->bitmap_slots * sizeof(p->bitmap[0]));
 	}
@@ -423,6 +615,7 @@ netmap_init_obj_allocator_bitmap(struct netmap_obj_pool *p)
 		p->bitmap[ (j>>5) ] |=  ( 1U << (j & 31U) );
 		p->objfree++;
 	}
+	netmap_obj_bitmap_summarize(p);
 
 	if (netmap_verbose)
 		nm_prinf("%s free %u", p->name, p->objfree);
@@ -443,6 +636,8 @@ netmap_mem_init_bitmaps(struct netmap_mem_d *nmd)
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		struct netmap_obj_pool *p = &nmd->pools[i];
 
+		if (i == NETMAP_LBUF_POOL && p->objtotal == 0)
+			continue; /* no large buffers */
 		error = netmap_init_obj_allocator_bitmap(p);
 		if (error)
 			return error;
@@ -462,26 +657,47 @@ netmap_mem_init_bitmaps(struct netmap_mem_d *nmd)
 		 * NULL pointer crash which currently happens only
 		 * with ptnetmap guests.
 		 * Removed shared-info --> is the bug still there? */
-		nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3U;
+		netmap_obj_bitmap_take(&nmd->pools[NETMAP_BUF_POOL], 0, 3U);
 	}
 	return 0;
 }
 
+static u_int netmap_mag_drain(struct netmap_mem_d *);
+static void netmap_mem_shrink(struct netmap_mem_d *);
+
 int
 netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 	int last_user = 0;
 	NMA_LOCK(nmd);
 	if (na->active_fds <= 0)
-		netmap_mem_unmap(&nmd->pools[NETMAP_BUF_POOL], na);
+		netmap_mem_unmap(nmd, na);
 	if (nmd->active == 1) {
 		last_user = 1;
 		/*
 		 * Reset the allocator when it falls out of use so that any
 		 * pool resources leaked by unclean application exits are
-		 * reclaimed.
+		 * reclaimed. Persistent regions keep everything.
 		 */
-		netmap_mem_init_bitmaps(nmd);
+		if (!(nmd->flags & NETMAP_MEM_PERSIST)) {
+			u_int i, inuse[NETMAP_POOLS_NR];
+
+			netmap_mag_drain(nmd);
+			for (i = 0; i < NETMAP_POOLS_NR; i++)
+				inuse[i] = nmd->pools[i].objtotal -
+					nmd->pools[i].objfree;
+			netmap_mem_shrink(nmd);
+			netmap_mem_init_bitmaps(nmd);
+			for (i = 0; i < NETMAP_POOLS_NR; i++) {
+				struct netmap_obj_pool *p = &nmd->pools[i];
+
+				if (inuse[i] > p->objtotal - p->objfree)
+					p->leaked += inuse[i] -
+						(p->objtotal - p->objfree);
+			}
+			nmd->parked_bufs = 0;
+			nmd->parked_num = 0;
+		}
 	}
 	nmd->ops->nmd_deref(nmd);
 
@@ -500,12 +716,20 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 static int
 netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
 {
-	lut->lut = nmd->pools[NETMAP_BUF_POOL].lut;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *lp = &nmd->pools[NETMAP_LBUF_POOL];
+
+	lut->lut = nmd->lut_all ? nmd->lut_all : p->lut;
 #ifdef __FreeBSD__
 	lut->plut = lut->lut;
 #endif
-	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
-	lut->objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	/* the room to grow is part of the index space from the start,
+	 * so that the adapters do not need to know about growth */
+	lut->objtotal = p->objcap + lp->objtotal;
+	lut->objsize = p->_objsize;
+	lut->lobjfirst = p->objcap;
+	lut->lobjsize = lp->objtotal ? lp->_objsize : 0;
+	lut->objbacked = &p->objtotal;
 
 	return 0;
 }
@@ -523,6 +747,10 @@ static struct netmap_obj_params netmap_min_priv_params[NETMAP_POOLS_NR] = {
 		.size = 2048,
 		.num  = 4098,
 	},
+	[NETMAP_LBUF_POOL] = {
+		.size = 9216,
+		.num  = 0,
+	},
 };
 
 
@@ -555,6 +783,13 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_LBUF_POOL] = {
+			.name	= "netmap_lbuf",
+			.objminsize = 64,
+			.objmaxsize = 65536,
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 
 	.params = {
@@ -570,10 +805,15 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.size = 2048,
 			.num  = NETMAP_BUF_MAX_NUM,
 		},
+		[NETMAP_LBUF_POOL] = {
+			.size = 9216,
+			.num  = 0,
+		},
 	},
 
 	.nm_id = 1,
 	.nm_grp = -1,
+	.nm_node = -1,
 
 	.prev = &nm_mem,
 	.next = &nm_mem,
@@ -609,15 +849,32 @@ static const struct netmap_mem_d nm_blueprint = {
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_LBUF_POOL] = {
+			.name	= "%s_lbuf",
+			.objminsize = 64,
+			.objmaxsize = 65536,
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 
 	.nm_grp = -1,
+	.nm_node = -1,
 
 	.flags = NETMAP_MEM_PRIVATE,
 
 	.ops = &netmap_mem_global_ops,
 };
 
+/* the global allocator and the per-node ones, used by the hardware ports */
+static inline int
+netmap_mem_shared(struct netmap_mem_d *nmd)
+{
+	return nmd->ops == &netmap_mem_global_ops &&
+		(!(nmd->flags & NETMAP_MEM_PRIVATE) ||
+		 (nmd->flags & NETMAP_MEM_NODE));
+}
+
 /* memory allocator related sysctls */
 
 #define STRINGIFY(x) #x
@@ -645,6 +902,38 @@ SYSCTL_DECL(_dev_netmap);
 DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
+DECLARE_SYSCTLS(NETMAP_LBUF_POOL, lbuf);
+
+/* per-CPU buffer caches, see netmap_mag_cache_create() */
+static int netmap_buf_magazines = 2;
+SYSBEGIN(mem2_mag);
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_magazines, CTLFLAG_RW,
+    &netmap_buf_magazines, 0,
+    "Depot magazines per CPU for the shared buffer pools (0 = no cache)");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, buf_mag_alloc_hits, CTLFLAG_RD,
+    &nm_mem.mag_stats.alloc_hits, 0, "Buffers allocated from the caches");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, buf_mag_alloc_misses, CTLFLAG_RD,
+    &nm_mem.mag_stats.alloc_misses, 0, "Buffers allocated from the pool");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, buf_mag_free_hits, CTLFLAG_RD,
+    &nm_mem.mag_stats.free_hits, 0, "Buffers freed to the caches");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, buf_mag_free_misses, CTLFLAG_RD,
+    &nm_mem.mag_stats.free_misses, 0, "Buffers freed to the pool");
+SYSEND;
+
+/* back the pools with huge pages, if the OS can map them */
+static int netmap_mem_hugepages = 0;
+SYSBEGIN(mem2_huge);
+SYSCTL_INT(_dev_netmap, OID_AUTO, hugepages, CTLFLAG_RW,
+    &netmap_mem_hugepages, 0, "Use huge pages for the netmap pools");
+SYSEND;
+
+/* let the shared buffer pools grow on demand, see netmap_mem_grow() */
+static u_int netmap_buf_max_num = 0;
+SYSBEGIN(mem2_grow);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, buf_max_num, CTLFLAG_RW,
+    &netmap_buf_max_num, 0,
+    "Maximum number of buffers of the shared pools (0 = no growth)");
+SYSEND;
 
 /* call with nm_mem_list_lock held */
 static int
@@ -804,15 +1093,21 @@ netmap_mem2_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 	p = nmd->pools;
 
 	for (i = 0; i < NETMAP_POOLS_NR; offset -= p[i].memtotal, i++) {
+		u_int c;
+
 		if (offset >= p[i].memtotal)
 			continue;
+		/* the pools of huge page allocators are padded */
+		c = offset / p[i]._clustsize;
+		if (c >= p[i].numclusters)
+			break;
 		// now lookup the cluster's address
 #ifndef _WIN32
-		pa = vtophys(p[i].lut[offset / p[i]._objsize].vaddr) +
-			offset % p[i]._objsize;
+		pa = vtophys(p[i].lut[c * p[i]._clustentries].vaddr) +
+			offset % p[i]._clustsize;
 #else
-		pa = vtophys(p[i].lut[offset / p[i]._objsize].vaddr);
-		pa.QuadPart += offset % p[i]._objsize;
+		pa = vtophys(p[i].lut[c * p[i]._clustentries].vaddr);
+		pa.QuadPart += offset % p[i]._clustsize;
 #endif
 		return pa;
 	}
@@ -884,6 +1179,8 @@ win32_build_user_vm_map(struct netmap_mem_d* nmd)
 		int mdl_len = sizeof(PFN_NUMBER) * BYTES_TO_PAGES(clsz);
 		PPFN_NUMBER pSrc, pDst;
 
+		if (p->objtotal == 0)
+			continue;
 		/* each pool has a different cluster size so we need to reallocate */
 		tempMdl = IoAllocateMdl(p->lut[0].vaddr, clsz, FALSE, FALSE, NULL);
 		if (tempMdl == NULL) {
@@ -947,7 +1244,7 @@ netmap_mem2_get_info(struct netmap_mem_d* nmd, uint64_t* size,
 			*size = 0;
 			for (i = 0; i < NETMAP_POOLS_NR; i++) {
 				struct netmap_obj_pool *p = nmd->pools + i;
-				*size += (p->_numclusters * p->_clustsize);
+				*size += (p->_maxclusters * p->_clustsize);
 			}
 		}
 	}
@@ -1003,51 +1300,72 @@ netmap_mem2_if_offset(struct netmap_mem_d *nmd, const void *addr)
 }
 
 /*
- * report the index, and use start position as a hint,
- * otherwise buffer allocation becomes terribly expensive.
+ * Allocate up to n objects, reporting their indexes in index[].
+ * Returns the number of objects allocated.
+ * The summary levels lead to the first non empty word of the bitmap
+ * in one step per level, and all the objects in that word are taken
+ * at once, so the cost does not depend on the size of the pool or
+ * on how full it is.
+ */
+static u_int
+netmap_obj_malloc_batch(struct netmap_obj_pool *p, uint32_t *index, u_int n)
+{
+	u_int got = 0;
+
+	while (got < n && p->objfree > 0) {
+		uint32_t i = 0, cur, taken = 0;
+		int l;
+
+		for (l = p->bitmap_nlvl - 1; l > 0; l--) {
+			cur = p->bitmap_lvl[l][i];
+			if (unlikely(cur == 0))
+				break;
+			i = i * 32 + NM_CTZ32(cur);
+		}
+		if (l == 0)
+			cur = p->bitmap[i];
+		if (unlikely(cur == 0)) {
+			nm_prerr("%s: bitmap out of sync, %u free objects",
+				p->name, p->objfree);
+			break;
+		}
+		do {
+			uint32_t j = NM_CTZ32(cur);
+
+			cur &= cur - 1;
+			taken |= 1U << j;
+			index[got++] = i * 32 + j;
+		} while (cur && got < n);
+		netmap_obj_bitmap_take(p, i, taken);
+		p->objfree -= NM_POPCOUNT32(taken);
+	}
+	if (p->objtotal - p->objfree > p->hiwat)
+		p->hiwat = p->objtotal - p->objfree;
+	ND("%s allocator: allocated %u objects, first %u", p->name, got,
+		got ? index[0] : 0);
+	return got;
+}
+
+/*
+ * allocate one object and report its index
  */
 static void *
-netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_t *index)
+netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *index)
 {
-	uint32_t i = 0;			/* index in the bitmap */
-	uint32_t mask, j = 0;		/* slot counter */
-	void *vaddr = NULL;
+	uint32_t j;
 
 	if (len > p->_objsize) {
 		nm_prerr("%s request size %d too large", p->name, len);
 		return NULL;
 	}
 
-	if (p->objfree == 0) {
+	if (netmap_obj_malloc_batch(p, &j, 1) == 0) {
 		nm_prerr("no more %s objects", p->name);
 		return NULL;
 	}
-	if (start)
-		i = *start;
-
-	/* termination is guaranteed by p->free, but better check bounds on i */
-	while (vaddr == NULL && i < p->bitmap_slots)  {
-		uint32_t cur = p->bitmap[i];
-		if (cur == 0) { /* bitmask is fully used */
-			i++;
-			continue;
-		}
-		/* locate a slot */
-		for (j = 0, mask = 1; (cur & mask) == 0; j++, mask <<= 1)
-			;
-
-		p->bitmap[i] &= ~mask; /* mark object as in use */
-		p->objfree--;
-
-		vaddr = p->lut[i * 32 + j].vaddr;
-		if (index)
-			*index = i * 32 + j;
-	}
-	ND("%s allocator: allocated object @ [%d][%d]: vaddr %p",p->name, i, j, vaddr);
-
-	if (start)
-		*start = i;
-	return vaddr;
+	if (index)
+		*index = j;
+	return p->lut[j].vaddr;
 }
 
 
@@ -1065,12 +1383,12 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 		return 1;
 	}
 	ptr = &p->bitmap[j / 32];
-	mask = (1 << (j % 32));
+	mask = (1U << (j % 32));
 	if (*ptr & mask) {
 		nm_prerr("ouch, double free on buffer %d", j);
 		return 1;
 	} else {
-		*ptr |= mask;
+		netmap_obj_bitmap_give(p, j / 32, mask);
 		p->objfree++;
 		return 0;
 	}
@@ -1108,156 +1426,801 @@ netmap_mem_bufsize(struct netmap_mem_d *nmd)
 	return nmd->pools[NETMAP_BUF_POOL]._objsize;
 }
 
-#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL, NULL)
+#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL)
 #define netmap_if_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_IF_POOL], (v))
-#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL, NULL)
+#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL)
 #define netmap_ring_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_RING_POOL], (v))
-#define netmap_buf_malloc(n, _pos, _index)			\
-	netmap_obj_malloc(&(n)->pools[NETMAP_BUF_POOL], netmap_mem_bufsize(n), _pos, _index)
+#define netmap_buf_malloc_batch(n, _index, _n)			\
+	netmap_obj_malloc_batch(&(n)->pools[NETMAP_BUF_POOL], _index, _n)
 
+/* buffers allocated at once on the stack by the callers of
+ * netmap_buf_malloc_batch()
+ */
+#define NM_BUF_BATCH	64
 
-#if 0 /* currently unused */
-/* Return the index associated to the given packet buffer */
-#define netmap_buf_index(n, v)						\
-    (netmap_obj_offset(&(n)->pools[NETMAP_BUF_POOL], (v)) / NETMAP_BDG_BUF_SIZE(n))
+
+/*
+ * Per-CPU magazines of free buffers, in front of the buffer pool of
+ * the allocators that are shared by several adapters.
+ * Each CPU owns a loaded and a previous magazine, which are always
+ * either full or empty when they are exchanged. When both cannot
+ * serve a request the CPU trades a whole magazine with the depot,
+ * which balances the buffers among CPUs. Only when the depot cannot
+ * help we fall back to the pool, which needs the allocator lock.
+ * Buffers in the caches are allocated from the point of view of the
+ * pool, so the caches are drained when the pool runs out.
+ */
+#define NM_MAG_SIZE	NM_BUF_BATCH	/* buffers per magazine */
+
+struct netmap_mag {
+	u_int n;			/* buffers in the magazine */
+	uint32_t idx[NM_MAG_SIZE];
+};
+
+struct netmap_mag_cpu {
+	NM_LOCK_T lock;
+	struct netmap_mag *loaded, *prev;
+	/* stats not yet added to mag_stats */
+	u_long alloc_hits, alloc_misses, free_hits, free_misses;
+}
+#ifdef _WIN32
+__declspec(align(64));
+#else
+__attribute__((__aligned__(64)));
 #endif
 
+struct netmap_mag_cache {
+	NM_LOCK_T depot_lock;
+	u_int ncpus;
+	u_int nfull, nempty;		/* magazines in the depot */
+	struct netmap_mag **full;	/* stacks of depot magazines */
+	struct netmap_mag **empty;
+	struct netmap_mag_cpu *cpu;	/* ncpus entries */
+	/* one bit per buffer, 1 means in a magazine. The pool bitmap
+	 * sees these buffers as allocated, so this is what catches
+	 * the double frees on the magazine path. */
+	uint32_t *cached;
+};
+
 /*
- * allocate extra buffers in a linked list.
- * returns the actual number.
+ * Atomically set (cached != 0) or clear bit j of mc->cached.
+ * Returns 1 if the bit already had that value, without touching it.
  */
-uint32_t
-netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
+static int
+netmap_mag_mark(struct netmap_mag_cache *mc, uint32_t j, int cached)
 {
-	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
-
-	NMA_LOCK(nmd);
+	uint32_t *w = &mc->cached[j / 32], mask = 1U << (j % 32), old;
 
-	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
-		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
-			nm_prerr("no more buffers after %d of %d", i, n);
-			*head = cur; /* restore */
-			break;
-		}
-		ND(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
-	}
+	do {
+		old = NM_ACCESS_ONCE(*w);
+		if (!(old & mask) == !cached)
+			return 1;
+	} while (!NM_ATOMIC_CMPSET32(w, old, old ^ mask));
+	return 0;
+}
 
-	NMA_UNLOCK(nmd);
+/* per-CPU stats are folded into mag_stats at this many operations */
+#define NM_MAG_FOLD	(16 * NM_MAG_SIZE)
 
-	return i;
+/* call with the depot lock held */
+static void
+netmap_mag_fold(struct netmap_mem_d *nmd, struct netmap_mag_cpu *c)
+{
+	nmd->mag_stats.alloc_hits += c->alloc_hits;
+	nmd->mag_stats.alloc_misses += c->alloc_misses;
+	nmd->mag_stats.free_hits += c->free_hits;
+	nmd->mag_stats.free_misses += c->free_misses;
+	c->alloc_hits = c->alloc_misses = c->free_hits = c->free_misses = 0;
 }
 
 static void
-netmap_extra_free(struct netmap_adapter *na, uint32_t head)
+netmap_mag_cache_destroy(struct netmap_mem_d *nmd)
 {
-	struct lut_entry *lut = na->na_lut.lut;
-	struct netmap_mem_d *nmd = na->nm_mem;
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-	uint32_t i, cur, *buf;
+	struct netmap_mag_cache *mc = nmd->mag;
+	u_int i;
 
-	ND("freeing the extra list");
-	for (i = 0; head >=2 && head < p->objtotal; i++) {
-		cur = head;
-		buf = lut[head].vaddr;
-		head = *buf;
-		*buf = 0;
-		if (netmap_obj_free(p, cur))
-			break;
-	}
-	if (head != 0)
-		nm_prerr("breaking with head %d", head);
-	if (netmap_debug & NM_DEBUG_MEM)
-		nm_prinf("freed %d buffers", i);
+	if (mc == NULL)
+		return;
+	for (i = 0; i < mc->ncpus; i++)
+		mtx_destroy(&mc->cpu[i].lock);
+	mtx_destroy(&mc->depot_lock);
+	nm_os_vfree(mc);
+	nmd->mag = NULL;
 }
 
-
-/* Return nonzero on error */
+/*
+ * Called at finalize time, on the shared allocators only: private
+ * allocators serve a single adapter and gain nothing from the caches.
+ * The cache, the magazines and the depot are a single allocation.
+ */
 static int
-netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+netmap_mag_cache_create(struct netmap_mem_d *nmd)
 {
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-	u_int i = 0;	/* slot counter */
-	uint32_t pos = 0;	/* slot in p->bitmap */
-	uint32_t index = 0;	/* buffer index */
+	struct netmap_mag_cache *mc;
+	struct netmap_mag *m;
+	u_int i, ncpus = nm_os_ncpus(), nmags;
+	u_int nwords = (nmd->pools[NETMAP_BUF_POOL].objcap + 31) / 32;
+	size_t hdr = (sizeof(*mc) + 63) & ~(size_t)63, size;
 
-	for (i = 0; i < n; i++) {
-		void *vaddr = netmap_buf_malloc(nmd, &pos, &index);
-		if (vaddr == NULL) {
-			nm_prerr("no more buffers after %d of %d", i, n);
-			goto cleanup;
+	if (netmap_buf_magazines <= 0 || !netmap_mem_shared(nmd))
+		return 0;
+	/* two for each CPU, the others start empty in the depot */
+	nmags = ncpus * (2 + netmap_buf_magazines);
+	size = hdr + ncpus * sizeof(struct netmap_mag_cpu) +
+		2 * nmags * sizeof(struct netmap_mag *) +
+		nmags * sizeof(struct netmap_mag) +
+		nwords * sizeof(uint32_t);
+	mc = nm_os_vmalloc(size);
+	if (mc == NULL)
+		return ENOMEM;
+	memset(mc, 0, size);
+	mc->ncpus = ncpus;
+	mc->cpu = (struct netmap_mag_cpu *)((char *)mc + hdr);
+	mc->full = (struct netmap_mag **)(mc->cpu + ncpus);
+	mc->empty = mc->full + nmags;
+	m = (struct netmap_mag *)(mc->empty + nmags);
+	mc->cached = (uint32_t *)(m + nmags);
+	mtx_init(&mc->depot_lock, "nm_mag_depot", NULL, MTX_DEF);
+	for (i = 0; i < ncpus; i++) {
+		mtx_init(&mc->cpu[i].lock, "nm_mag_cpu", NULL, MTX_DEF);
+		mc->cpu[i].loaded = m++;
+		mc->cpu[i].prev = m++;
+	}
+	for (i = 2 * ncpus; i < nmags; i++)
+		mc->empty[mc->nempty++] = m++;
+	nmd->mag = mc;
+	return 0;
+}
+
+/*
+ * Take up to n buffers from the cache of the current CPU, or from the
+ * depot. Returns the number of buffers taken, the caller must get the
+ * others from the pool. Can be called without the allocator lock.
+ */
+static u_int
+netmap_mag_alloc(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
+{
+	struct netmap_mag_cache *mc = nmd->mag;
+	struct netmap_mag_cpu *c;
+	u_int got = 0;
+
+	if (mc == NULL)
+		return 0;
+	c = &mc->cpu[nm_os_curcpu() % mc->ncpus];
+	mtx_lock(&c->lock);
+	while (got < n) {
+		struct netmap_mag *m = c->loaded;
+
+		if (m->n > 0) {
+			u_int k = n - got < m->n ? n - got : m->n;
+
+			m->n -= k;
+			memcpy(idx + got, m->idx + m->n, k * sizeof(*idx));
+			for (; k > 0; k--)
+				netmap_mag_mark(mc, idx[got++], 0);
+			continue;
 		}
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
-		slot[i].ptr = 0;
+		if (c->prev->n > 0) {
+			c->loaded = c->prev;
+			c->prev = m;
+			continue;
+		}
+		/* both empty, trade one of them for a full one */
+		mtx_lock(&mc->depot_lock);
+		if (mc->nfull == 0) {
+			mtx_unlock(&mc->depot_lock);
+			break;
+		}
+		mc->empty[mc->nempty++] = c->prev;
+		c->prev = m;
+		c->loaded = mc->full[--mc->nfull];
+		mtx_unlock(&mc->depot_lock);
+	}
+	c->alloc_hits += got;
+	c->alloc_misses += n - got;
+	if (c->alloc_hits + c->alloc_misses >= NM_MAG_FOLD) {
+		mtx_lock(&mc->depot_lock);
+		netmap_mag_fold(nmd, c);
+		mtx_unlock(&mc->depot_lock);
 	}
+	mtx_unlock(&c->lock);
+	return got;
+}
 
-	ND("%s: allocated %d buffers, %d available, first at %d", p->name, n, p->objfree, pos);
-	return (0);
+/*
+ * Put up to n buffers in the cache of the current CPU, or in the
+ * depot. Returns the number of buffers taken from the head of idx[],
+ * the caller must return the others to the pool.
+ */
+static u_int
+netmap_mag_free(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
+{
+	struct netmap_mag_cache *mc = nmd->mag;
+	struct netmap_mag_cpu *c;
+	u_int put = 0;
 
-cleanup:
-	while (i > 0) {
-		i--;
-		netmap_obj_free(p, slot[i].buf_idx);
+	if (mc == NULL)
+		return 0;
+	c = &mc->cpu[nm_os_curcpu() % mc->ncpus];
+	mtx_lock(&c->lock);
+	while (put < n) {
+		struct netmap_mag *m = c->loaded;
+
+		if (m->n < NM_MAG_SIZE) {
+			u_int k = NM_MAG_SIZE - m->n;
+
+			if (k > n - put)
+				k = n - put;
+			for (; k > 0; k--) {
+				uint32_t j = idx[put++];
+
+				if (netmap_mag_mark(mc, j, 1))
+					nm_prerr("ouch, double free on buffer %u", j);
+				else
+					m->idx[m->n++] = j;
+			}
+			continue;
+		}
+		if (c->prev->n == 0) {
+			c->loaded = c->prev;
+			c->prev = m;
+			continue;
+		}
+		/* both full, trade one of them for an empty one */
+		mtx_lock(&mc->depot_lock);
+		if (mc->nempty == 0) {
+			mtx_unlock(&mc->depot_lock);
+			break;
+		}
+		mc->full[mc->nfull++] = c->prev;
+		c->prev = m;
+		c->loaded = mc->empty[--mc->nempty];
+		mtx_unlock(&mc->depot_lock);
 	}
-	bzero(slot, n * sizeof(slot[0]));
-	return (ENOMEM);
+	c->free_hits += put;
+	c->free_misses += n - put;
+	if (c->free_hits + c->free_misses >= NM_MAG_FOLD) {
+		mtx_lock(&mc->depot_lock);
+		netmap_mag_fold(nmd, c);
+		mtx_unlock(&mc->depot_lock);
+	}
+	mtx_unlock(&c->lock);
+	return put;
 }
 
 static void
-netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n, uint32_t index)
+netmap_mag_empty(struct netmap_mag_cache *mc, struct netmap_obj_pool *p,
+		struct netmap_mag *m)
 {
+	while (m->n > 0) {
+		uint32_t j = m->idx[--m->n];
+
+		netmap_mag_mark(mc, j, 0);
+		netmap_obj_free(p, j);
+	}
+}
+
+/*
+ * Return all the cached buffers to the pool.
+ * Returns the number of buffers returned. Call with NMA_LOCK held.
+ */
+static u_int
+netmap_mag_drain(struct netmap_mem_d *nmd)
+{
+	struct netmap_mag_cache *mc = nmd->mag;
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-	u_int i;
+	u_int i, before = p->objfree;
 
-	for (i = 0; i < n; i++) {
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
+	if (mc == NULL)
+		return 0;
+	for (i = 0; i < mc->ncpus; i++) {
+		struct netmap_mag_cpu *c = &mc->cpu[i];
+
+		mtx_lock(&c->lock);
+		netmap_mag_empty(mc, p, c->loaded);
+		netmap_mag_empty(mc, p, c->prev);
+		mtx_lock(&mc->depot_lock);
+		netmap_mag_fold(nmd, c);
+		mtx_unlock(&mc->depot_lock);
+		mtx_unlock(&c->lock);
+	}
+	mtx_lock(&mc->depot_lock);
+	while (mc->nfull > 0) {
+		struct netmap_mag *m = mc->full[--mc->nfull];
+
+		netmap_mag_empty(mc, p, m);
+		mc->empty[mc->nempty++] = m;
 	}
+	mtx_unlock(&mc->depot_lock);
+	if (netmap_debug & NM_DEBUG_MEM)
+		nm_prinf("%s: drained %u buffers", p->name, p->objfree - before);
+	return p->objfree - before;
 }
 
+static u_int netmap_mem_grow(struct netmap_mem_d *, u_int);
+
+/*
+ * Allocate up to n buffers from the caches and then from the pool,
+ * draining the caches and then growing the pool if it is empty.
+ * Returns the number of buffers allocated. Call with NMA_LOCK held.
+ */
+static u_int
+netmap_buf_alloc_batch(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
+{
+	u_int got = netmap_mag_alloc(nmd, idx, n);
+
+	if (got < n)
+		got += netmap_buf_malloc_batch(nmd, idx + got, n - got);
+	if (got < n && netmap_mag_drain(nmd) > 0)
+		got += netmap_buf_malloc_batch(nmd, idx + got, n - got);
+	if (got < n && netmap_mem_grow(nmd, n - got) > 0)
+		got += netmap_buf_malloc_batch(nmd, idx + got, n - got);
+	return got;
+}
 
+/*
+ * Free n buffer indexes to the caches, and the ones that do not fit
+ * to the pool. The indexes come from the users: the ones out of
+ * range or already free in the pool are dropped here, the ones
+ * already in a magazine by netmap_mag_free(). Call with NMA_LOCK held.
+ */
 static void
-netmap_free_buf(struct netmap_mem_d *nmd, uint32_t i)
+netmap_buf_free_batch(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
 {
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i, k;
 
-	if (i < 2 || i >= p->objtotal) {
-		nm_prerr("Cannot free buf#%d: should be in [2, %d[", i, p->objtotal);
+	if (nmd->mag == NULL) {
+		for (i = 0; i < n; i++)
+			netmap_obj_free(p, idx[i]);
 		return;
 	}
-	netmap_obj_free(p, i);
+	for (i = k = 0; i < n; i++) {
+		if (idx[i] >= p->objtotal) {
+			nm_prerr("invalid index %u, max %u", idx[i], p->objtotal);
+			continue;
+		}
+		if (nm_isset(p->bitmap, idx[i])) {
+			nm_prerr("ouch, double free on buffer %u", idx[i]);
+			continue;
+		}
+		idx[k++] = idx[i];
+	}
+	i = netmap_mag_free(nmd, idx, k);
+	for (; i < k; i++) {
+		/* the same index may have gone to a magazine just now */
+		if (nm_isset(nmd->mag->cached, idx[i])) {
+			nm_prerr("ouch, double free on buffer %u", idx[i]);
+			continue;
+		}
+		netmap_obj_free(p, idx[i]);
+	}
 }
 
+#if 0 /* currently unused */
+/* Return the index associated to the given packet buffer */
+#define netmap_buf_index(n, v)						\
+    (netmap_obj_offset(&(n)->pools[NETMAP_BUF_POOL], (v)) / NETMAP_BDG_BUF_SIZE(n))
+#endif
 
+/*
+ * Account a buffer allocation call started at t0 (see nm_os_get_ns())
+ * in the latency histogram. The callers hold NMG_LOCK.
+ */
 static void
-netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+netmap_mem_lat_add(struct netmap_mem_d *nmd, uint64_t t0)
 {
-	u_int i;
+	uint64_t dt = nm_os_get_ns() - t0;
+	u_int b = 0;
 
-	for (i = 0; i < n; i++) {
-		if (slot[i].buf_idx > 1)
-			netmap_free_buf(nmd, slot[i].buf_idx);
+	while (dt > 1 && b < NR_POOLS_LAT_BUCKETS - 1) {
+		dt >>= 1;
+		b++;
 	}
-	ND("%s: released some buffers, available: %u",
-			p->name, p->objfree);
+	nmd->alloc_lat[b]++;
 }
 
-static void
-netmap_reset_obj_allocator(struct netmap_obj_pool *p)
-{
-
+/*
+ * allocate extra buffers and link them in front of the list at *head.
+ * returns the actual number.
+ */
+uint32_t
+netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+	struct lut_entry *lut = nmd->pools[NETMAP_BUF_POOL].lut;
+	uint32_t i = 0, k, got, idx[NM_BUF_BATCH];
+	int locked = 0;
+	uint64_t t0 = nm_os_get_ns();
+
+	while (i < n) {
+		u_int want = n - i < NM_BUF_BATCH ? n - i : NM_BUF_BATCH;
+
+		/* the per-CPU caches do not need the allocator lock */
+		got = locked ? 0 : netmap_mag_alloc(nmd, idx, want);
+		if (got < want) {
+			if (!locked) {
+				NMA_LOCK(nmd);
+				locked = 1;
+			}
+			got += netmap_buf_alloc_batch(nmd, idx + got,
+					want - got);
+		}
+		for (k = 0; k < got; k++) {
+			/* link to previous head */
+			*(uint32_t *)lut[idx[k]].vaddr = *head;
+			ND(5, "allocate buffer %d -> %d", idx[k], *head);
+			*head = idx[k];
+		}
+		i += got;
+		if (got < want) {
+			nm_prerr("no more buffers after %d of %d", i, n);
+			break;
+		}
+	}
+
+	if (locked)
+		NMA_UNLOCK(nmd);
+	netmap_mem_lat_add(nmd, t0);
+	na->na_extra_bufs += i;
+
+	return i;
+}
+
+/*
+ * Return the pool of buffer *j and turn *j into an index of that pool,
+ * or NULL if *j is not the index of an existing buffer.
+ */
+static struct netmap_obj_pool *
+netmap_buf_pool(struct netmap_mem_d *nmd, uint32_t *j)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *lp = &nmd->pools[NETMAP_LBUF_POOL];
+
+	if (*j < p->objtotal)
+		return p;
+	if (*j >= p->objcap && *j - p->objcap < lp->objtotal) {
+		*j -= p->objcap;
+		return lp;
+	}
+	return NULL;
+}
+
+static void
+netmap_extra_free(struct netmap_adapter *na, uint32_t head)
+{
+	struct lut_entry *lut = na->na_lut.lut;
+	struct netmap_mem_d *nmd = na->nm_mem;
+	struct netmap_obj_pool *p;
+	uint32_t i, j, k = 0, *buf, idx[NM_BUF_BATCH];
+
+	ND("freeing the extra list");
+	for (i = 0; head >= 2; i++) {
+		j = head;
+		p = netmap_buf_pool(nmd, &j);
+		if (p == NULL)
+			break;
+		buf = lut[head].vaddr;
+		head = *buf;
+		*buf = 0;
+		if (p != &nmd->pools[NETMAP_BUF_POOL]) {
+			/* large buffers are not cached */
+			netmap_obj_free(p, j);
+			continue;
+		}
+		idx[k++] = j;
+		if (k == NM_BUF_BATCH) {
+			netmap_buf_free_batch(nmd, idx, k);
+			k = 0;
+		}
+	}
+	netmap_buf_free_batch(nmd, idx, k);
+	if (head != 0)
+		nm_prerr("breaking with head %d", head);
+	if (netmap_debug & NM_DEBUG_MEM)
+		nm_prinf("freed %d buffers", i);
+	/* the user may have changed the list */
+	na->na_extra_bufs -= i < na->na_extra_bufs ? i : na->na_extra_bufs;
+}
+
+/*
+ * Keep the extra buffers of a netmap_if of a persistent region,
+ * to give them to the next netmap_if (see netmap_mem2_if_new()).
+ * The list is cut at the first invalid index.
+ */
+static void
+netmap_extra_park(struct netmap_adapter *na, uint32_t head)
+{
+	struct lut_entry *lut = na->na_lut.lut;
+	struct netmap_mem_d *nmd = na->nm_mem;
+	uint32_t i, j, k, *buf = NULL;
+
+	/* bounded, in case the list has a loop */
+	for (i = 0, j = head; j >= 2 && i < na->na_lut.objtotal; i++) {
+		k = j;
+		if (netmap_buf_pool(nmd, &k) == NULL)
+			break;
+		buf = lut[j].vaddr;
+		j = *buf;
+	}
+	if (buf == NULL)
+		return;
+	if (j != 0)
+		nm_prerr("breaking with head %d", j);
+	*buf = nmd->parked_bufs;
+	nmd->parked_bufs = head;
+	nmd->parked_num += i;
+	na->na_extra_bufs -= i < na->na_extra_bufs ? i : na->na_extra_bufs;
+	if (netmap_debug & NM_DEBUG_MEM)
+		nm_prinf("parked %d buffers", i);
+}
+
+
+/*
+ * Large buffers follow the small ones both in the index space and
+ * in the shared memory, so that a ring of large buffers can use the
+ * usual NETMAP_BUF() if the buffers below its first index are taken
+ * as large too. Returns what must be added to the buf_ofs of such a
+ * ring.
+ */
+static int64_t
+netmap_lbuf_ofs(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+	return (int64_t)p->memtotal -
+		(int64_t)p->objcap * nmd->pools[NETMAP_LBUF_POOL]._objsize;
+}
+
+/* Return nonzero on error */
+static int
+netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n,
+		int large)
+{
+	struct netmap_obj_pool *p =
+		&nmd->pools[large ? NETMAP_LBUF_POOL : NETMAP_BUF_POOL];
+	uint32_t first = large ? nmd->pools[NETMAP_BUF_POOL].objcap : 0;
+	u_int i = 0;	/* slot counter */
+	uint32_t k, got, idx[NM_BUF_BATCH];	/* buffer indexes */
+	uint64_t t0 = nm_os_get_ns();
+
+	while (i < n) {
+		u_int want = n - i < NM_BUF_BATCH ? n - i : NM_BUF_BATCH;
+
+		/* large buffers are not cached */
+		got = large ? netmap_obj_malloc_batch(p, idx, want) :
+			netmap_buf_alloc_batch(nmd, idx, want);
+		if (got == 0) {
+			nm_prerr("no more buffers after %d of %d", i, n);
+			goto cleanup;
+		}
+		for (k = 0; k < got; k++, i++) {
+			slot[i].buf_idx = first + idx[k];
+			slot[i].len = p->_objsize;
+			slot[i].flags = 0;
+			slot[i].ptr = 0;
+		}
+	}
+
+	ND("%s: allocated %d buffers, %d available", p->name, n, p->objfree);
+	netmap_mem_lat_add(nmd, t0);
+	return (0);
+
+cleanup:
+	while (i > 0) {
+		i--;
+		netmap_obj_free(p, slot[i].buf_idx - first);
+	}
+	bzero(slot, n * sizeof(slot[0]));
+	return (ENOMEM);
+}
+
+static void
+netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n, uint32_t index)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i;
+
+	for (i = 0; i < n; i++) {
+		slot[i].buf_idx = index;
+		slot[i].len = p->_objsize;
+		slot[i].flags = 0;
+	}
+}
+
+
+static void
+netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL], *q;
+	uint32_t idx[NM_BUF_BATCH];
+	u_int i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		uint32_t j = slot[i].buf_idx;
+
+		if (j <= 1)
+			continue;
+		q = netmap_buf_pool(nmd, &j);
+		if (q == NULL) {
+			nm_prerr("Cannot free buf#%d: not an allocated buffer",
+				slot[i].buf_idx);
+			continue;
+		}
+		if (q != p) {
+			/* large buffers are not cached */
+			netmap_obj_free(q, j);
+			continue;
+		}
+		idx[k++] = j;
+		if (k == NM_BUF_BATCH) {
+			netmap_buf_free_batch(nmd, idx, k);
+			k = 0;
+		}
+	}
+	netmap_buf_free_batch(nmd, idx, k);
+	ND("%s: released some buffers, available: %u",
+			p->name, p->objfree);
+}
+
+static void *
+netmap_clust_alloc(struct netmap_obj_pool *p, int node)
+{
+	if (p->_hugesize)
+		return nm_os_hugepage_alloc(p->_hugesize, node);
+	if (node >= 0)
+		return contigmalloc_domainset(p->_clustsize, M_NETMAP,
+		    DOMAINSET_PREF(node), M_NOWAIT | M_ZERO,
+		    (size_t)0, -1UL, PAGE_SIZE, 0);
+	return contigmalloc(p->_clustsize, M_NETMAP, M_NOWAIT | M_ZERO,
+	    (size_t)0, -1UL, PAGE_SIZE, 0);
+}
+
+static void
+netmap_clust_free(struct netmap_obj_pool *p, void *clust)
+{
+	if (p->_hugesize)
+		nm_os_hugepage_free(clust, p->_hugesize);
+	else
+		contigfree(clust, p->_clustsize, M_NETMAP);
+}
+
+/*
+ * Map the cluster of the buffers from 'first' on for all the adapters
+ * that have a physical lut. On failure nobody has it mapped.
+ */
+static int
+netmap_mem_map_cluster(struct netmap_mem_d *nmd, u_int first)
+{
+	int error = 0;
+#if defined(linux)
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_adapter *na, *nb;
+	int j;
+
+	for (na = nmd->mapped; na != NULL; na = na->na_mapped_next) {
+		struct plut_entry *plut = na->na_lut.plut + first;
+
+		error = netmap_load_map(na, (bus_dma_tag_t) na->pdev,
+				&plut->paddr, p->lut[first].vaddr, p->_clustsize);
+		if (error) {
+			nm_prerr("Failed to map cluster #%u for %s", first,
+					na->name);
+			plut[0] = na->na_lut.plut[0];
+			break;
+		}
+		for (j = 1; j < p->_clustentries; j++)
+			plut[j].paddr = plut[j - 1].paddr + p->_objsize;
+	}
+	if (error) {
+		for (nb = nmd->mapped; nb != na; nb = nb->na_mapped_next) {
+			struct plut_entry *plut = nb->na_lut.plut + first;
+
+			netmap_unload_map(nb, (bus_dma_tag_t) nb->pdev,
+					&plut->paddr, p->_clustsize);
+			for (j = 0; j < p->_clustentries; j++)
+				plut[j] = nb->na_lut.plut[0];
+		}
+	}
+#else
+	(void)nmd;
+	(void)first;
+#endif /* linux */
+	return error;
+}
+
+/*
+ * Append whole clusters to the buffer pool, until there are at least
+ * n new buffers or the pool reaches _maxclusters. The mmap offsets,
+ * lut entries and indexes of the new buffers have been reserved by
+ * netmap_finalize_obj_allocator(), pointing to buffer 0 until now, so
+ * the mapped users only need the new clusters in their physical lut
+ * before the buffers can be allocated.
+ * Returns the number of new buffers. Call with NMA_LOCK held.
+ */
+static u_int
+netmap_mem_grow(struct netmap_mem_d *nmd, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int added = 0;
+
+	if (p->_maxclusters <= p->_numclusters)
+		return 0; /* no room to grow */
+	while (added < n && p->numclusters < p->_maxclusters) {
+		u_int i, first = p->objtotal, lim = first + p->_clustentries;
+		char *clust = netmap_clust_alloc(p, nmd->nm_node);
+
+		if (clust == NULL) {
+			nm_prerr("Unable to grow '%s' beyond %u objects",
+					p->name, first);
+			break;
+		}
+		for (i = first; i < lim; i++) {
+			p->lut[i].vaddr = clust + (i - first) * p->_objsize;
+#if !defined(linux) && !defined(_WIN32)
+			p->lut[i].paddr = vtophys(p->lut[i].vaddr);
+#endif
+		}
+		if (netmap_mem_map_cluster(nmd, first)) {
+			for (i = first; i < lim; i++)
+				p->lut[i] = p->lut[0];
+			netmap_clust_free(p, clust);
+			break;
+		}
+		if (nmd->lut_all)
+			memcpy(nmd->lut_all + first, p->lut + first,
+				sizeof(p->lut[0]) * p->_clustentries);
+		for (i = first; i < lim; i++)
+			netmap_obj_bitmap_give(p, i / 32, 1U << (i % 32));
+		p->objtotal = lim;
+		p->numclusters++;
+		p->objfree += p->_clustentries;
+		added += p->_clustentries;
+	}
+	if (added && netmap_verbose)
+		nm_prinf("%s: grown to %u objects", p->name, p->objtotal);
+	return added;
+}
+
+/*
+ * Undo netmap_mem_grow() when the region falls out of use, so that
+ * the buffers of the rings that are no longer bound do not keep their
+ * memory. The lut entries go back to buffer 0. Only done when no
+ * adapter has a physical lut of the region. Call with NMA_LOCK held,
+ * before netmap_mem_init_bitmaps().
+ */
+static void
+netmap_mem_shrink(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i, lim = p->_numclusters * p->_clustentries;
+
+	if (p->numclusters <= p->_numclusters || nmd->mapped != NULL)
+		return;
+	for (i = lim; i < p->objtotal; i += p->_clustentries)
+		netmap_clust_free(p, p->lut[i].vaddr);
+	for (i = lim; i < p->objtotal; i++)
+		p->lut[i] = p->lut[0];
+	if (nmd->lut_all)
+		memcpy(nmd->lut_all + lim, p->lut + lim,
+			sizeof(p->lut[0]) * (p->objtotal - lim));
+	if (netmap_verbose)
+		nm_prinf("%s: shrunk from %u to %u objects", p->name,
+			p->objtotal, lim);
+	p->objtotal = lim;
+	p->numclusters = p->_numclusters;
+}
+
+static void
+netmap_reset_obj_allocator(struct netmap_obj_pool *p)
+{
+
 	if (p == NULL)
 		return;
 	if (p->bitmap)
 		nm_os_free(p->bitmap);
 	p->bitmap = NULL;
+	p->bitmap_nlvl = 0;
 	if (p->invalid_bitmap)
 		nm_os_free(p->invalid_bitmap);
 	p->invalid_bitmap = NULL;
@@ -1277,12 +2240,13 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 		 * in the lut.
 		 */
 		for (i = 0; i < p->objtotal; i += p->_clustentries) {
-			contigfree(p->lut[i].vaddr, p->_clustsize, M_NETMAP);
+			netmap_clust_free(p, p->lut[i].vaddr);
 		}
-		nm_free_lut(p->lut, p->objtotal);
+		nm_free_lut(p->lut, p->objcap);
 	}
 	p->lut = NULL;
 	p->objtotal = 0;
+	p->objcap = 0;
 	p->memtotal = 0;
 	p->numclusters = 0;
 	p->objfree = 0;
@@ -1309,12 +2273,19 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
  *
  * XXX note -- userspace needs the buffers to be contiguous,
  *	so we cannot afford gaps at the end of a cluster.
+ *
+ * If hugeshift is not zero the clusters are huge pages, unless
+ * the object size does not divide the huge page size.
+ *
+ * If objmax is larger than objtotal the pool may later grow up to
+ * objmax objects, see netmap_mem_grow().
  */
 
 
 /* call with NMA_LOCK held */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+		u_int objsize, u_int objmax, u_int hugeshift)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -1324,6 +2295,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	 * detect configuration changes later */
 	p->r_objtotal = objtotal;
 	p->r_objsize = objsize;
+	p->r_objmax = objmax;
 
 #define MAX_CLUSTSIZE	(1<<22)		// 4 MB
 #define LINE_ROUND	NM_CACHE_ALIGN	// 64
@@ -1348,6 +2320,12 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 			objtotal, p->nummin, p->nummax);
 		return EINVAL;
 	}
+	p->_hugesize = 0;
+	if (hugeshift && ((1U << hugeshift) % objsize) == 0) {
+		p->_hugesize = 1U << hugeshift;
+		clustentries = p->_hugesize / objsize;
+		goto done;
+	}
 	/*
 	 * Compute number of objects using a brute-force approach:
 	 * given a max cluster size,
@@ -1369,6 +2347,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 		nm_prerr("unsupported allocation for %d bytes", objsize);
 		return EINVAL;
 	}
+done:
 	/* compute clustsize */
 	clustsize = clustentries * objsize;
 	if (netmap_debug & NM_DEBUG_MEM)
@@ -1382,6 +2361,14 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	p->_clustentries = clustentries;
 	p->_clustsize = clustsize;
 	p->_numclusters = (objtotal + clustentries - 1) / clustentries;
+	if (objmax > p->nummax) {
+		nm_prinf("limiting the growth of '%s' to %u objects",
+			p->name, p->nummax);
+		objmax = p->nummax;
+	}
+	p->_maxclusters = (objmax + clustentries - 1) / clustentries;
+	if (p->_maxclusters < p->_numclusters)
+		p->_maxclusters = p->_numclusters;
 
 	/* actual values (may be larger than requested) */
 	p->_objsize = objsize;
@@ -1392,10 +2379,9 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 
 /* call with NMA_LOCK held */
 static int
-netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
+netmap_finalize_obj_allocator(struct netmap_obj_pool *p, int node)
 {
 	int i; /* must be signed */
-	size_t n;
 
 	if (p->lut) {
 		/* if the lut is already there we assume that also all the
@@ -1408,12 +2394,19 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		return 0;
 	}
 
+	if (p->_objtotal == 0) {
+		/* an empty pool, e.g. no large buffers */
+		p->numclusters = p->objtotal = p->objcap = p->memtotal = 0;
+		return 0;
+	}
+
 	/* optimistically assume we have enough memory */
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
+	p->objcap = p->_maxclusters * p->_clustentries;
 	p->alloc_done = 1;
 
-	p->lut = nm_alloc_lut(p->objtotal);
+	p->lut = nm_alloc_lut(p->objcap);
 	if (p->lut == NULL) {
 		nm_prerr("Unable to create lookup table for '%s'", p->name);
 		goto clean;
@@ -1423,7 +2416,6 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	 * Allocate clusters, init pointers
 	 */
 
-	n = p->_clustsize;
 	for (i = 0; i < (int)p->objtotal;) {
 		int lim = i + p->_clustentries;
 		char *clust;
@@ -1435,8 +2427,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * can live with standard malloc, because the hardware will not
 		 * access the pages directly.
 		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		clust = netmap_clust_alloc(p, node);
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
@@ -1449,8 +2440,7 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 			lim = i / 2;
 			for (i--; i >= lim; i--) {
 				if (i % p->_clustentries == 0 && p->lut[i].vaddr)
-					contigfree(p->lut[i].vaddr,
-						n, M_NETMAP);
+					netmap_clust_free(p, p->lut[i].vaddr);
 				p->lut[i].vaddr = NULL;
 			}
 		out:
@@ -1476,7 +2466,15 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 #endif
 		}
 	}
-	p->memtotal = p->numclusters * p->_clustsize;
+	/* the buffers that may be added later are buffer 0 for now */
+	for (i = p->objtotal; i < (int)p->objcap; i++)
+		p->lut[i] = p->lut[0];
+	if (p->_maxclusters > p->_numclusters) {
+		/* reserve the address space to grow into */
+		p->memtotal = p->_maxclusters * p->_clustsize;
+	} else {
+		p->memtotal = p->numclusters * p->_clustsize;
+	}
 	if (netmap_verbose)
 		nm_prinf("Pre-allocated %d clusters (%d/%dKB) for '%s'",
 		    p->numclusters, p->_clustsize >> 10,
@@ -1505,6 +2503,39 @@ netmap_mem_params_changed(struct netmap_obj_params* p)
 	return rv;
 }
 
+/*
+ * Build the lut that the adapters use to reach the buffers of both
+ * classes, unless there are only small buffers.
+ */
+static int
+netmap_mem_lut_all_create(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *lp = &nmd->pools[NETMAP_LBUF_POOL];
+
+	if (lp->objtotal == 0)
+		return 0;
+	nmd->lut_all = nm_alloc_lut(p->objcap + lp->objtotal);
+	if (nmd->lut_all == NULL) {
+		nm_prerr("Unable to create lookup table for '%s'", lp->name);
+		return ENOMEM;
+	}
+	memcpy(nmd->lut_all, p->lut, sizeof(p->lut[0]) * p->objcap);
+	memcpy(nmd->lut_all + p->objcap, lp->lut,
+		sizeof(lp->lut[0]) * lp->objtotal);
+	return 0;
+}
+
+static void
+netmap_mem_lut_all_destroy(struct netmap_mem_d *nmd)
+{
+	if (nmd->lut_all == NULL)
+		return;
+	nm_free_lut(nmd->lut_all, nmd->pools[NETMAP_BUF_POOL].objcap +
+		nmd->pools[NETMAP_LBUF_POOL].objtotal);
+	nmd->lut_all = NULL;
+}
+
 static void
 netmap_mem_reset_all(struct netmap_mem_d *nmd)
 {
@@ -1512,17 +2543,26 @@ netmap_mem_reset_all(struct netmap_mem_d *nmd)
 
 	if (netmap_debug & NM_DEBUG_MEM)
 		nm_prinf("resetting %p", nmd);
+	netmap_mag_cache_destroy(nmd);
+	netmap_mem_lut_all_destroy(nmd);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		netmap_reset_obj_allocator(&nmd->pools[i]);
 	}
 	nmd->flags  &= ~NETMAP_MEM_FINALIZED;
 }
 
+/*
+ * The buffer pools share the index space, with the large buffers after
+ * the small ones and the room to grow, and so the physical lut of the
+ * adapter. The adapters with a physical lut are on the nmd->mapped
+ * list, so that netmap_mem_grow() can map the new clusters for them.
+ */
 static int
-netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
+netmap_mem_unmap(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
-	int i, lim = p->objtotal;
+	int i, k, base = 0;
 	struct netmap_lut *lut = &na->na_lut;
+	struct netmap_adapter **nap;
 
 	if (na == NULL || na->pdev == NULL)
 		return 0;
@@ -1531,20 +2571,37 @@ netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
 	/* On FreeBSD mapping and unmapping is performed by the txsync
 	 * and rxsync routine, packet by packet. */
 	(void)i;
-	(void)lim;
+	(void)k;
+	(void)base;
 	(void)lut;
+	(void)nap;
 #elif defined(_WIN32)
 	(void)i;
-	(void)lim;
+	(void)k;
+	(void)base;
 	(void)lut;
+	(void)nap;
 	nm_prerr("unsupported on Windows");
 #else /* linux */
 	ND("unmapping and freeing plut for %s", na->name);
 	if (lut->plut == NULL)
 		return 0;
-	for (i = 0; i < lim; i += p->_clustentries) {
-		if (lut->plut[i].paddr)
-			netmap_unload_map(na, (bus_dma_tag_t) na->pdev, &lut->plut[i].paddr, p->_clustsize);
+	for (nap = &nmd->mapped; *nap != NULL; nap = &(*nap)->na_mapped_next) {
+		if (*nap == na) {
+			*nap = na->na_mapped_next;
+			break;
+		}
+	}
+	na->na_mapped_next = NULL;
+	for (k = NETMAP_BUF_POOL; k <= NETMAP_LBUF_POOL; k++) {
+		struct netmap_obj_pool *p = &nmd->pools[k];
+
+		for (i = 0; i < p->objtotal; i += p->_clustentries) {
+			if (lut->plut[base + i].paddr)
+				netmap_unload_map(na, (bus_dma_tag_t) na->pdev,
+					&lut->plut[base + i].paddr, p->_clustsize);
+		}
+		base += p->objcap;
 	}
 	nm_free_plut(lut->plut);
 	lut->plut = NULL;
@@ -1554,10 +2611,12 @@ netmap_mem_unmap(struct netmap_obj_pool *p, struct netmap_adapter *na)
 }
 
 static int
-netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
+netmap_mem_map(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 	int error = 0;
-	int i, lim = p->objtotal;
+	int i, k, base = 0;
+	int lim = nmd->pools[NETMAP_BUF_POOL].objcap +
+		nmd->pools[NETMAP_LBUF_POOL].objcap;
 	struct netmap_lut *lut = &na->na_lut;
 
 	if (na->pdev == NULL)
@@ -1567,10 +2626,14 @@ netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
 	/* On FreeBSD mapping and unmapping is performed by the txsync
 	 * and rxsync routine, packet by packet. */
 	(void)i;
+	(void)k;
+	(void)base;
 	(void)lim;
 	(void)lut;
 #elif defined(_WIN32)
 	(void)i;
+	(void)k;
+	(void)base;
 	(void)lim;
 	(void)lut;
 	nm_prerr("unsupported on Windows");
@@ -1588,30 +2651,43 @@ netmap_mem_map(struct netmap_obj_pool *p, struct netmap_adapter *na)
 		return ENOMEM;
 	}
 
-	for (i = 0; i < lim; i += p->_clustentries) {
+	for (i = 0; i < lim; i++) {
 		lut->plut[i].paddr = 0;
 	}
 
-	for (i = 0; i < lim; i += p->_clustentries) {
-		int j;
+	for (k = NETMAP_BUF_POOL; k <= NETMAP_LBUF_POOL; k++) {
+		struct netmap_obj_pool *p = &nmd->pools[k];
 
-		if (p->lut[i].vaddr == NULL)
-			continue;
+		for (i = 0; i < p->objtotal; i += p->_clustentries) {
+			struct plut_entry *plut = lut->plut + base + i;
+			int j;
 
-		error = netmap_load_map(na, (bus_dma_tag_t) na->pdev, &lut->plut[i].paddr,
-				p->lut[i].vaddr, p->_clustsize);
-		if (error) {
-			nm_prerr("Failed to map cluster #%d from the %s pool", i, p->name);
-			break;
-		}
+			if (p->lut[i].vaddr == NULL)
+				continue;
+
+			error = netmap_load_map(na, (bus_dma_tag_t) na->pdev, &plut->paddr,
+					p->lut[i].vaddr, p->_clustsize);
+			if (error) {
+				nm_prerr("Failed to map cluster #%d from the %s pool", i, p->name);
+				goto out;
+			}
 
-		for (j = 1; j < p->_clustentries; j++) {
-			lut->plut[i + j].paddr = lut->plut[i + j - 1].paddr + p->_objsize;
+			for (j = 1; j < p->_clustentries; j++) {
+				plut[j].paddr = plut[j - 1].paddr + p->_objsize;
+			}
 		}
+		/* the buffers not there yet are buffer 0 */
+		for (i = p->objtotal; i < p->objcap; i++)
+			lut->plut[base + i] = lut->plut[0];
+		base += p->objcap;
+	}
+out:
+	if (error) {
+		netmap_mem_unmap(nmd, na);
+	} else {
+		na->na_mapped_next = nmd->mapped;
+		nmd->mapped = na;
 	}
-
-	if (error)
-		netmap_mem_unmap(p, na);
 
 #endif /* linux */
 
@@ -1627,12 +2703,25 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	nmd->lasterr = 0;
 	nmd->nm_totalsize = 0;
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
+		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i],
+				nmd->nm_node);
 		if (nmd->lasterr)
 			goto error;
+		/* keep the next pool aligned to the huge pages */
+		if (nmd->hugeshift) {
+			u_int m = (1U << nmd->hugeshift) - 1;
+
+			nmd->pools[i].memtotal = (nmd->pools[i].memtotal + m) & ~m;
+		}
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
 	}
+	nmd->lasterr = netmap_mem_lut_all_create(nmd);
+	if (nmd->lasterr)
+		goto error;
 	nmd->lasterr = netmap_mem_init_bitmaps(nmd);
+	if (nmd->lasterr)
+		goto error;
+	nmd->lasterr = netmap_mag_cache_create(nmd);
 	if (nmd->lasterr)
 		goto error;
 
@@ -1684,6 +2773,7 @@ _netmap_mem_private_new(size_t size, struct netmap_obj_params *p,
 				d->name);
 		d->params[i].num = p[i].num;
 		d->params[i].size = p[i].size;
+		d->params[i].max = p[i].max;
 	}
 
 	NMA_LOCK_INIT(d);
@@ -1750,6 +2840,17 @@ netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
 		/* the +2 is for the tx and rx fake buffers (indices 0 and 1) */
 	if (p[NETMAP_BUF_POOL].num < v)
 		p[NETMAP_BUF_POOL].num = v;
+#ifndef _WIN32 /* see netmap_mem2_config() */
+	/* Only back the buffers of one ring pair and the extra buffers
+	 * at first: the pool grows when more rings are bound, and goes
+	 * back to this size when the last binding goes away. */
+	p[NETMAP_BUF_POOL].max = p[NETMAP_BUF_POOL].num;
+	v = txd + rxd + 2 + extra_bufs;
+	if (v < netmap_min_priv_params[NETMAP_BUF_POOL].num)
+		v = netmap_min_priv_params[NETMAP_BUF_POOL].num;
+	if (p[NETMAP_BUF_POOL].num > v)
+		p[NETMAP_BUF_POOL].num = v;
+#endif
 
 	if (netmap_verbose)
 		nm_prinf("req if %d*%d ring %d*%d buf %d*%d",
@@ -1765,29 +2866,109 @@ netmap_mem_private_new(u_int txr, u_int txd, u_int rxr, u_int rxd,
 	return d;
 }
 
+/* call with nm_mem_list_lock held */
+static struct netmap_mem_d *
+netmap_mem_node_find_locked(int node)
+{
+	struct netmap_mem_d *d = netmap_last_mem_d;
+
+	do {
+		if ((d->flags & NETMAP_MEM_NODE) && d->nm_node == node) {
+			d->refcount++;
+			NM_DBG_REFC(d, __FUNCTION__, __LINE__);
+			return d;
+		}
+		d = d->next;
+	} while (d != netmap_last_mem_d);
+
+	return NULL;
+}
+
+/*
+ * Find, or create, the allocator that places its pools on the given
+ * NUMA node. It has the same parameters as the global allocator.
+ */
+struct netmap_mem_d *
+netmap_mem_node_get(int node, int *perr)
+{
+	struct netmap_mem_d *d, *old;
+
+	if (!nm_os_numa_node_valid(node)) {
+		*perr = EINVAL;
+		return NULL;
+	}
+
+	NM_MTX_LOCK(nm_mem_list_lock);
+	d = netmap_mem_node_find_locked(node);
+	NM_MTX_UNLOCK(nm_mem_list_lock);
+	if (d != NULL)
+		return d;
+
+	d = _netmap_mem_private_new(sizeof(*d), nm_mem.params,
+			&netmap_mem_global_ops, perr);
+	if (d == NULL)
+		return NULL;
+
+	/* somebody may have created the same allocator while the
+	 * lock was dropped: only one of them gets the node tag */
+	NM_MTX_LOCK(nm_mem_list_lock);
+	old = netmap_mem_node_find_locked(node);
+	if (old == NULL) {
+		d->nm_node = node;
+		d->flags |= NETMAP_MEM_NODE;
+	}
+	NM_MTX_UNLOCK(nm_mem_list_lock);
+	if (old != NULL) {
+		netmap_mem_put(d);
+		return old;
+	}
+	if (netmap_verbose)
+		nm_prinf("allocator %d on node %d", d->nm_id, node);
+
+	return d;
+}
+
 
 /* call with lock held */
 static int
 netmap_mem2_config(struct netmap_mem_d *nmd)
 {
-	int i;
+	int i, changed;
+	u_int hugeshift = netmap_mem_hugepages ? nm_os_hugepage_shift() : 0;
+	u_int objmax = 0;
 
-	if (!netmap_mem_params_changed(nmd->params))
+#ifndef _WIN32 /* win32_build_user_vm_map() wants backed pools */
+	if (netmap_mem_shared(nmd))
+		objmax = netmap_buf_max_num;
+	else
+		objmax = nmd->params[NETMAP_BUF_POOL].max;
+#endif
+	changed = netmap_mem_params_changed(nmd->params);
+	if (!changed && hugeshift == nmd->hugeshift &&
+	    objmax == nmd->pools[NETMAP_BUF_POOL].r_objmax)
 		goto out;
 
 	ND("reconfiguring");
 
 	if (nmd->flags & NETMAP_MEM_FINALIZED) {
 		/* reset previous allocation */
+		netmap_mag_cache_destroy(nmd);
+		netmap_mem_lut_all_destroy(nmd);
 		for (i = 0; i < NETMAP_POOLS_NR; i++) {
 			netmap_reset_obj_allocator(&nmd->pools[i]);
 		}
 		nmd->flags &= ~NETMAP_MEM_FINALIZED;
 	}
 
+	nmd->hugeshift = hugeshift;
+	if (hugeshift)
+		nmd->flags |= NETMAP_MEM_HUGEPAGE;
+	else
+		nmd->flags &= ~NETMAP_MEM_HUGEPAGE;
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				nmd->params[i].num, nmd->params[i].size);
+				nmd->params[i].num, nmd->params[i].size,
+				i == NETMAP_BUF_POOL ? objmax : 0, hugeshift);
 		if (nmd->lasterr)
 			goto out;
 	}
@@ -1817,6 +2998,8 @@ netmap_mem2_delete(struct netmap_mem_d *nmd)
 {
 	int i;
 
+	netmap_mag_cache_destroy(nmd);
+	netmap_mem_lut_all_destroy(nmd);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 	    netmap_destroy_obj_allocator(&nmd->pools[i]);
 	}
@@ -1844,9 +3027,16 @@ netmap_mem_init(void)
 	return (0);
 }
 
+#ifdef WITH_EXTMEM
+static void netmap_mem_ext_fini(void);
+#endif /* WITH_EXTMEM */
+
 void
 netmap_mem_fini(void)
 {
+#ifdef WITH_EXTMEM
+	netmap_mem_ext_fini();
+#endif /* WITH_EXTMEM */
 	netmap_mem_put(&nm_mem);
 }
 
@@ -1899,6 +3089,7 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 		for (i = 0; i < netmap_all_rings(na, t); i++) {
 			struct netmap_kring *kring = NMR(na, t)[i];
 			struct netmap_ring *ring = kring->ring;
+			int large = kring->nr_kflags & NKR_LARGEBUF;
 			u_int len, ndesc;
 
 			if (ring || (!kring->users && !(kring->nr_kflags & NKR_NEEDRING))) {
@@ -1925,12 +3116,16 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 			    (na->nm_mem->pools[NETMAP_IF_POOL].memtotal +
 				na->nm_mem->pools[NETMAP_RING_POOL].memtotal) -
 				netmap_ring_offset(na->nm_mem, ring);
+			if (large)
+				*(int64_t *)(uintptr_t)&ring->buf_ofs +=
+					netmap_lbuf_ofs(na->nm_mem);
 
 			/* copy values from kring */
 			ring->head = kring->rhead;
 			ring->cur = kring->rcur;
 			ring->tail = kring->rtail;
-			*(uint32_t *)(uintptr_t)&ring->nr_buf_size =
+			*(uint32_t *)(uintptr_t)&ring->nr_buf_size = large ?
+				na->nm_mem->pools[NETMAP_LBUF_POOL]._objsize :
 				netmap_mem_bufsize(na->nm_mem);
 			ND("%s h %d c %d t %d", kring->name,
 				ring->head, ring->cur, ring->tail);
@@ -1939,7 +3134,7 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 				/* this is a real ring */
 				if (netmap_debug & NM_DEBUG_MEM)
 					nm_prinf("allocating buffers for %s", kring->name);
-				if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc)) {
+				if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc, large)) {
 					nm_prerr("Cannot allocate buffers for %s_ring", nm_txrx2str(t));
 					goto cleanup;
 				}
@@ -2013,6 +3208,11 @@ netmap_mem2_if_new(struct netmap_adapter *na, struct netmap_priv_d *priv)
 	*(u_int *)(uintptr_t)&nifp->ni_tx_rings = na->num_tx_rings;
 	*(u_int *)(uintptr_t)&nifp->ni_rx_rings = na->num_rx_rings;
 	strlcpy(nifp->ni_name, na->name, sizeof(nifp->ni_name));
+	/* the buffers left by a previous user of a persistent region */
+	nifp->ni_bufs_head = na->nm_mem->parked_bufs;
+	na->nm_mem->parked_bufs = 0;
+	na->na_extra_bufs += na->nm_mem->parked_num;
+	na->nm_mem->parked_num = 0;
 
 	/*
 	 * fill the slots for the rx and tx rings. They contain the offset
@@ -2054,8 +3254,12 @@ netmap_mem2_if_delete(struct netmap_adapter *na, struct netmap_if *nifp)
 	if (nifp == NULL)
 		/* nothing to do */
 		return;
-	if (nifp->ni_bufs_head)
-		netmap_extra_free(na, nifp->ni_bufs_head);
+	if (nifp->ni_bufs_head) {
+		if (na->nm_mem->flags & NETMAP_MEM_PERSIST)
+			netmap_extra_park(na, nifp->ni_bufs_head);
+		else
+			netmap_extra_free(na, nifp->ni_bufs_head);
+	}
 	netmap_if_free(na->nm_mem, nifp);
 }
 
@@ -2108,11 +3312,123 @@ netmap_mem_pools_info_get(struct nmreq_pools_info *req,
 			     nmd->pools[NETMAP_RING_POOL].memtotal;
 	req->nr_buf_pool_objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
 	req->nr_buf_pool_objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	req->nr_buf_pool_pagesize = nmd->pools[NETMAP_BUF_POOL]._hugesize ?
+		nmd->pools[NETMAP_BUF_POOL]._hugesize : PAGE_SIZE;
+	req->nr_numa_node = nmd->nm_node;
 	NMA_UNLOCK(nmd);
 
 	return 0;
 }
 
+/* Number of buffers in the per-CPU caches and in the depot. */
+static u_int
+netmap_mag_cached(struct netmap_mem_d *nmd)
+{
+	struct netmap_mag_cache *mc = nmd->mag;
+	u_int i, n = 0;
+
+	if (mc == NULL)
+		return 0;
+	for (i = 0; i < mc->ncpus; i++) {
+		struct netmap_mag_cpu *c = &mc->cpu[i];
+
+		mtx_lock(&c->lock);
+		n += c->loaded->n + c->prev->n;
+		mtx_unlock(&c->lock);
+	}
+	mtx_lock(&mc->depot_lock);
+	for (i = 0; i < mc->nfull; i++)
+		n += mc->full[i]->n;
+	mtx_unlock(&mc->depot_lock);
+	return n;
+}
+
+/*
+ * Count the maximal runs of free objects of a pool, and the length
+ * of the longest one. Whole words are skipped or taken at once.
+ */
+static void
+netmap_obj_free_runs(struct netmap_obj_pool *p, uint32_t *runs,
+		uint32_t *longest)
+{
+	uint32_t i, j, cur = 0;
+
+	*runs = *longest = 0;
+	for (i = 0; p->bitmap != NULL && i < p->bitmap_slots; i++) {
+		uint32_t w = p->bitmap[i];
+
+		if (w == 0 || w == ~0U) {
+			if (w == 0) {
+				cur = 0;
+				continue;
+			}
+			if (cur == 0)
+				(*runs)++;
+			cur += 32;
+		} else {
+			for (j = 0; j < 32; j++, w >>= 1) {
+				if (!(w & 1)) {
+					cur = 0;
+					continue;
+				}
+				if (cur++ == 0)
+					(*runs)++;
+				if (cur > *longest)
+					*longest = cur;
+			}
+		}
+		if (cur > *longest)
+			*longest = cur;
+	}
+}
+
+int
+netmap_mem_pools_stats_get(struct nmreq_pools_stats *req,
+		struct netmap_adapter *na)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+	int reset = req->nr_flags & NR_POOLS_STATS_RESET;
+	enum txrx t;
+	u_int i;
+
+	NMA_LOCK(nmd);
+	for (i = 0; i < NETMAP_POOLS_NR && i < NR_POOLS_NUM; i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+		struct nmreq_pool_stats *s = &req->nr_pool[i];
+
+		s->nr_objtotal = p->objtotal;
+		s->nr_inuse = p->objtotal - p->objfree;
+		s->nr_cached = i == NETMAP_BUF_POOL ? netmap_mag_cached(nmd) : 0;
+		s->nr_hiwat = p->hiwat > s->nr_inuse ? p->hiwat : s->nr_inuse;
+		s->nr_leaked = p->leaked;
+		netmap_obj_free_runs(p, &s->nr_free_runs, &s->nr_largest_run);
+		if (reset) {
+			p->hiwat = s->nr_inuse;
+			p->leaked = 0;
+		}
+	}
+	memcpy(req->nr_alloc_lat, nmd->alloc_lat, sizeof(req->nr_alloc_lat));
+	if (reset)
+		memset(nmd->alloc_lat, 0, sizeof(nmd->alloc_lat));
+	NMA_UNLOCK(nmd);
+
+	req->nr_port_ring_bufs = 0;
+	if (na->tx_rings != NULL) {
+		for_rx_tx(t) {
+			for (i = 0; i < netmap_all_rings(na, t); i++) {
+				struct netmap_kring *kring = NMR(na, t)[i];
+
+				if (kring->ring != NULL &&
+				    !(kring->nr_kflags & NKR_FAKERING))
+					req->nr_port_ring_bufs += kring->nkr_num_slots;
+			}
+		}
+	}
+	req->nr_port_extra_bufs = na->na_extra_bufs;
+
+	return 0;
+}
+
 #ifdef WITH_EXTMEM
 struct netmap_mem_ext {
 	struct netmap_mem_d up;
@@ -2147,6 +3463,49 @@ netmap_mem_ext_unregister(struct netmap_mem_ext *e)
 	e->prev = e->next = NULL;
 }
 
+/*
+ * Make an external region persistent (on != 0), or temporary again.
+ * A persistent region holds a reference to itself, so it survives its
+ * last user and netmap_mem_ext_search() can find it when the same
+ * memory is registered again. A region that becomes temporary is
+ * destroyed here if nobody else holds a reference.
+ */
+void
+netmap_mem_ext_persist(struct netmap_mem_d *nmd, int on)
+{
+	int change;
+
+	NMA_LOCK(nmd);
+	change = !on != !(nmd->flags & NETMAP_MEM_PERSIST);
+	if (change)
+		nmd->flags ^= NETMAP_MEM_PERSIST;
+	NMA_UNLOCK(nmd);
+	if (!change)
+		return;
+	if (on)
+		netmap_mem_get(nmd);
+	else
+		netmap_mem_put(nmd);
+}
+
+/* drop the persistent regions, when the module goes away */
+static void
+netmap_mem_ext_fini(void)
+{
+	struct netmap_mem_ext *e;
+
+	for (;;) {
+		NM_MTX_LOCK(nm_mem_ext_list_lock);
+		for (e = netmap_mem_ext_list; e; e = e->next)
+			if (e->up.flags & NETMAP_MEM_PERSIST)
+				break;
+		NM_MTX_UNLOCK(nm_mem_ext_list_lock);
+		if (e == NULL)
+			break;
+		netmap_mem_ext_persist(&e->up, 0);
+	}
+}
+
 static struct netmap_mem_ext *
 netmap_mem_ext_search(struct nm_os_extmem *os)
 {
@@ -2177,7 +3536,7 @@ netmap_mem_ext_delete(struct netmap_mem_d *d)
 		struct netmap_obj_pool *p = &d->pools[i];
 
 		if (p->lut) {
-			nm_free_lut(p->lut, p->objtotal);
+			nm_free_lut(p->lut, p->objcap);
 			p->lut = NULL;
 		}
 	}
@@ -2217,6 +3576,9 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 	size_t off;
 	struct nm_os_extmem *os = NULL;
 	int nr_pages;
+	/* _netmap_mem_private_new() reads all the pools: no large
+	 * buffers in external memory */
+	struct netmap_obj_params params[NETMAP_POOLS_NR];
 
 	// XXX sanity checks
 	if (pi->nr_if_pool_objtotal == 0)
@@ -2251,13 +3613,15 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 	if (netmap_verbose & NM_DEBUG_MEM)
 		nm_prinf("not found, creating new");
 
-	nme = _netmap_mem_private_new(sizeof(*nme),
-			(struct netmap_obj_params[]){
-				{ pi->nr_if_pool_objsize, pi->nr_if_pool_objtotal },
-				{ pi->nr_ring_pool_objsize, pi->nr_ring_pool_objtotal },
-				{ pi->nr_buf_pool_objsize, pi->nr_buf_pool_objtotal }},
-			&netmap_mem_ext_ops,
-			&error);
+	memset(params, 0, sizeof(params));
+	params[NETMAP_IF_POOL].size = pi->nr_if_pool_objsize;
+	params[NETMAP_IF_POOL].num = pi->nr_if_pool_objtotal;
+	params[NETMAP_RING_POOL].size = pi->nr_ring_pool_objsize;
+	params[NETMAP_RING_POOL].num = pi->nr_ring_pool_objtotal;
+	params[NETMAP_BUF_POOL].size = pi->nr_buf_pool_objsize;
+	params[NETMAP_BUF_POOL].num = pi->nr_buf_pool_objtotal;
+	nme = _netmap_mem_private_new(sizeof(*nme), params,
+			&netmap_mem_ext_ops, &error);
 	if (nme == NULL)
 		goto out_unmap;
 
@@ -2275,6 +3639,8 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 		struct netmap_obj_pool *p = &nme->up.pools[i];
 		struct netmap_obj_params *o = &nme->up.params[i];
 
+		if (o->num == 0)
+			continue; /* no large buffers */
 		p->_objsize = o->size;
 		p->_clustsize = o->size;
 		p->_clustentries = 1;
@@ -2294,6 +3660,7 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 
 		if (nr_pages == 0) {
 			p->objtotal = 0;
+			p->objcap = 0;
 			p->memtotal = 0;
 			p->objfree = 0;
 			continue;
@@ -2336,6 +3703,7 @@ netmap_mem_ext_create(uint64_t usrptr, struct nmreq_pools_info *pi, int *perror)
 			off = noff;
 		}
 		p->objtotal = j;
+		p->objcap = j;
 		p->numclusters = p->objtotal;
 		p->memtotal = j * p->_objsize;
 		ND("%d memtotal %u", j, p->memtotal);
@@ -2569,6 +3937,7 @@ netmap_mem_pt_guest_finalize(struct netmap_mem_d *nmd)
 
 	ptnmd->buf_lut.objtotal = nbuffers;
 	ptnmd->buf_lut.objsize = bufsize;
+	ptnmd->buf_lut.lobjfirst = nbuffers;	/* no large buffers */
 	nmd->nm_totalsize = (unsigned int)mem_size;
 
 	/* Initialize these fields as are needed by
@@ -2760,6 +4129,7 @@ netmap_mem_pt_guest_create(nm_memid_t mem_id)
 	}
 
 	ptnmd->up.ops = &netmap_mem_pt_guest_ops;
+	ptnmd->up.nm_node = -1;
 	ptnmd->host_mem_id = mem_id;
 	ptnmd->pt_ifs = NULL;
 
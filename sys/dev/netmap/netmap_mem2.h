@@ -66,9 +66,11 @@
  * per cluster).
  *
  * Objects are aligned to the cache line (64 bytes) rounding up object
- * sizes when needed. A bitmap contains the state of each object.
- * Allocation scans the bitmap; this is done only on attach, so we are not
- * too worried about performance
+ * sizes when needed. A bitmap contains the state of each object,
+ * with summary levels on top of it (one bit per word of the level
+ * below), so that a free object is found in a few steps regardless
+ * of the size of the pool and of its occupancy. Buffers for the
+ * rings and the extra buffers are allocated in batches.
  *
  * For each allocator we can define (thorugh sysctl) the size and
  * number of each object. Memory is allocated at the first use of a
@@ -126,6 +128,11 @@ typedef uint16_t nm_memid_t;
 int	   netmap_mem_get_lut(struct netmap_mem_d *, struct netmap_lut *);
 nm_memid_t netmap_mem_get_id(struct netmap_mem_d *);
 vm_paddr_t netmap_mem_ofstophys(struct netmap_mem_d *, vm_ooffset_t);
+#ifdef linux
+u_int	   netmap_mem_ofs_pageshift(struct netmap_mem_d *, vm_ooffset_t);
+vm_paddr_t netmap_mem_ofs_cluster(struct netmap_mem_d *, vm_ooffset_t,
+		size_t *);
+#endif
 #ifdef _WIN32
 PMDL win32_build_user_vm_map(struct netmap_mem_d* nmd);
 #endif
@@ -153,6 +160,7 @@ unsigned netmap_mem_bufsize(struct netmap_mem_d *nmd);
 
 #ifdef WITH_EXTMEM
 struct netmap_mem_d* netmap_mem_ext_create(uint64_t, struct nmreq_pools_info *, int *);
+void netmap_mem_ext_persist(struct netmap_mem_d *, int);
 #else /* !WITH_EXTMEM */
 #define netmap_mem_ext_create(nmr, _perr) \
 	({ int *perr = _perr; if (perr) *(perr) = EOPNOTSUPP; NULL; })
@@ -169,10 +177,14 @@ int netmap_mem_pt_guest_ifp_del(struct netmap_mem_d *, struct ifnet *);
 
 int netmap_mem_pools_info_get(struct nmreq_pools_info *,
 				struct netmap_mem_d *);
+int netmap_mem_pools_stats_get(struct nmreq_pools_stats *,
+				struct netmap_adapter *);
+struct netmap_mem_d *netmap_mem_node_get(int node, int *perr);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
 #define NETMAP_MEM_EXT		0x10	/* external memory (not remappable) */
+#define NETMAP_MEM_HUGEPAGE	0x20	/* some pools are made of huge pages */
 
 uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
 
@@ -724,7 +724,6 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 		int free_slots, busy, sent = 0, m;
 		u_int lim = kring->nkr_num_slots - 1;
 		struct netmap_ring *ring = kring->ring, *mring = mkring->ring;
-		u_int max_len = NETMAP_BUF_SIZE(mkring->na);
 
 		mlim = mkring->nkr_num_slots - 1;
 
@@ -757,6 +756,7 @@ netmap_monitor_parent_sync(struct netmap_kring *kring, u_int first_new, int new_
 			struct netmap_slot *s = &ring->slot[beg];
 			struct netmap_slot *ms = &mring->slot[i];
 			u_int copy_len = s->len;
+			u_int max_len = NMB_SIZE(mkring->na, ms);
 			char *src = NMB(kring->na, s),
 			     *dst = NMB(mkring->na, ms);
 
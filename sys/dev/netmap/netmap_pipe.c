@@ -189,6 +189,7 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 	int m; /* slots to transfer */
 	int complete; /* did we see a complete packet ? */
 	struct netmap_ring *txring = txkring->ring, *rxring = rxkring->ring;
+	uint64_t now = 0; /* rx timestamp, if enabled */
 
 	ND("%p: %s %x -> %s", txkring, txkring->name, flags, rxkring->name);
 	ND(20, "TX before: hwcur %d hwtail %d cur %d head %d tail %d",
@@ -207,12 +208,17 @@ netmap_pipe_txsync(struct netmap_kring *txkring, int flags)
 		return 0;
 	}
 
+	if (nm_slot_ts_enabled(rxkring))
+		now = nm_os_realtime_ns();
+
 	for (k = txkring->nr_hwcur, nk = lim + 1, complete = 0; m;
 			m--, k = nm_next(k, lim), nk = (complete ? k : nk)) {
 		struct netmap_slot *rs = &rxring->slot[k];
 		struct netmap_slot *ts = &txring->slot[k];
 
 		*rs = *ts;
+		if (now)
+			rs->ptr = now;
 		if (ts->flags & NS_BUF_CHANGED) {
 			ts->flags &= ~NS_BUF_CHANGED;
 		}
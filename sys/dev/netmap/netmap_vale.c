@@ -107,6 +107,12 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NETMAP_MAX_FRAGS)
 /* NM_FT_NULL terminates a list of slots in the ft */
 #define NM_FT_NULL		NM_BDG_BATCH_MAX
+/* slots in the hash table used to find the queue of a destination
+ * (port, ring) within a batch. Must be a power of 2 larger than
+ * NM_BDG_BATCH_MAX, so that the table is never more than half full.
+ */
+#define NM_BDG_DSTHASH_BITS	12
+#define NM_BDG_DSTHASH		(1 << NM_BDG_DSTHASH_BITS)
 
 
 /*
@@ -115,10 +121,39 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * last packet in the block may overflow the size.
  */
 static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
+/*
+ * When bridge_zerocopy is set, unicast packets between ports that use
+ * the same memory allocator are not copied: the buffer of the source
+ * tx slot is exchanged with the one of the destination rx slot, and
+ * both slots are marked with NS_BUF_CHANGED. Senders must then
+ * re-read buf_idx of their tx slots after each txsync, so this is
+ * disabled by default.
+ */
+static int bridge_zerocopy = 0;
+/*
+ * When bridge_lease_lockfree is set, senders reserve slots on the
+ * destination rx ring with a compare-and-set and only take the
+ * q_lock to publish completed leases in order. When cleared, the
+ * same operations are serialized by the q_lock (useful as a
+ * baseline when measuring contention).
+ */
+static int bridge_lease_lockfree = 1;
+/*
+ * When bridge_mcast_snooping is set, learning bridges track the
+ * IGMP/MLD reports of their ports and forward multicast frames to
+ * the members of the group only (see struct nm_bdg_mcast).
+ */
+static int bridge_mcast_snooping = 1;
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0,
 		"Max batch size to be used in the bridge");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_zerocopy, CTLFLAG_RW,
+		&bridge_zerocopy, 0, "Swap buffers between ports sharing memory");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_lease_lockfree, CTLFLAG_RW,
+		&bridge_lease_lockfree, 0, "Reserve rx slots without the q_lock");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_mcast_snooping, CTLFLAG_RW,
+		&bridge_mcast_snooping, 0, "Forward multicast to group members only");
 SYSEND;
 
 static int netmap_vale_vp_create(struct nmreq_header *hdr, struct ifnet *,
@@ -131,20 +166,65 @@ static int netmap_vale_bwrap_attach(const char *, struct netmap_adapter *);
  * For each output interface, nm_vale_q is used to construct a list.
  * bq_len is the number of output buffers (we can have coalescing
  * during the copy).
+ * bq_dst identifies the destination as port * NM_BDG_MAXRINGS + ring,
+ * and bq_hslot is the entry of the destination hash that points
+ * to this queue. bq_mcast counts the packets of the broadcast queue
+ * that only go to the members of a multicast group.
  */
 struct nm_vale_q {
 	uint16_t bq_head;
 	uint16_t bq_tail;
 	uint32_t bq_len;	/* number of buffers */
+	uint32_t bq_dst;	/* destination port and ring */
+	uint16_t bq_hslot;	/* slot in the destination hash */
+	uint16_t bq_mcast;	/* multicast packets (broadcast queue) */
+};
+
+/* arguments and results of bdg_ops.lookup_batch() */
+struct nm_vale_lkup {
+	struct nm_bdg_fwd *lk_ft[NM_BDG_BATCH_MAX];
+	uint32_t lk_port[NM_BDG_BATCH_MAX];
+	uint16_t lk_idx[NM_BDG_BATCH_MAX];	/* packet index in ft */
+	uint8_t lk_ring[NM_BDG_BATCH_MAX];
+};
+
+/* datapath counters of a tx ring of a VALE port, reported by
+ * NETMAP_REQ_VALE_STATS_GET. Only the thread that owns the ring
+ * writes them, so they need no atomics.
+ */
+struct nm_vale_stats {
+	uint64_t fwd_pkts;
+	uint64_t fwd_bytes;
+	uint64_t brd_copies;
+	uint64_t mcast_saved;
+	uint64_t drop_nospace;
+	uint64_t drop_lookup;
+	uint64_t drop_hdr;
+	uint64_t batch[NR_VALE_BATCH_BUCKETS];
 };
 
+/* the counters are at the end of the scratch area of the ring */
+static __inline struct nm_vale_stats *
+nm_vale_ft_stats(struct nm_bdg_fwd *ft)
+{
+	struct nm_vale_q *dstq = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
+	uint16_t *dsthash = (uint16_t *)(dstq + NM_BDG_BATCH_MAX + 1);
+
+	return (struct nm_vale_stats *)
+		((struct nm_vale_lkup *)(dsthash + NM_BDG_DSTHASH) + 1);
+}
+
+static void netmap_vale_flowtab_free(void *);
+
 /* Holds the default callbacks */
 struct netmap_bdg_ops vale_bdg_ops = {
 	.lookup = netmap_vale_learning,
+	.lookup_batch = netmap_vale_learning_batch,
 	.config = NULL,
 	.dtor = NULL,
 	.vp_create = netmap_vale_vp_create,
 	.bwrap_attach = netmap_vale_bwrap_attach,
+	.flowtab_free = netmap_vale_flowtab_free,
 	.name = NM_BDG_NAME,
 };
 
@@ -201,6 +281,10 @@ nm_free_bdgfwd(struct netmap_adapter *na)
 
 /*
  * Allocate the forwarding tables for the rings attached to the bridge ports.
+ * The size does not depend on the number of ports in the bridge:
+ * a batch can reach at most one unicast destination per packet, so
+ * we only need NM_BDG_BATCH_MAX queues plus one for the broadcast
+ * traffic, and a small hash table to find them.
  */
 static int
 nm_alloc_bdgfwd(struct netmap_adapter *na)
@@ -209,17 +293,20 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 	struct netmap_kring **kring;
 
 	NMG_LOCK_ASSERT();
-	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
+	/* touched port:rings + broadcast */
+	num_dstq = NM_BDG_BATCH_MAX + 1;
 	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
 	l += sizeof(struct nm_vale_q) * num_dstq;
-	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
+	l += sizeof(uint16_t) * NM_BDG_DSTHASH;
+	l += sizeof(struct nm_vale_lkup);
+	l += sizeof(struct nm_vale_stats);
 
 	nrings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
 	for (i = 0; i < nrings; i++) {
 		struct nm_bdg_fwd *ft;
 		struct nm_vale_q *dstq;
+		uint16_t *dsthash;
 		int j;
 
 		ft = nm_os_malloc(l);
@@ -231,6 +318,11 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 		for (j = 0; j < num_dstq; j++) {
 			dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
 			dstq[j].bq_len = 0;
+			dstq[j].bq_mcast = 0;
+		}
+		dsthash = (uint16_t *)(dstq + num_dstq);
+		for (j = 0; j < NM_BDG_DSTHASH; j++) {
+			dsthash[j] = NM_FT_NULL;
 		}
 		kring[i]->nkr_ft = ft;
 	}
@@ -366,6 +458,11 @@ netmap_vale_list(struct nmreq_header *hdr)
 		NMG_LOCK();
 		for (error = ENOENT; i < NM_BRIDGES; i++) {
 			b = bridges + i;
+			if (b->bdg_ports == NULL) {
+				/* bridge not in use */
+				j = 0;
+				continue;
+			}
 			for ( ; j < NM_BDG_MAXPORTS; j++) {
 				if (b->bdg_ports[j] == NULL)
 					continue;
@@ -387,6 +484,213 @@ netmap_vale_list(struct nmreq_header *hdr)
 	return error;
 }
 
+/* Process NETMAP_REQ_VALE_FDB. */
+int
+netmap_vale_fdb(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_fdb *req =
+		(struct nmreq_vale_fdb *)(uintptr_t)hdr->nr_body;
+	struct nm_bridge *b;
+	struct nm_hash_tbl *ht;
+	uint32_t now = (uint32_t)time_second;
+	u_int i, j, full;
+	int error = 0;
+
+	if (strncmp(hdr->nr_name, NM_BDG_NAME, strlen(NM_BDG_NAME))) {
+		return EINVAL;
+	}
+	if (req->nr_flags & ~(NR_FDB_SET_SIZE | NR_FDB_SET_AGE | NR_FDB_FLUSH)) {
+		return EINVAL;
+	}
+
+	NMG_LOCK();
+	b = nm_find_bridge(hdr->nr_name, 0 /* don't create */, NULL);
+	if (!b) {
+		error = ENOENT;
+		goto unlock_fdb;
+	}
+	ht = b->ht;
+	if (req->nr_flags) {
+		if (!nm_bdg_valid_auth_token(b, NULL)) {
+			error = EACCES;
+			goto unlock_fdb;
+		}
+		if (b->private_data != ht &&
+		    (b->flowtab == NULL || b->private_data != b->flowtab)) {
+			/* the table is not in use, or not ours */
+			error = EBUSY;
+			goto unlock_fdb;
+		}
+	}
+	if (req->nr_flags & NR_FDB_SET_AGE) {
+		ht->max_age = req->nr_max_age > 0xffff ? 0xffff :
+			req->nr_max_age;
+	}
+	if (req->nr_flags & NR_FDB_SET_SIZE) {
+		if (req->nr_size == 0) {
+			error = EINVAL;
+			goto unlock_fdb;
+		}
+		error = nm_bdg_ht_resize(b, req->nr_size);
+		if (error)
+			goto unlock_fdb;
+	}
+	if (req->nr_flags & NR_FDB_FLUSH) {
+		BDG_WLOCK(b);
+		nm_bdg_ht_flush(ht);
+		BDG_WUNLOCK(b);
+	}
+
+	/* the datapath may be updating the table, so these
+	 * figures are only a snapshot */
+	req->nr_buckets = ht->mask + 1;
+	req->nr_ways = NM_BDG_HASH_WAYS;
+	req->nr_size = req->nr_buckets * NM_BDG_HASH_WAYS;
+	req->nr_max_age = ht->max_age;
+	req->nr_used = req->nr_expired = req->nr_full_buckets = 0;
+	for (i = 0; i <= ht->mask; i++) {
+		struct nm_hash_ent *e = &ht->buckets[i];
+
+		for (full = 1, j = 0; j < NM_BDG_HASH_WAYS; j++) {
+			if (NM_BDG_HT_PORT(e->mac[j]) == NM_BDG_NOPORT) {
+				full = 0;
+			} else if (nm_bdg_ht_expired(ht, e, j, now)) {
+				req->nr_expired++;
+			} else {
+				req->nr_used++;
+			}
+		}
+		req->nr_full_buckets += full;
+	}
+	req->nr_learned = ht->learned;
+	req->nr_moved = ht->moved;
+	req->nr_collisions = ht->collisions;
+
+unlock_fdb:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_REQ_VALE_DISPATCH. */
+int
+netmap_vale_dispatch(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_dispatch *req =
+		(struct nmreq_vale_dispatch *)(uintptr_t)hdr->nr_body;
+	struct netmap_adapter *na = NULL;
+	/* Build a nmreq_register out of the nmreq_vale_dispatch,
+	 * so that we can call netmap_get_vale_na(). */
+	struct nmreq_register regreq;
+	int error;
+
+	if ((req->nr_flags & NR_DISPATCH_SET) &&
+			req->nr_mode != NR_DISPATCH_SRC_RING &&
+			req->nr_mode != NR_DISPATCH_RXHASH) {
+		return EINVAL;
+	}
+	bzero(&regreq, sizeof(regreq));
+	regreq.nr_mode = NR_REG_ALL_NIC;
+	NMG_LOCK();
+	hdr->nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr->nr_body = (uintptr_t)&regreq;
+	error = netmap_get_vale_na(hdr, &na, NULL, 0 /* don't create */);
+	hdr->nr_reqtype = NETMAP_REQ_VALE_DISPATCH;
+	hdr->nr_body = (uintptr_t)req;
+	if (na && !error) {
+		struct netmap_vp_adapter *vpna =
+			(struct netmap_vp_adapter *)na;
+
+		if (req->nr_flags & NR_DISPATCH_SET) {
+			/* a flush running concurrently may still use the
+			 * old mode for this port, for one batch */
+			struct nm_bridge *b = vpna->na_bdg;
+
+			if (b)
+				BDG_WLOCK(b);
+			vpna->rx_dispatch = req->nr_mode;
+			if (b)
+				BDG_WUNLOCK(b);
+		}
+		req->nr_mode = vpna->rx_dispatch;
+		netmap_adapter_put(na);
+	} else if (!na) {
+		error = ENXIO;
+	}
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_REQ_VALE_STATS_GET. */
+int
+netmap_vale_stats_get(struct nmreq_header *hdr)
+{
+	struct nmreq_vale_stats *req =
+		(struct nmreq_vale_stats *)(uintptr_t)hdr->nr_body;
+	struct netmap_adapter *na = NULL;
+	struct nmreq_register regreq;
+	u_int i, k, first, last, nrings;
+	int error;
+
+	bzero(&regreq, sizeof(regreq));
+	regreq.nr_mode = NR_REG_ALL_NIC;
+	NMG_LOCK();
+	hdr->nr_reqtype = NETMAP_REQ_REGISTER;
+	hdr->nr_body = (uintptr_t)&regreq;
+	error = netmap_get_vale_na(hdr, &na, NULL, 0 /* don't create */);
+	hdr->nr_reqtype = NETMAP_REQ_VALE_STATS_GET;
+	hdr->nr_body = (uintptr_t)req;
+	if (!na) {
+		NMG_UNLOCK();
+		return error ? error : ENXIO;
+	}
+	if (error)
+		goto out;
+
+	nrings = netmap_real_rings(na, NR_TX);
+	if (req->nr_ring_id == NR_VALE_STATS_ALLRINGS) {
+		first = 0;
+		last = nrings;
+	} else if (req->nr_ring_id < nrings) {
+		first = req->nr_ring_id;
+		last = first + 1;
+	} else {
+		error = EINVAL;
+		goto out;
+	}
+	req->nr_tx_rings = nrings;
+	req->nr_fwd_pkts = req->nr_fwd_bytes = req->nr_brd_copies = 0;
+	req->nr_drop_nospace = req->nr_drop_lookup = req->nr_drop_hdr = 0;
+	req->nr_mcast_saved = 0;
+	bzero(req->nr_batch, sizeof(req->nr_batch));
+	/* the scratch areas only exist while the krings do, and
+	 * NMG_LOCK keeps them around. The counters are read while
+	 * the rings may be forwarding, so the result is approximate.
+	 */
+	for (i = first; na->tx_rings && i < last; i++) {
+		struct nm_bdg_fwd *ft = na->tx_rings[i]->nkr_ft;
+		struct nm_vale_stats *st;
+
+		if (ft == NULL)
+			continue;
+		st = nm_vale_ft_stats(ft);
+		req->nr_fwd_pkts += st->fwd_pkts;
+		req->nr_fwd_bytes += st->fwd_bytes;
+		req->nr_brd_copies += st->brd_copies;
+		req->nr_mcast_saved += st->mcast_saved;
+		req->nr_drop_nospace += st->drop_nospace;
+		req->nr_drop_lookup += st->drop_lookup;
+		req->nr_drop_hdr += st->drop_hdr;
+		for (k = 0; k < NR_VALE_BATCH_BUCKETS; k++)
+			req->nr_batch[k] += st->batch[k];
+		if (req->nr_flags & NR_VALE_STATS_RESET)
+			bzero(st, sizeof(*st));
+	}
+out:
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+	return error;
+}
+
 /* Process NETMAP_REQ_VALE_ATTACH.
  */
 int
@@ -560,10 +864,16 @@ static int
 netmap_vale_vp_krings_create(struct netmap_adapter *na)
 {
 	u_int tailroom;
-	int error, i;
+	int error, i, j;
 	uint32_t *leases;
 	u_int nrx = netmap_real_rings(na, NR_RX);
 
+	/* hwlease and lease_idx are packed in 16 bits each */
+	if (na->num_rx_desc > NM_LEASE_MAXSLOTS) {
+		nm_prerr("%s: too many rx slots (%u)", na->name,
+			na->num_rx_desc);
+		return EINVAL;
+	}
 	/*
 	 * Leases are attached to RX rings on vale ports
 	 */
@@ -577,6 +887,9 @@ netmap_vale_vp_krings_create(struct netmap_adapter *na)
 
 	for (i = 0; i < nrx; i++) { /* Receive rings */
 		na->rx_rings[i]->nkr_leases = leases;
+		/* a lease is pending until its entry is written */
+		for (j = 0; j < na->num_rx_desc; j++)
+			leases[j] = NR_NOSLOT;
 		leases += na->num_rx_desc;
 	}
 
@@ -601,7 +914,8 @@ netmap_vale_vp_krings_delete(struct netmap_adapter *na)
 
 static int
 nm_vale_flush(struct nm_bdg_fwd *ft, u_int n,
-	struct netmap_vp_adapter *na, u_int ring_nr);
+	struct netmap_vp_adapter *na, u_int ring_nr,
+	const struct nm_bdg_lookup *lu);
 
 
 /*
@@ -623,17 +937,36 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
 	struct nm_bridge *b = na->na_bdg;
+	const struct nm_bdg_lookup *lu;
+	int maysleep = na->up.na_flags & NAF_BDG_MAYSLEEP;
+#ifndef NM_BDG_NOEPOCH
+	BDG_EPOCH_T et;
+#endif /* !NM_BDG_NOEPOCH */
 
 	/* To protect against modifications to the bridge we acquire a
-	 * shared lock, waiting if we can sleep (if the source port is
-	 * attached to a user process) or with a trylock otherwise (NICs).
+	 * shared lock if we can sleep (if the source port is attached
+	 * to a user process, which may copy from NS_INDIRECT buffers).
+	 * Otherwise (NICs) we enter an epoch section, so that we never
+	 * wait nor skip the batch: writers wait for the end of the
+	 * section before reusing anything we may see (see netmap_bdg.h).
+	 * Without epoch support, we fall back to a trylock.
 	 */
 	ND("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
+	if (maysleep)
 		BDG_RLOCK(b);
+#ifndef NM_BDG_NOEPOCH
+	else
+		BDG_EPOCH_ENTER(et);
+#else /* NM_BDG_NOEPOCH */
 	else if (!BDG_RTRYLOCK(b))
 		return j;
+#endif /* NM_BDG_NOEPOCH */
 	ND(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	lu = NM_ACCESS_ONCE(b->bdg_lookup);
+	if (unlikely(lu == NULL)) {
+		/* a module is replacing its private data, retry later */
+		goto out;
+	}
 	ft = kring->nkr_ft;
 
 	for (; likely(j != end); j = nm_next(j, lim)) {
@@ -643,6 +976,8 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i].ft_len = slot->len;
 		ft[ft_i].ft_flags = slot->flags;
 		ft[ft_i].ft_offset = 0;
+		ft[ft_i].ft_slot = j;
+		ft[ft_i].ft_mgrp = 0;
 
 		ND("flags is 0x%x", slot->flags);
 		/* we do not use the buf changed flag, but we still need to reset it */
@@ -671,7 +1006,7 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
 		if (unlikely((int)ft_i >= bridge_batch))
-			ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
+			ft_i = nm_vale_flush(ft, ft_i, na, ring_nr, lu);
 	}
 	if (frags > 1) {
 		/* Here ft_i > 0, ft[ft_i-1].flags has NS_MOREFRAG, and we
@@ -682,53 +1017,355 @@ nm_vale_preflush(struct netmap_kring *kring, u_int end)
 		nm_prlim(5, "Truncate incomplete fragment at %d (%d frags)", ft_i, frags);
 	}
 	if (ft_i)
-		ft_i = nm_vale_flush(ft, ft_i, na, ring_nr);
+		ft_i = nm_vale_flush(ft, ft_i, na, ring_nr, lu);
+out:
+#ifndef NM_BDG_NOEPOCH
+	if (!maysleep) {
+		BDG_EPOCH_EXIT(et);
+		return j;
+	}
+#endif /* !NM_BDG_NOEPOCH */
 	BDG_RUNLOCK(b);
 	return j;
 }
 
 
-/* ----- FreeBSD if_bridge hash function ------- */
+/*
+ * Record that 'smac' was seen on 'port' at time 'now'.
+ * If the address is not in its bucket, take a free or expired
+ * way, or evict the least recently seen one.
+ */
+static void
+nm_vale_ht_learn(struct nm_hash_tbl *ht, uint64_t smac, uint32_t hash,
+		u_int port, uint32_t now)
+{
+	struct nm_hash_ent *e = &ht->buckets[hash & ht->mask];
+	uint64_t v = NM_BDG_HT_ENT(smac, port);
+	u_int i, victim = 0;
+	uint32_t oldest = 0;
+
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		if (NM_BDG_HT_PORT(e->mac[i]) != NM_BDG_NOPORT &&
+		    (e->mac[i] & NM_BDG_HASH_MACMASK) == smac) {
+			if (e->mac[i] != v) {
+				e->mac[i] = v;
+				ht->moved++;
+			}
+			if (e->epoch[i] != now)
+				e->epoch[i] = now;
+			return;
+		}
+	}
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		uint32_t age;
+
+		if (NM_BDG_HT_PORT(e->mac[i]) == NM_BDG_NOPORT ||
+		    nm_bdg_ht_expired(ht, e, i, now)) {
+			victim = i;
+			break;
+		}
+		age = now - e->epoch[i];
+		if (age >= oldest) {
+			oldest = age;
+			victim = i;
+		}
+	}
+	if (i == NM_BDG_HASH_WAYS)
+		ht->collisions++;
+	/* a reader may briefly see the new address with the old epoch */
+	e->epoch[victim] = now;
+	e->mac[victim] = v;
+	ht->learned++;
+}
+
+/* port of 'dmac', or NM_BDG_BROADCAST if unknown or expired */
+static __inline u_int
+nm_vale_ht_find(const struct nm_hash_tbl *ht, uint64_t dmac, uint32_t hash,
+		uint32_t now)
+{
+	const struct nm_hash_ent *e = &ht->buckets[hash & ht->mask];
+	u_int i;
+
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++) {
+		uint64_t m = NM_ACCESS_ONCE(e->mac[i]);
+
+		if (NM_BDG_HT_PORT(m) != NM_BDG_NOPORT &&
+		    (m & NM_BDG_HASH_MACMASK) == dmac) {
+			if (nm_bdg_ht_expired(ht, e, i, now))
+				break;
+			return NM_BDG_HT_PORT(m);
+		}
+	}
+	return NM_BDG_BROADCAST;
+}
 
 /*
- * The following hash function is adapted from "Hash Functions" by Bob Jenkins
- * ("Algorithm Alley", Dr. Dobbs Journal, September 1997).
- *
- * http://www.burtleburtle.net/bob/hash/spooky.html
+ * IGMP/MLD snooping, see struct nm_bdg_mcast.
+ * Multicast addresses are handled in the same format as dmac in the
+ * lookup, i.e. as loaded with le64toh() from the frame.
+ */
+static uint64_t
+nm_vale_mac(const uint8_t *m)
+{
+	return (uint64_t)m[0] | ((uint64_t)m[1] << 8) |
+		((uint64_t)m[2] << 16) | ((uint64_t)m[3] << 24) |
+		((uint64_t)m[4] << 32) | ((uint64_t)m[5] << 40);
+}
+
+/* ethernet address of IPv4 group a (01:00:5e + low 23 bits) */
+static uint64_t
+nm_vale_mcast_mac4(const uint8_t *a)
+{
+	uint8_t m[6] = { 0x01, 0x00, 0x5e, a[1] & 0x7f, a[2], a[3] };
+
+	return nm_vale_mac(m);
+}
+
+/* ethernet address of IPv6 group a (33:33 + low 32 bits) */
+static uint64_t
+nm_vale_mcast_mac6(const uint8_t *a)
+{
+	uint8_t m[6] = { 0x33, 0x33, a[12], a[13], a[14], a[15] };
+
+	return nm_vale_mac(m);
+}
+
+/* frames that always go to all ports: broadcast, non-IP multicast
+ * and the link-local groups 224.0.0.0/24 and ff02::/112, which
+ * are not reported by their members
  */
-#define mix(a, b, c)                                                    \
-do {                                                                    \
-	a -= b; a -= c; a ^= (c >> 13);                                 \
-	b -= c; b -= a; b ^= (a << 8);                                  \
-	c -= a; c -= b; c ^= (b >> 13);                                 \
-	a -= b; a -= c; a ^= (c >> 12);                                 \
-	b -= c; b -= a; b ^= (a << 16);                                 \
-	c -= a; c -= b; c ^= (b >> 5);                                  \
-	a -= b; a -= c; a ^= (c >> 3);                                  \
-	b -= c; b -= a; b ^= (a << 10);                                 \
-	c -= a; c -= b; c ^= (b >> 15);                                 \
-} while (/*CONSTCOND*/0)
+static __inline int
+nm_vale_mcast_flood(uint64_t dmac)
+{
+	if ((dmac & 0xffffff) == 0x5e0001)
+		return ((dmac >> 24) & 0xffff) == 0;
+	if ((dmac & 0xffff) == 0x3333)
+		return ((dmac >> 16) & 0xffffff) == 0;
+	return 1;
+}
+
+/* group index (1..NM_BDG_MCAST_GROUPS) of mac, or 0 if unknown */
+static u_int
+nm_vale_mcast_find(const struct nm_bdg_mcast *mc, uint64_t mac)
+{
+	u_int i, g, h = nm_bdg_rthash(mac);
+	uint64_t m;
+
+	for (i = 0; i < NM_BDG_MCAST_GROUPS; i++) {
+		g = (h + i) % NM_BDG_MCAST_GROUPS;
+		m = NM_ACCESS_ONCE(mc->mac[g]);
+		if (m == mac)
+			return g + 1;
+		if (m == 0)
+			break;
+	}
+	return 0;
+}
 
+/* start a new generation of p if the current one is over */
+static void
+nm_vale_mcast_rotate(struct nm_bdg_mcast_ports *p, uint32_t now)
+{
+	uint32_t age = now - p->epoch;
+	u_int i;
 
-static __inline uint32_t
-nm_vale_rthash(const uint8_t *addr)
+	if (age < NM_BDG_MCAST_PERIOD)
+		return;
+	for (i = 0; i < NM_BDG_MAXPORTS / 32; i++) {
+		p->prev[i] = age < 2 * NM_BDG_MCAST_PERIOD ? p->cur[i] : 0;
+		p->cur[i] = 0;
+	}
+	p->epoch = now;
+}
+
+static void
+nm_vale_mcast_set(struct nm_bdg_mcast_ports *p, u_int port, int join,
+		uint32_t now)
+{
+	uint32_t bit = 1U << (port % 32);
+
+	nm_vale_mcast_rotate(p, now);
+	if (join) {
+		p->cur[port / 32] |= bit;
+	} else {
+		p->cur[port / 32] &= ~bit;
+		p->prev[port / 32] &= ~bit;
+	}
+}
+
+/* a join or leave for group mac from port */
+static void
+nm_vale_mcast_report(struct nm_bdg_mcast *mc, uint64_t mac, u_int port,
+		int join, uint32_t now)
 {
-	uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0; // hask key
+	u_int i, g, h = nm_bdg_rthash(mac), victim = NM_BDG_MCAST_GROUPS;
+	struct nm_bdg_mcast_ports *p;
 
-	b += addr[5] << 8;
-	b += addr[4];
-	a += addr[3] << 24;
-	a += addr[2] << 16;
-	a += addr[1] << 8;
-	a += addr[0];
+	if (nm_vale_mcast_flood(mac))
+		return;
+	mtx_lock(&mc->lock);
+	for (i = 0; i < NM_BDG_MCAST_GROUPS; i++) {
+		g = (h + i) % NM_BDG_MCAST_GROUPS;
+		if (mc->mac[g] == mac)
+			break;
+		if (victim == NM_BDG_MCAST_GROUPS && (mc->mac[g] == 0 ||
+		    (now - mc->grp[g].epoch) >=
+		    2 * NM_BDG_MCAST_PERIOD))
+			victim = g;
+		if (mc->mac[g] == 0)
+			break;
+	}
+	if (i == NM_BDG_MCAST_GROUPS || mc->mac[g] != mac) {
+		/* new group, in the first free or expired slot.
+		 * If the table is full the group is flooded.
+		 */
+		if (!join || victim == NM_BDG_MCAST_GROUPS)
+			goto out;
+		g = victim;
+		p = &mc->grp[g];
+		memset(p->cur, 0, sizeof(p->cur));
+		memset(p->prev, 0, sizeof(p->prev));
+		p->epoch = now;
+		nm_stst_barrier();
+		mc->mac[g] = mac;
+	}
+	nm_vale_mcast_set(&mc->grp[g], port, join, now);
+out:
+	mtx_unlock(&mc->lock);
+}
 
-	mix(a, b, c);
-#define BRIDGE_RTHASH_MASK	(NM_BDG_HASH-1)
-	return (c & BRIDGE_RTHASH_MASK);
+static void
+nm_vale_mcast_router(struct nm_bdg_mcast *mc, u_int port, uint32_t now)
+{
+	mtx_lock(&mc->lock);
+	nm_vale_mcast_set(&mc->routers, port, 1, now);
+	mtx_unlock(&mc->lock);
 }
 
-#undef mix
+#define NM_VALE_GET16(p)	(((p)[0] << 8) | (p)[1])
+
+/*
+ * Parse an IGMP (v1-v3) or MLD (v1-v2) message sent by port.
+ * Queries mark the port as a multicast router, reports and leaves
+ * update the groups. Only the first fragment of the frame is looked at.
+ */
+static void
+nm_vale_mcast_snoop(struct nm_bdg_mcast *mc, const uint8_t *buf,
+		u_int len, u_int port, uint32_t now)
+{
+	const uint8_t *p;
+	u_int off = 12, type, n, i, rlen;
+
+	type = NM_VALE_GET16(buf + off);
+	if (type == 0x8100) { /* one VLAN tag */
+		off += 4;
+		if (len < off + 2)
+			return;
+		type = NM_VALE_GET16(buf + off);
+	}
+	off += 2;
+	if (type == 0x0800) {
+		if (len < off + 20 || (buf[off] >> 4) != 4 ||
+		    buf[off + 9] != 2 /* IGMP */ || (buf[off] & 0xf) < 5)
+			return;
+		off += (buf[off] & 0xf) * 4;
+		if (len < off + 8)
+			return;
+		p = buf + off;
+		switch (p[0]) {
+		case 0x11: /* query */
+			nm_vale_mcast_router(mc, port, now);
+			break;
+		case 0x12: /* v1 report */
+		case 0x16: /* v2 report */
+		case 0x17: /* v2 leave */
+			nm_vale_mcast_report(mc, nm_vale_mcast_mac4(p + 4),
+				port, p[0] != 0x17, now);
+			break;
+		case 0x22: /* v3 report */
+			n = NM_VALE_GET16(p + 6);
+			off += 8;
+			for (i = 0; i < n && len >= off + 8; i++, off += rlen) {
+				p = buf + off;
+				rlen = 8 + p[1] * 4 + NM_VALE_GET16(p + 2) * 4;
+				if (p[0] == 6) /* BLOCK_OLD_SOURCES */
+					continue;
+				/* INCLUDE of no sources is a leave */
+				nm_vale_mcast_report(mc,
+					nm_vale_mcast_mac4(p + 4), port,
+					!((p[0] == 1 || p[0] == 3) &&
+					  NM_VALE_GET16(p + 2) == 0), now);
+			}
+			break;
+		}
+	} else if (type == 0x86dd) {
+		if (len < off + 40 || (buf[off] >> 4) != 6)
+			return;
+		type = buf[off + 6];
+		off += 40;
+		if (type == 0) { /* hop-by-hop options, with router alert */
+			if (len < off + 8)
+				return;
+			type = buf[off];
+			off += (buf[off + 1] + 1) * 8;
+		}
+		if (type != 58 /* ICMPv6 */ || len < off + 8)
+			return;
+		p = buf + off;
+		switch (p[0]) {
+		case 130: /* query */
+			nm_vale_mcast_router(mc, port, now);
+			break;
+		case 131: /* v1 report */
+		case 132: /* v1 done */
+			if (len < off + 24)
+				return;
+			nm_vale_mcast_report(mc, nm_vale_mcast_mac6(p + 8),
+				port, p[0] == 131, now);
+			break;
+		case 143: /* v2 report */
+			n = NM_VALE_GET16(p + 6);
+			off += 8;
+			for (i = 0; i < n && len >= off + 20; i++, off += rlen) {
+				p = buf + off;
+				rlen = 20 + p[1] * 4 + NM_VALE_GET16(p + 2) * 16;
+				if (p[0] == 6)
+					continue;
+				nm_vale_mcast_report(mc,
+					nm_vale_mcast_mac6(p + 4), port,
+					!((p[0] == 1 || p[0] == 3) &&
+					  NM_VALE_GET16(p + 2) == 0), now);
+			}
+			break;
+		}
+	}
+}
 
+/* destination of a multicast or broadcast frame sent by port,
+ * always NM_BDG_BROADCAST. For a known group g, ft_mgrp is set to g.
+ */
+static u_int
+nm_vale_mcast_dst(struct nm_hash_tbl *ht, struct nm_bdg_fwd *ft,
+		uint64_t dmac, u_int port, uint32_t now)
+{
+	struct nm_bdg_mcast *mc = ht->mcast;
+	u_int g;
+
+	if (mc == NULL || !bridge_mcast_snooping)
+		return NM_BDG_BROADCAST;
+	if (!(ft->ft_flags & NS_INDIRECT))
+		nm_vale_mcast_snoop(mc, (uint8_t *)ft->ft_buf + ft->ft_offset,
+			ft->ft_len - ft->ft_offset, port, now);
+	if (nm_vale_mcast_flood(dmac))
+		return NM_BDG_BROADCAST;
+	g = nm_vale_mcast_find(mc, dmac);
+	/* groups with no members for two periods are flooded */
+	if (g == 0 || (now - NM_ACCESS_ONCE(mc->grp[g - 1].epoch)) >=
+			2 * NM_BDG_MCAST_PERIOD)
+		return NM_BDG_BROADCAST;
+	ft->ft_mgrp = g;
+	return NM_BDG_BROADCAST;
+}
 
 /*
  * Lookup function for a learning bridge.
@@ -742,10 +1379,10 @@ netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 {
 	uint8_t *buf = ((uint8_t *)ft->ft_buf) + ft->ft_offset;
 	u_int buf_len = ft->ft_len - ft->ft_offset;
-	struct nm_hash_ent *ht = private_data;
-	uint32_t sh, dh;
+	struct nm_hash_tbl *ht = private_data;
 	u_int dst, mysrc = na->bdg_port;
 	uint64_t smac, dmac;
+	uint32_t now = (uint32_t)time_second;
 	uint8_t indbuf[12];
 
 	if (buf_len < 14) {
@@ -759,220 +1396,1298 @@ netmap_vale_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		buf = indbuf;
 	}
 
-	dmac = le64toh(*(uint64_t *)(buf)) & 0xffffffffffff;
+	dmac = le64toh(*(uint64_t *)(buf)) & NM_BDG_HASH_MACMASK;
 	smac = le64toh(*(uint64_t *)(buf + 4));
 	smac >>= 16;
 
 	/*
-	 * The hash is somewhat expensive, there might be some
-	 * worthwhile optimizations here.
+	 * Refresh the source entry only when the address changes,
+	 * or once per second to keep it from expiring.
 	 */
-	if (((buf[6] & 1) == 0) && (na->last_smac != smac)) { /* valid src */
+	if (((buf[6] & 1) == 0) && (na->last_smac != smac ||
+			na->last_smac_epoch != now)) { /* valid src */
 		uint8_t *s = buf+6;
-		sh = nm_vale_rthash(s); /* hash of source */
-		/* update source port forwarding entry */
-		na->last_smac = ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
+		nm_vale_ht_learn(ht, smac, nm_bdg_rthash(smac), mysrc, now);
+		na->last_smac = smac;
+		na->last_smac_epoch = now;
 		if (netmap_debug & NM_DEBUG_VALE)
 		    nm_prinf("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
 			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
 	}
-	dst = NM_BDG_BROADCAST;
 	if ((buf[0] & 1) == 0) { /* unicast */
-		dh = nm_vale_rthash(buf); /* hash of dst */
-		if (ht[dh].mac == dmac) {	/* found dst */
-			dst = ht[dh].ports;
-		}
+		dst = nm_vale_ht_find(ht, dmac, nm_bdg_rthash(dmac), now);
+	} else {
+		dst = nm_vale_mcast_dst(ht, ft, dmac, mysrc, now);
 	}
 	return dst;
 }
 
-
 /*
- * Available space in the ring. Only used in VALE code
- * and only with is_rx = 1
+ * Batched version of netmap_vale_learning().
+ * Packets are processed in chunks of NM_VALE_LK_CHUNK: first we load
+ * all the addresses, then we hash them in a tight loop with no
+ * memory accesses and prefetch the buckets, and only then we walk
+ * the table, so that the cache misses of a chunk overlap.
  */
-static inline uint32_t
-nm_kr_space(struct netmap_kring *k, int is_rx)
+#define NM_VALE_LK_CHUNK	16
+#define NM_VALE_LK_DROP		0x1	/* runt or unreadable frame */
+#define NM_VALE_LK_SRC		0x2	/* valid source address */
+#define NM_VALE_LK_UCAST	0x4	/* unicast destination */
+
+void
+netmap_vale_learning_batch(struct nm_bdg_fwd **ft, u_int n,
+		uint32_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na, void *private_data)
 {
-	int space;
+	struct nm_hash_tbl *ht = private_data;
+	u_int base, c, k, mysrc = na->bdg_port;
+	uint32_t now = (uint32_t)time_second;
+	uint64_t smac[NM_VALE_LK_CHUNK], dmac[NM_VALE_LK_CHUNK];
+	uint32_t sh[NM_VALE_LK_CHUNK], dh[NM_VALE_LK_CHUNK];
+	uint8_t fl[NM_VALE_LK_CHUNK];
+
+	for (base = 0; base < n; base += c) {
+		c = n - base;
+		if (c > NM_VALE_LK_CHUNK)
+			c = NM_VALE_LK_CHUNK;
+
+		for (k = 0; k < c; k++) {
+			struct nm_bdg_fwd *f = ft[base + k];
+			uint8_t *buf = ((uint8_t *)f->ft_buf) + f->ft_offset;
+			uint8_t indbuf[12];
+
+			smac[k] = dmac[k] = 0;
+			if (f->ft_len - f->ft_offset < 14) {
+				fl[k] = NM_VALE_LK_DROP;
+				continue;
+			}
+			if (f->ft_flags & NS_INDIRECT) {
+				if (copyin(buf, indbuf, sizeof(indbuf))) {
+					fl[k] = NM_VALE_LK_DROP;
+					continue;
+				}
+				buf = indbuf;
+			}
+			dmac[k] = le64toh(*(uint64_t *)(buf)) &
+				NM_BDG_HASH_MACMASK;
+			smac[k] = le64toh(*(uint64_t *)(buf + 4)) >> 16;
+			fl[k] = ((buf[6] & 1) ? 0 : NM_VALE_LK_SRC) |
+				((buf[0] & 1) ? 0 : NM_VALE_LK_UCAST);
+		}
 
-	if (is_rx) {
-		int busy = k->nkr_hwlease - k->nr_hwcur;
-		if (busy < 0)
-			busy += k->nkr_num_slots;
-		space = k->nkr_num_slots - 1 - busy;
-	} else {
-		/* XXX never used in this branch */
-		space = k->nr_hwtail - k->nkr_hwlease;
-		if (space < 0)
-			space += k->nkr_num_slots;
-	}
-#if 0
-	// sanity check
-	if (k->nkr_hwlease >= k->nkr_num_slots ||
-		k->nr_hwcur >= k->nkr_num_slots ||
-		k->nr_tail >= k->nkr_num_slots ||
-		busy < 0 ||
-		busy >= k->nkr_num_slots) {
-		D("invalid kring, cur %d tail %d lease %d lease_idx %d lim %d",			k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
-			k->nkr_lease_idx, k->nkr_num_slots);
-	}
-#endif
-	return space;
-}
+		for (k = 0; k < c; k++) {
+			sh[k] = nm_bdg_rthash(smac[k]);
+			dh[k] = nm_bdg_rthash(dmac[k]);
+		}
+
+		for (k = 0; k < c; k++) {
+			__builtin_prefetch(&ht->buckets[dh[k] & ht->mask]);
+		}
 
+		for (k = 0; k < c; k++) {
+			uint32_t *dst = &dst_port[base + k];
 
+			if (fl[k] & NM_VALE_LK_DROP) {
+				*dst = NM_BDG_NOPORT;
+				continue;
+			}
+			if ((fl[k] & NM_VALE_LK_SRC) &&
+			    (na->last_smac != smac[k] ||
+			     na->last_smac_epoch != now)) {
+				nm_vale_ht_learn(ht, smac[k], sh[k], mysrc,
+					now);
+				na->last_smac = smac[k];
+				na->last_smac_epoch = now;
+			}
+			*dst = (fl[k] & NM_VALE_LK_UCAST) ?
+				nm_vale_ht_find(ht, dmac[k], dh[k], now) :
+				nm_vale_mcast_dst(ht, ft[base + k], dmac[k],
+					mysrc, now);
+		}
+	}
+}
 
 
-/* make a lease on the kring for N positions. return the
- * lease index
- * XXX only used in VALE code and with is_rx = 1
+/*
+ * Available space in the ring, given a snapshot of nkr_lease_state.
+ * Only used in VALE code, on rx rings. nr_hwcur may be advanced
+ * concurrently by rxsync, a stale value only underestimates the space.
  */
 static inline uint32_t
-nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
+nm_kr_space(struct netmap_kring *k, uint32_t state)
 {
-	uint32_t lim = k->nkr_num_slots - 1;
-	uint32_t lease_idx = k->nkr_lease_idx;
+	int busy = NM_LEASE_HW(state) - NM_ACCESS_ONCE(k->nr_hwcur);
 
-	k->nkr_leases[lease_idx] = NR_NOSLOT;
-	k->nkr_lease_idx = nm_next(lease_idx, lim);
+	if (busy < 0)
+		busy += k->nkr_num_slots;
+	return k->nkr_num_slots - 1 - busy;
+}
 
-#ifdef CONFIG_NETMAP_DEBUG
-	if (n > nm_kr_space(k, is_rx)) {
-		nm_prerr("invalid request for %d slots", n);
-		panic("x");
-	}
-#endif /* CONFIG NETMAP_DEBUG */
-	/* XXX verify that there are n slots */
-	k->nkr_hwlease += n;
-	if (k->nkr_hwlease > lim)
-		k->nkr_hwlease -= lim + 1;
+
+/* make a lease on the kring for up to n positions. Returns the
+ * number of slots actually reserved (possibly 0), the first one in
+ * *start, and the lease index where completion must be reported.
+ * hwlease and lease_idx move together with a single compare-and-set,
+ * so this may run with or without the q_lock.
+ * XXX only used in VALE code, on rx rings.
+ */
+static inline u_int
+nm_kr_lease(struct netmap_kring *k, u_int n, uint32_t *start,
+	uint32_t *lease_idx)
+{
+	uint32_t lim = k->nkr_num_slots - 1;
+	uint32_t old, hw, idx;
+	u_int howmany;
+
+	do {
+		old = k->nkr_lease_state;
+		hw = NM_LEASE_HW(old);
+		idx = NM_LEASE_IDX(old);
+		howmany = nm_kr_space(k, old);
+		if (n < howmany)
+			howmany = n;
+		hw += howmany;
+		if (hw > lim)
+			hw -= lim + 1;
+	} while (!NM_ATOMIC_CMPSET32(&k->nkr_lease_state, old,
+			NM_LEASE_MK(nm_next(idx, lim), hw)));
 
 #ifdef CONFIG_NETMAP_DEBUG
-	if (k->nkr_hwlease >= k->nkr_num_slots ||
+	if (hw >= k->nkr_num_slots ||
 		k->nr_hwcur >= k->nkr_num_slots ||
 		k->nr_hwtail >= k->nkr_num_slots ||
-		k->nkr_lease_idx >= k->nkr_num_slots) {
+		k->nkr_leases[idx] != NR_NOSLOT) {
 		nm_prerr("invalid kring %s, cur %d tail %d lease %d lease_idx %d lim %d",
 			k->na->name,
-			k->nr_hwcur, k->nr_hwtail, k->nkr_hwlease,
-			k->nkr_lease_idx, k->nkr_num_slots);
+			k->nr_hwcur, k->nr_hwtail, hw,
+			idx, k->nkr_num_slots);
 	}
 #endif /* CONFIG_NETMAP_DEBUG */
-	return lease_idx;
+	*start = NM_LEASE_HW(old);
+	*lease_idx = idx;
+	return howmany;
 }
 
-/*
- *
- * This flush routine supports only unicast and broadcast but a large
- * number of ports, and lets us replace the learn and dispatch functions.
+/* give back the unused tail [j, end) of lease lease_idx.
+ * This only succeeds if no other lease has been made in the meantime,
+ * otherwise the caller must fill the slots with empty packets.
  */
-int
-nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
-		u_int ring_nr)
+static inline int
+nm_kr_lease_rollback(struct netmap_kring *k, uint32_t lease_idx,
+	uint32_t j, uint32_t end)
 {
-	struct nm_vale_q *dst_ents, *brddst;
-	uint16_t num_dsts = 0, *dsts;
-	struct nm_bridge *b = na->na_bdg;
-	u_int i, me = na->bdg_port;
+	uint32_t next = nm_next(lease_idx, k->nkr_num_slots - 1);
 
-	/*
-	 * The work area (pointed by ft) is followed by an array of
-	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
-	 */
-	dst_ents = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
+	return NM_ATOMIC_CMPSET32(&k->nkr_lease_state,
+		NM_LEASE_MK(next, end), NM_LEASE_MK(next, j));
+}
 
-	/* first pass: find a destination for each packet in the batch */
-	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
-		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
-		uint16_t dst_port, d_i;
-		struct nm_vale_q *d;
-		struct nm_bdg_fwd *start_ft = NULL;
+/* merge the completed leases, in order, starting from nkr_lease_head,
+ * and advance nr_hwtail accordingly. Must be called under the q_lock.
+ * Returns 1 if nr_hwtail has moved.
+ */
+static inline int
+nm_kr_lease_complete(struct netmap_kring *k)
+{
+	uint32_t lim = k->nkr_num_slots - 1;
+	uint32_t *p = k->nkr_leases;
+	uint32_t head = k->nkr_lease_head;
+	uint32_t last = NM_LEASE_IDX(k->nkr_lease_state);
+	uint32_t j = k->nr_hwtail;
+
+	while (head != last && p[head] != NR_NOSLOT) {
+		j = p[head];
+		p[head] = NR_NOSLOT;
+		head = nm_next(head, lim);
+	}
+	k->nkr_lease_head = head;
+	if (j == k->nr_hwtail)
+		return 0;
+	k->nr_hwtail = j;
+	return 1;
+}
 
-		ND("slot %d frags %d", i, ft[i].ft_frags);
+/* hash of a destination (port * NM_BDG_MAXRINGS + ring) */
+static inline u_int
+nm_vale_dsthash(uint32_t d_i)
+{
+	return (d_i * 2654435761U) >> (32 - NM_BDG_DSTHASH_BITS);
+}
 
-		if (na->up.virt_hdr_len < ft[i].ft_len) {
-			ft[i].ft_offset = na->up.virt_hdr_len;
-			start_ft = &ft[i];
-		} else if (na->up.virt_hdr_len == ft[i].ft_len && ft[i].ft_flags & NS_MOREFRAG) {
-			ft[i].ft_offset = ft[i].ft_len;
-			start_ft = &ft[i+1];
-		} else {
-			/* Drop the packet if the virtio-net header is not into the first
-			 * fragment nor at the very beginning of the second.
-			 */
-			continue;
-		}
-		dst_port = b->bdg_ops.lookup(start_ft, &dst_ring, na, b->private_data);
-		if (netmap_verbose > 255)
-			RD(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port >= NM_BDG_NOPORT)
-			continue; /* this packet is identified to be dropped */
-		else if (dst_port == NM_BDG_BROADCAST)
-			dst_ring = 0; /* broadcasts always go to ring 0 */
-		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
-			continue;
+/*
+ * Look up the queue of destination d_i in the current batch.
+ * If the destination is not there and num_dsts is not NULL,
+ * the next free queue in dst_ents is assigned to it.
+ * Otherwise return NULL.
+ */
+static inline struct nm_vale_q *
+nm_vale_dst_lookup(struct nm_vale_q *dst_ents, uint16_t *dsthash,
+		uint32_t d_i, u_int *num_dsts)
+{
+	u_int h = nm_vale_dsthash(d_i);
+	uint16_t q;
 
-		/* get a position in the scratch pad */
-		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
-		d = dst_ents + d_i;
-
-		/* append the first fragment to the list */
-		if (d->bq_head == NM_FT_NULL) { /* new destination */
-			d->bq_head = d->bq_tail = i;
-			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
-				dsts[num_dsts++] = d_i;
-		} else {
-			ft[d->bq_tail].ft_next = i;
-			d->bq_tail = i;
-		}
-		d->bq_len += ft[i].ft_frags;
+	while ((q = dsthash[h]) != NM_FT_NULL) {
+		if (dst_ents[q].bq_dst == d_i)
+			return dst_ents + q;
+		h = (h + 1) & (NM_BDG_DSTHASH - 1);
 	}
+	if (num_dsts == NULL)
+		return NULL;
+	q = (*num_dsts)++;
+	dsthash[h] = q;
+	dst_ents[q].bq_dst = d_i;
+	dst_ents[q].bq_hslot = h;
+	return dst_ents + q;
+}
 
-	/*
-	 * Broadcast traffic goes to ring 0 on all destinations.
-	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
-	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
-	if (brddst->bq_head != NM_FT_NULL) {
-		u_int j;
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
-			uint16_t d_i;
-			i = b->bdg_port_index[j];
-			if (unlikely(i == me))
-				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
-				dsts[num_dsts++] = d_i;
-		}
+/* Never hand out the reserved buffers 0 and 1, or an invalid
+ * index set by the user of either port, to the other port.
+ * Nor a buffer that is not of the class of its ring, which the user
+ * may have put there: the other ring would get a mixed class.
+ */
+static __inline int
+nm_vale_swappable(struct netmap_kring *kring, struct netmap_slot *slot)
+{
+	return slot->buf_idx >= 2 && NMB_VALID(kring->na, slot->buf_idx) &&
+		NMB_SIZE(kring->na, slot) == NETMAP_KRING_BUF_SIZE(kring);
+}
+
+/*
+ * Skip the virtio-net header of packet i, returning the fragment
+ * where the frame starts, or NULL if the packet must be dropped
+ * because the header is not into the first fragment nor at the
+ * very beginning of the second.
+ */
+static __inline struct nm_bdg_fwd *
+nm_vale_pkt_start(struct netmap_vp_adapter *na, struct nm_bdg_fwd *ft, u_int i)
+{
+	ND("slot %d frags %d", i, ft[i].ft_frags);
+	if (na->up.virt_hdr_len < ft[i].ft_len) {
+		ft[i].ft_offset = na->up.virt_hdr_len;
+		return &ft[i];
+	} else if (na->up.virt_hdr_len == ft[i].ft_len &&
+			ft[i].ft_flags & NS_MOREFRAG) {
+		ft[i].ft_offset = ft[i].ft_len;
+		return &ft[i+1];
+	}
+	return NULL;
+}
+
+/* finalization mix of MurmurHash3 */
+static __inline uint32_t
+nm_vale_fmix(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/*
+ * Symmetric flow hash of the frame starting at ft, used to select
+ * the rx ring of ports in NR_DISPATCH_RXHASH mode. Addresses and
+ * ports are combined with xor, so that both directions of a flow
+ * get the same value. IP fragments are hashed without ports, so
+ * that all the fragments of a datagram stay together. Frames that
+ * are not IP are hashed on the MAC addresses.
+ */
+static uint32_t
+nm_vale_rxhash(const struct nm_bdg_fwd *ft)
+{
+	const uint8_t *buf = (const uint8_t *)ft->ft_buf + ft->ft_offset;
+	u_int len = ft->ft_len - ft->ft_offset, l3 = 14, l4;
+	uint32_t h, ports = 0;
+	uint16_t type;
+	uint8_t proto;
+
+	if ((ft->ft_flags & NS_INDIRECT) || len < 14)
+		return 0;
+	type = (buf[12] << 8) | buf[13];
+	if (type == 0x8100 && len >= 18) { /* skip one VLAN tag */
+		type = (buf[16] << 8) | buf[17];
+		l3 = 18;
+	}
+	if (type == 0x0800 && len >= l3 + 20) { /* IPv4 */
+		const uint8_t *ip = buf + l3;
+
+		h = *(const uint32_t *)(ip + 12) ^ *(const uint32_t *)(ip + 16);
+		proto = ip[9];
+		l4 = l3 + ((ip[0] & 0xf) << 2);
+		if ((ip[6] & 0x3f) | ip[7]) /* MF or fragment offset */
+			l4 = len;
+	} else if (type == 0x86dd && len >= l3 + 40) { /* IPv6 */
+		const uint32_t *a = (const uint32_t *)(buf + l3 + 8);
+
+		h = a[0] ^ a[1] ^ a[2] ^ a[3] ^ a[4] ^ a[5] ^ a[6] ^ a[7];
+		proto = buf[l3 + 6];
+		l4 = l3 + 40;
+	} else {
+		h = *(const uint32_t *)buf ^ *(const uint32_t *)(buf + 6) ^
+			(((buf[4] << 8) | buf[5]) ^ ((buf[10] << 8) | buf[11]));
+		return nm_vale_fmix(h);
+	}
+	/* TCP, UDP, SCTP and UDP-Lite have the ports in the same place */
+	if ((proto == 6 || proto == 17 || proto == 132 || proto == 136) &&
+			len >= l4 + 4) {
+		ports = *(const uint16_t *)(buf + l4) ^
+			*(const uint16_t *)(buf + l4 + 2);
+	}
+	return nm_vale_fmix(h ^ ports ^ proto);
+}
+
+/* number of rx rings used by NR_DISPATCH_RXHASH on a port */
+static __inline u_int
+nm_vale_nrxrings(const struct netmap_vp_adapter *vpna)
+{
+	u_int n = vpna->up.num_rx_rings;
+
+	return n > NM_BDG_MAXRINGS ? NM_BDG_MAXRINGS : n;
+}
+
+/*
+ * Exact match flow table, the built-in alternative to the learning
+ * bridge (see struct nm_vale_flow_cfg in netmap.h).
+ * The key of a packet is made of the IP addresses (IPv4 is mapped
+ * into IPv6), the TCP/UDP/SCTP ports and the protocol. The table is
+ * a bucketized cuckoo hash: a key can live in either of two buckets
+ * of NM_VALE_FLOW_WAYS entries, and the alternate bucket is computed
+ * from the bucket and a 16-bit tag of the key, so that entries can
+ * be moved without looking at their keys. Lookups first compare the
+ * tags, which for a bucket fit in a fraction of a cache line.
+ *
+ * Changes are made under NMG_LOCK. The datapath does not lock:
+ * writers make fl_seq odd while they change the table, and readers
+ * repeat the lookups that overlapped a change. After a few attempts
+ * readers take fl_lock, which writers hold while fl_seq is odd, so
+ * that a busy writer cannot make packets bypass their flows.
+ */
+#define NM_VALE_FLOW_WAYS	8
+#define NM_VALE_FLOW_MAX	(1 << 20)
+#define NM_VALE_FLOW_KICKS	64	/* max length of a cuckoo path */
+#define NM_VALE_FLOW_RETRY	4	/* lookups overlapping a change */
+#define NM_VALE_FLOW_KEYW	10
+
+struct nm_vale_fkey {
+	/* src[4], dst[4], ports (as in the packet), protocol */
+	uint32_t	w[NM_VALE_FLOW_KEYW];
+};
+
+struct nm_vale_fent {
+	struct nm_vale_fkey key;
+	uint16_t	port;
+	uint8_t		ring;
+	uint8_t		pad;
+};
+
+struct nm_vale_fbkt {
+	uint16_t	tag[NM_VALE_FLOW_WAYS];	/* 0 means free */
+};
+
+struct nm_vale_flowtab {
+	struct nm_vale_fbkt *bkt;
+	struct nm_vale_fent *ent;	/* NM_VALE_FLOW_WAYS per bucket */
+	uint32_t	mask;		/* number of buckets - 1 */
+	uint32_t	size;		/* max number of flows */
+	uint32_t	used;
+	volatile uint32_t fl_seq;	/* odd while the table changes */
+	struct mtx	fl_lock;	/* held by writers, see above */
+	uint32_t	victim;		/* next way evicted by cuckoo moves */
+	struct nm_hash_tbl *ht;		/* for the packets that miss */
+	/* updated by concurrent senders, only approximate */
+	uint64_t	hits;
+	uint64_t	misses;
+};
+
+/* fill in the key of the frame starting at ft, return 0 if not IP */
+static int
+nm_vale_flow_key(const struct nm_bdg_fwd *ft, struct nm_vale_fkey *k)
+{
+	const uint8_t *buf = (const uint8_t *)ft->ft_buf + ft->ft_offset;
+	u_int len = ft->ft_len - ft->ft_offset, l3 = 14, l4;
+	uint16_t type;
+	uint8_t proto;
+
+	if ((ft->ft_flags & NS_INDIRECT) || len < 14)
+		return 0;
+	type = (buf[12] << 8) | buf[13];
+	if (type == 0x8100 && len >= 18) { /* skip one VLAN tag */
+		type = (buf[16] << 8) | buf[17];
+		l3 = 18;
+	}
+	if (type == 0x0800 && len >= l3 + 20) { /* IPv4 */
+		const uint8_t *ip = buf + l3;
+
+		k->w[0] = k->w[1] = k->w[4] = k->w[5] = 0;
+		k->w[2] = k->w[6] = htonl(0xffff);
+		k->w[3] = *(const uint32_t *)(ip + 12);
+		k->w[7] = *(const uint32_t *)(ip + 16);
+		proto = ip[9];
+		l4 = l3 + ((ip[0] & 0xf) << 2);
+		if ((ip[6] & 0x3f) | ip[7]) /* MF or fragment offset */
+			l4 = len;
+	} else if (type == 0x86dd && len >= l3 + 40) { /* IPv6 */
+		memcpy(k->w, buf + l3 + 8, 32);
+		proto = buf[l3 + 6];
+		l4 = l3 + 40;
+	} else {
+		return 0;
+	}
+	k->w[8] = 0;
+	if ((proto == 6 || proto == 17 || proto == 132 || proto == 136) &&
+			len >= l4 + 4)
+		k->w[8] = *(const uint32_t *)(buf + l4);
+	k->w[9] = proto;
+	return 1;
+}
+
+/* MurmurHash3 of a key */
+static __inline uint32_t
+nm_vale_flow_hash(const struct nm_vale_fkey *k)
+{
+	uint32_t h = 0, c;
+	u_int i;
+
+	for (i = 0; i < NM_VALE_FLOW_KEYW; i++) {
+		c = k->w[i] * 0xcc9e2d51;
+		c = (c << 15) | (c >> 17);
+		h ^= c * 0x1b873593;
+		h = (h << 13) | (h >> 19);
+		h = h * 5 + 0xe6546b64;
+	}
+	return nm_vale_fmix(h ^ sizeof(*k));
+}
+
+/* tag of a key with hash h, never 0 */
+static __inline uint16_t
+nm_vale_flow_tag(uint32_t h)
+{
+	uint16_t tag = h >> 16;
+
+	return tag ? tag : 1;
+}
+
+/* the other bucket of a key with the given tag in bucket b */
+static __inline uint32_t
+nm_vale_flow_alt(const struct nm_vale_flowtab *fl, uint32_t b, uint16_t tag)
+{
+	return (b ^ (nm_vale_fmix(tag) | 1)) & fl->mask;
+}
+
+static __inline int
+nm_vale_fkey_eq(const struct nm_vale_fkey *a, const struct nm_vale_fkey *b)
+{
+	u_int i;
+
+	for (i = 0; i < NM_VALE_FLOW_KEYW; i++) {
+		if (a->w[i] != b->w[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* entry of key k in bucket b, or NULL */
+static __inline struct nm_vale_fent *
+nm_vale_flow_find(const struct nm_vale_flowtab *fl, uint32_t b, uint16_t tag,
+		const struct nm_vale_fkey *k)
+{
+	const struct nm_vale_fbkt *bk = &fl->bkt[b];
+	u_int w;
+
+	for (w = 0; w < NM_VALE_FLOW_WAYS; w++) {
+		struct nm_vale_fent *e = &fl->ent[b * NM_VALE_FLOW_WAYS + w];
+
+		if (bk->tag[w] == tag && nm_vale_fkey_eq(&e->key, k))
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Look up keys k[0..n-1], with hashes h[], under the sequence
+ * counter. Keys with ip[i] == 0 (frames that are not IP) are skipped.
+ * On return res[i] is the port and ring of the matching flow
+ * ((port << 8) | ring), or 0xffffffff for a miss. Returns 0
+ * if a writer changed the table in the meantime.
+ */
+static int
+nm_vale_flow_lookup_keys(const struct nm_vale_flowtab *fl,
+		const struct nm_vale_fkey *k, const uint32_t *h,
+		const uint8_t *ip, u_int n, uint32_t *res)
+{
+	uint32_t seq = NM_ACCESS_ONCE(fl->fl_seq);
+	u_int i;
+
+	if (seq & 1)
+		return 0;
+	nm_full_barrier();
+	for (i = 0; i < n; i++) {
+		uint16_t tag = nm_vale_flow_tag(h[i]);
+		uint32_t b = h[i] & fl->mask;
+		const struct nm_vale_fent *e;
+
+		res[i] = 0xffffffff;
+		if (!ip[i])
+			continue;
+		e = nm_vale_flow_find(fl, b, tag, &k[i]);
+		if (e == NULL)
+			e = nm_vale_flow_find(fl,
+				nm_vale_flow_alt(fl, b, tag), tag, &k[i]);
+		if (e != NULL)
+			res[i] = ((uint32_t)e->port << 8) | e->ring;
+	}
+	nm_full_barrier();
+	return NM_ACCESS_ONCE(fl->fl_seq) == seq;
+}
+
+/* lockless lookup of the keys, locked if writers keep interfering */
+static void
+nm_vale_flow_lookup_all(struct nm_vale_flowtab *fl,
+		const struct nm_vale_fkey *k, const uint32_t *h,
+		const uint8_t *ip, u_int n, uint32_t *res)
+{
+	u_int i;
+
+	for (i = 0; i < NM_VALE_FLOW_RETRY; i++) {
+		if (nm_vale_flow_lookup_keys(fl, k, h, ip, n, res))
+			return;
+	}
+	mtx_lock(&fl->fl_lock);
+	nm_vale_flow_lookup_keys(fl, k, h, ip, n, res);
+	mtx_unlock(&fl->fl_lock);
+}
+
+/* destination of a packet whose lookup returned r */
+static __inline uint32_t
+nm_vale_flow_dst(uint32_t r, uint8_t *dst_ring)
+{
+	if ((r & 0xff) != NM_VALE_FLOW_SRCRING)
+		*dst_ring = r & 0xff;
+	r >>= 8;
+	return r == NM_VALE_FLOW_DROP ? NM_BDG_NOPORT : r;
+}
+
+/* per-packet lookup for bridges that use the flow table */
+uint32_t
+netmap_vale_flow_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_vale_flowtab *fl = private_data;
+	struct nm_vale_fkey k;
+	uint32_t h, r = 0xffffffff;
+	uint8_t ip = 1;
+
+	if (nm_vale_flow_key(ft, &k)) {
+		h = nm_vale_flow_hash(&k);
+		nm_vale_flow_lookup_all(fl, &k, &h, &ip, 1, &r);
+	}
+	if (r == 0xffffffff) {
+		fl->misses++;
+		return netmap_vale_learning(ft, dst_ring, na, fl->ht);
+	}
+	fl->hits++;
+	return nm_vale_flow_dst(r, dst_ring);
+}
+
+/*
+ * Batched lookup for bridges that use the flow table. Like
+ * netmap_vale_learning_batch(), it works on chunks of packets:
+ * it builds and hashes the keys, prefetches the buckets, looks up
+ * the whole chunk, and then passes the misses to the learning table.
+ */
+void
+netmap_vale_flow_lookup_batch(struct nm_bdg_fwd **ft, u_int n,
+		uint32_t *dst_port, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_vale_flowtab *fl = private_data;
+	struct nm_vale_fkey k[NM_VALE_LK_CHUNK];
+	uint32_t h[NM_VALE_LK_CHUNK], res[NM_VALE_LK_CHUNK];
+	struct nm_bdg_fwd *mft[NM_VALE_LK_CHUNK];
+	uint32_t mport[NM_VALE_LK_CHUNK];
+	uint8_t mring[NM_VALE_LK_CHUNK], midx[NM_VALE_LK_CHUNK];
+	uint8_t ip[NM_VALE_LK_CHUNK];
+	u_int base, c, i, m;
+
+	for (base = 0; base < n; base += c) {
+		c = n - base;
+		if (c > NM_VALE_LK_CHUNK)
+			c = NM_VALE_LK_CHUNK;
+
+		for (i = 0; i < c; i++) {
+			ip[i] = nm_vale_flow_key(ft[base + i], &k[i]);
+			h[i] = ip[i] ? nm_vale_flow_hash(&k[i]) : 0;
+		}
+		for (i = 0; i < c; i++) {
+			uint32_t b = h[i] & fl->mask;
+
+			__builtin_prefetch(&fl->bkt[b]);
+			__builtin_prefetch(&fl->bkt[nm_vale_flow_alt(fl, b,
+				nm_vale_flow_tag(h[i]))]);
+		}
+		nm_vale_flow_lookup_all(fl, k, h, ip, c, res);
+
+		for (i = m = 0; i < c; i++) {
+			if (res[i] != 0xffffffff) {
+				dst_port[base + i] = nm_vale_flow_dst(res[i],
+					&dst_ring[base + i]);
+				continue;
+			}
+			mft[m] = ft[base + i];
+			mring[m] = dst_ring[base + i];
+			midx[m++] = i;
+		}
+		fl->hits += c - m;
+		if (m == 0)
+			continue;
+		fl->misses += m;
+		netmap_vale_learning_batch(mft, m, mport, mring, na, fl->ht);
+		for (i = 0; i < m; i++) {
+			dst_port[base + midx[i]] = mport[i];
+			dst_ring[base + midx[i]] = mring[i];
+		}
+	}
+}
+
+/* writers bracket their changes with these */
+static __inline void
+nm_vale_flow_wbegin(struct nm_vale_flowtab *fl)
+{
+	mtx_lock(&fl->fl_lock);
+	fl->fl_seq++;
+	nm_full_barrier();
+}
+
+static __inline void
+nm_vale_flow_wend(struct nm_vale_flowtab *fl)
+{
+	nm_stst_barrier();
+	fl->fl_seq++;
+	mtx_unlock(&fl->fl_lock);
+}
+
+static void nm_vale_flow_free(struct nm_vale_flowtab *fl);
+
+static struct nm_vale_flowtab *
+nm_vale_flow_alloc(u_int size)
+{
+	struct nm_vale_flowtab *fl;
+	u_int nb = 1;
+
+	/* keep the load below 80% */
+	while (nb * NM_VALE_FLOW_WAYS * 4 < size * 5)
+		nb <<= 1;
+	fl = nm_os_malloc(sizeof(*fl));
+	if (fl == NULL)
+		return NULL;
+	mtx_init(&fl->fl_lock, "nm_flow_lock", NULL, MTX_DEF);
+	fl->bkt = nm_os_vmalloc(nb * sizeof(*fl->bkt));
+	fl->ent = nm_os_vmalloc(nb * NM_VALE_FLOW_WAYS * sizeof(*fl->ent));
+	if (fl->bkt == NULL || fl->ent == NULL) {
+		nm_vale_flow_free(fl);
+		return NULL;
+	}
+	memset(fl->bkt, 0, nb * sizeof(*fl->bkt));
+	fl->mask = nb - 1;
+	fl->size = size;
+	return fl;
+}
+
+static void
+nm_vale_flow_free(struct nm_vale_flowtab *fl)
+{
+	if (fl == NULL)
+		return;
+	if (fl->bkt)
+		nm_os_vfree(fl->bkt);
+	if (fl->ent)
+		nm_os_vfree(fl->ent);
+	mtx_destroy(&fl->fl_lock);
+	nm_os_free(fl);
+}
+
+/* the flowtab_free callback of VALE bridges */
+static void
+netmap_vale_flowtab_free(void *fl)
+{
+	nm_vale_flow_free(fl);
+}
+
+static void
+nm_vale_flow_set(struct nm_vale_flowtab *fl, u_int b, u_int w,
+		uint16_t tag, const struct nm_vale_fent *src)
+{
+	fl->ent[b * NM_VALE_FLOW_WAYS + w] = *src;
+	fl->bkt[b].tag[w] = tag;
+}
+
+/* a way of bucket b that is not on the first d entries of path */
+static u_int
+nm_vale_flow_victim(struct nm_vale_flowtab *fl, u_int b,
+		const uint32_t *path, u_int d)
+{
+	u_int i, j, w;
+
+	for (i = 0; i < NM_VALE_FLOW_WAYS; i++) {
+		w = fl->victim++ % NM_VALE_FLOW_WAYS;
+		for (j = 0; j < d; j++) {
+			if (path[j] == b * NM_VALE_FLOW_WAYS + w)
+				break;
+		}
+		if (j == d)
+			return w;
+	}
+	return NM_VALE_FLOW_WAYS;
+}
+
+/* a free way in bucket b, or NM_VALE_FLOW_WAYS */
+static __inline u_int
+nm_vale_flow_freeway(const struct nm_vale_flowtab *fl, u_int b)
+{
+	u_int w;
+
+	for (w = 0; w < NM_VALE_FLOW_WAYS; w++) {
+		if (fl->bkt[b].tag[w] == 0)
+			break;
+	}
+	return w;
+}
+
+/*
+ * Insert or update a flow. If both buckets of the key are full,
+ * look for a cuckoo path, i.e. a chain of entries, each of which
+ * can move to its alternate bucket, ending in a bucket with a free
+ * way. The path is found first and then applied from the end, so
+ * a failed insertion leaves the table unchanged.
+ * Called under NMG_LOCK and between wbegin and wend.
+ */
+static int
+nm_vale_flow_add(struct nm_vale_flowtab *fl, const struct nm_vale_fent *ne)
+{
+	uint32_t h = nm_vale_flow_hash(&ne->key);
+	uint16_t tag = nm_vale_flow_tag(h);
+	uint32_t bb[2], path[NM_VALE_FLOW_KICKS];
+	struct nm_vale_fent *e;
+	u_int i, d, w, cur;
+
+	bb[0] = h & fl->mask;
+	bb[1] = nm_vale_flow_alt(fl, bb[0], tag);
+	for (i = 0; i < 2; i++) {
+		e = nm_vale_flow_find(fl, bb[i], tag, &ne->key);
+		if (e != NULL) {
+			e->port = ne->port;
+			e->ring = ne->ring;
+			return 0;
+		}
+	}
+	if (fl->used >= fl->size)
+		return ENOSPC;
+	for (i = 0; i < 2; i++) {
+		w = nm_vale_flow_freeway(fl, bb[i]);
+		if (w < NM_VALE_FLOW_WAYS) {
+			nm_vale_flow_set(fl, bb[i], w, tag, ne);
+			fl->used++;
+			return 0;
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		cur = bb[i];
+		for (d = 0; d < NM_VALE_FLOW_KICKS; d++) {
+			/* the path must not go through the same entry twice */
+			w = nm_vale_flow_victim(fl, cur, path, d);
+			if (w == NM_VALE_FLOW_WAYS) {
+				d = NM_VALE_FLOW_KICKS;
+				break;
+			}
+			path[d] = cur * NM_VALE_FLOW_WAYS + w;
+			cur = nm_vale_flow_alt(fl, cur, fl->bkt[cur].tag[w]);
+			w = nm_vale_flow_freeway(fl, cur);
+			if (w < NM_VALE_FLOW_WAYS)
+				break;
+		}
+		if (d == NM_VALE_FLOW_KICKS)
+			continue;
+		/* move each entry of the path to the next position */
+		for (;;) {
+			u_int src = path[d], sb = src / NM_VALE_FLOW_WAYS;
+
+			nm_vale_flow_set(fl, cur, w, fl->bkt[sb].tag[
+				src % NM_VALE_FLOW_WAYS], &fl->ent[src]);
+			cur = sb;
+			w = src % NM_VALE_FLOW_WAYS;
+			if (d-- == 0)
+				break;
+		}
+		nm_vale_flow_set(fl, cur, w, tag, ne);
+		fl->used++;
+		return 0;
+	}
+	return ENOSPC;
+}
+
+/* remove a flow, called as nm_vale_flow_add() */
+static int
+nm_vale_flow_del(struct nm_vale_flowtab *fl, const struct nm_vale_fkey *k)
+{
+	uint32_t h = nm_vale_flow_hash(k);
+	uint16_t tag = nm_vale_flow_tag(h);
+	uint32_t b = h & fl->mask;
+	struct nm_vale_fent *e;
+
+	e = nm_vale_flow_find(fl, b, tag, k);
+	if (e == NULL)
+		e = nm_vale_flow_find(fl, nm_vale_flow_alt(fl, b, tag), tag, k);
+	if (e == NULL)
+		return ENOENT;
+	fl->bkt[(e - fl->ent) / NM_VALE_FLOW_WAYS].tag[
+		(e - fl->ent) % NM_VALE_FLOW_WAYS] = 0;
+	fl->used--;
+	return 0;
+}
+
+/* convert a flow from userspace */
+static int
+nm_vale_flow_from_user(const struct nm_vale_flow *f, struct nm_vale_fent *e)
+{
+	if (f->nf_port >= NM_BDG_MAXPORTS && f->nf_port != NM_VALE_FLOW_DROP)
+		return EINVAL;
+	if (f->nf_ring >= NM_BDG_MAXRINGS && f->nf_ring != NM_VALE_FLOW_SRCRING)
+		return EINVAL;
+	memcpy(e->key.w, f->nf_src, 16);
+	memcpy(e->key.w + 4, f->nf_dst, 16);
+	memcpy(e->key.w + 8, &f->nf_sport, 4); /* with nf_dport */
+	e->key.w[9] = f->nf_proto;
+	e->port = f->nf_port;
+	e->ring = f->nf_ring;
+	e->pad = 0;
+	return 0;
+}
+
+/* NM_VALE_FLOW_ADD and NM_VALE_FLOW_DEL, in chunks of flows */
+#define NM_VALE_FLOW_CHUNK	16
+static int
+nm_vale_flow_bulk(struct nm_vale_flowtab *fl, struct nm_vale_flow_cfg *c)
+{
+	struct nm_vale_flow f[NM_VALE_FLOW_CHUNK];
+	const char *uf = (const char *)(uintptr_t)c->nfc_flows;
+	u_int done = 0, i, n;
+	int error = 0;
+
+	if (c->nfc_num > NM_VALE_FLOW_MAX) {
+		c->nfc_num = 0;
+		return EINVAL;
+	}
+	while (!error && done < c->nfc_num) {
+		n = c->nfc_num - done;
+		if (n > NM_VALE_FLOW_CHUNK)
+			n = NM_VALE_FLOW_CHUNK;
+		if (copyin(uf + done * sizeof(f[0]), f, n * sizeof(f[0]))) {
+			error = EFAULT;
+			break;
+		}
+		nm_vale_flow_wbegin(fl);
+		for (i = 0; i < n; i++) {
+			struct nm_vale_fent e;
+
+			error = nm_vale_flow_from_user(&f[i], &e);
+			if (error)
+				break;
+			if (c->nfc_cmd == NM_VALE_FLOW_ADD)
+				error = nm_vale_flow_add(fl, &e);
+			else
+				error = nm_vale_flow_del(fl, &e.key);
+			if (error)
+				break;
+		}
+		nm_vale_flow_wend(fl);
+		done += i;
+	}
+	c->nfc_num = done;
+	return error;
+}
+
+/*
+ * Process the commands for the built-in modules received with
+ * NIOCCONFIG. Bridges that use an external module with a config
+ * function get the request as before, see netmap_bdg_config().
+ */
+int
+netmap_vale_config(struct nm_ifreq *nr)
+{
+	struct nm_vale_flow_cfg *c = (struct nm_vale_flow_cfg *)nr->data;
+	struct nm_vale_flowtab *fl;
+	struct nm_bridge *b;
+	int error = 0;
+
+	NMG_LOCK();
+	b = nm_find_bridge(nr->nifr_name, 0 /* don't create */, NULL);
+	if (!b) {
+		NMG_UNLOCK();
+		return EINVAL;
+	}
+	if (b->bdg_ops.config != NULL) {
+		NMG_UNLOCK();
+		return netmap_bdg_config(nr);
+	}
+	if (!nm_bdg_valid_auth_token(b, NULL)) {
+		error = EACCES;
+		goto out;
+	}
+	fl = b->flowtab;
+	switch (c->nfc_cmd) {
+	case NM_VALE_FLOW_ENABLE:
+		if (fl != NULL || b->private_data != b->ht) {
+			error = EBUSY;
+			break;
+		}
+		if (c->nfc_size == 0 || c->nfc_size > NM_VALE_FLOW_MAX) {
+			error = EINVAL;
+			break;
+		}
+		fl = nm_vale_flow_alloc(c->nfc_size);
+		if (fl == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		fl->ht = b->ht;
+		BDG_WLOCK(b);
+		b->flowtab = fl;
+		b->bdg_ops.lookup = netmap_vale_flow_lookup;
+		b->bdg_ops.lookup_batch = netmap_vale_flow_lookup_batch;
+		b->private_data = fl;
+		nm_bdg_publish_lookup(b);
+		BDG_WUNLOCK(b);
+		BDG_EPOCH_WAIT();
+		break;
+
+	case NM_VALE_FLOW_DISABLE:
+		if (fl == NULL) {
+			error = ENOENT;
+			break;
+		}
+		BDG_WLOCK(b);
+		b->bdg_ops.lookup = b->bdg_saved_ops.lookup;
+		b->bdg_ops.lookup_batch = b->bdg_saved_ops.lookup_batch;
+		b->private_data = b->ht;
+		b->flowtab = NULL;
+		nm_bdg_publish_lookup(b);
+		BDG_WUNLOCK(b);
+		BDG_EPOCH_WAIT();
+		nm_vale_flow_free(fl);
+		fl = NULL;
+		break;
+
+	case NM_VALE_FLOW_ADD:
+	case NM_VALE_FLOW_DEL:
+		if (fl == NULL) {
+			error = ENOENT;
+			c->nfc_num = 0;
+			break;
+		}
+		error = nm_vale_flow_bulk(fl, c);
+		break;
+
+	case NM_VALE_FLOW_FLUSH:
+		if (fl == NULL) {
+			error = ENOENT;
+			break;
+		}
+		nm_vale_flow_wbegin(fl);
+		memset(fl->bkt, 0, (fl->mask + 1) * sizeof(*fl->bkt));
+		fl->used = 0;
+		nm_vale_flow_wend(fl);
+		break;
+
+	case NM_VALE_FLOW_INFO:
+		break;
+
+	default:
+		error = EINVAL;
+		break;
+	}
+	c->nfc_enabled = fl != NULL;
+	c->nfc_size = fl ? fl->size : 0;
+	c->nfc_used = fl ? fl->used : 0;
+	c->nfc_hits = fl ? fl->hits : 0;
+	c->nfc_misses = fl ? fl->misses : 0;
+out:
+	NMG_UNLOCK();
+	return error;
+}
+
+/* how a destination selects its packets from the broadcast queue */
+struct nm_vale_brdf {
+	u_int nrings;	/* NR_DISPATCH_RXHASH: packets hashed to ring r */
+	u_int r;
+	const struct nm_bdg_mcast *mc;	/* if set, only the groups of port */
+	u_int port;
+	uint32_t now;
+};
+
+/* whether the broadcast or multicast packet f goes to the port */
+static __inline int
+nm_vale_brd_member(const struct nm_bdg_fwd *f, const struct nm_vale_brdf *bf)
+{
+	const struct nm_bdg_mcast *mc = bf->mc;
+
+	return f->ft_mgrp == 0 || mc == NULL ||
+		nm_bdg_mcast_member(&mc->grp[f->ft_mgrp - 1], bf->port,
+			bf->now) ||
+		nm_bdg_mcast_member(&mc->routers, bf->port, bf->now);
+}
+
+/* first broadcast packet, starting from i, that passes the filter bf */
+static __inline u_int
+nm_vale_brd_next(const struct nm_bdg_fwd *ft, u_int i,
+		const struct nm_vale_brdf *bf)
+{
+	while (i != NM_FT_NULL &&
+	    ((bf->nrings && ft[i].ft_hash % bf->nrings != bf->r) ||
+	     !nm_vale_brd_member(ft + i, bf)))
+		i = ft[i].ft_next;
+	return i;
+}
+
+/* number of packets not delivered to a destination, i.e. still
+ * in the unicast list from next and in the broadcast list from
+ * brd_next (bf is NULL if the destination takes all of them)
+ */
+static u_int
+nm_vale_qleft(const struct nm_bdg_fwd *ft, u_int next, u_int brd_next,
+		const struct nm_vale_brdf *bf)
+{
+	u_int n = 0;
+
+	for (; next != NM_FT_NULL; next = ft[next].ft_next)
+		n++;
+	while (brd_next != NM_FT_NULL) {
+		n++;
+		brd_next = bf ? nm_vale_brd_next(ft, ft[brd_next].ft_next, bf) :
+			ft[brd_next].ft_next;
+	}
+	return n;
+}
+
+/* histogram bucket of a batch of n slots: floor(log2(n)) */
+static __inline u_int
+nm_vale_batch_bucket(u_int n)
+{
+	u_int k = 0;
+
+	while ((n >>= 1) && k < NR_VALE_BATCH_BUCKETS - 1)
+		k++;
+	return k;
+}
+
+/* Append packet i, whose frame starts at start_ft, to the queue of
+ * its destination, as returned by the lookup function.
+ * The broadcast queue follows dst_ents, and also holds the packets
+ * to multicast groups, which are filtered for each destination.
+ */
+static __inline void
+nm_vale_enqueue(struct nm_bridge *b, struct nm_bdg_fwd *ft, u_int i,
+		struct nm_bdg_fwd *start_ft, uint32_t dst_port, uint8_t dst_ring,
+		u_int me, struct nm_vale_q *dst_ents, uint16_t *dsthash,
+		u_int *num_dsts, struct nm_vale_stats *st)
+{
+	struct nm_vale_q *d;
+	struct netmap_vp_adapter *dst_na;
+	u_int mgrp = 0;
+
+	if (netmap_verbose > 255)
+		RD(5, "slot %d port %d -> %d", i, me, dst_port);
+	if (dst_port >= NM_BDG_NOPORT) {
+		st->drop_lookup++;
+		return; /* this packet is identified to be dropped */
+	}
+	if (dst_port == NM_BDG_BROADCAST) {
+		/* the ring is chosen later, for each destination */
+		ft[i].ft_hash = nm_vale_rxhash(start_ft);
+		mgrp = start_ft->ft_mgrp;
+		if (mgrp > NM_BDG_MCAST_GROUPS)
+			mgrp = 0;
+		ft[i].ft_mgrp = mgrp;
+		d = dst_ents + NM_BDG_BATCH_MAX;
+		if (mgrp)
+			d->bq_mcast++;
+	} else {
+		dst_na = b->bdg_ports[dst_port];
+		if (unlikely(dst_port == me || dst_na == NULL)) {
+			st->drop_lookup++;
+			return;
+		}
+		if (dst_na->rx_dispatch == NR_DISPATCH_RXHASH) {
+			ft[i].ft_hash = nm_vale_rxhash(start_ft);
+			dst_ring = ft[i].ft_hash % nm_vale_nrxrings(dst_na);
+		}
+		/* get a position in the scratch pad */
+		d = nm_vale_dst_lookup(dst_ents, dsthash,
+			dst_port * NM_BDG_MAXRINGS +
+			(dst_ring & (NM_BDG_MAXRINGS - 1)), num_dsts);
 	}
 
-	ND(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
+	/* append the first fragment to the list */
+	if (d->bq_head == NM_FT_NULL) { /* new destination */
+		d->bq_head = d->bq_tail = i;
+	} else {
+		ft[d->bq_tail].ft_next = i;
+		d->bq_tail = i;
+	}
+	d->bq_len += ft[i].ft_frags;
+}
+
+/*
+ *
+ * This flush routine supports unicast, broadcast and multicast to the
+ * groups learned by snooping (struct nm_bdg_mcast), and a large
+ * number of ports, and lets us replace the learn and dispatch functions.
+ */
+int
+nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
+		u_int ring_nr, const struct nm_bdg_lookup *lu)
+{
+	struct nm_vale_q *dst_ents, *brddst, brdonly;
+	struct nm_vale_stats *st;
+	u_int num_dsts = 0, num_brd = 0;
+	uint16_t *dsthash;
+	uint32_t *port_index;
+	struct nm_bridge *b = na->na_bdg;
+	u_int i, me = na->bdg_port;
+	struct netmap_kring *src_kring = na->up.tx_rings[ring_nr];
+	struct netmap_ring *src_ring = src_kring->ring;
+	int zcopy_on = bridge_zerocopy;
+	u_int brd_r;	/* next ring of a broadcast-only destination */
+	const struct nm_bdg_mcast *mc;
+	uint32_t now = 0;
+
+	/*
+	 * The work area (pointed by ft) is followed by a compact array
+	 * of queues, dst_ents, one for each destination (port, ring)
+	 * reached by the batch, plus one for the broadcast traffic.
+	 * Then we have a hash table to map destinations to queues,
+	 * the arrays exchanged with bdg_ops.lookup_batch() and
+	 * the counters of the ring.
+	 * All costs are proportional to the number of destinations
+	 * actually used, not to NM_BDG_MAXPORTS.
+	 */
+	dst_ents = (struct nm_vale_q *)(ft + NM_BDG_BATCH_MAX);
+	brddst = dst_ents + NM_BDG_BATCH_MAX;
+	dsthash = (uint16_t *)(brddst + 1);
+	st = nm_vale_ft_stats(ft);
+	st->batch[nm_vale_batch_bucket(n)]++;
+
+	/* first pass: find a destination for each packet in the batch */
+	if (lu->lookup_batch) {
+		struct nm_vale_lkup *lk =
+			(struct nm_vale_lkup *)(dsthash + NM_BDG_DSTHASH);
+		u_int m = 0;
+
+		for (i = 0; likely(i < n); i += ft[i].ft_frags) {
+			struct nm_bdg_fwd *start_ft = nm_vale_pkt_start(na, ft, i);
+
+			if (start_ft == NULL) {
+				st->drop_hdr++;
+				continue;
+			}
+			lk->lk_ft[m] = start_ft;
+			lk->lk_idx[m] = i;
+			lk->lk_ring[m] = ring_nr;
+			m++;
+		}
+		lu->lookup_batch(lk->lk_ft, m, lk->lk_port, lk->lk_ring,
+				na, lu->private_data);
+		for (i = 0; i < m; i++) {
+			nm_vale_enqueue(b, ft, lk->lk_idx[i], lk->lk_ft[i],
+				lk->lk_port[i], lk->lk_ring[i], me, dst_ents,
+				dsthash, &num_dsts, st);
+		}
+	} else {
+		for (i = 0; likely(i < n); i += ft[i].ft_frags) {
+			uint8_t dst_ring = ring_nr; /* default, same ring as origin */
+			struct nm_bdg_fwd *start_ft = nm_vale_pkt_start(na, ft, i);
+			uint32_t dst_port;
+
+			if (start_ft == NULL) {
+				st->drop_hdr++;
+				continue;
+			}
+			dst_port = lu->lookup(start_ft, &dst_ring, na,
+					lu->private_data);
+			nm_vale_enqueue(b, ft, i, start_ft, dst_port, dst_ring,
+				me, dst_ents, dsthash, &num_dsts, st);
+		}
+	}
+
+	/*
+	 * Broadcast traffic goes to ring 0 on all destinations, or is
+	 * spread on all the rings of ports in NR_DISPATCH_RXHASH mode.
+	 * The rings already in dst_ents get it together with the
+	 * unicast traffic. The other active ports (and rings) are
+	 * scanned after dst_ents, using an empty unicast queue (brdonly).
+	 */
+	port_index = NM_ACCESS_ONCE(b->bdg_port_index);
+	if (brddst->bq_head != NM_FT_NULL)
+		num_brd = NM_ACCESS_ONCE(b->bdg_active_ports);
+	mc = brddst->bq_mcast ? b->ht->mcast : NULL;
+	if (mc)
+		now = (uint32_t)time_second;
+	brdonly.bq_head = brdonly.bq_tail = NM_FT_NULL;
+	brdonly.bq_len = 0;
+	brd_r = 0;
+
+	ND(5, "pass 1 done %d pkts %d dsts %d brd", n, num_dsts, num_brd);
 	/* second pass: scan destinations */
-	for (i = 0; i < num_dsts; i++) {
+	for (i = 0; i < num_dsts + num_brd; i++) {
 		struct netmap_vp_adapter *dst_na;
 		struct netmap_kring *kring;
 		struct netmap_ring *ring;
 		u_int dst_nr, lim, j, d_i, next, brd_next;
+		struct nm_vale_brdf bf, *brdf = NULL;
 		u_int needed, howmany;
 		int retry = netmap_txsync_retry;
 		struct nm_vale_q *d;
-		uint32_t my_start = 0, lease_idx = 0;
+		uint32_t my_start = 0, my_end = 0, lease_idx = 0;
 		int nrings;
 		int virt_hdr_mismatch = 0;
+		int zcopy;
+		int lockfree, moved, notified;
+		uint64_t *dropped; /* where undelivered packets are counted */
 
-		d_i = dsts[i];
+		if (i < num_dsts) {
+			d = dst_ents + i;
+			d_i = d->bq_dst;
+		} else {
+			/* broadcast-only destination, unless this ring
+			 * of the port has already been served above.
+			 * Ports in NR_DISPATCH_RXHASH mode are visited
+			 * once for each ring.
+			 */
+			struct netmap_vp_adapter *bp;
+			u_int r = brd_r;
+
+			d_i = port_index[i - num_dsts];
+			bp = b->bdg_ports[d_i];
+			if (bp && bp->rx_dispatch == NR_DISPATCH_RXHASH &&
+					++brd_r < nm_vale_nrxrings(bp))
+				i--; /* come back for the next ring */
+			else
+				brd_r = 0;
+			if (unlikely(d_i == me))
+				continue;
+			d_i = d_i * NM_BDG_MAXRINGS + r;
+			if (nm_vale_dst_lookup(dst_ents, dsthash, d_i, NULL))
+				continue;
+			d = &brdonly;
+		}
 		ND("second pass %d port %d", i, d_i);
-		d = dst_ents + d_i;
+		/* unicast packets to an inactive destination are
+		 * accounted as lookup failures
+		 */
+		next = d->bq_head;
+		brd_next = NM_FT_NULL;
+		dropped = &st->drop_lookup;
 		// XXX fix the division
 		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
 		/* protect from the lookup function returning an inactive
@@ -992,9 +2707,51 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			goto cleanup;
 		}
 
-		/* there is at least one either unicast or broadcast packet */
-		brd_next = brddst->bq_head;
-		next = d->bq_head;
+		/* there is at least one either unicast or broadcast packet.
+		 * Broadcast traffic is only merged in the queue for ring 0,
+		 * or split among the rings by hash, so that a port is not
+		 * reached twice.
+		 */
+		needed = d->bq_len;
+		if (brddst->bq_head == NM_FT_NULL) {
+			/* no broadcast */
+		} else if (dst_na->rx_dispatch == NR_DISPATCH_RXHASH ||
+				(d_i & (NM_BDG_MAXRINGS - 1)) == 0) {
+			bf.nrings = bf.r = 0;
+			bf.mc = mc;
+			if (dst_na->rx_dispatch == NR_DISPATCH_RXHASH) {
+				bf.nrings = nm_vale_nrxrings(dst_na);
+				bf.r = d_i & (NM_BDG_MAXRINGS - 1);
+			}
+			bf.port = d_i / NM_BDG_MAXRINGS;
+			bf.now = now;
+			if (bf.nrings || bf.mc)
+				brdf = &bf;
+			if (brdf == NULL) {
+				brd_next = brddst->bq_head;
+				needed += brddst->bq_len;
+			} else {
+				u_int k;
+
+				brd_next = nm_vale_brd_next(ft,
+					brddst->bq_head, brdf);
+				/* also count the multicast copies that
+				 * are not needed by this destination
+				 */
+				for (k = brddst->bq_head; k != NM_FT_NULL;
+						k = ft[k].ft_next) {
+					if (bf.nrings &&
+					    ft[k].ft_hash % bf.nrings != bf.r)
+						continue;
+					if (nm_vale_brd_member(ft + k, brdf))
+						needed += ft[k].ft_frags;
+					else
+						st->mcast_saved++;
+				}
+			}
+		}
+		if (unlikely(next == NM_FT_NULL && brd_next == NM_FT_NULL))
+			goto cleanup;
 		/* we need to reserve this many slots. If fewer are
 		 * available, some packets will be dropped.
 		 * Packets may have multiple fragments, so we may not use
@@ -1002,7 +2759,6 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		 * we have claimed, so we will need to handle the leftover
 		 * ones when we regain the lock.
 		 */
-		needed = d->bq_len + brddst->bq_len;
 
 		if (unlikely(dst_na->up.virt_hdr_len != na->up.virt_hdr_len)) {
 			if (netmap_verbose) {
@@ -1032,6 +2788,10 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			}
 		}
 
+		/* buffers can only be swapped within the same allocator */
+		zcopy = zcopy_on && !virt_hdr_mismatch &&
+			dst_na->up.nm_mem == na->up.nm_mem;
+
 		ND(5, "pass 2 dst %d is %x %s",
 			i, d_i, is_vp ? "virtual" : "nic/host");
 		dst_nr = d_i & (NM_BDG_MAXRINGS-1);
@@ -1041,9 +2801,12 @@ nm_vale_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		kring = dst_na->up.rx_rings[dst_nr];
 		ring = kring->ring;
 		/* the destination ring may have not been opened for RX */
-		if (unlikely(ring == NULL || kring->nr_mode != NKR_NETMAP_ON))
+		if (unlikely(ring == NULL || kring->nr_mode != NKR_NETMAP_ON)) {
+			brd_next = NM_FT_NULL;
 			goto cleanup;
+		}
 		lim = kring->nkr_num_slots - 1;
+		dropped = &st->drop_nospace;
 
 retry:
 
@@ -1056,20 +2819,24 @@ retry:
 			 */
 		}
 		/* reserve the buffers in the queue and an entry
-		 * to report completion, and drop lock.
-		 * XXX this might become a helper function.
+		 * to report completion. In lockfree mode this does
+		 * not take the q_lock.
 		 */
-		mtx_lock(&kring->q_lock);
-		if (kring->nkr_stopped) {
-			mtx_unlock(&kring->q_lock);
+		lockfree = bridge_lease_lockfree;
+		if (!lockfree)
+			mtx_lock(&kring->q_lock);
+		if (NM_ACCESS_ONCE(kring->nkr_stopped)) {
+			if (!lockfree)
+				mtx_unlock(&kring->q_lock);
 			goto cleanup;
 		}
-		my_start = j = kring->nkr_hwlease;
-		howmany = nm_kr_space(kring, 1);
-		if (needed < howmany)
-			howmany = needed;
-		lease_idx = nm_kr_lease(kring, howmany, 1);
-		mtx_unlock(&kring->q_lock);
+		howmany = nm_kr_lease(kring, needed, &my_start, &lease_idx);
+		if (!lockfree)
+			mtx_unlock(&kring->q_lock);
+		j = my_start;
+		my_end = j + howmany;
+		if (my_end > lim)
+			my_end -= lim + 1;
 
 		/* only retry if we need more than available slots */
 		if (retry && needed <= howmany)
@@ -1079,7 +2846,8 @@ retry:
 		while (howmany > 0) {
 			struct netmap_slot *slot;
 			struct nm_bdg_fwd *ft_p, *ft_end;
-			u_int cnt;
+			u_int cnt, k;
+			int swap = zcopy, brd = 0;
 
 			/* find the queue from which we pick next packet.
 			 * NM_FT_NULL is always higher than valid indexes
@@ -1092,14 +2860,24 @@ retry:
 				next = ft_p->ft_next;
 			} else { /* insert broadcast */
 				ft_p = ft + brd_next;
-				brd_next = ft_p->ft_next;
+				brd_next = brdf ? nm_vale_brd_next(ft,
+					ft_p->ft_next, brdf) : ft_p->ft_next;
+				/* other ports need the same buffer */
+				swap = 0;
+				brd = 1;
 			}
 			cnt = ft_p->ft_frags; // cnt > 0
-			if (unlikely(cnt > howmany))
-			    break; /* no more space */
+			if (unlikely(cnt > howmany)) {
+				st->drop_nospace++;
+				break; /* no more space */
+			}
 			if (netmap_verbose && cnt > 1)
 				RD(5, "rx %d frags to %d", cnt, j);
 			ft_end = ft_p + cnt;
+			st->fwd_pkts++;
+			st->brd_copies += brd;
+			for (k = 0; k < cnt; k++)
+				st->fwd_bytes += ft_p[k].ft_len;
 			if (unlikely(virt_hdr_mismatch)) {
 				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
 			} else {
@@ -1109,6 +2887,28 @@ retry:
 					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
 
 					slot = &ring->slot[j];
+					/* the rings must also be of the same class */
+					if (swap && !(ft_p->ft_flags & NS_INDIRECT) &&
+					    NETMAP_KRING_BUF_SIZE(kring) ==
+					    NETMAP_KRING_BUF_SIZE(src_kring) &&
+					    nm_vale_swappable(kring, slot) &&
+					    nm_vale_swappable(src_kring,
+						&src_ring->slot[ft_p->ft_slot])) {
+						struct netmap_slot *src_slot =
+							&src_ring->slot[ft_p->ft_slot];
+						uint32_t idx = slot->buf_idx;
+
+						slot->buf_idx = src_slot->buf_idx;
+						src_slot->buf_idx = idx;
+						src_slot->flags |= NS_BUF_CHANGED;
+						slot->len = dst_len;
+						slot->flags = (cnt << 8) | NS_MOREFRAG |
+							NS_BUF_CHANGED;
+						j = nm_next(j, lim);
+						needed--;
+						ft_p++;
+						continue;
+					}
 					dst = NMB(&dst_na->up, slot);
 
 					ND("send [%d] %d(%d) bytes at %s:%d",
@@ -1117,8 +2917,9 @@ retry:
 					/* round to a multiple of 64 */
 					copy_len = (copy_len + 63) & ~63;
 
-					if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
-						     copy_len > NETMAP_BUF_SIZE(&na->up))) {
+					if (unlikely(copy_len > NMB_SIZE(&dst_na->up, slot) ||
+						     copy_len > NMB_SIZE(&na->up,
+							&src_ring->slot[ft_p->ft_slot]))) {
 						RD(5, "invalid len %d, down to 64", (int)copy_len);
 						copy_len = dst_len = 64; // XXX
 					}
@@ -1137,81 +2938,85 @@ retry:
 					needed--;
 					ft_p++;
 				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
+				slot->flags &= ~NS_MOREFRAG; /* clear flag on last entry */
 			}
 			/* are we done ? */
 			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
 				break;
 		}
-		{
-		    /* current position */
-		    uint32_t *p = kring->nkr_leases; /* shorthand */
-		    uint32_t update_pos;
-		    int still_locked = 1;
-
-		    mtx_lock(&kring->q_lock);
-		    if (unlikely(howmany > 0)) {
+		if (unlikely(howmany > 0)) {
 			/* not used all bufs. If i am the last one
 			 * i can recover the slots, otherwise must
 			 * fill them with 0 to mark empty packets.
 			 */
 			ND("leftover %d bufs", howmany);
-			if (nm_next(lease_idx, lim) == kring->nkr_lease_idx) {
-			    /* yes i am the last one */
-			    ND("roll back nkr_hwlease to %d", j);
-			    kring->nkr_hwlease = j;
+			if (nm_kr_lease_rollback(kring, lease_idx, j, my_end)) {
+				ND("roll back hwlease to %d", j);
 			} else {
-			    while (howmany-- > 0) {
-				ring->slot[j].len = 0;
-				ring->slot[j].flags = 0;
-				j = nm_next(j, lim);
-			    }
-			}
-		    }
-		    p[lease_idx] = j; /* report I am done */
-
-		    update_pos = kring->nr_hwtail;
-
-		    if (my_start == update_pos) {
-			/* all slots before my_start have been reported,
-			 * so scan subsequent leases to see if other ranges
-			 * have been completed, and to a selwakeup or txsync.
-		         */
-			while (lease_idx != kring->nkr_lease_idx &&
-				p[lease_idx] != NR_NOSLOT) {
-			    j = p[lease_idx];
-			    p[lease_idx] = NR_NOSLOT;
-			    lease_idx = nm_next(lease_idx, lim);
-			}
-			/* j is the new 'write' position. j != my_start
-			 * means there are new buffers to report
-			 */
-			if (likely(j != my_start)) {
-				kring->nr_hwtail = j;
-				still_locked = 0;
-				mtx_unlock(&kring->q_lock);
-				kring->nm_notify(kring, 0);
-				/* this is netmap_notify for VALE ports and
-				 * netmap_bwrap_notify for bwrap. The latter will
-				 * trigger a txsync on the underlying hwna
-				 */
-				if (dst_na->retry && retry--) {
-					/* XXX this is going to call nm_notify again.
-					 * Only useful for bwrap in virtual machines
-					 */
-					goto retry;
+				while (howmany-- > 0) {
+					ring->slot[j].len = 0;
+					ring->slot[j].flags = 0;
+					j = nm_next(j, lim);
 				}
 			}
-		    }
-		    if (still_locked)
+		}
+		if (nm_slot_ts_enabled(kring))
+			nm_slot_ts_fill(kring, my_start, j, nm_os_realtime_ns());
+		/* report I am done. The barriers pair with the ones in
+		 * the publishing loop below: either we see that all the
+		 * slots before my_start have been published, or whoever
+		 * publishes them sees our entry.
+		 */
+		nm_stst_barrier();
+		kring->nkr_leases[lease_idx] = j;
+		nm_full_barrier();
+		if (lockfree && NM_ACCESS_ONCE(kring->nr_hwtail) != my_start)
+			goto cleanup;
+		notified = 0;
+		for (;;) {
+			/* merge our lease and the subsequent completed ones
+			 * into hwtail, then do a selwakeup or txsync.
+			 */
+			mtx_lock(&kring->q_lock);
+			moved = nm_kr_lease_complete(kring);
 			mtx_unlock(&kring->q_lock);
+			if (!moved)
+				break;
+			kring->nm_notify(kring, 0);
+			/* this is netmap_notify for VALE ports and
+			 * netmap_bwrap_notify for bwrap. The latter will
+			 * trigger a txsync on the underlying hwna
+			 */
+			notified = 1;
+			if (!lockfree)
+				break;
+			/* a lease completed while we were publishing
+			 * may have seen the old hwtail and left it to us.
+			 */
+			nm_full_barrier();
+			if (NM_ACCESS_ONCE(kring->nkr_leases[
+			    NM_ACCESS_ONCE(kring->nkr_lease_head)]) == NR_NOSLOT)
+				break;
+		}
+		if (notified && dst_na->retry && retry--) {
+			/* XXX this is going to call nm_notify again.
+			 * Only useful for bwrap in virtual machines
+			 */
+			goto retry;
 		}
 cleanup:
+		*dropped += nm_vale_qleft(ft, next, brd_next, brdf);
 		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
 		d->bq_len = 0;
 	}
+	/* the hash must stay valid until all the broadcast-only
+	 * destinations have been scanned, so clear it only now
+	 */
+	for (i = 0; i < num_dsts; i++)
+		dsthash[dst_ents[i].bq_hslot] = NM_FT_NULL;
 	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
 	brddst->bq_len = 0;
+	brddst->bq_mcast = 0;
 	return 0;
 }
 
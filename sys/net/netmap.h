@@ -168,7 +168,8 @@ struct netmap_slot {
 	uint32_t buf_idx;	/* buffer index */
 	uint16_t len;		/* length for this slot */
 	uint16_t flags;		/* buf changed, etc. */
-	uint64_t ptr;		/* pointer for indirect buffers */
+	uint64_t ptr;		/* pointer for indirect buffers, or
+				 * rx timestamp (see NR_SLOT_TS) */
 };
 
 /*
@@ -328,6 +329,23 @@ struct netmap_ring {
 	 * Enables the NS_FORWARD slot flag for the ring.
 	 */
 
+#define	NR_SLOT_TS	0x0008		/* per-slot rx timestamps */
+	/*
+	 * On rx rings, stores in the ptr field of each slot a receive
+	 * timestamp, in nanoseconds since the Epoch. VALE ports and
+	 * pipes take the time when the packet is delivered to the ring,
+	 * emulated (generic) adapters and host rings when the packet is
+	 * handed to netmap. Native NIC rings take one timestamp per
+	 * rxsync, shared by all the packets received by that rxsync.
+	 */
+
+#define	NR_MOREFRAG	0x0010		/* host rx: chains for long packets */
+	/*
+	 * On the host rx ring, packets from the host stack longer than
+	 * a buffer are split over several slots linked with
+	 * NS_MOREFRAG, instead of being dropped.
+	 */
+
 /*
  * Helper functions for kernel and userspace
  */
@@ -536,6 +554,17 @@ enum {
 	NETMAP_REQ_SYNC_KLOOP_STOP,
 	/* Enable CSB mode on a registered netmap control device. */
 	NETMAP_REQ_CSB_ENABLE,
+	/* Get (and optionally change) the learning table of a VALE switch. */
+	NETMAP_REQ_VALE_FDB,
+	/* Get or set how a VALE port spreads packets on its rx rings. */
+	NETMAP_REQ_VALE_DISPATCH,
+	/* Get (and optionally reset) the datapath counters of a VALE port. */
+	NETMAP_REQ_VALE_STATS_GET,
+	/* Get the pools information together with the occupancy counters
+	 * of the memory allocator. */
+	NETMAP_REQ_POOLS_STATS_GET,
+	/* Get (and optionally reset) the datapath counters of a ring. */
+	NETMAP_REQ_RING_STATS_GET,
 };
 
 enum {
@@ -553,6 +582,10 @@ enum {
 	 * struct netmap_ring header, but rather using an user-provided
 	 * memory area (see struct nm_csb_atok and struct nm_csb_ktoa). */
 	NETMAP_REQ_OPT_CSB,
+
+	/* On NETMAP_REQ_REGISTER, ask netmap to use a memory region
+	 * allocated on the given NUMA node. */
+	NETMAP_REQ_OPT_MEM_NODE,
 };
 
 /*
@@ -592,6 +625,24 @@ struct nmreq_register {
  * NETMAP_DO_RX_POLL. */
 #define NR_DO_RX_POLL		0x10000
 #define NR_NO_TX_POLL		0x20000
+/* The rings created by this registration get buffers of the large
+ * class of the allocator (see the lbuf_* sysctls), and report their
+ * size in nr_buf_size. Buffers should only be swapped between rings
+ * with the same nr_buf_size. Not available on hardware ports. */
+#define NR_LARGE_BUFS		0x40000
+/* Used with NETMAP_REQ_OPT_EXTMEM: the memory region is not destroyed
+ * when its last user goes away, and keeps the extra buffers that were
+ * in the ni_bufs_head list of the closed netmap_if's. An application
+ * that registers the same memory again (e.g. by mmap()ing the same
+ * hugetlbfs or tmpfs file after a restart) gets the region back, and
+ * the saved buffers at the end of its ni_bufs_head list. Registering
+ * the region without the flag makes it temporary again. */
+#define NR_EXTMEM_PERSIST	0x80000
+/* Map the whole memory region in advance when the file descriptor
+ * is mmap()ed, instead of page by page as the application touches
+ * it, so that no page faults happen on the datapath. Only Linux
+ * supports it, other systems ignore it. */
+#define NR_PREFAULT		0x100000
 };
 
 /* Valid values for nmreq_register.nr_mode (see above). */
@@ -619,6 +670,34 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 #define NIOCTXSYNC	_IO('i', 148) /* sync tx queues */
 #define NIOCRXSYNC	_IO('i', 149) /* sync rx queues */
 
+/* NIOCSYNCV syncs an arbitrary list of rings in a single system call.
+ * Each entry names a file descriptor (-1 for the one the ioctl is
+ * issued on), a ring index and a direction. The ring must be bound
+ * by that descriptor; ring indices are the same used in nr_ringid,
+ * with the host rings following the hardware ones. Entries are
+ * processed in order and ns_error reports the outcome of each one,
+ * so the ioctl itself only fails on malformed requests.
+ * At most NM_SYNCV_MAX entries are accepted. */
+struct nmsync_entry {
+	int32_t		ns_fd;
+	uint16_t	ns_ring;
+	uint8_t		ns_dir;		/* NR_SYNC_TX or NR_SYNC_RX */
+	uint8_t		ns_pad;
+	int32_t		ns_error;	/* out: 0 or errno */
+	uint32_t	ns_pad2;
+};
+#define NR_SYNC_TX	0
+#define NR_SYNC_RX	1
+
+struct nmsyncv {
+	uint64_t	nsv_entries;	/* (struct nmsync_entry *) */
+	uint32_t	nsv_count;
+	uint32_t	nsv_errors;	/* out: entries with ns_error != 0 */
+};
+#define NM_SYNCV_MAX	256
+
+#define NIOCSYNCV	_IOWR('i', 152, struct nmsyncv)
+
 /*
  * nr_reqtype: NETMAP_REQ_PORT_INFO_GET
  * Get information about a netmap port, including number of rings.
@@ -720,7 +799,10 @@ struct nmreq_vale_polling {
 struct nmreq_pools_info {
 	uint64_t	nr_memsize;
 	uint16_t	nr_mem_id; /* in/out argument */
-	uint16_t	pad1[3];
+	int16_t		nr_numa_node; /* out: NUMA node of the pools,
+				       * -1 if not bound to a node */
+	uint32_t	nr_buf_pool_pagesize; /* out: size of the pages that
+					       * back and map the buffers */
 	uint64_t	nr_if_pool_offset;
 	uint32_t	nr_if_pool_objtotal;
 	uint32_t	nr_if_pool_objsize;
@@ -732,6 +814,204 @@ struct nmreq_pools_info {
 	uint32_t	nr_buf_pool_objsize;
 };
 
+/*
+ * nr_reqtype: NETMAP_REQ_POOLS_STATS_GET
+ * Like NETMAP_REQ_POOLS_INFO_GET (nr_info is the same, in/out), and also
+ * get the occupancy counters of each pool of the allocator, in the order
+ * if, ring, buf and large buf. Objects cached by the per-CPU magazines
+ * (nr_cached) count as in use. nr_hiwat is the largest nr_inuse seen,
+ * nr_leaked counts the objects still in use when the last user of the
+ * allocator went away. nr_free_runs and nr_largest_run describe the
+ * fragmentation of the free objects (maximal runs of free indexes).
+ * nr_port_ring_bufs and nr_port_extra_bufs are the buffers held by the
+ * rings and by the extra buffer lists of hdr.nr_name.
+ * nr_alloc_lat[i] counts the buffer allocation calls (one per ring or
+ * extra buffer list) that took 2^i .. 2^(i+1)-1 nanoseconds (the last
+ * bucket also holds the longer ones).
+ * With NR_POOLS_STATS_RESET the high-water marks, the leak counters and
+ * the histogram are reset after being read.
+ */
+struct nmreq_pool_stats {
+	uint32_t	nr_objtotal;
+	uint32_t	nr_inuse;
+	uint32_t	nr_cached;
+	uint32_t	nr_hiwat;
+	uint32_t	nr_free_runs;
+	uint32_t	nr_largest_run;
+	uint64_t	nr_leaked;
+};
+
+struct nmreq_pools_stats {
+	struct nmreq_pools_info nr_info;
+	uint32_t	nr_flags;
+#define NR_POOLS_STATS_RESET	0x1
+	uint32_t	pad1;
+#define NR_POOLS_NUM		4
+	struct nmreq_pool_stats nr_pool[NR_POOLS_NUM];	/* out */
+	uint32_t	nr_port_ring_bufs;	/* out */
+	uint32_t	nr_port_extra_bufs;	/* out */
+#define NR_POOLS_LAT_BUCKETS	24
+	uint64_t	nr_alloc_lat[NR_POOLS_LAT_BUCKETS];	/* out */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_FDB
+ * Get info about the learning table (forwarding database) of the
+ * VALE switch specified by hdr.nr_name (e.g. "vale0:").
+ * nr_flags may ask to resize the table to hold nr_size entries,
+ * to change the max age of the entries to nr_max_age seconds
+ * (0 means never expire) and to forget all the learned addresses.
+ * Changing the table is not allowed on switches whose lookup
+ * function has been replaced by an external module.
+ * On return, all the other fields describe the current table.
+ */
+struct nmreq_vale_fdb {
+	uint32_t	nr_flags;
+#define NR_FDB_SET_SIZE		0x1
+#define NR_FDB_SET_AGE		0x2
+#define NR_FDB_FLUSH		0x4
+	uint32_t	nr_size;	/* in/out: max number of entries */
+	uint32_t	nr_max_age;	/* in/out: seconds */
+	uint32_t	nr_buckets;	/* out: each one has nr_ways entries */
+	uint32_t	nr_ways;
+	uint32_t	nr_used;	/* out: live entries */
+	uint32_t	nr_expired;	/* out: entries older than nr_max_age */
+	uint32_t	nr_full_buckets; /* out: buckets with no free entry */
+	uint64_t	nr_learned;	/* out: addresses inserted */
+	uint64_t	nr_moved;	/* out: addresses that changed port */
+	uint64_t	nr_collisions;	/* out: live entries evicted */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_DISPATCH
+ * Get, or set if NR_DISPATCH_SET is in nr_flags, the rx ring selection
+ * mode of the VALE port specified by hdr.nr_name.
+ * With NR_DISPATCH_SRC_RING (the default) unicast packets go to the
+ * rx ring with the same number as the source tx ring, and broadcast
+ * packets go to ring 0.
+ * With NR_DISPATCH_RXHASH all packets are spread on the rx rings of
+ * the port using a symmetric hash of the IPv4/IPv6 addresses, protocol
+ * and TCP/UDP ports (or of the MAC addresses for other frames), so
+ * that both directions of a flow land on the same ring.
+ */
+struct nmreq_vale_dispatch {
+	uint32_t	nr_flags;
+#define NR_DISPATCH_SET		0x1
+	uint32_t	nr_mode;	/* in/out */
+#define NR_DISPATCH_SRC_RING	0
+#define NR_DISPATCH_RXHASH	1
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_VALE_STATS_GET
+ * Get the forwarding counters of the VALE port specified by hdr.nr_name.
+ * Counters are kept per tx ring of the port (i.e., per source ring):
+ * nr_ring_id selects one ring, or NR_VALE_STATS_ALLRINGS for the sum
+ * over all of them. Packets are counted on the port that sent them.
+ * nr_batch[i] counts the flushes of 2^i .. 2^(i+1)-1 packets (the last
+ * bucket also holds the larger ones).
+ * nr_mcast_saved counts the copies of multicast packets not made to
+ * ports outside of the group (see dev.netmap.bridge_mcast_snooping).
+ * With NR_VALE_STATS_RESET the selected counters are cleared after
+ * being read; packets forwarded concurrently may be lost to the reset.
+ */
+struct nmreq_vale_stats {
+	uint32_t	nr_flags;
+#define NR_VALE_STATS_RESET	0x1
+	uint16_t	nr_ring_id;	/* in */
+#define NR_VALE_STATS_ALLRINGS	0xffff
+	uint16_t	nr_tx_rings;	/* out: number of tx rings of the port */
+	uint64_t	nr_fwd_pkts;	/* out: packets delivered (per copy) */
+	uint64_t	nr_fwd_bytes;	/* out: bytes delivered */
+	uint64_t	nr_brd_copies;	/* out: copies made for broadcast */
+	uint64_t	nr_drop_nospace; /* out: no room on the destination */
+	uint64_t	nr_drop_lookup;	/* out: no (valid) destination port */
+	uint64_t	nr_drop_hdr;	/* out: malformed virtio-net header */
+#define NR_VALE_BATCH_BUCKETS	11
+	uint64_t	nr_batch[NR_VALE_BATCH_BUCKETS];
+	uint64_t	nr_mcast_saved;	/* out: multicast copies avoided */
+};
+
+/*
+ * nr_reqtype: NETMAP_REQ_RING_STATS_GET
+ * Get the datapath counters of one ring of the port specified by
+ * hdr.nr_name. nr_dir (NR_SYNC_TX or NR_SYNC_RX) and nr_ring_id select
+ * the ring, with the host rings following the hardware ones; on
+ * return nr_tx_rings and nr_rx_rings hold the number of rings of each
+ * kind, host rings included, so that all of them can be scraped.
+ * The counters exist while the port is in use, and start from zero
+ * when it is registered again after its last user has gone away.
+ * nr_sync_lat[i] counts the *sync() calls that took 2^i .. 2^(i+1)-1
+ * nanoseconds (the last bucket also holds the longer ones), while the
+ * dev.netmap.ring_latency sysctl is set.
+ * nr_host_drops counts the packets dropped on the way to or from the
+ * host stack. Counters are updated without locks and are approximate.
+ * With NR_RING_STATS_RESET they are cleared after being read.
+ */
+struct nmreq_ring_stats {
+	uint32_t	nr_flags;
+#define NR_RING_STATS_RESET	0x1
+	uint16_t	nr_ring_id;	/* in */
+	uint8_t		nr_dir;		/* in */
+	uint8_t		nr_pad1;
+	uint16_t	nr_tx_rings;	/* out */
+	uint16_t	nr_rx_rings;	/* out */
+	uint32_t	nr_pad2;
+	uint64_t	nr_syncs;	/* out: *sync() calls */
+	uint64_t	nr_slots;	/* out: slots transmitted/received */
+	uint64_t	nr_busy;	/* out: ring busy or stopped */
+	uint64_t	nr_reinit;	/* out: ring reinitializations */
+	uint64_t	nr_host_drops;	/* out */
+#define NR_RING_LAT_BUCKETS	24
+	uint64_t	nr_sync_lat[NR_RING_LAT_BUCKETS];	/* out */
+};
+
+/*
+ * Exact match flow table of a VALE switch, the built-in alternative
+ * to the learning bridge. It is configured with the legacy
+ * ioctl(fd, NIOCCONFIG, &ifr), where ifr.nifr_name is the switch
+ * (e.g. "vale0:") and ifr.data holds a struct nm_vale_flow_cfg.
+ * Switches controlled by an external module do not accept it.
+ * NM_VALE_FLOW_ENABLE replaces the learning bridge with a table of
+ * up to nfc_size flows, NM_VALE_FLOW_DISABLE goes back to learning.
+ * NM_VALE_FLOW_ADD inserts (or updates) and NM_VALE_FLOW_DEL removes
+ * the nfc_num flows at the user address nfc_flows; on return nfc_num
+ * is the number of flows processed. NM_VALE_FLOW_FLUSH removes all
+ * the flows. All the commands return the state of the table.
+ * Packets are matched on the IP addresses, the protocol and the
+ * TCP/UDP/SCTP ports (0 for other protocols and for IP fragments).
+ * Packets that match no flow, including non-IP ones, are forwarded
+ * by the learning table.
+ */
+struct nm_vale_flow {
+	uint8_t		nf_src[16];	/* IPv6, or IPv4-mapped ::ffff:a.b.c.d */
+	uint8_t		nf_dst[16];
+	uint16_t	nf_sport;	/* network byte order */
+	uint16_t	nf_dport;
+	uint8_t		nf_proto;
+	uint8_t		nf_ring;	/* destination ring, or */
+#define NM_VALE_FLOW_SRCRING	0xff	/* the ring of the sender */
+	uint16_t	nf_port;	/* destination port index, or */
+#define NM_VALE_FLOW_DROP	0xffff
+};
+
+struct nm_vale_flow_cfg {
+	uint16_t	nfc_cmd;
+#define NM_VALE_FLOW_ENABLE	1
+#define NM_VALE_FLOW_DISABLE	2
+#define NM_VALE_FLOW_ADD	3
+#define NM_VALE_FLOW_DEL	4
+#define NM_VALE_FLOW_FLUSH	5
+#define NM_VALE_FLOW_INFO	6
+	uint16_t	nfc_enabled;	/* out */
+	uint32_t	nfc_num;	/* in/out: flows at nfc_flows */
+	uint64_t	nfc_flows;	/* in: pointer to struct nm_vale_flow[] */
+	uint32_t	nfc_size;	/* in (ENABLE)/out: max number of flows */
+	uint32_t	nfc_used;	/* out: flows in the table */
+	uint64_t	nfc_hits;	/* out: packets that matched a flow */
+	uint64_t	nfc_misses;	/* out: packets sent to the learning table */
+};
+
 /*
  * nr_reqtype: NETMAP_REQ_SYNC_KLOOP_START
  * Start an in-kernel loop that syncs the rings periodically or on
@@ -869,6 +1149,12 @@ struct nmreq_opt_extmem {
 	struct nmreq_pools_info	nro_info;	/* (in/out) */
 };
 
+struct nmreq_opt_mem_node {
+	struct nmreq_option	nro_opt;	/* common header */
+	int32_t			nro_node;	/* (in) NUMA node */
+	uint32_t		pad1;
+};
+
 struct nmreq_opt_csb {
 	struct nmreq_option	nro_opt;
 
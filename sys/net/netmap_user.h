@@ -753,6 +753,12 @@ nm_parse(const char *ifname, struct nm_desc *d, char *err)
 			case 'T':
 				nr_flags |= NR_TX_RINGS_ONLY;
 				break;
+			case 'L':
+				nr_flags |= NR_LARGE_BUFS;
+				break;
+			case 'P':
+				nr_flags |= NR_PREFAULT;
+				break;
 			default:
 				snprintf(errmsg, MAXERRMSG, "unrecognized flag: '%c'", *port);
 				goto fail;
@@ -1122,7 +1128,14 @@ nm_dispatch(struct nm_desc *d, int cnt, nm_cb_t cb, u_char *arg)
 					oldbuf = NULL;
 				}
 			}
-			d->hdr.ts = ring->ts;
+			if (ring->flags & NR_SLOT_TS) {
+				uint64_t ns = d->hdr.slot->ptr;
+
+				d->hdr.ts.tv_sec = ns / 1000000000;
+				d->hdr.ts.tv_usec = (ns % 1000000000) / 1000;
+			} else {
+				d->hdr.ts = ring->ts;
+			}
 			ring->head = ring->cur = nm_ring_next(ring, i);
 		}
 	}
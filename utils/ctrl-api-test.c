@@ -31,6 +31,7 @@
 #include <sys/mman.h>
 #include <sys/wait.h>
 
+#include <arpa/inet.h>
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -38,6 +39,7 @@
 #include <inttypes.h>
 #include <net/if.h>
 #include <net/netmap.h>
+#include <net/netmap_user.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdint.h>
@@ -143,6 +145,7 @@ struct TestContext {
 	uint32_t nr_mode;       /* specify NR_REG_* modes */
 	uint32_t nr_extra_bufs; /* number of requested extra buffers */
 	uint64_t nr_flags;      /* additional flags (see below) */
+	uint64_t nr_offset;     /* offset of the netmap_if */
 	uint32_t nr_hdr_len; /* for PORT_HDR_SET and PORT_HDR_GET */
 	uint32_t nr_first_cpu_id;     /* vale polling */
 	uint32_t nr_num_polling_cpus; /* vale polling */
@@ -277,6 +280,7 @@ port_register(struct TestContext *ctx)
 	ctx->nr_rx_rings   = req.nr_rx_rings;
 	ctx->nr_mem_id     = req.nr_mem_id;
 	ctx->nr_extra_bufs = req.nr_extra_bufs;
+	ctx->nr_offset     = req.nr_offset;
 
 	return 0;
 }
@@ -555,6 +559,330 @@ vale_attach_detach_host_rings(struct TestContext *ctx)
 	return vale_attach_detach(ctx);
 }
 
+/* NETMAP_REQ_VALE_FDB on the bridge of ctx */
+static int
+vale_fdb_req(struct TestContext *ctx, struct nmreq_vale_fdb *req)
+{
+	struct nmreq_header hdr;
+	char bdgname[sizeof(ctx->bdgname) + 1];
+	int ret;
+
+	snprintf(bdgname, sizeof(bdgname), "%s:", ctx->bdgname);
+	printf("Testing NETMAP_REQ_VALE_FDB on '%s' (flags %x)\n", bdgname,
+	       req->nr_flags);
+	nmreq_hdr_init(&hdr, bdgname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_FDB;
+	hdr.nr_body    = (uintptr_t)req;
+	ret            = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_FDB)");
+		return ret;
+	}
+	printf("nr_size %u nr_buckets %u nr_ways %u nr_max_age %u nr_used %u\n",
+	       req->nr_size, req->nr_buckets, req->nr_ways, req->nr_max_age,
+	       req->nr_used);
+
+	return 0;
+}
+
+/* Attach a port, then get, resize, age and flush the learning table. */
+static int
+vale_fdb(struct TestContext *ctx)
+{
+	struct nmreq_vale_fdb req;
+	int ret;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	memset(&req, 0, sizeof(req));
+	if ((ret = vale_fdb_req(ctx, &req)) != 0) {
+		goto out;
+	}
+	if (req.nr_size != req.nr_buckets * req.nr_ways || req.nr_used != 0) {
+		ret = -1;
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nr_flags   = NR_FDB_SET_SIZE | NR_FDB_SET_AGE;
+	req.nr_size    = 4000;
+	req.nr_max_age = 60;
+	if ((ret = vale_fdb_req(ctx, &req)) != 0) {
+		goto out;
+	}
+	if (req.nr_size < 4000 || req.nr_max_age != 60) {
+		ret = -1;
+		goto out;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nr_flags = NR_FDB_FLUSH;
+	if ((ret = vale_fdb_req(ctx, &req)) != 0) {
+		goto out;
+	}
+	ret = (req.nr_used == 0 && req.nr_learned == 0) ? 0 : -1;
+out:
+	if (vale_detach(ctx) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/* NETMAP_REQ_VALE_DISPATCH on the port attached by vale_attach() */
+static int
+vale_dispatch_req(struct TestContext *ctx, uint32_t flags, uint32_t *mode)
+{
+	struct nmreq_vale_dispatch req;
+	struct nmreq_header hdr;
+	char vpname[sizeof(ctx->bdgname) + 1 + sizeof(ctx->ifname_ext)];
+	int ret;
+
+	snprintf(vpname, sizeof(vpname), "%s:%s", ctx->bdgname, ctx->ifname_ext);
+	printf("Testing NETMAP_REQ_VALE_DISPATCH on '%s' (flags %x mode %u)\n",
+	       vpname, flags, *mode);
+	nmreq_hdr_init(&hdr, vpname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_DISPATCH;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	req.nr_flags = flags;
+	req.nr_mode  = *mode;
+	ret          = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_DISPATCH)");
+		return ret;
+	}
+	*mode = req.nr_mode;
+
+	return 0;
+}
+
+/* Switch a port to hash dispatch and back. */
+static int
+vale_dispatch(struct TestContext *ctx)
+{
+	uint32_t mode = 0;
+	int ret;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	if ((ret = vale_dispatch_req(ctx, 0, &mode)) != 0) {
+		goto out;
+	}
+	if (mode != NR_DISPATCH_SRC_RING) {
+		ret = -1;
+		goto out;
+	}
+	mode = NR_DISPATCH_RXHASH;
+	if ((ret = vale_dispatch_req(ctx, NR_DISPATCH_SET, &mode)) != 0) {
+		goto out;
+	}
+	mode = 0;
+	if ((ret = vale_dispatch_req(ctx, 0, &mode)) != 0) {
+		goto out;
+	}
+	if (mode != NR_DISPATCH_RXHASH) {
+		ret = -1;
+		goto out;
+	}
+	mode = 12345;
+	if (vale_dispatch_req(ctx, NR_DISPATCH_SET, &mode) == 0) {
+		/* invalid modes must be rejected */
+		ret = -1;
+	}
+out:
+	if (vale_detach(ctx) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/* NETMAP_REQ_VALE_STATS_GET on the port attached by vale_attach() */
+static int
+vale_stats_req(struct TestContext *ctx, uint32_t flags, uint16_t ring_id,
+	       struct nmreq_vale_stats *req)
+{
+	struct nmreq_header hdr;
+	char vpname[sizeof(ctx->bdgname) + 1 + sizeof(ctx->ifname_ext)];
+	int ret;
+
+	snprintf(vpname, sizeof(vpname), "%s:%s", ctx->bdgname, ctx->ifname_ext);
+	printf("Testing NETMAP_REQ_VALE_STATS_GET on '%s' (flags %x ring %u)\n",
+	       vpname, flags, ring_id);
+	nmreq_hdr_init(&hdr, vpname);
+	hdr.nr_reqtype = NETMAP_REQ_VALE_STATS_GET;
+	hdr.nr_body    = (uintptr_t)req;
+	memset(req, 0, sizeof(*req));
+	req->nr_flags   = flags;
+	req->nr_ring_id = ring_id;
+	ret             = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, VALE_STATS_GET)");
+		return ret;
+	}
+	printf("nr_tx_rings %u fwd %llu drop nospace %llu lookup %llu\n",
+	       req->nr_tx_rings, (unsigned long long)req->nr_fwd_pkts,
+	       (unsigned long long)req->nr_drop_nospace,
+	       (unsigned long long)req->nr_drop_lookup);
+
+	return 0;
+}
+
+/* Read and reset the counters of a port, for all rings and for one. */
+static int
+vale_stats(struct TestContext *ctx)
+{
+	struct nmreq_vale_stats req;
+	int ret;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	if ((ret = vale_stats_req(ctx, 0, NR_VALE_STATS_ALLRINGS, &req)) != 0) {
+		goto out;
+	}
+	if (req.nr_tx_rings == 0) {
+		ret = -1;
+		goto out;
+	}
+	if ((ret = vale_stats_req(ctx, NR_VALE_STATS_RESET, 0, &req)) != 0) {
+		goto out;
+	}
+	if (vale_stats_req(ctx, 0, req.nr_tx_rings, &req) == 0) {
+		/* out of range rings must be rejected */
+		ret = -1;
+	}
+out:
+	if (vale_detach(ctx) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/* NIOCCONFIG with a flow table command on the bridge of ctx */
+static int
+vale_flow_req(struct TestContext *ctx, struct nm_vale_flow_cfg *cfg)
+{
+	struct nm_ifreq ifr;
+	int ret;
+
+	memset(&ifr, 0, sizeof(ifr));
+	if (snprintf(ifr.nifr_name, sizeof(ifr.nifr_name), "%s:",
+		     ctx->bdgname) >= (int)sizeof(ifr.nifr_name)) {
+		printf("bridge name '%s' too long\n", ctx->bdgname);
+		return -1;
+	}
+	printf("Testing NIOCCONFIG flow table on '%s' (cmd %u num %u)\n",
+	       ifr.nifr_name, cfg->nfc_cmd, cfg->nfc_num);
+	memcpy(ifr.data, cfg, sizeof(*cfg));
+	ret = ioctl(ctx->fd, NIOCCONFIG, &ifr);
+	memcpy(cfg, ifr.data, sizeof(*cfg));
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCONFIG, flow table)");
+		return ret;
+	}
+	printf("nfc_enabled %u nfc_size %u nfc_used %u\n", cfg->nfc_enabled,
+	       cfg->nfc_size, cfg->nfc_used);
+
+	return 0;
+}
+
+/* Switch a bridge to the flow table, add and remove flows, and
+ * go back to the learning bridge. */
+static int
+vale_flow_table(struct TestContext *ctx)
+{
+	struct nm_vale_flow_cfg cfg;
+	struct nm_vale_flow flows[3];
+	int i, ret;
+
+	if ((ret = vale_attach(ctx)) != 0) {
+		return ret;
+	}
+
+	memset(flows, 0, sizeof(flows));
+	for (i = 0; i < 3; i++) {
+		flows[i].nf_src[10] = flows[i].nf_src[11] = 0xff;
+		flows[i].nf_dst[10] = flows[i].nf_dst[11] = 0xff;
+		flows[i].nf_src[15] = i + 1; /* ::ffff:0.0.0.x */
+		flows[i].nf_dst[15] = 100;
+		flows[i].nf_sport   = htons(1000 + i);
+		flows[i].nf_dport   = htons(80);
+		flows[i].nf_proto   = 6;
+		flows[i].nf_ring    = NM_VALE_FLOW_SRCRING;
+		flows[i].nf_port    = i == 2 ? NM_VALE_FLOW_DROP : 0;
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nfc_cmd  = NM_VALE_FLOW_ENABLE;
+	cfg.nfc_size = 1000;
+	if ((ret = vale_flow_req(ctx, &cfg)) != 0) {
+		goto out;
+	}
+	if (!cfg.nfc_enabled || cfg.nfc_size != 1000) {
+		ret = -1;
+		goto disable;
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nfc_cmd   = NM_VALE_FLOW_ADD;
+	cfg.nfc_num   = 3;
+	cfg.nfc_flows = (uintptr_t)flows;
+	if ((ret = vale_flow_req(ctx, &cfg)) != 0) {
+		goto disable;
+	}
+	if (cfg.nfc_num != 3 || cfg.nfc_used != 3) {
+		ret = -1;
+		goto disable;
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nfc_cmd   = NM_VALE_FLOW_DEL;
+	cfg.nfc_num   = 1;
+	cfg.nfc_flows = (uintptr_t)flows;
+	if ((ret = vale_flow_req(ctx, &cfg)) != 0) {
+		goto disable;
+	}
+	if (cfg.nfc_used != 2) {
+		ret = -1;
+		goto disable;
+	}
+
+	/* removing it again must fail */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nfc_cmd   = NM_VALE_FLOW_DEL;
+	cfg.nfc_num   = 1;
+	cfg.nfc_flows = (uintptr_t)flows;
+	if (vale_flow_req(ctx, &cfg) == 0) {
+		ret = -1;
+		goto disable;
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nfc_cmd = NM_VALE_FLOW_FLUSH;
+	if ((ret = vale_flow_req(ctx, &cfg)) != 0) {
+		goto disable;
+	}
+	if (cfg.nfc_used != 0) {
+		ret = -1;
+	}
+disable:
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.nfc_cmd = NM_VALE_FLOW_DISABLE;
+	if (vale_flow_req(ctx, &cfg) != 0 || cfg.nfc_enabled) {
+		ret = -1;
+	}
+out:
+	if (vale_detach(ctx) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
 /* First NETMAP_REQ_PORT_HDR_SET and the NETMAP_REQ_PORT_HDR_GET
  * to check that we get the same value. */
 static int
@@ -706,13 +1034,16 @@ pools_info_get(struct TestContext *ctx)
 		(unsigned long long)req.nr_buf_pool_offset);
 	printf("nr_buf_pool_objtotal %u\n", req.nr_buf_pool_objtotal);
 	printf("nr_buf_pool_objsize %u\n", req.nr_buf_pool_objsize);
+	printf("nr_buf_pool_pagesize %u\n", req.nr_buf_pool_pagesize);
+	printf("nr_numa_node %d\n", req.nr_numa_node);
 
 	return req.nr_memsize && req.nr_if_pool_objtotal &&
 	                       req.nr_if_pool_objsize &&
 	                       req.nr_ring_pool_objtotal &&
 	                       req.nr_ring_pool_objsize &&
 	                       req.nr_buf_pool_objtotal &&
-	                       req.nr_buf_pool_objsize
+	                       req.nr_buf_pool_objsize &&
+	                       req.nr_buf_pool_pagesize
 	               ? 0
 	               : -1;
 }
@@ -949,7 +1280,6 @@ infinite_options(struct TestContext *ctx)
 	return (errno == EMSGSIZE ? 0 : -1);
 }
 
-#ifdef CONFIG_NETMAP_EXTMEM
 int
 change_param(const char *pname, unsigned long newv, unsigned long *poldv)
 {
@@ -984,6 +1314,7 @@ change_param(const char *pname, unsigned long newv, unsigned long *poldv)
 	return 0;
 }
 
+#ifdef CONFIG_NETMAP_EXTMEM
 static int
 push_extmem_option(struct TestContext *ctx, const struct nmreq_pools_info *pi,
 		struct nmreq_opt_extmem *e)
@@ -1156,8 +1487,740 @@ duplicate_extmem_options(struct TestContext *ctx)
 
 	return 0;
 }
+
+/* Register vale0:0 on a new file descriptor, in the extmem region
+ * at addr. */
+static int
+extmem_persist_register(struct TestContext *ctx, void *addr,
+		const struct nmreq_pools_info *pi, uint64_t flags)
+{
+	struct nmreq_opt_extmem e;
+	int ret;
+
+	memset(&e, 0, sizeof(e));
+	e.nro_opt.nro_reqtype = NETMAP_REQ_OPT_EXTMEM;
+	e.nro_info            = *pi;
+	e.nro_usrptr          = (uintptr_t)addr;
+	push_option(&e.nro_opt, ctx);
+
+	close(ctx->fd);
+	ctx->fd = open("/dev/netmap", O_RDWR);
+	if (ctx->fd < 0) {
+		perror("open(/dev/netmap)");
+		ret = -1;
+	} else {
+		ctx->nr_flags  = flags;
+		ctx->nr_mem_id = 0;
+		ret = port_register_hwall(ctx);
+	}
+	clear_options(ctx);
+
+	return ret ? ret : (int)e.nro_opt.nro_status;
+}
+
+static int
+extmem_persist(struct TestContext *ctx)
+{
+	char path[] = "/tmp/ctrl-api-test-XXXXXX";
+	struct nmreq_pools_info pi;
+	struct netmap_if *nifp;
+	uint16_t mem_id;
+	uint32_t head;
+	void *addr;
+	int mfd, ret = -1;
+
+	printf("Testing persistent extmem on vale0:0\n");
+
+	pools_info_fill(&pi);
+	mfd = mkstemp(path);
+	if (mfd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+	if (ftruncate(mfd, pi.nr_memsize) < 0) {
+		perror("ftruncate");
+		close(mfd);
+		return -1;
+	}
+	addr = mmap(NULL, pi.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	            mfd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		close(mfd);
+		return -1;
+	}
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_tx_slots = 16;
+	ctx->nr_rx_slots = 16;
+
+	/* The region and the extra buffers must survive the close. */
+	ctx->nr_extra_bufs = 4;
+	if (extmem_persist_register(ctx, addr, &pi, NR_EXTMEM_PERSIST))
+		goto out;
+	mem_id = ctx->nr_mem_id;
+	head   = NETMAP_IF(addr, ctx->nr_offset)->ni_bufs_head;
+	ctx->nr_extra_bufs = 0;
+	if (extmem_persist_register(ctx, addr, &pi, NR_EXTMEM_PERSIST))
+		goto out;
+	nifp = NETMAP_IF(addr, ctx->nr_offset);
+	if (ctx->nr_mem_id != mem_id || nifp->ni_bufs_head != head) {
+		printf("mem_id %u bufs_head %u, expected %u %u\n",
+		       ctx->nr_mem_id, nifp->ni_bufs_head, mem_id, head);
+		goto out;
+	}
+
+	/* Without the flag, the region goes away with its last user. */
+	if (extmem_persist_register(ctx, addr, &pi, 0))
+		goto out;
+	if (extmem_persist_register(ctx, addr, &pi, 0))
+		goto out;
+	if (ctx->nr_mem_id == mem_id) {
+		printf("mem_id %u still in use\n", mem_id);
+		goto out;
+	}
+	ret = 0;
+out:
+	munmap(addr, pi.nr_memsize);
+	close(mfd);
+
+	return ret;
+}
 #endif /* CONFIG_NETMAP_EXTMEM */
 
+static int
+mem_node_option(struct TestContext *ctx)
+{
+	struct nmreq_opt_mem_node opt, save;
+	struct nmreq_pools_info req;
+	struct nmreq_header hdr;
+	int ret;
+
+	printf("Testing mem node option on vale0:0\n");
+
+	memset(&opt, 0, sizeof(opt));
+	opt.nro_opt.nro_reqtype = NETMAP_REQ_OPT_MEM_NODE;
+	opt.nro_node            = 0;
+	push_option(&opt.nro_opt, ctx);
+	save = opt;
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	if ((ret = port_register_hwall(ctx)))
+		return ret;
+	clear_options(ctx);
+	if ((ret = checkoption(&opt.nro_opt, &save.nro_opt)))
+		return ret;
+
+	/* the port must now use a region on node 0 */
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_INFO_GET;
+	hdr.nr_body    = (uintptr_t)&req;
+	memset(&req, 0, sizeof(req));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		return ret;
+	}
+	printf("nr_mem_id %u nr_numa_node %d\n", req.nr_mem_id,
+	       req.nr_numa_node);
+
+	return req.nr_mem_id != 1 && req.nr_numa_node == 0 ? 0 : -1;
+}
+
+/* The rings of a VALE port registered with NR_LARGE_BUFS must
+ * get buffers from the large pool, which follows the normal one. */
+static int
+vale_large_bufs(struct TestContext *ctx)
+{
+	struct nmreq_pools_info pi;
+	struct nmreq_header hdr;
+	struct netmap_ring *ring;
+	unsigned long oldv = 0;
+	char *mem, *buf, *lbase;
+	int ret;
+
+	printf("Testing large buffers on vale0:0\n");
+
+	if (change_param("priv_lbuf_num", 4096, &oldv) < 0)
+		return -1;
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_flags |= NR_LARGE_BUFS;
+	ret = port_register_hwall(ctx);
+	change_param("priv_lbuf_num", oldv, NULL);
+	if (ret)
+		return ret;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_INFO_GET;
+	hdr.nr_body    = (uintptr_t)&pi;
+	memset(&pi, 0, sizeof(pi));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		return ret;
+	}
+
+	mem = mmap(NULL, pi.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	           ctx->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	ring  = NETMAP_RXRING(NETMAP_IF(mem, ctx->nr_offset), 0);
+	buf   = NETMAP_BUF(ring, ring->slot[0].buf_idx);
+	lbase = mem + pi.nr_buf_pool_offset +
+	        (uint64_t)pi.nr_buf_pool_objtotal * pi.nr_buf_pool_objsize;
+	printf("nr_buf_size %u buf_idx %u offset %lld\n", ring->nr_buf_size,
+	       ring->slot[0].buf_idx, (long long)(buf - mem));
+
+	ret = ring->nr_buf_size > pi.nr_buf_pool_objsize &&
+	      ring->slot[0].buf_idx >= pi.nr_buf_pool_objtotal &&
+	      buf >= lbase && buf + ring->nr_buf_size <= mem + pi.nr_memsize
+	              ? 0 : -1;
+	munmap(mem, pi.nr_memsize);
+
+	return ret;
+}
+
+static int
+pools_stats_get(struct TestContext *ctx, struct nmreq_pools_stats *req,
+		uint32_t flags)
+{
+	struct nmreq_header hdr;
+	int ret, i;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_STATS_GET;
+	hdr.nr_body    = (uintptr_t)req;
+	memset(req, 0, sizeof(*req));
+	req->nr_flags = flags;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_STATS_GET)");
+		return ret;
+	}
+	for (i = 0; i < NR_POOLS_NUM; i++) {
+		struct nmreq_pool_stats *s = &req->nr_pool[i];
+
+		printf("pool %d: objtotal %u inuse %u cached %u hiwat %u "
+		       "leaked %llu free_runs %u largest_run %u\n", i,
+		       s->nr_objtotal, s->nr_inuse, s->nr_cached, s->nr_hiwat,
+		       (unsigned long long)s->nr_leaked, s->nr_free_runs,
+		       s->nr_largest_run);
+	}
+	printf("nr_port_ring_bufs %u nr_port_extra_bufs %u\n",
+	       req->nr_port_ring_bufs, req->nr_port_extra_bufs);
+
+	return 0;
+}
+
+/* NETMAP_REQ_POOLS_STATS_GET on a VALE port with extra buffers: the
+ * buffers of the port must be accounted as in use. */
+static int
+pools_stats(struct TestContext *ctx)
+{
+	struct nmreq_pools_stats req;
+	struct nmreq_pool_stats *bp = &req.nr_pool[2]; /* buffers */
+	int ret;
+
+	printf("Testing NETMAP_REQ_POOLS_STATS_GET on vale0:0\n");
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_extra_bufs = 16;
+	ret = port_register_hwall(ctx);
+	if (ret)
+		return ret;
+	ret = pools_stats_get(ctx, &req, NR_POOLS_STATS_RESET);
+	if (ret)
+		return ret;
+
+	return req.nr_info.nr_memsize &&
+	                       req.nr_pool[0].nr_inuse > 0 &&
+	                       req.nr_pool[1].nr_inuse > 0 &&
+	                       req.nr_port_ring_bufs > 0 &&
+	                       req.nr_port_extra_bufs == ctx->nr_extra_bufs &&
+	                       bp->nr_inuse >= req.nr_port_ring_bufs +
+	                                               req.nr_port_extra_bufs &&
+	                       bp->nr_hiwat >= bp->nr_inuse &&
+	                       bp->nr_largest_run <= bp->nr_objtotal - bp->nr_inuse
+	               ? 0
+	               : -1;
+}
+
+/* With NR_PREFAULT the region must be mapped by mmap() itself: the
+ * netmap_if, the rings and the buffers are resident before they
+ * are touched. */
+static int
+vale_prefault(struct TestContext *ctx)
+{
+#ifdef __linux__
+	struct nmreq_pools_info pi;
+	struct nmreq_header hdr;
+	unsigned char vec[1];
+	uint64_t ofs[3];
+	long pgsz = sysconf(_SC_PAGESIZE);
+	char *mem;
+	int ret, i;
+
+	printf("Testing NR_PREFAULT on vale0:0\n");
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_flags |= NR_PREFAULT;
+	ret = port_register_hwall(ctx);
+	if (ret)
+		return ret;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_INFO_GET;
+	hdr.nr_body    = (uintptr_t)&pi;
+	memset(&pi, 0, sizeof(pi));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		return ret;
+	}
+
+	mem = mmap(NULL, pi.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	           ctx->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	ofs[0] = ctx->nr_offset;
+	ofs[1] = pi.nr_ring_pool_offset;
+	ofs[2] = pi.nr_buf_pool_offset + 2 * pi.nr_buf_pool_objsize;
+	for (i = 0; i < 3 && ret == 0; i++) {
+		if (mincore(mem + (ofs[i] & ~(pgsz - 1)), pgsz, vec) < 0) {
+			perror("mincore");
+			ret = -1;
+		} else if (!(vec[0] & 1)) {
+			printf("offset 0x%llx not mapped\n",
+			       (unsigned long long)ofs[i]);
+			ret = -1;
+		}
+	}
+	munmap(mem, pi.nr_memsize);
+
+	return ret;
+#else
+	(void)ctx;
+	return 0; /* ignored */
+#endif
+}
+
+/* Bind the two ends of the pipe 'name' on ctx->fd and on a new file
+ * descriptor in ctx2, and map their memory. */
+static int
+pipe_pair_open(struct TestContext *ctx, struct TestContext *ctx2,
+	       const char *name, char **mem, uint64_t *memsize)
+{
+	struct nmreq_pools_info pi;
+	struct nmreq_header hdr;
+	int ret;
+
+	*ctx2 = *ctx;
+	strncat(ctx->ifname_ext, "{", sizeof(ctx->ifname_ext) - 1);
+	strncat(ctx->ifname_ext, name, sizeof(ctx->ifname_ext) - 2);
+	ret = port_register_hwall(ctx);
+	if (ret)
+		return ret;
+
+	strncat(ctx2->ifname_ext, "}", sizeof(ctx2->ifname_ext) - 1);
+	strncat(ctx2->ifname_ext, name, sizeof(ctx2->ifname_ext) - 2);
+	ctx2->nr_mem_id = ctx->nr_mem_id;
+	ctx2->fd = open("/dev/netmap", O_RDWR);
+	if (ctx2->fd < 0) {
+		perror("open(/dev/netmap)");
+		return -1;
+	}
+	ret = port_register_hwall(ctx2);
+	if (ret)
+		goto err;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_INFO_GET;
+	hdr.nr_body    = (uintptr_t)&pi;
+	memset(&pi, 0, sizeof(pi));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		goto err;
+	}
+	*mem = mmap(NULL, pi.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	            ctx->fd, 0);
+	if (*mem == MAP_FAILED) {
+		perror("mmap");
+		ret = -1;
+		goto err;
+	}
+	*memsize = pi.nr_memsize;
+
+	return 0;
+err:
+	close(ctx2->fd);
+	return ret;
+}
+
+/* Queue a 60 bytes packet on the first tx ring of ctx. */
+static void
+pipe_pair_send(struct TestContext *ctx, char *mem)
+{
+	struct netmap_ring *txr = NETMAP_TXRING(NETMAP_IF(mem, ctx->nr_offset), 0);
+
+	memset(NETMAP_BUF(txr, txr->slot[txr->cur].buf_idx), 0xa5, 60);
+	txr->slot[txr->cur].len = 60;
+	txr->head = txr->cur = nm_ring_next(txr, txr->cur);
+}
+
+/* NIOCSYNCV on the two ends of a pipe, bound on different file
+ * descriptors: a packet transmitted on the master must be received
+ * by the slave within a single ioctl, and bad entries must be
+ * reported without failing the others. */
+static int
+pipe_syncv(struct TestContext *ctx)
+{
+	struct TestContext ctx2;
+	struct nmsync_entry ent[4];
+	struct nmsyncv sv;
+	struct netmap_ring *rxr;
+	uint64_t memsize;
+	char *mem;
+	int ret;
+
+	printf("Testing NIOCSYNCV on a pipe\n");
+
+	ret = pipe_pair_open(ctx, &ctx2, "syncv", &mem, &memsize);
+	if (ret)
+		return ret;
+	rxr = NETMAP_RXRING(NETMAP_IF(mem, ctx2.nr_offset), 0);
+	pipe_pair_send(ctx, mem);
+
+	memset(ent, 0, sizeof(ent));
+	ent[0].ns_fd   = -1;
+	ent[0].ns_ring = 0;
+	ent[0].ns_dir  = NR_SYNC_TX;
+	ent[1].ns_fd   = ctx2.fd;
+	ent[1].ns_ring = 0;
+	ent[1].ns_dir  = NR_SYNC_RX;
+	ent[2].ns_fd   = -1;
+	ent[2].ns_ring = ctx->nr_tx_rings + 5; /* not bound */
+	ent[2].ns_dir  = NR_SYNC_TX;
+	ent[3].ns_fd   = ctx2.fd;
+	ent[3].ns_ring = 0;
+	ent[3].ns_dir  = 7; /* invalid */
+	memset(&sv, 0, sizeof(sv));
+	sv.nsv_entries = (uintptr_t)ent;
+	sv.nsv_count   = 4;
+	ret = ioctl(ctx->fd, NIOCSYNCV, &sv);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCSYNCV)");
+	} else {
+		printf("nsv_errors %u errors %d %d %d %d rx space %u\n",
+		       sv.nsv_errors, ent[0].ns_error, ent[1].ns_error,
+		       ent[2].ns_error, ent[3].ns_error, nm_ring_space(rxr));
+		ret = sv.nsv_errors == 2 && ent[0].ns_error == 0 &&
+		                      ent[1].ns_error == 0 &&
+		                      ent[2].ns_error == EINVAL &&
+		                      ent[3].ns_error == EINVAL &&
+		                      nm_ring_space(rxr) == 1 &&
+		                      rxr->slot[rxr->cur].len == 60
+		              ? 0
+		              : -1;
+	}
+	munmap(mem, memsize);
+	close(ctx2.fd);
+
+	return ret;
+}
+
+/* NR_SLOT_TS on the receive side of a pipe: the slot must carry the
+ * wall clock time of the transmission, in nanoseconds. */
+static int
+pipe_slot_ts(struct TestContext *ctx)
+{
+	struct TestContext ctx2;
+	struct netmap_ring *rxr;
+	struct timespec t0, t1;
+	uint64_t memsize, ns0, ns1, ts;
+	char *mem;
+	int ret;
+
+	printf("Testing NR_SLOT_TS on a pipe\n");
+
+	ret = pipe_pair_open(ctx, &ctx2, "slotts", &mem, &memsize);
+	if (ret)
+		return ret;
+	rxr = NETMAP_RXRING(NETMAP_IF(mem, ctx2.nr_offset), 0);
+	rxr->flags |= NR_SLOT_TS;
+	pipe_pair_send(ctx, mem);
+
+	clock_gettime(CLOCK_REALTIME, &t0);
+	ret = ioctl(ctx->fd, NIOCTXSYNC, NULL);
+	clock_gettime(CLOCK_REALTIME, &t1);
+	if (ret == 0)
+		ret = ioctl(ctx2.fd, NIOCRXSYNC, NULL);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOC*XSYNC)");
+	} else {
+		ns0 = (uint64_t)t0.tv_sec * 1000000000 + t0.tv_nsec;
+		ns1 = (uint64_t)t1.tv_sec * 1000000000 + t1.tv_nsec;
+		ts  = rxr->slot[rxr->cur].ptr;
+		printf("slot ts %llu, txsync between %llu and %llu\n",
+		       (unsigned long long)ts, (unsigned long long)ns0,
+		       (unsigned long long)ns1);
+		/* allow for the coarser kernel clock */
+		ret = nm_ring_space(rxr) == 1 && ts + 1000000 >= ns0 &&
+		                      ts <= ns1 + 1000000
+		              ? 0
+		              : -1;
+	}
+	munmap(mem, memsize);
+	close(ctx2.fd);
+
+	return ret;
+}
+
+static int
+ring_stats_get(struct TestContext *ctx, struct nmreq_ring_stats *req,
+	       uint16_t ring_id, uint8_t dir, uint32_t flags)
+{
+	struct nmreq_header hdr;
+	int ret, i;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_RING_STATS_GET;
+	hdr.nr_body    = (uintptr_t)req;
+	memset(req, 0, sizeof(*req));
+	req->nr_ring_id = ring_id;
+	req->nr_dir     = dir;
+	req->nr_flags   = flags;
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0)
+		return ret;
+	printf("ring %u dir %u: syncs %llu slots %llu busy %llu reinit %llu "
+	       "host_drops %llu\n", ring_id, dir,
+	       (unsigned long long)req->nr_syncs,
+	       (unsigned long long)req->nr_slots,
+	       (unsigned long long)req->nr_busy,
+	       (unsigned long long)req->nr_reinit,
+	       (unsigned long long)req->nr_host_drops);
+	for (i = 0; i < NR_RING_LAT_BUCKETS; i++) {
+		if (req->nr_sync_lat[i])
+			printf("  lat [%d] %llu\n", i,
+			       (unsigned long long)req->nr_sync_lat[i]);
+	}
+
+	return 0;
+}
+
+/* NETMAP_REQ_RING_STATS_GET on a VALE port: the syncs issued on a
+ * ring must be accounted, with their latency when enabled, and reset
+ * on request. */
+static int
+ring_stats(struct TestContext *ctx)
+{
+	struct nmreq_ring_stats req;
+	unsigned long oldv = 0;
+	uint64_t lat = 0;
+	int ret, i;
+
+	printf("Testing NETMAP_REQ_RING_STATS_GET on vale0:0\n");
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ret = port_register_hwall(ctx);
+	if (ret)
+		return ret;
+	if (change_param("ring_latency", 1, &oldv) < 0)
+		return -1;
+	for (i = 0; i < 10; i++) {
+		ret = ioctl(ctx->fd, NIOCTXSYNC, NULL);
+		if (ret != 0) {
+			perror("ioctl(/dev/netmap, NIOCTXSYNC)");
+			break;
+		}
+	}
+	change_param("ring_latency", oldv, NULL);
+	if (ret != 0)
+		return ret;
+
+	ret = ring_stats_get(ctx, &req, 0, NR_SYNC_TX, NR_RING_STATS_RESET);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, RING_STATS_GET)");
+		return ret;
+	}
+	for (i = 0; i < NR_RING_LAT_BUCKETS; i++)
+		lat += req.nr_sync_lat[i];
+	if (req.nr_syncs != 10 || lat != 10 || req.nr_slots != 0 ||
+	    req.nr_tx_rings != ctx->nr_tx_rings || /* no host rings */
+	    req.nr_rx_rings != ctx->nr_rx_rings) {
+		return -1;
+	}
+
+	/* the counters have been reset */
+	ret = ring_stats_get(ctx, &req, 0, NR_SYNC_TX, 0);
+	if (ret != 0 || req.nr_syncs != 0)
+		return -1;
+
+	/* invalid ring or direction */
+	if (ring_stats_get(ctx, &req, req.nr_tx_rings, NR_SYNC_TX, 0) == 0 ||
+	    ring_stats_get(ctx, &req, 0, 2, 0) == 0) {
+		printf("invalid requests accepted\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* A VALE port with many rings, bound one ring pair at a time: only
+ * the bound rings must have buffers, and the private pool must not
+ * back the buffers of all the rings. */
+static int
+vale_lazy_rings(struct TestContext *ctx)
+{
+	struct nmreq_pools_stats req;
+	struct nmreq_pool_stats *bp = &req.nr_pool[2]; /* buffers */
+	int ret;
+
+	printf("Testing ring buffers on demand on vale0:0\n");
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_tx_rings = ctx->nr_rx_rings = 16;
+	ctx->nr_tx_slots = ctx->nr_rx_slots = 1024;
+	ret = port_register_single_ring_couple(ctx);
+	if (ret)
+		return ret;
+	ret = pools_stats_get(ctx, &req, 0);
+	if (ret)
+		return ret;
+
+	return req.nr_port_ring_bufs == ctx->nr_tx_slots + ctx->nr_rx_slots &&
+	                       bp->nr_objtotal < ctx->nr_tx_rings *
+	                                       ctx->nr_tx_slots +
+	                                       ctx->nr_rx_rings *
+	                                       ctx->nr_rx_slots
+	               ? 0
+	               : -1;
+}
+
+static int
+pools_info_req(struct TestContext *ctx, struct nmreq_pools_info *pi)
+{
+	struct nmreq_header hdr;
+	int ret;
+
+	nmreq_hdr_init(&hdr, ctx->ifname_ext);
+	hdr.nr_reqtype = NETMAP_REQ_POOLS_INFO_GET;
+	hdr.nr_body    = (uintptr_t)pi;
+	memset(pi, 0, sizeof(*pi));
+	ret = ioctl(ctx->fd, NIOCCTRL, &hdr);
+	if (ret != 0) {
+		perror("ioctl(/dev/netmap, NIOCCTRL, POOLS_INFO_GET)");
+		return ret;
+	}
+	printf("nr_memsize %llu nr_buf_pool_objtotal %u\n",
+	       (unsigned long long)pi->nr_memsize, pi->nr_buf_pool_objtotal);
+
+	return 0;
+}
+
+/* Bind all the rings of a VALE port on a second file descriptor while
+ * one ring pair is bound and mapped on the first: the pool must grow
+ * without changing the size of the region, and the buffers of the new
+ * rings must be reachable through the existing mapping. */
+static int
+vale_pool_grow(struct TestContext *ctx)
+{
+	struct nmreq_pools_info pi, pi2;
+	struct TestContext ctx2;
+	struct netmap_ring *ring;
+	char *mem, *mem2 = MAP_FAILED;
+	uint32_t idx;
+	unsigned int i;
+	int ret;
+
+	printf("Testing pool growth on vale0:0\n");
+
+	strncpy(ctx->ifname_ext, "vale0:0", sizeof(ctx->ifname_ext));
+	ctx->nr_tx_rings = ctx->nr_rx_rings = 16;
+	ctx->nr_tx_slots = ctx->nr_rx_slots = 1024;
+	ret = port_register_single_ring_couple(ctx);
+	if (ret)
+		return ret;
+	ret = pools_info_req(ctx, &pi);
+	if (ret)
+		return ret;
+	mem = mmap(NULL, pi.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	           ctx->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	ctx2    = *ctx;
+	ctx2.fd = open("/dev/netmap", O_RDWR);
+	if (ctx2.fd < 0) {
+		perror("open(/dev/netmap)");
+		ret = -1;
+		goto out;
+	}
+	ret = port_register_hwall(&ctx2);
+	if (ret)
+		goto out;
+	ret = pools_info_req(&ctx2, &pi2);
+	if (ret)
+		goto out;
+	if (pi2.nr_memsize != pi.nr_memsize ||
+	    pi2.nr_buf_pool_objtotal <= pi.nr_buf_pool_objtotal) {
+		printf("pool did not grow\n");
+		ret = -1;
+		goto out;
+	}
+
+	/* the last ring of the second binding has new buffers */
+	ring = NETMAP_TXRING(NETMAP_IF(mem, ctx2.nr_offset),
+	                     ctx2.nr_tx_rings - 1);
+	idx  = ring->slot[0].buf_idx;
+	for (i = 0; i < ring->num_slots; i++) {
+		if (ring->slot[i].buf_idx >= pi2.nr_buf_pool_objtotal) {
+			printf("slot %u: index %u not backed\n", i,
+			       ring->slot[i].buf_idx);
+			ret = -1;
+			goto out;
+		}
+		if (ring->slot[i].buf_idx > idx)
+			idx = ring->slot[i].buf_idx;
+	}
+	if (idx < pi.nr_buf_pool_objtotal) {
+		printf("no new buffer in the ring\n");
+		ret = -1;
+		goto out;
+	}
+
+	/* write through the old mapping, read through a new one */
+	memset(NETMAP_BUF(ring, idx), 0x5a, ring->nr_buf_size);
+	mem2 = mmap(NULL, pi2.nr_memsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	            ctx2.fd, 0);
+	if (mem2 == MAP_FAILED) {
+		perror("mmap");
+		ret = -1;
+		goto out;
+	}
+	ret = memcmp(NETMAP_BUF(ring, idx) - mem + mem2,
+	             NETMAP_BUF(ring, idx), ring->nr_buf_size) == 0 &&
+	                      *(unsigned char *)NETMAP_BUF(ring, idx) == 0x5a
+	              ? 0
+	              : -1;
+out:
+	if (mem2 != MAP_FAILED)
+		munmap(mem2, pi2.nr_memsize);
+	if (ctx2.fd >= 0)
+		close(ctx2.fd);
+	munmap(mem, pi.nr_memsize);
+
+	return ret;
+}
+
 static int
 push_csb_option(struct TestContext *ctx, struct nmreq_opt_csb *opt)
 {
@@ -1656,6 +2719,10 @@ static struct mytest tests[] = {
 	decltest(port_register_single_ring_couple),
 	decltest(vale_attach_detach),
 	decltest(vale_attach_detach_host_rings),
+	decltest(vale_fdb),
+	decltest(vale_dispatch),
+	decltest(vale_stats),
+	decltest(vale_flow_table),
 	decltest(vale_ephemeral_port_hdr_manipulation),
 	decltest(vale_persistent_port),
 	decltest(pools_info_get_and_register),
@@ -1671,7 +2738,17 @@ static struct mytest tests[] = {
 	decltest(extmem_option),
 	decltest(bad_extmem_option),
 	decltest(duplicate_extmem_options),
+	decltest(extmem_persist),
 #endif /* CONFIG_NETMAP_EXTMEM */
+	decltest(mem_node_option),
+	decltest(vale_large_bufs),
+	decltest(pools_stats),
+	decltest(vale_lazy_rings),
+	decltest(vale_pool_grow),
+	decltest(vale_prefault),
+	decltest(pipe_syncv),
+	decltest(pipe_slot_ts),
+	decltest(ring_stats),
 	decltest(csb_mode),
 	decltest(csb_mode_invalid_memory),
 	decltest(sync_kloop),
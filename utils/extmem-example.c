@@ -28,9 +28,15 @@ int main(int argc, char *argv[])
 	int mem_fd, netmap_fd;
 	const char *ifname, *filename;
 	off_t filesize;
+	int persist = 0;
 
+	if (argc == 4 && strcmp(argv[1], "-p") == 0) {
+		persist = 1;
+		argc--;
+		argv++;
+	}
 	if (argc != 3) {
-		fprintf(stderr, "usage: %s <netmap-port> <file>\n", argv[0]);
+		fprintf(stderr, "usage: %s [-p] <netmap-port> <file>\n", argv[0]);
 		exit(1);
 	}
 
@@ -82,6 +88,12 @@ int main(int argc, char *argv[])
 	/* initialize the register request */
 	memset(&req, 0, sizeof(req));
 	req.nr_mode = NR_REG_ALL_NIC; /* or whatever */
+	/* with -p the region stays in the kernel when we exit, and
+	 * running again on the same file gets it back, together with
+	 * the extra buffers we leave in nif->ni_bufs_head
+	 */
+	if (persist)
+		req.nr_flags |= NR_EXTMEM_PERSIST;
 
 	/* initialize the header */
 	memset(&hdr, 0, sizeof(hdr));
@@ -121,8 +133,9 @@ int main(int argc, char *argv[])
 	 */
 
 	nif = NETMAP_IF(addr, req.nr_offset);
+	printf("%s: mem_id %u, extra buffers list at %u\n", ifname,
+	       req.nr_mem_id, nif->ni_bufs_head);
 
 	/* and so on ... */
-	(void)nif;
 	return 0;
 }
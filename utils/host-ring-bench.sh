@@ -0,0 +1,61 @@
+#!/usr/bin/env bash
+################################################################################
+# Measure the rate at which packets written to the host transmit ring of an
+# interface reach the host stack, delivering them one at a time
+# (host_batch=1) and in batches.
+#
+# usage: host-ring-bench.sh [-i ifname] [-n count] [-l len] [-b "batches"]
+#
+# Without -i a veth pair is created (Linux only) and removed on exit.
+################################################################################
+
+IF=""
+COUNT=10000000
+LEN=60
+BATCHES="1 64"
+PKTGEN=${PKTGEN:-pkt-gen}
+
+while getopts "i:n:l:b:" opt; do
+	case $opt in
+	i) IF=$OPTARG ;;
+	n) COUNT=$OPTARG ;;
+	l) LEN=$OPTARG ;;
+	b) BATCHES=$OPTARG ;;
+	*) echo "usage: $0 [-i ifname] [-n count] [-l len] [-b batches]"
+	   exit 1 ;;
+	esac
+done
+
+host_batch() {
+	if [ "$(uname)" = "FreeBSD" ]; then
+		sysctl -n dev.netmap.host_batch${1:+=$1}
+	else
+		local p=/sys/module/netmap/parameters/host_batch
+		if [ -n "$1" ]; then
+			echo "$1" > $p
+		else
+			cat $p
+		fi
+	fi
+}
+
+if [ -z "$IF" ]; then
+	IF=nmhb0
+	ip link add $IF type veth peer name ${IF}p || exit 1
+	ip link set $IF up
+	ip link set ${IF}p up
+	trap "ip link del $IF" EXIT
+fi
+
+SAVED=$(host_batch) || exit 1
+for b in $BATCHES; do
+	if ! host_batch $b; then
+		echo "cannot set host_batch to $b"
+		host_batch $SAVED
+		exit 1
+	fi
+	echo -n "host_batch $b: "
+	$PKTGEN -i "netmap:${IF}^" -f tx -n $COUNT -l $LEN -N 2>&1 |
+		grep "Speed:" | tail -n 1
+done
+host_batch $SAVED || echo "cannot restore host_batch to $SAVED"
@@ -166,6 +166,7 @@ struct glob_arg {
 	int cpus;
 	int privs;	// 1 if has IO privileges
 	int arg;	// microseconds in usleep
+	int fill;	// percent of the pool in use (alloc tests)
 	int nullfd;	// open(/dev/null)
 	char *test_name;
 	pthread_mutex_t mtx;
@@ -585,6 +586,286 @@ test_spinlock(struct targ *t)
         }
 }
 
+/*
+ * Emulation of the lease scheme used by VALE senders on a destination
+ * rx ring (see nm_kr_lease() in netmap_vale.c). Each thread reserves
+ * up to -l slots (default 8), fills them and reports completion in
+ * the lease array; completed leases are merged in order into tail,
+ * and immediately consumed. lease_mutex makes the reservation under
+ * the mutex, lease_cas with a compare-and-set. Compare the two with
+ * increasing -t to see how they scale with the number of senders.
+ */
+#define LEASE_SLOTS	1024
+#define LEASE_NOSLOT	((uint32_t)~0)
+static struct {
+	volatile uint32_t state;	/* lease_idx << 16 | hwlease */
+	volatile uint32_t cur, tail;
+	volatile uint32_t head;
+	volatile uint32_t leases[LEASE_SLOTS];
+	uint32_t slot[LEASE_SLOTS];
+} lring;
+static pthread_once_t lring_once = PTHREAD_ONCE_INIT;
+
+static void
+lring_init(void)
+{
+	int i;
+
+	for (i = 0; i < LEASE_SLOTS; i++)
+		lring.leases[i] = LEASE_NOSLOT;
+}
+
+/* merge completed leases into tail, return 1 if it moved */
+static int
+lring_complete(void)
+{
+	uint32_t last = lring.state >> 16, head = lring.head, j = lring.tail;
+
+	while (head != last && lring.leases[head] != LEASE_NOSLOT) {
+		j = lring.leases[head];
+		lring.leases[head] = LEASE_NOSLOT;
+		head = (head + 1) % LEASE_SLOTS;
+	}
+	lring.head = head;
+	if (j == lring.tail)
+		return 0;
+	lring.tail = lring.cur = j; /* consume */
+	return 1;
+}
+
+static void
+lease_run(struct targ *t, int lockfree)
+{
+	pthread_mutex_t *mtx = &t->g->mtx;
+	uint32_t n = t->g->arg > 0 ? t->g->arg : 8;
+	int64_t m, i, lim = CE(t->g->m_cycles, ONE_MILLION);
+
+	pthread_once(&lring_once, lring_init);
+	for (m = 0; m < lim; m++) {
+		for (i = 0; i < ONE_MILLION; i++) {
+			uint32_t old, start, idx, j, howmany, k;
+			int busy;
+
+			if (!lockfree)
+				pthread_mutex_lock(mtx);
+			do {
+				old = lring.state;
+				start = old & 0xffff;
+				idx = old >> 16;
+				busy = start - lring.cur;
+				if (busy < 0)
+					busy += LEASE_SLOTS;
+				howmany = LEASE_SLOTS - 1 - busy;
+				if (howmany > n)
+					howmany = n;
+			} while (!atomic_cmpset_32(&lring.state, old,
+			    ((idx + 1) % LEASE_SLOTS) << 16 |
+			    (start + howmany) % LEASE_SLOTS));
+			if (!lockfree)
+				pthread_mutex_unlock(mtx);
+			for (j = start, k = 0; k < howmany; k++) {
+				lring.slot[j] = t->me;
+				j = (j + 1) % LEASE_SLOTS;
+			}
+			__sync_synchronize();
+			lring.leases[idx] = j;
+			__sync_synchronize();
+			t->count += howmany;
+			if (lockfree && lring.tail != start)
+				continue;
+			for (;;) {
+				int moved;
+
+				pthread_mutex_lock(mtx);
+				moved = lring_complete();
+				pthread_mutex_unlock(mtx);
+				if (!moved || !lockfree)
+					break;
+				__sync_synchronize();
+				if (lring.leases[lring.head] == LEASE_NOSLOT)
+					break;
+			}
+		}
+	}
+}
+
+void
+test_lease_mutex(struct targ *t)
+{
+	lease_run(t, 0);
+}
+
+void
+test_lease_cas(struct targ *t)
+{
+	lease_run(t, 1);
+}
+
+/*
+ * Emulation of the buffer allocator of netmap_mem2.c. Each thread
+ * has a pool of -l objects (default 2M) of which the first -f percent
+ * (default 90) are in use, as after the rings of many ports have been
+ * populated, and then repeatedly allocates and frees a batch of 64
+ * buffers. alloc_scan searches the bitmap word by word from the start
+ * of the pool, one buffer at a time, as netmap_obj_malloc() used to do.
+ * alloc_hier uses the summary levels and takes all the free buffers
+ * of a word at once (see netmap_obj_malloc_batch()).
+ */
+#define ALLOC_BATCH	64
+#define ALLOC_LEVELS	7
+
+struct apool {
+	uint32_t nobj, nfree, nlvl;
+	uint32_t *lvl[ALLOC_LEVELS];	/* lvl[0] is the bitmap */
+};
+
+static void
+apool_take(struct apool *p, uint32_t i, uint32_t mask)
+{
+	uint32_t l;
+
+	for (l = 0; l < p->nlvl; l++) {
+		uint32_t *w = &p->lvl[l][i];
+
+		*w &= ~mask;
+		if (*w != 0)
+			break;
+		mask = 1U << (i % 32);
+		i /= 32;
+	}
+}
+
+static void
+apool_give(struct apool *p, uint32_t i, uint32_t mask)
+{
+	uint32_t l;
+
+	for (l = 0; l < p->nlvl; l++) {
+		uint32_t *w = &p->lvl[l][i], old = *w;
+
+		*w = old | mask;
+		if (old != 0)
+			break;
+		mask = 1U << (i % 32);
+		i /= 32;
+	}
+}
+
+static uint32_t
+apool_alloc_scan(struct apool *p, uint32_t *index, uint32_t n)
+{
+	uint32_t got, i = 0, j, mask, slots = (p->nobj + 31) / 32;
+
+	for (got = 0; got < n && p->nfree > 0; got++) {
+		while (i < slots && p->lvl[0][i] == 0)
+			i++;
+		if (i == slots)
+			break;
+		for (j = 0, mask = 1; (p->lvl[0][i] & mask) == 0; j++, mask <<= 1)
+			;
+		apool_take(p, i, mask);
+		p->nfree--;
+		index[got] = i * 32 + j;
+	}
+	return got;
+}
+
+static uint32_t
+apool_alloc_hier(struct apool *p, uint32_t *index, uint32_t n)
+{
+	uint32_t got = 0;
+
+	while (got < n && p->nfree > 0) {
+		uint32_t i = 0, cur, taken = 0;
+		int l;
+
+		for (l = p->nlvl - 1; l > 0; l--)
+			i = i * 32 + __builtin_ctz(p->lvl[l][i]);
+		cur = p->lvl[0][i];
+		do {
+			uint32_t j = __builtin_ctz(cur);
+
+			cur &= cur - 1;
+			taken |= 1U << j;
+			index[got++] = i * 32 + j;
+		} while (cur && got < n);
+		apool_take(p, i, taken);
+		p->nfree -= __builtin_popcount(taken);
+	}
+	return got;
+}
+
+static int
+apool_init(struct apool *p, uint32_t nobj, uint32_t fill)
+{
+	uint32_t n = (nobj + 31) / 32, tot = 0, i, j, l;
+	uint32_t *m;
+
+	bzero(p, sizeof(*p));
+	for (l = 0, j = n; ; l++) {
+		tot += j;
+		if (j <= 1)
+			break;
+		j = (j + 31) / 32;
+	}
+	m = calloc(tot, sizeof(*m));
+	if (m == NULL)
+		return -1;
+	p->nobj = nobj;
+	p->nlvl = l + 1;
+	for (l = 0, j = n; l < p->nlvl; l++) {
+		p->lvl[l] = m;
+		m += j;
+		j = (j + 31) / 32;
+	}
+	for (i = (uint64_t)nobj * fill / 100; i < nobj; i++)
+		p->lvl[0][i / 32] |= 1U << (i % 32);
+	for (l = 1, j = n; l < p->nlvl; l++, j = (j + 31) / 32) {
+		for (i = 0; i < j; i++) {
+			if (p->lvl[l - 1][i])
+				p->lvl[l][i / 32] |= 1U << (i % 32);
+		}
+	}
+	p->nfree = nobj - (uint64_t)nobj * fill / 100;
+	return 0;
+}
+
+static void
+alloc_run(struct targ *t, int hier)
+{
+	struct apool p;
+	uint32_t nobj = t->g->arg > 0 ? t->g->arg : 2 * ONE_MILLION;
+	uint32_t index[ALLOC_BATCH], got, k;
+	int64_t m;
+
+	if (apool_init(&p, nobj, t->g->fill) < 0) {
+		D("cannot allocate a pool of %u objects", nobj);
+		return;
+	}
+	for (m = 0; m < t->g->m_cycles; m += ALLOC_BATCH) {
+		got = hier ? apool_alloc_hier(&p, index, ALLOC_BATCH) :
+			apool_alloc_scan(&p, index, ALLOC_BATCH);
+		for (k = 0; k < got; k++) {
+			apool_give(&p, index[k] / 32, 1U << (index[k] % 32));
+			p.nfree++;
+		}
+		t->count += got;
+	}
+	free(p.lvl[0]);
+}
+
+void
+test_alloc_scan(struct targ *t)
+{
+	alloc_run(t, 0);
+}
+
+void
+test_alloc_hier(struct targ *t)
+{
+	alloc_run(t, 1);
+}
+
 void
 test_time(struct targ *t)
 {
@@ -812,6 +1093,10 @@ struct entry tests[] = {
 	EE(netmap, _1K, _100M),
 	EE(pthread_mutex, _1K, _100M),
 	EE(spinlock, _1K, _100M),
+	EE(lease_mutex, _1M, _100M),
+	EE(lease_cas, _1M, _100M),
+	EE(alloc_scan, _1M, _10M),
+	EE(alloc_hier, _1M, _100M),
 	{ NULL, NULL, 0, 0 }
 };
 
@@ -827,6 +1112,7 @@ usage(void)
 		"\t-m name		test name\n"
 		"\t-n cycles		(millions) of cycles\n"
 		"\t-l arg		bytes, usec, ... \n"
+		"\t-f percent		fill level of the pool (alloc tests)\n"
 		"\t-t threads		total threads\n"
 		"\t-c cores		cores to use\n"
 		"\t-a n			force affinity every n cores\n"
@@ -885,10 +1171,11 @@ main(int argc, char **argv)
 	g.nthreads = 1;
 	g.cpus = 1;
 	g.m_cycles = 0;
+	g.fill = 90;
 	g.nullfd = open("/dev/zero", O_RDWR);
 	D("nullfd is %d", g.nullfd);
 
-	while ( (ch = getopt(argc, argv, "A:a:m:n:w:c:t:vl:")) != -1) {
+	while ( (ch = getopt(argc, argv, "A:a:f:m:n:w:c:t:vl:")) != -1) {
 		switch(ch) {
 		default:
 			D("bad option %c %s", ch, optarg);
@@ -918,6 +1205,13 @@ main(int argc, char **argv)
 		case 'l':
 			g.arg = getnum(optarg);
 			break;
+		case 'f':	/* fill level */
+			g.fill = atoi(optarg);
+			if (g.fill < 0 || g.fill > 100) {
+				D("bad fill level %d", g.fill);
+				usage();
+			}
+			break;
 
 		case 'v':
 			verbose++;